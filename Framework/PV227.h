@@ -3,6 +3,16 @@
 #define INCLUDED_PV227_H
 
 #include "PV227_Basics.h"
+#include "PV227_DrawPackets.h"
+#include "PV227_FrameGraph.h"
+#include "PV227_FramePacer.h"
+#include "PV227_Jobs.h"
 #include "PV227_UBOs.h"
+#include "PV227_Lights.h"
+#include "PV227_PassCache.h"
+#include "PV227_QualityGovernor.h"
+#include "PV227_Scene.h"
+#include "PV227_Simulation.h"
+#include "PV227_Transforms.h"
 
 #endif	// INCLUDED_PV227_H
\ No newline at end of file
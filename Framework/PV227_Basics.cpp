@@ -21,6 +21,7 @@ extern "C"
 #include <GL/wglew.h>			// Include on Windows
 #else
 #include <GL/glxew.h>			// Include on Linux and Mac
+#include <time.h>				// clock_gettime
 #endif
 
 // Include DevIL for image loading
@@ -35,8 +36,22 @@ extern "C"
 #endif
 
 #include <memory>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
+
+// Creating the directory of the binary cache of the shader programs, and watching the files of the shaders
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#elif defined(__linux__)
+#define PV227_USE_INOTIFY
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 #include "../inlines/tangentcube.inl"
 #include "../inlines/tangentsphere.inl"
@@ -133,21 +148,247 @@ namespace PV227
 	}
 
 	float GetFPS()
+	{
+		static double last_time = 0.0;
+		double current_time = GetTime();
+		double diff_s = current_time - last_time;
+		last_time = current_time;
+		return 1.0f / float(diff_s);
+	}
+
+	double GetTime()
 	{
 #if defined(_WIN32)
-		static int64_t last_tick_count = 0;
-		LARGE_INTEGER current_tick_count, frequency;
-		QueryPerformanceCounter(&current_tick_count);
+		LARGE_INTEGER tick_count, frequency;
+		QueryPerformanceCounter(&tick_count);
 		QueryPerformanceFrequency(&frequency);
-		int64_t tick_diff = int64_t(current_tick_count.QuadPart) - last_tick_count;
-		last_tick_count = int64_t(current_tick_count.QuadPart);
-		double diff_s = double(tick_diff) / double(frequency.QuadPart);
-		return 1.0f / float(diff_s);
+		return double(tick_count.QuadPart) / double(frequency.QuadPart);
 #else
-		return -1.0f;		// I'm sorry, I don't have Linux equivalent yet
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return double(time.tv_sec) + double(time.tv_nsec) * 1e-9;
 #endif
 	}
 
+	//---------------------------------
+	//----    OPENGL STATE CACHE    ----
+	//---------------------------------
+
+	GLuint GLStateCache::current_program = GLStateCache::Unknown;
+	GLuint GLStateCache::current_vao = GLStateCache::Unknown;
+	GLuint GLStateCache::active_texture_unit = GLStateCache::Unknown;
+	GLuint GLStateCache::textures[GLStateCache::MaxTextureUnits][GLStateCache::TextureTargets];
+	GLStateCache::BufferBinding GLStateCache::uniform_buffers[GLStateCache::MaxBufferBindings];
+	GLStateCache::BufferBinding GLStateCache::storage_buffers[GLStateCache::MaxBufferBindings];
+	GLint GLStateCache::patch_vertices = -1;
+	unsigned int GLStateCache::issued_calls = 0;
+	unsigned int GLStateCache::filtered_calls = 0;
+
+	/// Makes sure the arrays are set to Unknown before the first use
+	static struct GLStateCacheInitializer
+	{
+		GLStateCacheInitializer() { GLStateCache::Invalidate(); }
+	} gl_state_cache_initializer;
+
+	int GLStateCache::GetTextureTargetIndex(GLenum target)
+	{
+		switch (target)
+		{
+		case GL_TEXTURE_2D:				return 0;
+		case GL_TEXTURE_CUBE_MAP:		return 1;
+		case GL_TEXTURE_2D_ARRAY:		return 2;
+		case GL_TEXTURE_3D:				return 3;
+		case GL_TEXTURE_1D:				return 4;
+		default:						return -1;
+		}
+	}
+
+	GLStateCache::BufferBinding *GLStateCache::GetBufferBindings(GLenum target, GLuint index)
+	{
+		if (index >= GLuint(MaxBufferBindings))
+			return nullptr;
+		if (target == GL_UNIFORM_BUFFER)
+			return uniform_buffers + index;
+		if (target == GL_SHADER_STORAGE_BUFFER)
+			return storage_buffers + index;
+		return nullptr;
+	}
+
+	void GLStateCache::UseProgram(GLuint program)
+	{
+		if (current_program == program)
+		{
+			filtered_calls++;
+			return;
+		}
+		glUseProgram(program);
+		current_program = program;
+		issued_calls++;
+	}
+
+	void GLStateCache::BindVertexArray(GLuint vao)
+	{
+		if (current_vao == vao)
+		{
+			filtered_calls++;
+			return;
+		}
+		glBindVertexArray(vao);
+		current_vao = vao;
+		issued_calls++;
+	}
+
+	void GLStateCache::ActiveTexture(GLuint unit)
+	{
+		if (active_texture_unit == unit)
+		{
+			filtered_calls++;
+			return;
+		}
+		glActiveTexture(GL_TEXTURE0 + unit);
+		active_texture_unit = unit;
+		issued_calls++;
+	}
+
+	void GLStateCache::BindTexture(GLenum target, GLuint texture)
+	{
+		int target_idx = GetTextureTargetIndex(target);
+		GLuint *bound = ((target_idx >= 0) && (active_texture_unit < GLuint(MaxTextureUnits))) ? &textures[active_texture_unit][target_idx] : nullptr;
+		if (bound && (*bound == texture))
+		{
+			filtered_calls++;
+			return;
+		}
+		glBindTexture(target, texture);
+		if (bound)
+			*bound = texture;
+		issued_calls++;
+	}
+
+	void GLStateCache::BindTexture(GLuint unit, GLenum target, GLuint texture)
+	{
+		// Do not change the active unit if the texture is already there
+		int target_idx = GetTextureTargetIndex(target);
+		if ((target_idx >= 0) && (unit < GLuint(MaxTextureUnits)) && (textures[unit][target_idx] == texture))
+		{
+			filtered_calls += 2;
+			return;
+		}
+		ActiveTexture(unit);
+		BindTexture(target, texture);
+	}
+
+	void GLStateCache::BindBufferBase(GLenum target, GLuint index, GLuint buffer)
+	{
+		BufferBinding *bound = GetBufferBindings(target, index);
+		if (bound && (bound->buffer == buffer) && (bound->offset < 0))
+		{
+			filtered_calls++;
+			return;
+		}
+		glBindBufferBase(target, index, buffer);
+		if (bound)
+		{
+			bound->buffer = buffer;
+			bound->offset = -1;
+			bound->size = -1;
+		}
+		issued_calls++;
+	}
+
+	void GLStateCache::BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+	{
+		BufferBinding *bound = GetBufferBindings(target, index);
+		if (bound && (bound->buffer == buffer) && (bound->offset == offset) && (bound->size == size))
+		{
+			filtered_calls++;
+			return;
+		}
+		glBindBufferRange(target, index, buffer, offset, size);
+		if (bound)
+		{
+			bound->buffer = buffer;
+			bound->offset = offset;
+			bound->size = size;
+		}
+		issued_calls++;
+	}
+
+	void GLStateCache::SetPatchVertices(GLint count)
+	{
+		if (patch_vertices == count)
+		{
+			filtered_calls++;
+			return;
+		}
+		glPatchParameteri(GL_PATCH_VERTICES, count);
+		patch_vertices = count;
+		issued_calls++;
+	}
+
+	void GLStateCache::Invalidate()
+	{
+		current_program = Unknown;
+		current_vao = Unknown;
+		active_texture_unit = Unknown;
+		for (int unit = 0; unit < MaxTextureUnits; unit++)
+			for (int target = 0; target < TextureTargets; target++)
+				textures[unit][target] = Unknown;
+		for (int i = 0; i < MaxBufferBindings; i++)
+		{
+			uniform_buffers[i].buffer = Unknown;
+			storage_buffers[i].buffer = Unknown;
+		}
+		patch_vertices = -1;
+	}
+
+	void GLStateCache::ForgetProgram(GLuint program)
+	{
+		if (current_program == program)
+			current_program = Unknown;
+	}
+
+	void GLStateCache::ForgetVertexArray(GLuint vao)
+	{
+		if (current_vao == vao)
+			current_vao = Unknown;
+	}
+
+	void GLStateCache::ForgetTexture(GLuint texture)
+	{
+		for (int unit = 0; unit < MaxTextureUnits; unit++)
+			for (int target = 0; target < TextureTargets; target++)
+				if (textures[unit][target] == texture)
+					textures[unit][target] = Unknown;
+	}
+
+	void GLStateCache::ForgetBuffer(GLuint buffer)
+	{
+		for (int i = 0; i < MaxBufferBindings; i++)
+		{
+			if (uniform_buffers[i].buffer == buffer)
+				uniform_buffers[i].buffer = Unknown;
+			if (storage_buffers[i].buffer == buffer)
+				storage_buffers[i].buffer = Unknown;
+		}
+	}
+
+	unsigned int GLStateCache::GetIssuedCalls()
+	{
+		return issued_calls;
+	}
+
+	unsigned int GLStateCache::GetFilteredCalls()
+	{
+		return filtered_calls;
+	}
+
+	void GLStateCache::ResetCounters()
+	{
+		issued_calls = 0;
+		filtered_calls = 0;
+	}
+
 	//------------------------------------
 	//----    SHADERS AND PROGRAMS    ----
 	//------------------------------------
@@ -160,7 +401,22 @@ namespace PV227
 		return ss.str();
 	}
 
-	GLuint LoadAndCompileShader(GLenum shader_type, const char *file_name)
+	string InjectShaderDefines(const string &source, const string &defines)
+	{
+		if (defines.empty())
+			return source;
+
+		// #version must be the first statement, so the defines go right after its line
+		size_t version_pos = source.find("#version");
+		if (version_pos == string::npos)
+			return defines + source;
+		size_t line_end = source.find('\n', version_pos);
+		if (line_end == string::npos)
+			return source + "\n" + defines;
+		return source.substr(0, line_end + 1) + defines + source.substr(line_end + 1);
+	}
+
+	GLuint LoadAndCompileShader(GLenum shader_type, const char *file_name, const string &defines)
 	{
 		// Load the file from the disk
 		string s_source = LoadFileToString(file_name);
@@ -169,14 +425,24 @@ namespace PV227
 			cout << "File " << file_name << " is empty or failed to load" << endl;
 			return 0;
 		}
+		s_source = InjectShaderDefines(s_source, defines);
+
+		return CompileShader(shader_type, s_source, file_name);
+	}
 
-		// Create shader object and set the source
+	/// Creates a shader object, sets its source, and starts its compilation. It does not wait for the result.
+	static GLuint StartCompileShader(GLenum shader_type, const string &s_source)
+	{
 		GLuint shader = glCreateShader(shader_type);
 		const char *source = s_source.c_str();
 		glShaderSource(shader, 1, &source, nullptr);
 		glCompileShader(shader);
+		return shader;
+	}
 
-		// Compile and get errors
+	/// Checks whether the shader was compiled. If not, prints the errors, deletes the shader, and returns false.
+	static bool CheckShaderCompileStatus(GLuint shader, GLenum shader_type, const char *file_name)
+	{
 		int compile_status;
 		glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_status);
 		if (GL_FALSE == compile_status)
@@ -199,30 +465,75 @@ namespace PV227
 			cout << log.get() << endl;
 
 			glDeleteShader(shader);
-			return 0;
+			return false;
 		}
-		else return shader;
+		else return true;
+	}
+
+	GLuint CompileShader(GLenum shader_type, const string &s_source, const char *file_name)
+	{
+		GLuint shader = StartCompileShader(shader_type, s_source);
+		return CheckShaderCompileStatus(shader, shader_type, file_name) ? shader : 0;
 	}
 
-	ShaderProgram::ShaderProgram(): program(0), valid(false)
+	string ShaderProgram::binary_cache_directory;
+	vector<ShaderProgram *> ShaderProgram::building_programs;
+	map<string, ShaderProgram::ExpectedBlockSize> ShaderProgram::expected_block_sizes;
+	vector<string> ShaderProgram::uniform_id_names;
+
+	/// Value in ShaderProgram::uniform_id_locations of the ids whose locations were not looked up yet
+	static const GLint UnresolvedLocation = -2;
+
+	ShaderProgram::ShaderProgram(): loaded_from_cache(false), building(false), replaces(nullptr), program(0), valid(false)
 	{
 	}
 
 	void ShaderProgram::Init()
 	{
 		Destroy();
+		defines.clear();
+		bound_locations.clear();
 		program = glCreateProgram();
 	}
 
+	void ShaderProgram::AddDefine(const char *name, int value)
+	{
+		defines += string("#define ") + name + " " + to_string(value) + "\n";
+	}
+
+	const string &ShaderProgram::GetDefines() const
+	{
+		return defines;
+	}
+
 	void ShaderProgram::Destroy()
 	{
+		// Cancel the asynchronous builds
+		if (building)
+		{
+			building_programs.erase(std::remove(building_programs.begin(), building_programs.end(), this), building_programs.end());
+			building = false;
+		}
+		if (pending)
+		{
+			pending->Destroy();
+			pending.reset();
+		}
+
 		valid = false;
+		loaded_from_cache = false;
+		uniform_locations.clear();
+		uniform_id_locations.clear();
+		uniform_blocks.clear();
+		storage_blocks.clear();
 
+		GLStateCache::ForgetProgram(program);
 		glDeleteProgram(program);
 		program = 0;
 		
 		for (Shader &shader : shaders)
-			glDeleteShader(shader.shader);
+			if (!shader.borrowed)
+				glDeleteShader(shader.shader);
 		shaders.clear();
 	}
 
@@ -231,20 +542,23 @@ namespace PV227
 		if (!program)
 			return false;		// Ignore silently
 
-		// Load and compile the shader
+		// Load the shader, it is compiled in Link
 		Shader shader;
-		shader.shader = LoadAndCompileShader(shader_type, file_name);
+		shader.shader = 0;
+		shader.borrowed = false;
 		shader.type = shader_type;
 		shader.file_name = file_name;
-		shaders.push_back(shader);
+		shader.source = LoadFileToString(file_name);
 		
-		if (shader.shader)
+		if (!shader.source.empty())
 		{
-			glAttachShader(program, shader.shader);
+			shader.source = InjectShaderDefines(shader.source, defines);
+			shaders.push_back(shader);
 			return true;
 		}
 		else
 		{
+			cout << "File " << file_name << " is empty or failed to load" << endl;
 			Destroy();
 			return false;
 		}
@@ -283,13 +597,21 @@ namespace PV227
 	void ShaderProgram::BindAttribLocation(GLint idx, const char *name) const
 	{
 		if (program)			// Ignore silently
+		{
 			glBindAttribLocation(program, idx, name);
+			BoundLocation location = { false, idx, name };
+			bound_locations.push_back(location);
+		}
 	}
 
 	void ShaderProgram::BindFragDataLocation(GLint idx, const char *name) const
 	{
 		if (program)			// Ignore silently
+		{
 			glBindFragDataLocation(program, idx, name);
+			BoundLocation location = { true, idx, name };
+			bound_locations.push_back(location);
+		}
 	}
 
 	bool ShaderProgram::Link()
@@ -297,10 +619,51 @@ namespace PV227
 		if (!program)
 			return false;		// Ignore silently
 
+		// Use the binary from the cache if there is one
+		if (LoadFromBinaryCache())
+		{
+			valid = true;
+			loaded_from_cache = true;
+			Reflect();
+			return true;
+		}
+
+		StartLink();
+		return FinishLink();
+	}
+
+	void ShaderProgram::StartLink()
+	{
+		// Start compilation of all shaders that are not compiled yet, do not wait for the results
+		for (Shader &shader : shaders)
+		{
+			if (!shader.shader)
+			{
+				shader.shader = StartCompileShader(shader.type, shader.source);
+				glAttachShader(program, shader.shader);
+			}
+		}
+
 		// Link program
+		if (!binary_cache_directory.empty())
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(program);
+	}
+
+	bool ShaderProgram::FinishLink()
+	{
+		// Get errors of the compilation
+		for (Shader &shader : shaders)
+		{
+			if (!CheckShaderCompileStatus(shader.shader, shader.type, shader.file_name))
+			{
+				shader.shader = 0;		// Already deleted
+				Destroy();
+				return false;
+			}
+		}
 
-		// Link and get errors
+		// Get errors of the linking
 		int link_status;
 		glGetProgramiv(program, GL_LINK_STATUS, &link_status);
 		if (GL_FALSE == link_status)
@@ -322,118 +685,1179 @@ namespace PV227
 		else
 		{
 			valid = true;
+			Reflect();
+			SaveToBinaryCache();
 			return true;
 		}
 	}
 
-	bool ShaderProgram::IsValid() const
+	void ShaderProgram::Reflect()
 	{
-		return valid;
+		uniform_locations.clear();
+		uniform_id_locations.clear();
+		uniform_blocks.clear();
+		storage_blocks.clear();
+
+		// Uniforms in the default block (uniforms in blocks have no location)
+		GLint count = 0, max_name_length = 0;
+		glGetProgramInterfaceiv(program, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+		glGetProgramInterfaceiv(program, GL_UNIFORM, GL_MAX_NAME_LENGTH, &max_name_length);
+		vector<char> name(max_name_length + 1);
+		for (GLint i = 0; i < count; i++)
+		{
+			const GLenum prop = GL_LOCATION;
+			GLint location = -1;
+			glGetProgramResourceiv(program, GL_UNIFORM, i, 1, &prop, 1, nullptr, &location);
+			if (location < 0)
+				continue;
+			glGetProgramResourceName(program, GL_UNIFORM, i, GLsizei(name.size()), nullptr, name.data());
+			string uniform_name = name.data();
+			uniform_locations[uniform_name] = location;
+			// Arrays are reported as 'name[0]', make them accessible also by 'name', as glGetUniformLocation does
+			if ((uniform_name.size() > 3) && (uniform_name.compare(uniform_name.size() - 3, 3, "[0]") == 0))
+				uniform_locations[uniform_name.substr(0, uniform_name.size() - 3)] = location;
+		}
+
+		// Uniform blocks and shader storage blocks
+		const GLenum interfaces[2] = { GL_UNIFORM_BLOCK, GL_SHADER_STORAGE_BLOCK };
+		for (GLenum inter : interfaces)
+		{
+			unordered_map<string, BlockInfo> &blocks = (inter == GL_UNIFORM_BLOCK) ? uniform_blocks : storage_blocks;
+			glGetProgramInterfaceiv(program, inter, GL_ACTIVE_RESOURCES, &count);
+			glGetProgramInterfaceiv(program, inter, GL_MAX_NAME_LENGTH, &max_name_length);
+			name.resize(max_name_length + 1);
+			for (GLint i = 0; i < count; i++)
+			{
+				const GLenum prop = GL_BUFFER_DATA_SIZE;
+				BlockInfo block;
+				block.index = GLuint(i);
+				glGetProgramResourceiv(program, inter, i, 1, &prop, 1, nullptr, &block.data_size);
+				glGetProgramResourceName(program, inter, i, GLsizei(name.size()), nullptr, name.data());
+				blocks[name.data()] = block;
+				CheckBlockSize((inter == GL_UNIFORM_BLOCK) ? "Uniform block" : "Shader storage block", name.data(), block);
+			}
+		}
 	}
 
-	GLuint ShaderProgram::GetProgram() const
+	void ShaderProgram::CheckBlockSize(const char *block_kind, const string &name, const BlockInfo &block) const
 	{
-		return program;
+		map<string, ExpectedBlockSize>::const_iterator expected = expected_block_sizes.find(name);
+		if (expected == expected_block_sizes.end())
+			return;
+
+		// The shader reports the size of the array of unspecified size as if it had one element
+		size_t expected_size = expected->second.size + expected->second.array_element_size;
+		size_t rounded_expected = (expected_size + 15) & ~size_t(15);
+		size_t rounded_actual = (size_t(block.data_size) + 15) & ~size_t(15);
+		if (rounded_expected != rounded_actual)
+		{
+			cout << block_kind << " " << name << " has " << block.data_size << " bytes, but its C++ structure has "
+				<< expected_size << " bytes, in program with shaders: ";
+			for (const Shader &shader : shaders)
+				cout << shader.file_name << ", ";
+			cout << endl;
+		}
 	}
 
-	GLint ShaderProgram::GetAttribLocation(const char *name) const
+	void ShaderProgram::SetExpectedBlockSize(const char *block_name, size_t size, size_t array_element_size)
 	{
-		if (valid)
-			return glGetAttribLocation(program, name);
-		else return -1;
+		ExpectedBlockSize &expected = expected_block_sizes[block_name];
+		expected.size = size;
+		expected.array_element_size = array_element_size;
+	}
+
+	bool ShaderProgram::WasLoadedFromCache() const
+	{
+		return loaded_from_cache;
+	}
+
+	/// Asks the driver to compile the shaders in parallel, returns true if it can report when a compilation is completed
+	static bool EnableParallelShaderCompile()
+	{
+		static int supported = -1;		// Unknown yet
+		if (supported < 0)
+		{
+			supported = 0;
+			if (GLEW_ARB_parallel_shader_compile)
+			{
+				glMaxShaderCompilerThreadsARB(0xFFFFFFFF);		// Use as many threads as the driver wants
+				supported = 1;
+			}
+			else if (IsOpenGLExtensionPresent("GL_KHR_parallel_shader_compile"))
+			{
+				supported = 1;		// The KHR version uses the same GL_COMPLETION_STATUS query, its default number of threads is kept
+			}
+		}
+		return (supported == 1);
+	}
+
+	bool ShaderProgram::LinkAsync()
+	{
+		if (!program)
+		{
+			if (replaces)
+				FinishAsyncBuild(false);
+			return false;		// Ignore silently
+		}
+
+		// Use the binary from the cache if there is one
+		if (LoadFromBinaryCache())
+		{
+			valid = true;
+			loaded_from_cache = true;
+			FinishAsyncBuild(true);
+			return true;
+		}
+
+		EnableParallelShaderCompile();
+		StartLink();
+		building = true;
+		building_programs.push_back(this);
+		return true;
+	}
+
+	bool ShaderProgram::IsBuilding() const
+	{
+		return building || (pending != nullptr);
+	}
+
+	bool ShaderProgram::RebuildChangedShaders(const set<string> &changed_files)
+	{
+		bool uses_changed_file = false;
+		for (const Shader &shader : shaders)
+			if (changed_files.count(shader.file_name) > 0)
+				uses_changed_file = true;
+		if (!uses_changed_file)
+			return false;
+
+		ShaderProgram &new_program = BeginRebuild();
+		new_program.defines = defines;
+		for (const Shader &shader : shaders)
+		{
+			if ((changed_files.count(shader.file_name) > 0) || !shader.shader)
+			{
+				// Load the shader again (shaders loaded from the binary cache have no objects, they must be compiled, too)
+				new_program.AddShader(shader.type, shader.file_name);
+			}
+			else if (new_program.program)
+			{
+				// Reuse the compiled shader
+				Shader reused = shader;
+				reused.borrowed = true;
+				new_program.shaders.push_back(reused);
+				glAttachShader(new_program.program, reused.shader);
+			}
+		}
+		for (const BoundLocation &location : bound_locations)
+		{
+			if (location.frag_data)
+				new_program.BindFragDataLocation(location.idx, location.name.c_str());
+			else
+				new_program.BindAttribLocation(location.idx, location.name.c_str());
+		}
+		new_program.LinkAsync();
+		return true;
+	}
+
+	vector<string> ShaderProgram::GetShaderFiles() const
+	{
+		vector<string> files;
+		for (const Shader &shader : shaders)
+			files.push_back(shader.file_name);
+		return files;
+	}
+
+	bool ShaderProgram::IsBuildComplete() const
+	{
+		// Without the parallel compile extension, querying the status blocks until the build is complete
+		if (!EnableParallelShaderCompile())
+			return true;
+		int completion_status = GL_FALSE;
+		glGetProgramiv(program, GL_COMPLETION_STATUS_ARB, &completion_status);
+		return (GL_FALSE != completion_status);
+	}
+
+	ShaderProgram &ShaderProgram::BeginRebuild()
+	{
+		if (pending)
+			pending->Destroy();		// Cancel the previous rebuild
+		pending = make_shared<ShaderProgram>();
+		pending->replaces = this;
+		pending->Init();
+		return *pending;
+	}
+
+	void ShaderProgram::FinishAsyncBuild(bool success)
+	{
+		if (!replaces)
+			return;
+
+		// This object is owned by replaces->pending, keep it alive until the end of this method
+		ShaderProgram *owner = replaces;
+		shared_ptr<ShaderProgram> keep_alive = owner->pending;
+		owner->pending.reset();
+		replaces = nullptr;
+
+		if (success)
+		{
+			// The new version of the program takes over the OpenGL objects, the old one is deleted
+			// except the shaders that the new version reuses
+			for (Shader &shader : shaders)
+			{
+				if (shader.borrowed)
+				{
+					for (Shader &owner_shader : owner->shaders)
+						if (owner_shader.shader == shader.shader)
+							owner_shader.borrowed = true;
+					shader.borrowed = false;
+				}
+			}
+			owner->Destroy();
+			*owner = *this;
+		}
+		else
+		{
+			// The errors were printed, the old version of the program is kept
+			Destroy();
+		}
+	}
+
+	int ShaderProgram::PollPendingPrograms()
+	{
+		int finished = 0;
+
+		// Finishing a build may destroy other programs, so iterate over a copy of the list
+		vector<ShaderProgram *> programs = building_programs;
+		for (ShaderProgram *program : programs)
+		{
+			if (std::find(building_programs.begin(), building_programs.end(), program) == building_programs.end())
+				continue;		// Destroyed meanwhile
+			if (!program->IsBuildComplete())
+				continue;
+
+			building_programs.erase(std::find(building_programs.begin(), building_programs.end(), program));
+			program->building = false;
+			bool success = program->FinishLink();
+			program->FinishAsyncBuild(success);
+			finished++;
+		}
+
+		return finished;
+	}
+
+	bool ShaderProgram::HasPendingPrograms()
+	{
+		return !building_programs.empty();
+	}
+
+	void ShaderProgram::SetBinaryCacheDirectory(const char *directory)
+	{
+		binary_cache_directory = directory ? directory : "";
+		if (!binary_cache_directory.empty())
+		{
+			// Fails silently when the directory already exists
+#if defined(_WIN32)
+			_mkdir(binary_cache_directory.c_str());
+#else
+			mkdir(binary_cache_directory.c_str(), 0755);
+#endif
+		}
+	}
+
+	const string &ShaderProgram::GetBinaryCacheDirectory()
+	{
+		return binary_cache_directory;
+	}
+
+	string ShaderProgram::GetBinaryCacheFileName() const
+	{
+		// 64-bit FNV-1a hash of everything that affects the binary
+		uint64_t hash = 14695981039346656037ull;
+		auto add_to_hash = [&hash](const string &str) {
+			for (unsigned char c : str)
+			{
+				hash ^= c;
+				hash *= 1099511628211ull;
+			}
+			hash ^= 0xFF;		// Separator, so that "ab","c" and "a","bc" differ
+			hash *= 1099511628211ull;
+		};
+
+		add_to_hash((const char *)glGetString(GL_VENDOR));
+		add_to_hash((const char *)glGetString(GL_RENDERER));
+		add_to_hash((const char *)glGetString(GL_VERSION));
+		add_to_hash(defines);
+		for (const BoundLocation &location : bound_locations)
+			add_to_hash((location.frag_data ? "frag_data " : "attrib ") + location.name + " " + to_string(location.idx));
+		for (const Shader &shader : shaders)
+		{
+			add_to_hash(to_string(shader.type));
+			add_to_hash(shader.source);
+		}
+
+		stringstream ss;
+		ss << binary_cache_directory << "/" << hex << setw(16) << setfill('0') << hash << ".bin";
+		return ss.str();
+	}
+
+	bool ShaderProgram::LoadFromBinaryCache()
+	{
+		if (binary_cache_directory.empty())
+			return false;
+		GLint formats_count = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats_count);
+		if (formats_count <= 0)
+			return false;
+
+		// The file contains the format of the binary followed by the binary itself
+		ifstream file(GetBinaryCacheFileName(), ios::binary);
+		if (!file)
+			return false;
+		GLenum format = 0;
+		if (!file.read((char *)&format, sizeof(format)))
+			return false;
+		vector<char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		if (binary.empty())
+			return false;
+
+		// The driver rejects the binary when it does not match (e.g. after a driver update), compile the shaders in that case
+		glProgramBinary(program, format, binary.data(), GLsizei(binary.size()));
+		int link_status;
+		glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+		return (GL_FALSE != link_status);
+	}
+
+	void ShaderProgram::SaveToBinaryCache() const
+	{
+		if (binary_cache_directory.empty())
+			return;
+		GLint binary_length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_length);
+		if (binary_length <= 0)
+			return;
+
+		vector<char> binary(binary_length);
+		GLenum format = 0;
+		glGetProgramBinary(program, binary_length, nullptr, &format, binary.data());
+
+		ofstream file(GetBinaryCacheFileName(), ios::binary);
+		file.write((const char *)&format, sizeof(format));
+		file.write(binary.data(), binary.size());
+	}
+
+	bool ShaderProgram::IsValid() const
+	{
+		return valid;
+	}
+
+	GLuint ShaderProgram::GetProgram() const
+	{
+		return program;
+	}
+
+	GLint ShaderProgram::GetAttribLocation(const char *name) const
+	{
+		if (valid)
+			return glGetAttribLocation(program, name);
+		else return -1;
+	}
+
+	GLint ShaderProgram::GetUniformLocation(const char *name) const
+	{
+		if (!valid)
+			return -1;
+		unordered_map<string, GLint>::const_iterator it = uniform_locations.find(name);
+		if (it != uniform_locations.end())
+			return it->second;
+
+		// The name is not an active uniform or it is an element of an array, ask OpenGL and remember the answer
+		GLint location = glGetUniformLocation(program, name);
+		uniform_locations[name] = location;
+		return location;
+	}
+
+	GLint ShaderProgram::GetUniformLocation(UniformId id) const
+	{
+		if (!valid)
+			return -1;
+		if (size_t(id.index) >= uniform_id_locations.size())
+			uniform_id_locations.resize(uniform_id_names.size(), UnresolvedLocation);
+		GLint &location = uniform_id_locations[id.index];
+		if (location == UnresolvedLocation)
+			location = GetUniformLocation(uniform_id_names[id.index].c_str());
+		return location;
+	}
+
+	UniformId ShaderProgram::GetUniformId(const char *name)
+	{
+		UniformId id;
+		for (id.index = 0; id.index < int(uniform_id_names.size()); id.index++)
+			if (uniform_id_names[id.index] == name)
+				return id;
+		uniform_id_names.push_back(name);
+		return id;
+	}
+
+	GLuint ShaderProgram::GetUniformBlockIndex(const char *name) const
+	{
+		if (!valid)
+			return GL_INVALID_INDEX;
+		unordered_map<string, BlockInfo>::const_iterator it = uniform_blocks.find(name);
+		return (it != uniform_blocks.end()) ? it->second.index : GL_INVALID_INDEX;
+	}
+
+	GLuint ShaderProgram::GetStorageBlockIndex(const char *name) const
+	{
+		if (!valid)
+			return GL_INVALID_INDEX;
+		unordered_map<string, BlockInfo>::const_iterator it = storage_blocks.find(name);
+		return (it != storage_blocks.end()) ? it->second.index : GL_INVALID_INDEX;
+	}
+
+	GLint ShaderProgram::GetUniformBlockSize(const char *name) const
+	{
+		unordered_map<string, BlockInfo>::const_iterator it = uniform_blocks.find(name);
+		return (valid && (it != uniform_blocks.end())) ? it->second.data_size : -1;
+	}
+
+	GLint ShaderProgram::GetStorageBlockSize(const char *name) const
+	{
+		unordered_map<string, BlockInfo>::const_iterator it = storage_blocks.find(name);
+		return (valid && (it != storage_blocks.end())) ? it->second.data_size : -1;
+	}
+
+	void ShaderProgram::SetUniformBlockBindingIndex(const char *name, GLuint idx) const
+	{
+		GLuint loc = GetUniformBlockIndex(name);
+		if (loc != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, loc, idx);
+	}
+
+	void ShaderProgram::Use() const
+	{
+		GLStateCache::UseProgram(program);
+	}
+
+	void ShaderProgram::Uniform1f			(const char *name, GLfloat v0) const												{	glUniform1f		(GetUniformLocation(name), v0);					}
+	void ShaderProgram::Uniform1fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform1fv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform1i			(const char *name, GLint v0) const													{	glUniform1i		(GetUniformLocation(name), v0);					}
+	void ShaderProgram::Uniform1iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform1iv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform2f			(const char *name, GLfloat v0, GLfloat v1) const									{	glUniform2f		(GetUniformLocation(name), v0, v1);				}
+	void ShaderProgram::Uniform2fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform2fv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform2i			(const char *name, GLint v0, GLint v1) const										{	glUniform2i		(GetUniformLocation(name), v0, v1);				}
+	void ShaderProgram::Uniform2iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform2iv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform3f			(const char *name, GLfloat v0, GLfloat v1, GLfloat v2) const						{	glUniform3f		(GetUniformLocation(name), v0, v1, v2);			}
+	void ShaderProgram::Uniform3fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform3fv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform3i			(const char *name, GLint v0, GLint v1, GLint v2) const								{	glUniform3i		(GetUniformLocation(name), v0, v1, v2);			}
+	void ShaderProgram::Uniform3iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform3iv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform4f			(const char *name, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) const			{	glUniform4f		(GetUniformLocation(name), v0, v1, v2, v3);		}
+	void ShaderProgram::Uniform4fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform4fv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform4i			(const char *name, GLint v0, GLint v1, GLint v2, GLint v3) const					{	glUniform4i		(GetUniformLocation(name), v0, v1, v2, v3);		}
+	void ShaderProgram::Uniform4iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform4iv	(GetUniformLocation(name), count, value);		}
+	void ShaderProgram::Uniform1ui			(const char *name, GLuint v0) const													{	glUniform1ui	(GetUniformLocation(name), v0);					}
+	void ShaderProgram::Uniform2ui			(const char *name, GLuint v0, GLuint v1) const										{	glUniform2ui	(GetUniformLocation(name), v0, v1);				}
+	void ShaderProgram::Uniform3ui			(const char *name, GLuint v0, GLuint v1, GLuint v2) const							{	glUniform3ui	(GetUniformLocation(name), v0, v1, v2);			}
+	void ShaderProgram::Uniform4ui			(const char *name, GLuint v0, GLuint v1, GLuint v2, GLuint v3) const				{	glUniform4ui	(GetUniformLocation(name), v0, v1, v2, v3);		}
+	void ShaderProgram::UniformMatrix2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2fv		(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3fv		(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4fv		(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix2x3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x3fv	(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix2x4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x4fv	(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3x2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x2fv	(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3x4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x4fv	(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4x2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x2fv	(GetUniformLocation(name), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4x3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x3fv	(GetUniformLocation(name), count, transpose, value);	}
+
+	void ShaderProgram::Uniform1f			(UniformId id,    GLfloat v0) const												{	glUniform1f		(GetUniformLocation(id), v0);					}
+	void ShaderProgram::Uniform1fv			(UniformId id,    GLsizei count, const GLfloat* value) const						{	glUniform1fv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform1i			(UniformId id,    GLint v0) const													{	glUniform1i		(GetUniformLocation(id), v0);					}
+	void ShaderProgram::Uniform1iv			(UniformId id,    GLsizei count, const GLint* value) const							{	glUniform1iv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform2f			(UniformId id,    GLfloat v0, GLfloat v1) const									{	glUniform2f		(GetUniformLocation(id), v0, v1);				}
+	void ShaderProgram::Uniform2fv			(UniformId id,    GLsizei count, const GLfloat* value) const						{	glUniform2fv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform2i			(UniformId id,    GLint v0, GLint v1) const										{	glUniform2i		(GetUniformLocation(id), v0, v1);				}
+	void ShaderProgram::Uniform2iv			(UniformId id,    GLsizei count, const GLint* value) const							{	glUniform2iv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform3f			(UniformId id,    GLfloat v0, GLfloat v1, GLfloat v2) const						{	glUniform3f		(GetUniformLocation(id), v0, v1, v2);			}
+	void ShaderProgram::Uniform3fv			(UniformId id,    GLsizei count, const GLfloat* value) const						{	glUniform3fv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform3i			(UniformId id,    GLint v0, GLint v1, GLint v2) const								{	glUniform3i		(GetUniformLocation(id), v0, v1, v2);			}
+	void ShaderProgram::Uniform3iv			(UniformId id,    GLsizei count, const GLint* value) const							{	glUniform3iv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform4f			(UniformId id,    GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) const			{	glUniform4f		(GetUniformLocation(id), v0, v1, v2, v3);		}
+	void ShaderProgram::Uniform4fv			(UniformId id,    GLsizei count, const GLfloat* value) const						{	glUniform4fv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform4i			(UniformId id,    GLint v0, GLint v1, GLint v2, GLint v3) const					{	glUniform4i		(GetUniformLocation(id), v0, v1, v2, v3);		}
+	void ShaderProgram::Uniform4iv			(UniformId id,    GLsizei count, const GLint* value) const							{	glUniform4iv	(GetUniformLocation(id), count, value);		}
+	void ShaderProgram::Uniform1ui			(UniformId id,    GLuint v0) const													{	glUniform1ui	(GetUniformLocation(id), v0);					}
+	void ShaderProgram::Uniform2ui			(UniformId id,    GLuint v0, GLuint v1) const										{	glUniform2ui	(GetUniformLocation(id), v0, v1);				}
+	void ShaderProgram::Uniform3ui			(UniformId id,    GLuint v0, GLuint v1, GLuint v2) const							{	glUniform3ui	(GetUniformLocation(id), v0, v1, v2);			}
+	void ShaderProgram::Uniform4ui			(UniformId id,    GLuint v0, GLuint v1, GLuint v2, GLuint v3) const				{	glUniform4ui	(GetUniformLocation(id), v0, v1, v2, v3);		}
+	void ShaderProgram::UniformMatrix2fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2fv		(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3fv		(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4fv		(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix2x3fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x3fv	(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix2x4fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x4fv	(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3x2fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x2fv	(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix3x4fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x4fv	(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4x2fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x2fv	(GetUniformLocation(id), count, transpose, value);	}
+	void ShaderProgram::UniformMatrix4x3fv	(UniformId id,    GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x3fv	(GetUniformLocation(id), count, transpose, value);	}
+
+	void ShaderProgramMap::AddProgram(int key, ShaderProgram *program)
+	{
+		if (!program)
+			RemoveProgram(key);
+		else
+			shader_map[key] = program;
+	}
+
+	void ShaderProgramMap::RemoveProgram(int key)
+	{
+		shader_map.erase(key);
+	}
+
+	void ShaderProgramMap::RemoveAll()
+	{
+		shader_map.clear();
+	}
+
+	ShaderProgram *ShaderProgramMap::GetProgram(int key)
+	{
+		auto iter = shader_map.find(key);
+		return (iter == shader_map.end()) ? nullptr : iter->second;
+	}
+
+	bool ShaderProgramMap::UseProgram(int key)
+	{
+		ShaderProgram *program = GetProgram(key);
+		if (!program || !program->IsValid())
+		{
+			return false;
+		}
+		else
+		{
+			program->Use();
+			return true;
+		}
+	}
+
+	void ShaderProgramVariants::Init()
+	{
+		// Keep the existing variants usable until their new versions are built
+		stages.clear();
+		flags.clear();
+		MarkOutdated();
+	}
+
+	void ShaderProgramVariants::MarkOutdated()
+	{
+		for (auto &variant : variants)
+			outdated.insert(variant.first);
+	}
+
+	void ShaderProgramVariants::SetUpVariant(ShaderProgram &program, unsigned int mask) const
+	{
+		for (const auto &flag : flags)
+			program.AddDefine(flag.second.c_str(), (mask & flag.first) ? 1 : 0);
+		for (const Stage &stage : stages)
+			program.AddShader(stage.type, stage.file_name);
+	}
+
+	void ShaderProgramVariants::Destroy()
+	{
+		for (auto &variant : variants)
+			variant.second.Destroy();
+		variants.clear();
+		outdated.clear();
+	}
+
+	void ShaderProgramVariants::AddShader(GLenum shader_type, const char *file_name)
+	{
+		Stage stage;
+		stage.type = shader_type;
+		stage.file_name = file_name;
+		stages.push_back(stage);
+		MarkOutdated();		// Existing variants do not contain the new shader
+	}
+
+	void ShaderProgramVariants::AddVertexShader(const char *file_name)
+	{
+		AddShader(GL_VERTEX_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddTessControlShader(const char *file_name)
+	{
+		AddShader(GL_TESS_CONTROL_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddTessEvaluationShader(const char *file_name)
+	{
+		AddShader(GL_TESS_EVALUATION_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddGeometryShader(const char *file_name)
+	{
+		AddShader(GL_GEOMETRY_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddFragmentShader(const char *file_name)
+	{
+		AddShader(GL_FRAGMENT_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddComputeShader(const char *file_name)
+	{
+		AddShader(GL_COMPUTE_SHADER, file_name);
+	}
+
+	void ShaderProgramVariants::AddFlag(unsigned int bit_mask, const char *define_name)
+	{
+		flags.push_back(std::make_pair(bit_mask, string(define_name)));
+		MarkOutdated();		// Existing variants do not contain the new define
+	}
+
+	ShaderProgram *ShaderProgramVariants::GetVariant(unsigned int mask)
+	{
+		auto iter = variants.find(mask);
+		if (iter != variants.end())
+		{
+			// Rebuild the outdated variant in the background, its old version is used meanwhile
+			if (outdated.erase(mask) > 0)
+			{
+				ShaderProgram &new_program = iter->second.BeginRebuild();
+				SetUpVariant(new_program, mask);
+				new_program.LinkAsync();
+			}
+			return &iter->second;
+		}
+
+		// Build the variant in the background, remember it even if it fails so that it is not built again each frame
+		ShaderProgram &program = variants[mask];
+		program.Init();
+		SetUpVariant(program, mask);
+		program.LinkAsync();
+		return &program;
+	}
+
+	bool ShaderProgramVariants::UseVariant(unsigned int mask)
+	{
+		ShaderProgram *program = GetVariant(mask);
+		if (!program->IsValid())
+		{
+			return false;
+		}
+		else
+		{
+			program->Use();
+			return true;
+		}
+	}
+
+	bool ShaderProgramVariants::RebuildChangedShaders(const set<string> &changed_files)
+	{
+		bool uses_changed_file = false;
+		for (const Stage &stage : stages)
+			if (changed_files.count(stage.file_name) > 0)
+				uses_changed_file = true;
+		if (!uses_changed_file)
+			return false;
+
+		for (auto &variant : variants)
+		{
+			// Variants that are being built already, or that failed to build (they have no shaders),
+			// are built again from scratch when they are used
+			if (variant.second.IsBuilding() || !variant.second.RebuildChangedShaders(changed_files))
+				outdated.insert(variant.first);
+		}
+		return true;
+	}
+
+	vector<string> ShaderProgramVariants::GetShaderFiles() const
+	{
+		vector<string> files;
+		for (const Stage &stage : stages)
+			files.push_back(stage.file_name);
+		return files;
+	}
+
+	ShaderHotReloader::ShaderHotReloader(): last_check_time(0), inotify_fd(-1)
+	{
+	}
+
+	void ShaderHotReloader::Destroy()
+	{
+#ifdef PV227_USE_INOTIFY
+		if (inotify_fd >= 0)
+			close(inotify_fd);
+#endif
+		inotify_fd = -1;
+		watched_directories.clear();
+		file_times.clear();
+		programs.clear();
+		variants.clear();
+	}
+
+	void ShaderHotReloader::Watch(ShaderProgram *program)
+	{
+		WatchedProgram watched;
+		watched.program = program;
+		programs.push_back(watched);
+		UpdateWatchedFiles();
+	}
+
+	void ShaderHotReloader::Watch(ShaderProgramVariants *variants)
+	{
+		this->variants.push_back(variants);
+		UpdateWatchedFiles();
+	}
+
+	void ShaderHotReloader::UpdateWatchedFiles()
+	{
+		// Remember the shaders of the programs (including those that are being built), so that the programs can be built
+		// again from scratch even when their build failed and they lost their shaders
+		set<string> files;
+		for (WatchedProgram &watched : programs)
+		{
+			const ShaderProgram *description = watched.program->pending ? watched.program->pending.get() : watched.program;
+			if (!description->shaders.empty())
+			{
+				watched.shaders.clear();
+				for (const ShaderProgram::Shader &shader : description->shaders)
+					watched.shaders.push_back(std::make_pair(shader.type, shader.file_name));
+				watched.defines = description->defines;
+			}
+			for (const auto &shader : watched.shaders)
+				files.insert(shader.second);
+		}
+		for (ShaderProgramVariants *watched_variants : variants)
+		{
+			vector<string> variants_files = watched_variants->GetShaderFiles();
+			files.insert(variants_files.begin(), variants_files.end());
+		}
+
+		for (const string &file : files)
+		{
+			if (file_times.count(file) > 0)
+				continue;
+
+			// Remember the modification time of the new file
+			struct stat file_stat;
+			file_times[file] = (stat(file.c_str(), &file_stat) == 0) ? (long long)file_stat.st_mtime : 0;
+
+#ifdef PV227_USE_INOTIFY
+			// Watch the directory of the file rather than the file, editors often replace the files when saving them
+			if (inotify_fd < 0)
+				inotify_fd = inotify_init1(IN_NONBLOCK);
+			if (inotify_fd >= 0)
+			{
+				size_t slash = file.find_last_of('/');
+				string directory = (slash == string::npos) ? "." : file.substr(0, slash);
+				int wd = inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+				if (wd >= 0)
+					watched_directories[wd] = directory;
+			}
+#endif
+		}
+	}
+
+	set<string> ShaderHotReloader::GetChangedFiles()
+	{
+		set<string> changed_files;
+
+#ifdef PV227_USE_INOTIFY
+		if (inotify_fd >= 0)
+		{
+			alignas(inotify_event) char buffer[4096];
+			ssize_t length;
+			while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+			{
+				for (char *ptr = buffer; ptr < buffer + length; ptr += sizeof(inotify_event) + ((inotify_event *)ptr)->len)
+				{
+					const inotify_event *event = (const inotify_event *)ptr;
+					auto directory = watched_directories.find(event->wd);
+					if ((event->len == 0) || (directory == watched_directories.end()))
+						continue;
+					string file = (directory->second == ".") ? string(event->name) : directory->second + "/" + event->name;
+					if (file_times.count(file) > 0)
+						changed_files.insert(file);
+				}
+			}
+			return changed_files;
+		}
+#endif
+
+		// Check the modification times
+		int current_time = glutGet(GLUT_ELAPSED_TIME);
+		if (current_time - last_check_time < 500)
+			return changed_files;
+		last_check_time = current_time;
+
+		for (auto &file_time : file_times)
+		{
+			struct stat file_stat;
+			if (stat(file_time.first.c_str(), &file_stat) != 0)
+				continue;		// The file may be just being replaced, try it next time
+			if ((long long)file_stat.st_mtime != file_time.second)
+			{
+				file_time.second = (long long)file_stat.st_mtime;
+				changed_files.insert(file_time.first);
+			}
+		}
+		return changed_files;
+	}
+
+	int ShaderHotReloader::Update()
+	{
+		UpdateWatchedFiles();
+
+		set<string> changed_files = GetChangedFiles();
+		if (changed_files.empty())
+			return 0;
+
+		for (const string &file : changed_files)
+			cout << "Shader " << file << " changed, rebuilding the programs that use it" << endl;
+
+		for (WatchedProgram &watched : programs)
+		{
+			bool uses_changed_file = false;
+			for (const auto &shader : watched.shaders)
+				if (changed_files.count(shader.second) > 0)
+					uses_changed_file = true;
+			if (!uses_changed_file)
+				continue;
+
+			// Compile only the changed shaders. When the program is being rebuilt already (and the rebuild
+			// may contain other changes), or when it has no shaders (its build failed), build it from scratch.
+			if (!watched.program->pending && watched.program->RebuildChangedShaders(changed_files))
+				continue;
+			ShaderProgram &new_program = watched.program->BeginRebuild();
+			new_program.defines = watched.defines;
+			for (const auto &shader : watched.shaders)
+				new_program.AddShader(shader.first, shader.second);
+			new_program.LinkAsync();
+		}
+
+		for (ShaderProgramVariants *watched_variants : variants)
+			watched_variants->RebuildChangedShaders(changed_files);
+
+		return int(changed_files.size());
+	}
+
+	//----------------------------------------
+	//----    BUFFERS AND VERTEX ARRAYS    ----
+	//----------------------------------------
+
+	/// True if direct state access may be used, see AllowDirectStateAccess
+	static bool direct_state_access_allowed = true;
+
+	bool IsDirectStateAccessUsed()
+	{
+		static int available = -1;		// Unknown yet, OpenGL must be initialized before we ask
+		if (available < 0)
+			available = (GLEW_VERSION_4_5 || GLEW_ARB_direct_state_access) ? 1 : 0;
+		return direct_state_access_allowed && (available == 1);
+	}
+
+	void AllowDirectStateAccess(bool allow)
+	{
+		direct_state_access_allowed = allow;
+	}
+
+	GLuint CreateImmutableBuffer(GLsizeiptr size, const void *data, GLbitfield flags)
+	{
+		GLuint buffer = 0;
+		if (IsDirectStateAccessUsed())
+		{
+			glCreateBuffers(1, &buffer);
+			if (size > 0)		// Immutable storage cannot be empty
+				glNamedBufferStorage(buffer, size, data, flags);
+		}
+		else
+		{
+			// GL_COPY_WRITE_BUFFER is not a part of any other state (unlike e.g. GL_ELEMENT_ARRAY_BUFFER, which belongs to the VAO)
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, size, data, (flags & GL_DYNAMIC_STORAGE_BIT) ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+		return buffer;
+	}
+
+	GLuint CreateMutableBuffer(GLsizeiptr size, const void *data, GLenum usage)
+	{
+		GLuint buffer = 0;
+		if (IsDirectStateAccessUsed())
+			glCreateBuffers(1, &buffer);
+		else
+			glGenBuffers(1, &buffer);
+		SetBufferData(buffer, size, data, usage);
+		return buffer;
+	}
+
+	void SetBufferData(GLuint buffer, GLsizeiptr size, const void *data, GLenum usage)
+	{
+		if (IsDirectStateAccessUsed())
+		{
+			glNamedBufferData(buffer, size, data, usage);
+		}
+		else
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, size, data, usage);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+	}
+
+	/// Number of bytes copied into the buffers, see GetUploadedBytes
+	static size_t uploaded_bytes = 0;
+
+	/// Copies the data into the buffer, without counting them into uploaded_bytes
+	static void CopyIntoBuffer(GLuint buffer, GLintptr offset, GLsizeiptr size, const void *data)
+	{
+		if (IsDirectStateAccessUsed())
+		{
+			glNamedBufferSubData(buffer, offset, size, data);
+		}
+		else
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+	}
+
+	void UpdateBufferData(GLuint buffer, GLintptr offset, GLsizeiptr size, const void *data)
+	{
+		if (size <= 0)
+			return;
+		uploaded_bytes += size;
+		CopyIntoBuffer(buffer, offset, size, data);
+	}
+
+	size_t GetUploadedBytes()
+	{
+		return uploaded_bytes;
+	}
+
+	void ResetUploadedBytes()
+	{
+		uploaded_bytes = 0;
+	}
+
+	GLuint CreateVertexArray()
+	{
+		GLuint vao = 0;
+		if (IsDirectStateAccessUsed())
+		{
+			glCreateVertexArrays(1, &vao);
+		}
+		else
+		{
+			// glGenVertexArrays only reserves the name, the object is created when it is bound for the first time
+			glGenVertexArrays(1, &vao);
+			GLStateCache::BindVertexArray(vao);
+			GLStateCache::BindVertexArray(0);
+		}
+		return vao;
+	}
+
+	void SetVertexAttribute(GLuint vao, GLint location, GLuint buffer, GLint components, GLsizei stride, GLintptr offset)
+	{
+		if (location < 0)
+			return;
+
+		if (IsDirectStateAccessUsed())
+		{
+			// Each attribute uses its own binding point (with the same index as the location), the offset is in the binding
+			glVertexArrayVertexBuffer(vao, location, buffer, offset, stride ? stride : GLsizei(sizeof(float) * components));
+			glVertexArrayAttribFormat(vao, location, components, GL_FLOAT, GL_FALSE, 0);
+			glVertexArrayAttribBinding(vao, location, location);
+			glEnableVertexArrayAttrib(vao, location);
+		}
+		else
+		{
+			GLStateCache::BindVertexArray(vao);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glEnableVertexAttribArray(location);
+			glVertexAttribPointer(location, components, GL_FLOAT, GL_FALSE, stride, (const void *)offset);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			GLStateCache::BindVertexArray(0);
+		}
+	}
+
+	void SetIndexBuffer(GLuint vao, GLuint buffer)
+	{
+		if (IsDirectStateAccessUsed())
+		{
+			glVertexArrayElementBuffer(vao, buffer);
+		}
+		else
+		{
+			GLStateCache::BindVertexArray(vao);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+			GLStateCache::BindVertexArray(0);
+		}
+	}
+
+	//-------------------------------
+	//----    FRAME DATA RING    ----
+	//-------------------------------
+
+	FrameDataRing::FrameDataRing()
+		: buffer(0), mapped(nullptr), frame_size(0), alignment(1), current(0), used(0), frame_index(0), stalls(0)
+	{
+	}
+
+	void FrameDataRing::Init(GLsizeiptr frame_size, int frames_in_flight)
+	{
+		Destroy();
+
+		// The allocations may be bound both as uniform buffers and as shader storage buffers
+		GLint ubo_alignment = 1, ssbo_alignment = 1;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_alignment);
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_alignment);
+		alignment = std::max(1, std::max(ubo_alignment, ssbo_alignment));
+
+		this->frame_size = (frame_size + alignment - 1) / alignment * alignment;
+		fences.assign(std::max(frames_in_flight, 1), nullptr);
+		current = 0;
+		used = 0;
+		frame_index = 0;
+		stalls = 0;
+
+		const GLsizeiptr total_size = this->frame_size * GLsizeiptr(fences.size());
+		if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+		{
+			// Persistent coherent mapping, the writes are visible to the GPU without any flush
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			if (IsDirectStateAccessUsed())
+			{
+				glCreateBuffers(1, &buffer);
+				glNamedBufferStorage(buffer, total_size, nullptr, flags);
+				mapped = (unsigned char *)glMapNamedBufferRange(buffer, 0, total_size, flags);
+			}
+			else
+			{
+				glGenBuffers(1, &buffer);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+				glBufferStorage(GL_COPY_WRITE_BUFFER, total_size, nullptr, flags);
+				mapped = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total_size, flags);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+			}
+
+			// The immutable storage cannot be written with glBufferSubData, so a buffer that cannot be mapped is replaced
+			if (!mapped)
+			{
+				cout << "FrameDataRing: the buffer could not be mapped persistently, glBufferSubData is used instead" << endl;
+				glDeleteBuffers(1, &buffer);
+				buffer = 0;
+			}
+		}
+		if (!buffer)
+		{
+			buffer = CreateMutableBuffer(total_size, nullptr, GL_STREAM_DRAW);
+		}
+	}
+
+	void FrameDataRing::Destroy()
+	{
+		for (GLsync &fence : fences)
+		{
+			if (fence)
+				glDeleteSync(fence);
+			fence = nullptr;
+		}
+		fences.clear();
+
+		// Deleting the buffer also unmaps it
+		GLStateCache::ForgetBuffer(buffer);
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		mapped = nullptr;
+		frame_size = 0;
+		used = 0;
+	}
+
+	void FrameDataRing::BeginFrame()
+	{
+		if (fences.empty())
+			return;
+
+		// All commands that use the data of the finished frame were already issued
+		if (fences[current])
+			glDeleteSync(fences[current]);
+		fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		current = (current + 1) % int(fences.size());
+		used = 0;
+		frame_index++;
+
+		// Wait until the GPU finishes the frame that used this part of the buffer the last time
+		if (fences[current])
+		{
+			GLenum result = glClientWaitSync(fences[current], 0, 0);
+			if (result == GL_TIMEOUT_EXPIRED)
+			{
+				stalls++;
+				do
+				{
+					result = glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);		// 1 second
+				} while (result == GL_TIMEOUT_EXPIRED);
+			}
+			glDeleteSync(fences[current]);
+			fences[current] = nullptr;
+		}
 	}
 
-	GLint ShaderProgram::GetUniformLocation(const char *name) const
+	GLintptr FrameDataRing::Allocate(GLsizeiptr size)
 	{
-		if (valid)
-			return glGetUniformLocation(program, name);
-		else return -1;
+		const GLintptr offset = (used + alignment - 1) / alignment * alignment;
+		if ((size <= 0) || (offset + size > frame_size))
+			return -1;
+		used = offset + size;
+		uploaded_bytes += size;		// Everything that is allocated is also written
+		return frame_size * current + offset;
 	}
 
-	GLuint ShaderProgram::GetUniformBlockIndex(const char *name) const
+	void FrameDataRing::Write(GLintptr offset, const void *data, GLsizeiptr size)
 	{
-		if (valid)
-			return glGetUniformBlockIndex(program, name);
-		else return GL_INVALID_INDEX;
+		if (mapped)
+			memcpy(mapped + offset, data, size);
+		else
+			CopyIntoBuffer(buffer, offset, size, data);
 	}
 
-	void ShaderProgram::SetUniformBlockBindingIndex(const char *name, GLuint idx) const
+	GLintptr FrameDataRing::Upload(const void *data, GLsizeiptr size)
 	{
-		if (valid)
-		{
-			GLuint loc = glGetUniformBlockIndex(program, name);
-			if (loc != GL_INVALID_INDEX)
-				glUniformBlockBinding(program, loc, idx);
-		}
+		const GLintptr offset = Allocate(size);
+		if (offset >= 0)
+			Write(offset, data, size);
+		return offset;
 	}
 
-	void ShaderProgram::Use() const
+	void *FrameDataRing::GetPointer(GLintptr offset) const
 	{
-		glUseProgram(program);
+		return mapped ? mapped + offset : nullptr;
 	}
 
-	void ShaderProgram::Uniform1f			(const char *name, GLfloat v0) const												{	glUniform1f		(GetUniformLocation(name), v0);					}
-	void ShaderProgram::Uniform1fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform1fv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform1i			(const char *name, GLint v0) const													{	glUniform1i		(GetUniformLocation(name), v0);					}
-	void ShaderProgram::Uniform1iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform1iv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform2f			(const char *name, GLfloat v0, GLfloat v1) const									{	glUniform2f		(GetUniformLocation(name), v0, v1);				}
-	void ShaderProgram::Uniform2fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform2fv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform2i			(const char *name, GLint v0, GLint v1) const										{	glUniform2i		(GetUniformLocation(name), v0, v1);				}
-	void ShaderProgram::Uniform2iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform2iv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform3f			(const char *name, GLfloat v0, GLfloat v1, GLfloat v2) const						{	glUniform3f		(GetUniformLocation(name), v0, v1, v2);			}
-	void ShaderProgram::Uniform3fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform3fv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform3i			(const char *name, GLint v0, GLint v1, GLint v2) const								{	glUniform3i		(GetUniformLocation(name), v0, v1, v2);			}
-	void ShaderProgram::Uniform3iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform3iv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform4f			(const char *name, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) const			{	glUniform4f		(GetUniformLocation(name), v0, v1, v2, v3);		}
-	void ShaderProgram::Uniform4fv			(const char *name, GLsizei count, const GLfloat* value) const						{	glUniform4fv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::Uniform4i			(const char *name, GLint v0, GLint v1, GLint v2, GLint v3) const					{	glUniform4i		(GetUniformLocation(name), v0, v1, v2, v3);		}
-	void ShaderProgram::Uniform4iv			(const char *name, GLsizei count, const GLint* value) const							{	glUniform4iv	(GetUniformLocation(name), count, value);		}
-	void ShaderProgram::UniformMatrix2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2fv		(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3fv		(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4fv		(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix2x3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x3fv	(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix2x4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix2x4fv	(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix3x2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x2fv	(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix3x4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix3x4fv	(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix4x2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x2fv	(GetUniformLocation(name), count, transpose, value);	}
-	void ShaderProgram::UniformMatrix4x3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const	{	glUniformMatrix4x3fv	(GetUniformLocation(name), count, transpose, value);	}
-
-	void ShaderProgramMap::AddProgram(int key, ShaderProgram *program)
+	GLuint FrameDataRing::GetBuffer() const
 	{
-		if (!program)
-			RemoveProgram(key);
-		else
-			shader_map[key] = program;
+		return buffer;
 	}
 
-	void ShaderProgramMap::RemoveProgram(int key)
+	bool FrameDataRing::IsPersistentlyMapped() const
 	{
-		shader_map.erase(key);
+		return mapped != nullptr;
 	}
 
-	void ShaderProgramMap::RemoveAll()
+	unsigned int FrameDataRing::GetFrameIndex() const
 	{
-		shader_map.clear();
+		return frame_index;
 	}
 
-	ShaderProgram *ShaderProgramMap::GetProgram(int key)
+	GLsizeiptr FrameDataRing::GetUsedSize() const
 	{
-		auto iter = shader_map.find(key);
-		return (iter == shader_map.end()) ? nullptr : iter->second;
+		return used;
 	}
 
-	bool ShaderProgramMap::UseProgram(int key)
+	int FrameDataRing::GetStallCount() const
 	{
-		ShaderProgram *program = GetProgram(key);
-		if (!program || !program->IsValid())
-		{
-			return false;
-		}
-		else
-		{
-			program->Use();
-			return true;
-		}
+		return stalls;
 	}
 
 	//------------------------------
@@ -444,10 +1868,14 @@ namespace PV227
 	{
 		IndexBuffer = 0;
 		VAO = 0;
+		PositionBuffer = 0;
+		DepthOnlyVAO = 0;
 		Mode = GL_POINTS;
 		DrawArraysCount = 0;
 		DrawElementsCount = 0;
 		PatchVertices = 0;
+		BoundsMin = glm::vec3(FLT_MAX);
+		BoundsMax = glm::vec3(-FLT_MAX);
 	}
 
 	Geometry::Geometry(const Geometry &rhs)
@@ -460,10 +1888,14 @@ namespace PV227
 		VertexBuffers = rhs.VertexBuffers;
 		IndexBuffer = rhs.IndexBuffer;
 		VAO = rhs.VAO;
+		PositionBuffer = rhs.PositionBuffer;
+		DepthOnlyVAO = rhs.DepthOnlyVAO;
 		Mode = rhs.Mode;
 		DrawArraysCount = rhs.DrawArraysCount;
 		DrawElementsCount = rhs.DrawElementsCount;
 		PatchVertices = rhs.PatchVertices;
+		BoundsMin = rhs.BoundsMin;
+		BoundsMax = rhs.BoundsMax;
 		return *this;
 	}
 
@@ -472,23 +1904,68 @@ namespace PV227
 		// When using it, make sure the OpenGL context still exists (i.e. the main window still exists).
 		
 		// OpenGL silently ignores deleting objects that are 0, so this is safe even if the buffers were not created.
+		GLStateCache::ForgetVertexArray(VAO);
+		GLStateCache::ForgetVertexArray(DepthOnlyVAO);
 		if (!VertexBuffers.empty())
 			glDeleteBuffers(VertexBuffers.size(), VertexBuffers.data());
 		glDeleteBuffers(1, &IndexBuffer);
 		glDeleteVertexArrays(1, &VAO);
+		glDeleteBuffers(1, &PositionBuffer);
+		glDeleteVertexArrays(1, &DepthOnlyVAO);
 
 		*this = Geometry();		// Reset the state to 'no geometry'
 	}
 
+	void Geometry::CreateDepthOnlyVAO(const float *vertices, GLsizei vertices_count, GLsizei stride, GLint position_loc)
+	{
+		if (position_loc < 0)
+			return;
+
+		// De-interleave the positions, so that depth-only passes fetch only 12 bytes per vertex
+		std::vector<float> positions(vertices_count * 3);
+		for (GLsizei i = 0; i < vertices_count; i++)
+		{
+			positions[i * 3 + 0] = vertices[i * stride + 0];
+			positions[i * 3 + 1] = vertices[i * stride + 1];
+			positions[i * 3 + 2] = vertices[i * stride + 2];
+		}
+
+		glDeleteBuffers(1, &PositionBuffer);
+		PositionBuffer = CreateImmutableBuffer(positions.size() * sizeof(float), positions.data());
+
+		GLStateCache::ForgetVertexArray(DepthOnlyVAO);
+		glDeleteVertexArrays(1, &DepthOnlyVAO);
+		DepthOnlyVAO = CreateVertexArray();
+		SetVertexAttribute(DepthOnlyVAO, position_loc, PositionBuffer, 3, sizeof(float) * 3, 0);
+		SetIndexBuffer(DepthOnlyVAO, IndexBuffer);
+	}
+
+	void Geometry::ComputeBounds(const float *vertices, GLsizei vertices_count, GLsizei stride)
+	{
+		BoundsMin = glm::vec3(FLT_MAX);
+		BoundsMax = glm::vec3(-FLT_MAX);
+		for (GLsizei i = 0; i < vertices_count; i++)
+		{
+			const glm::vec3 position(vertices[i * stride + 0], vertices[i * stride + 1], vertices[i * stride + 2]);
+			BoundsMin = glm::min(BoundsMin, position);
+			BoundsMax = glm::max(BoundsMax, position);
+		}
+	}
+
 	void Geometry::BindVAO() const
 	{
-		glBindVertexArray(VAO);
+		GLStateCache::BindVertexArray(VAO);
+	}
+
+	void Geometry::BindDepthOnlyVAO() const
+	{
+		GLStateCache::BindVertexArray(DepthOnlyVAO ? DepthOnlyVAO : VAO);
 	}
 
 	void Geometry::Draw() const
 	{
 		if (Mode == GL_PATCHES)
-			glPatchParameteri(GL_PATCH_VERTICES, PatchVertices);
+			GLStateCache::SetPatchVertices(PatchVertices);
 		if (DrawArraysCount > 0)
 			glDrawArrays(Mode, 0, DrawArraysCount);
 		if (DrawElementsCount > 0)
@@ -498,383 +1975,81 @@ namespace PV227
 	void Geometry::DrawInstanced(int primcount) const
 	{
 		if (Mode == GL_PATCHES)
-			glPatchParameteri(GL_PATCH_VERTICES, PatchVertices);
+			GLStateCache::SetPatchVertices(PatchVertices);
 		if (DrawArraysCount > 0)
 			glDrawArraysInstanced(Mode, 0, DrawArraysCount, primcount);
 		if (DrawElementsCount > 0)
 			glDrawElementsInstanced(Mode, DrawElementsCount, GL_UNSIGNED_INT, nullptr, primcount);
 	}
 
-	Geometry CreateCube(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
+	/// Creates a geometry from the interleaved vertices with 14 floats (position, normal, texture coordinate,
+	/// tangent, bitangent) and indices, as they are stored in the headers in 'inlines' directory
+	static Geometry CreateGeometryWithTangents(GLenum mode, const float *vertices, int vertices_count, const unsigned int *indices, int indices_count,
+		GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
 		Geometry geometry;
 
-		// Create a single buffer for vertex data
+		// Create a single buffer for vertex data, and a buffer for indices, both are never changed
 		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentcube_vertices_count * sizeof(float) * 14, tangentcube_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangentcube_indices_count * sizeof(unsigned int), tangentcube_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		geometry.VertexBuffers[0] = CreateImmutableBuffer(vertices_count * sizeof(float) * 14, vertices);
+		geometry.IndexBuffer = CreateImmutableBuffer(indices_count * sizeof(unsigned int), indices);
+
+		// Create a vertex array object for the geometry and set its parameters
+		geometry.VAO = CreateVertexArray();
+		const GLsizei stride = sizeof(float) * 14;
+		SetVertexAttribute(geometry.VAO, position_loc, geometry.VertexBuffers[0], 3, stride, 0);
+		SetVertexAttribute(geometry.VAO, normal_loc, geometry.VertexBuffers[0], 3, stride, sizeof(float) * 3);
+		SetVertexAttribute(geometry.VAO, tex_coord_loc, geometry.VertexBuffers[0], 2, stride, sizeof(float) * 6);
+		SetVertexAttribute(geometry.VAO, tangent_loc, geometry.VertexBuffers[0], 3, stride, sizeof(float) * 8);
+		SetVertexAttribute(geometry.VAO, bitangent_loc, geometry.VertexBuffers[0], 3, stride, sizeof(float) * 11);
+		SetIndexBuffer(geometry.VAO, geometry.IndexBuffer);
 
 		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLES;
+		geometry.Mode = mode;
 		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangentcube_indices_count;
+		geometry.DrawElementsCount = indices_count;
+
+		// Create a stream with positions only for depth-only passes
+		geometry.CreateDepthOnlyVAO(vertices, vertices_count, 14, position_loc);
+		geometry.ComputeBounds(vertices, vertices_count, 14);
 
 		return geometry;
 	}
 
-	Geometry CreateSphere(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
+	Geometry CreateCube(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
-		Geometry geometry;
-
-		// Create a single buffer for vertex data
-		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentsphere_vertices_count * sizeof(float) * 14, tangentsphere_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangentsphere_indices_count * sizeof(unsigned int), tangentsphere_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLE_STRIP;
-		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangentsphere_indices_count;
+		return CreateGeometryWithTangents(GL_TRIANGLES, tangentcube_vertices, tangentcube_vertices_count, tangentcube_indices, tangentcube_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
+	}
 
-		return geometry;
+	Geometry CreateSphere(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
+	{
+		return CreateGeometryWithTangents(GL_TRIANGLE_STRIP, tangentsphere_vertices, tangentsphere_vertices_count, tangentsphere_indices, tangentsphere_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
 	}
 
 	Geometry CreateTorus(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
-		Geometry geometry;
-
-		// Create a single buffer for vertex data
-		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangenttorus_vertices_count * sizeof(float) * 14, tangenttorus_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangenttorus_indices_count * sizeof(unsigned int), tangenttorus_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLE_STRIP;
-		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangenttorus_indices_count;
-
-		return geometry;
+		return CreateGeometryWithTangents(GL_TRIANGLE_STRIP, tangenttorus_vertices, tangenttorus_vertices_count, tangenttorus_indices, tangenttorus_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
 	}
 
 	Geometry CreateCylinder(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
-		Geometry geometry;
-
-		// Create a single buffer for vertex data
-		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentcylinder_vertices_count * sizeof(float) * 14, tangentcylinder_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangentcylinder_indices_count * sizeof(unsigned int), tangentcylinder_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLE_STRIP;
-		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangentcylinder_indices_count;
-
-		return geometry;
+		return CreateGeometryWithTangents(GL_TRIANGLE_STRIP, tangentcylinder_vertices, tangentcylinder_vertices_count, tangentcylinder_indices, tangentcylinder_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
 	}
 
 	Geometry CreateCapsule(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
-		Geometry geometry;
-
-		// Create a single buffer for vertex data
-		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentcapsule_vertices_count * sizeof(float) * 14, tangentcapsule_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangentcapsule_indices_count * sizeof(unsigned int), tangentcapsule_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLE_STRIP;
-		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangentcapsule_indices_count;
-
-		return geometry;
+		return CreateGeometryWithTangents(GL_TRIANGLE_STRIP, tangentcapsule_vertices, tangentcapsule_vertices_count, tangentcapsule_indices, tangentcapsule_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
 	}
 
 	Geometry CreateTeapot(GLint position_loc, GLint normal_loc, GLint tex_coord_loc, GLint tangent_loc, GLint bitangent_loc)
 	{
-		Geometry geometry;
-
-		// Create a single buffer for vertex data
-		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentteapot_vertices_count * sizeof(float) * 14, tangentteapot_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		// Create a buffer for indices
-		glGenBuffers(1, &geometry.IndexBuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, tangentteapot_indices_count * sizeof(unsigned int), tangentteapot_indices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 3));
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 6));
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 8));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 14, (const void *)(sizeof(float) * 11));
-		}
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.IndexBuffer);
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-		// Set the Mode and the number of vertices to draw
-		geometry.Mode = GL_TRIANGLE_STRIP;
-		geometry.DrawArraysCount = 0;
-		geometry.DrawElementsCount = tangentteapot_indices_count;
-
-		return geometry;
+		return CreateGeometryWithTangents(GL_TRIANGLE_STRIP, tangentteapot_vertices, tangentteapot_vertices_count, tangentteapot_indices, tangentteapot_indices_count,
+			position_loc, normal_loc, tex_coord_loc, tangent_loc, bitangent_loc);
 	}
 
 	Geometry CreateTeapotPatch(GLint position_loc, GLint tangent_loc, GLint bitangent_loc)
@@ -883,37 +2058,16 @@ namespace PV227
 
 		// Create a single buffer for vertex data
 		geometry.VertexBuffers.resize(1, 0);
-		glGenBuffers(1, &geometry.VertexBuffers[0]);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, tangentteapotpatch_vertices_count * sizeof(float) * 9, tangentteapotpatch_vertices, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		geometry.VertexBuffers[0] = CreateImmutableBuffer(tangentteapotpatch_vertices_count * sizeof(float) * 9, tangentteapotpatch_vertices);
 
 		// No index buffer
 
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		if (position_loc >= 0)
-		{
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 9, 0);
-		}
-		if (tangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(tangent_loc);
-			glVertexAttribPointer(tangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 9, (const void *)(sizeof(float) * 3));
-		}
-		if (bitangent_loc >= 0)
-		{
-			glEnableVertexAttribArray(bitangent_loc);
-			glVertexAttribPointer(bitangent_loc, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 9, (const void *)(sizeof(float) * 6));
-		}
-
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		// Create a vertex array object for the geometry and set its parameters
+		geometry.VAO = CreateVertexArray();
+		const GLsizei stride = sizeof(float) * 9;
+		SetVertexAttribute(geometry.VAO, position_loc, geometry.VertexBuffers[0], 3, stride, 0);
+		SetVertexAttribute(geometry.VAO, tangent_loc, geometry.VertexBuffers[0], 3, stride, sizeof(float) * 3);
+		SetVertexAttribute(geometry.VAO, bitangent_loc, geometry.VertexBuffers[0], 3, stride, sizeof(float) * 6);
 
 		// Set the Mode and the number of vertices to draw
 		geometry.Mode = GL_PATCHES;
@@ -921,6 +2075,9 @@ namespace PV227
 		geometry.DrawArraysCount = tangentteapotpatch_vertices_count;
 		geometry.DrawElementsCount = 0;
 
+		// Bezier patches lie in the convex hulls of their control points
+		geometry.ComputeBounds(tangentteapotpatch_vertices, tangentteapotpatch_vertices_count, 9);
+
 		return geometry;
 	}
 
@@ -933,9 +2090,7 @@ namespace PV227
 		geometry.IndexBuffer = 0;
 
 		// Create an empty VAO
-		glGenVertexArrays(1, &geometry.VAO);
-		glBindVertexArray(geometry.VAO);
-		glBindVertexArray(0);
+		geometry.VAO = CreateVertexArray();
 
 		// Set the Mode and the number of vertices to draw
 		geometry.Mode = GL_TRIANGLES;
@@ -1122,50 +2277,33 @@ namespace PV227
 
 		// Create buffers for vertex data
 		geometry.VertexBuffers.resize(3, 0);
-		glGenBuffers(3, geometry.VertexBuffers.data());
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float) * 3, vertices.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[1]);
-		glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float) * 3, normals.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[2]);
-		glBufferData(GL_ARRAY_BUFFER, tex_coords.size() * sizeof(float) * 2, tex_coords.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		geometry.VertexBuffers[0] = CreateImmutableBuffer(vertices.size() * sizeof(float) * 3, vertices.data());
+		geometry.VertexBuffers[1] = CreateImmutableBuffer(normals.size() * sizeof(float) * 3, normals.data());
+		geometry.VertexBuffers[2] = CreateImmutableBuffer(tex_coords.size() * sizeof(float) * 2, tex_coords.data());
 
 		// No indices
 		geometry.IndexBuffer = 0;
 
-		// Create a vertex array object for the geometry
-		glGenVertexArrays(1, &geometry.VAO);
-
-		// Set the parameters of the geometry
-		glBindVertexArray(geometry.VAO);
-		if (position_loc >= 0)
-		{
-			glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[0]);
-			glEnableVertexAttribArray(position_loc);
-			glVertexAttribPointer(position_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		}
-		if (normal_loc >= 0)
-		{
-			glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[1]);
-			glEnableVertexAttribArray(normal_loc);
-			glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		}
-		if (tex_coord_loc >= 0)
-		{
-			glBindBuffer(GL_ARRAY_BUFFER, geometry.VertexBuffers[2]);
-			glEnableVertexAttribArray(tex_coord_loc);
-			glVertexAttribPointer(tex_coord_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-		}
-		
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		// Create a vertex array object for the geometry and set its parameters
+		geometry.VAO = CreateVertexArray();
+		SetVertexAttribute(geometry.VAO, position_loc, geometry.VertexBuffers[0], 3, 0, 0);
+		SetVertexAttribute(geometry.VAO, normal_loc, geometry.VertexBuffers[1], 3, 0, 0);
+		SetVertexAttribute(geometry.VAO, tex_coord_loc, geometry.VertexBuffers[2], 2, 0, 0);
 
 		// Set the Mode and the number of vertices to draw
 		geometry.Mode = GL_TRIANGLES;
 		geometry.DrawArraysCount = vertices.size();
 		geometry.DrawElementsCount = 0;
 
+		// The positions are already tightly packed, create only a VAO with positions for depth-only passes
+		if (position_loc >= 0)
+		{
+			geometry.DepthOnlyVAO = CreateVertexArray();
+			SetVertexAttribute(geometry.DepthOnlyVAO, position_loc, geometry.VertexBuffers[0], 3, 0, 0);
+		}
+		if (!vertices.empty())
+			geometry.ComputeBounds(&vertices[0].x, GLsizei(vertices.size()), 3);
+
 		return geometry;
 	}
 
@@ -1337,13 +2475,25 @@ namespace PV227
 		ilInit();
 	}
 
-	bool LoadAndSetTexture(const wchar_t *filename, GLenum target)
+	/// Image loaded by DevIL, with the parameters for OpenGL
+	struct DevILImage
+	{
+		ILuint IL_tex;				// DevIL image, it stays bound until FreeDevILImage
+		int width;
+		int height;
+		GLint internal_format;		// Internal format for glTexImage2D
+		GLenum sized_format;		// Sized internal format for glTextureStorage2D, or 0 if the type of the data is not supported
+		GLenum format;				// Format and type of the data
+		GLenum type;
+	};
+
+	/// Loads an image with DevIL, prints an error message and returns false on failure
+	static bool LoadDevILImage(const wchar_t *filename, DevILImage &image)
 	{
 		// Create IL image
-		ILuint IL_tex;
-		ilGenImages(1, &IL_tex);
+		ilGenImages(1, &image.IL_tex);
 
-		ilBindImage(IL_tex);
+		ilBindImage(image.IL_tex);
 
 		// Solve upside down textures
 		ilEnable(IL_ORIGIN_SET);
@@ -1354,65 +2504,102 @@ namespace PV227
 		if (!success)
 		{
 			ilBindImage(0);
-			ilDeleteImages(1, &IL_tex);
+			ilDeleteImages(1, &image.IL_tex);
 			ILenum error = ilGetError();
 			printf("Couldn't load texture: %S, error: %d\n", filename, error);
 			return false;
 		}
 
 		// Get IL image parameters
-		int img_width = ilGetInteger(IL_IMAGE_WIDTH);
-		int img_height = ilGetInteger(IL_IMAGE_HEIGHT);
+		image.width = ilGetInteger(IL_IMAGE_WIDTH);
+		image.height = ilGetInteger(IL_IMAGE_HEIGHT);
 		int img_format = ilGetInteger(IL_IMAGE_FORMAT);
-		int img_type = ilGetInteger(IL_IMAGE_TYPE);
+		image.type = ilGetInteger(IL_IMAGE_TYPE);			// IL constants matches GL constants
 
 		// Choose internal format, format, and type for glTexImage2D
-		GLint internal_format = 0;
-		GLenum format = 0;
-		GLenum type = img_type;			// IL constants matches GL constants
+		image.internal_format = 0;
+		image.format = 0;
 		switch (img_format)
 		{
-		case IL_RGB:	internal_format = GL_RGB;	format = GL_RGB;	break;
-		case IL_RGBA:	internal_format = GL_RGBA;	format = GL_RGBA;	break;
-		case IL_BGR:	internal_format = GL_RGB;	format = GL_BGR;	break;
-		case IL_BGRA:	internal_format = GL_RGBA;	format = GL_BGRA;	break;
+		case IL_RGB:	image.internal_format = GL_RGB;		image.format = GL_RGB;	break;
+		case IL_RGBA:	image.internal_format = GL_RGBA;	image.format = GL_RGBA;	break;
+		case IL_BGR:	image.internal_format = GL_RGB;		image.format = GL_BGR;	break;
+		case IL_BGRA:	image.internal_format = GL_RGBA;	image.format = GL_BGRA;	break;
 		case IL_COLOR_INDEX:
 		case IL_ALPHA:
 		case IL_LUMINANCE:
 		case IL_LUMINANCE_ALPHA:
 			// Unsupported format
 			ilBindImage(0);
-			ilDeleteImages(1, &IL_tex); 
+			ilDeleteImages(1, &image.IL_tex); 
 			printf("Texture %S has unsupported format\n", filename);
 			return false;
 		}
 
-		// Set the data to OpenGL (assumes texture object is already bound)
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glTexImage2D(target, 0, internal_format, img_width, img_height, 0, format, type, ilGetData());
+		// Immutable storage needs a sized format, we know it only for 8-bit data
+		image.sized_format = 0;
+		if (image.type == GL_UNSIGNED_BYTE)
+			image.sized_format = (image.internal_format == GL_RGBA) ? GL_RGBA8 : GL_RGB8;
+
+		return true;
+	}
 
-		// Unset and delete IL texture
+	/// Unsets and deletes the image loaded by LoadDevILImage
+	static void FreeDevILImage(DevILImage &image)
+	{
 		ilBindImage(0);
-		ilDeleteImages(1, &IL_tex);
+		ilDeleteImages(1, &image.IL_tex);
+	}
+
+	bool LoadAndSetTexture(const wchar_t *filename, GLenum target)
+	{
+		DevILImage image;
+		if (!LoadDevILImage(filename, image))
+			return false;
+
+		// Set the data to OpenGL (assumes texture object is already bound)
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(target, 0, image.internal_format, image.width, image.height, 0, image.format, image.type, ilGetData());
 
+		FreeDevILImage(image);
 		return true;
 	}
 
 	GLuint CreateAndLoadTexture2D(const wchar_t *filename)
 	{
+		// With direct state access, create an immutable texture and set its data without binding it
+		if (IsDirectStateAccessUsed())
+		{
+			DevILImage image;
+			if (!LoadDevILImage(filename, image))
+				return 0;
+			if (image.sized_format)
+			{
+				GLuint tex_obj;
+				glCreateTextures(GL_TEXTURE_2D, 1, &tex_obj);
+				glTextureStorage2D(tex_obj, 1, image.sized_format, image.width, image.height);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+				glTextureSubImage2D(tex_obj, 0, 0, 0, image.width, image.height, image.format, image.type, ilGetData());
+				FreeDevILImage(image);
+				return tex_obj;
+			}
+			FreeDevILImage(image);		// Unsupported type of the data, use glTexImage2D
+		}
+
 		// Create OpenGL texture object
 		GLuint tex_obj;
 		glGenTextures(1, &tex_obj);
-		glBindTexture(GL_TEXTURE_2D, tex_obj);
+		GLStateCache::BindTexture(GL_TEXTURE_2D, tex_obj);
 
 		// Load the data into OpenGL texture object
 		if (!LoadAndSetTexture(filename, GL_TEXTURE_2D))
 		{
-			glBindTexture(GL_TEXTURE_2D, 0);
+			GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
+			GLStateCache::ForgetTexture(tex_obj);
 			glDeleteTextures(1, &tex_obj);
 			return 0;
 		}
-		glBindTexture(GL_TEXTURE_2D, 0);
+		GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 
 		return tex_obj;
 	}
@@ -1422,10 +2609,46 @@ namespace PV227
 		const wchar_t *filename_py, const wchar_t *filename_ny,
 		const wchar_t *filename_pz, const wchar_t *filename_nz)
 	{
+		// With direct state access, create an immutable texture and set its faces without binding it
+		if (IsDirectStateAccessUsed())
+		{
+			const wchar_t *filenames[6] = { filename_px, filename_nx, filename_py, filename_ny, filename_pz, filename_nz };
+			GLuint tex_obj = 0;
+			GLsizei size = 0;
+			for (int face = 0; face < 6; face++)
+			{
+				DevILImage image;
+				if (!LoadDevILImage(filenames[face], image))
+				{
+					glDeleteTextures(1, &tex_obj);
+					return 0;
+				}
+				if (!image.sized_format || ((face > 0) && ((image.width != size) || (image.height != size))))
+				{
+					// Use glTexImage2D for the unsupported types of the data, it also reports the faces with different sizes
+					FreeDevILImage(image);
+					glDeleteTextures(1, &tex_obj);
+					tex_obj = 0;
+					break;
+				}
+				if (face == 0)
+				{
+					size = image.width;
+					glCreateTextures(GL_TEXTURE_CUBE_MAP, 1, &tex_obj);
+					glTextureStorage2D(tex_obj, 1, image.sized_format, image.width, image.height);
+				}
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+				glTextureSubImage3D(tex_obj, 0, 0, 0, face, image.width, image.height, 1, image.format, image.type, ilGetData());
+				FreeDevILImage(image);
+			}
+			if (tex_obj)
+				return tex_obj;
+		}
+
 		// Create OpenGL texture object
 		GLuint tex_obj;
 		glGenTextures(1, &tex_obj);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, tex_obj);
+		GLStateCache::BindTexture(GL_TEXTURE_CUBE_MAP, tex_obj);
 
 		// Load the data into OpenGL texture object
 		if (
@@ -1436,11 +2659,12 @@ namespace PV227
 			!LoadAndSetTexture(filename_pz, GL_TEXTURE_CUBE_MAP_POSITIVE_Z) ||
 			!LoadAndSetTexture(filename_nz, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z))
 		{
-			glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+			GLStateCache::BindTexture(GL_TEXTURE_CUBE_MAP, 0);
+			GLStateCache::ForgetTexture(tex_obj);
 			glDeleteTextures(1, &tex_obj);
 			return 0;
 		}
-		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+		GLStateCache::BindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
 		return tex_obj;
 	}
@@ -9,8 +9,11 @@
 #include <math.h>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <set>
 #include <string>
 #include <iostream>
+#include <memory>
 
 //	- Include GLEW, use static library
 #define GLEW_STATIC
@@ -72,6 +75,94 @@ namespace PV227
 	/// Call it exactly once per frame.
 	float GetFPS();
 
+	/// Returns the time in seconds from a monotonic high-resolution clock (QueryPerformanceCounter on Windows,
+	/// clock_gettime(CLOCK_MONOTONIC) elsewhere). Only the differences of the times are meaningful.
+	double GetTime();
+
+	//---------------------------------
+	//----    OPENGL STATE CACHE    ----
+	//---------------------------------
+
+	/// GLStateCache remembers the OpenGL state that is changed most often while rendering (current program, VAO,
+	/// indexed buffer bindings, textures in texture units, number of vertices in a patch), and skips the OpenGL
+	/// calls that would not change it. The framework changes this state only through this class.
+	///
+	/// The cache knows only about the changes made through it. Call Invalidate after the code that changes
+	/// the state behind its back (e.g. TwDraw, or direct calls to glBindTexture), and Forget* when deleting
+	/// objects that may be bound (OpenGL may reuse their names).
+	///
+	/// Example of use:
+	///		GLStateCache::BindTexture(0, GL_TEXTURE_2D, wood_tex);		// glActiveTexture(GL_TEXTURE0) + glBindTexture
+	///		GLStateCache::BindBufferBase(GL_UNIFORM_BUFFER, 1, ubo);		// Skipped if ubo is already bound to the index 1
+	class GLStateCache
+	{
+	private:
+		/// Value of the state that is not known, e.g. after Invalidate
+		static const GLuint Unknown = 0xFFFFFFFFu;
+
+		/// Number of texture units, indices of buffer bindings, and texture targets whose state is cached
+		static const int MaxTextureUnits = 32;
+		static const int MaxBufferBindings = 16;
+		static const int TextureTargets = 5;
+
+		static GLuint current_program;
+		static GLuint current_vao;
+		static GLuint active_texture_unit;
+		static GLuint textures[MaxTextureUnits][TextureTargets];
+		/// Buffer bound to an indexed binding point, the whole buffer (glBindBufferBase) has offset and size -1
+		struct BufferBinding
+		{
+			GLuint buffer;
+			GLintptr offset;
+			GLsizeiptr size;
+		};
+		static BufferBinding uniform_buffers[MaxBufferBindings];
+		static BufferBinding storage_buffers[MaxBufferBindings];
+		static GLint patch_vertices;
+
+		static unsigned int issued_calls;
+		static unsigned int filtered_calls;
+
+		/// Returns the index of the texture target in 'textures', or -1 if the target is not cached
+		static int GetTextureTargetIndex(GLenum target);
+		/// Returns the array with the buffers bound to the indexed target, or nullptr if the target is not cached
+		static BufferBinding *GetBufferBindings(GLenum target, GLuint index);
+
+	public:
+		/// Similar to glUseProgram
+		static void UseProgram(GLuint program);
+		/// Similar to glBindVertexArray
+		static void BindVertexArray(GLuint vao);
+		/// Similar to glActiveTexture, 'unit' is a number of the unit (e.g. 0), not GL_TEXTURE0
+		static void ActiveTexture(GLuint unit);
+		/// Similar to glBindTexture, binds the texture into the active texture unit
+		static void BindTexture(GLenum target, GLuint texture);
+		/// Similar to glActiveTexture(GL_TEXTURE0 + unit) and glBindTexture(target, texture). The active unit is not
+		/// changed when the texture is already bound, so use ActiveTexture and BindTexture(target, texture) before glTexParameter*.
+		static void BindTexture(GLuint unit, GLenum target, GLuint texture);
+		/// Similar to glBindBufferBase
+		static void BindBufferBase(GLenum target, GLuint index, GLuint buffer);
+		/// Similar to glBindBufferRange
+		static void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+		/// Similar to glPatchParameteri(GL_PATCH_VERTICES, count)
+		static void SetPatchVertices(GLint count);
+
+		/// Forgets the whole state, the next calls will not be skipped
+		static void Invalidate();
+		/// Forgets the bindings of an object that is being deleted
+		static void ForgetProgram(GLuint program);
+		static void ForgetVertexArray(GLuint vao);
+		static void ForgetTexture(GLuint texture);
+		static void ForgetBuffer(GLuint buffer);
+
+		/// Returns the number of calls that were passed to OpenGL since the last ResetCounters
+		static unsigned int GetIssuedCalls();
+		/// Returns the number of calls that were skipped since the last ResetCounters
+		static unsigned int GetFilteredCalls();
+		/// Sets both counters to zero, call it e.g. at the beginning of each frame
+		static void ResetCounters();
+	};
+
 	//------------------------------------
 	//----    SHADERS AND PROGRAMS    ----
 	//------------------------------------
@@ -79,11 +170,27 @@ namespace PV227
 	/// Loads a file and returns its content as std::string
 	std::string LoadFileToString(const char *file_name);
 
+	/// Inserts given lines (e.g. "#define TOON 1\n") into the source code of a shader, right after
+	/// its #version line (or at its beginning if there is no #version line).
+	std::string InjectShaderDefines(const std::string &source, const std::string &defines);
+
 	/// Creates a shader of given type, loads and sets its source code, compiles it, and prints errors
-	/// to stdout if some occur.
+	/// to stdout if some occur. 'defines' are inserted after the #version line, see InjectShaderDefines.
+	///
+	/// Returns shader object on success or 0 if failed.
+	GLuint LoadAndCompileShader(GLenum shader_type, const char *file_name, const std::string &defines = std::string());
+
+	/// Creates a shader of given type from the source code, compiles it, and prints errors to stdout
+	/// if some occur. 'file_name' is used only in the error messages.
 	///
 	/// Returns shader object on success or 0 if failed.
-	GLuint LoadAndCompileShader(GLenum shader_type, const char *file_name);
+	GLuint CompileShader(GLenum shader_type, const std::string &source, const char *file_name);
+
+	/// Id of the name of a uniform variable, see ShaderProgram::GetUniformId
+	struct UniformId
+	{
+		int index;					// Index into the names of the uniforms with ids
+	};
 
 	/// This is a VERY SIMPLE class that maintains a shader program and its shaders.
 	/// It is not a perfect, brilliant, smart, or whatever implementation of a shader program.
@@ -97,6 +204,12 @@ namespace PV227
 	///		my_program.Link();						// Link program
 	///		if (my_program.IsValid())				// Test if the program is ready to use
 	///
+	/// The shaders are compiled in Link. When a binary cache directory is set (see SetBinaryCacheDirectory),
+	/// Link first looks for the binary of the program in the cache, and compiles the shaders only when it is
+	/// not there (or when it cannot be loaded). The binaries of newly linked programs are stored into the cache.
+	/// The cache is keyed by the source code of all shaders (including the defines), locations bound by
+	/// Bind*Location, and the vendor, renderer and version of OpenGL.
+	///
 	/// There are also several methods that makes the work easier, especially (see their docs for more info):
 	///		Use, GetAttribLocation, GetUniformLocation, GetUniformBlockIndex, SetUniformBlockBindingIndex, Uniform*
 	class ShaderProgram
@@ -104,14 +217,96 @@ namespace PV227
 	private:
 		struct Shader
 		{
-			GLuint shader;				// OpenGL object of the shader
+			GLuint shader;				// OpenGL object of the shader, zero until the program is linked (or when it was loaded from the cache)
 			GLenum type;				// Type of the shader, e.g. GL_VERTEX_SHADER
 			const char *file_name;		// Path to the source of the shader
+			std::string source;			// Source code of the shader, including the defines
+			bool borrowed;				// True if the shader object belongs to the program which this one replaces, see RebuildChangedShaders
+		};
+
+		struct BoundLocation
+		{
+			bool frag_data;				// True for BindFragDataLocation, false for BindAttribLocation
+			GLint idx;					// Location
+			std::string name;			// Name of the variable
 		};
 
 		/// List of all shaders that the program uses
 		std::vector<Shader> shaders;
 
+		/// Lines with #defines that are inserted into all shaders after their #version line
+		std::string defines;
+
+		/// Locations bound by BindAttribLocation and BindFragDataLocation, they are a part of the key of the binary cache
+		mutable std::vector<BoundLocation> bound_locations;
+
+		/// True if the program was loaded from the binary cache
+		bool loaded_from_cache;
+
+		/// Directory with the binaries of the programs, empty if the cache is not used
+		static std::string binary_cache_directory;
+
+		/// Returns the name of the file of this program in the binary cache
+		std::string GetBinaryCacheFileName() const;
+		/// Tries to load the program from the binary cache, returns true on success
+		bool LoadFromBinaryCache();
+		/// Stores the binary of the linked program into the binary cache
+		void SaveToBinaryCache() const;
+
+		/// True while the program is being compiled and linked asynchronously, see LinkAsync
+		bool building;
+		/// New version of this program that is being built asynchronously, see BeginRebuild
+		std::shared_ptr<ShaderProgram> pending;
+		/// Program which is replaced by this one when it is built, set in the programs returned by BeginRebuild
+		ShaderProgram *replaces;
+		/// Programs that are being built asynchronously
+		static std::vector<ShaderProgram *> building_programs;
+
+		/// Starts the compilation of the shaders and the linking of the program, does not wait for the results
+		void StartLink();
+		/// Waits for the results of the compilation and linking, and checks them (see Link)
+		bool FinishLink();
+		/// Returns true if the asynchronous compilation and linking is complete, i.e. FinishLink will not block
+		bool IsBuildComplete() const;
+		/// Called when the asynchronous build finishes, replaces the program in 'replaces' if the build succeeded
+		void FinishAsyncBuild(bool success);
+
+		friend class ShaderHotReloader;
+
+		/// Data of an active uniform block or shader storage block of the linked program
+		struct BlockInfo
+		{
+			GLuint index;				// Index of the block, as returned by glGetUniformBlockIndex or glGetProgramResourceIndex
+			GLint data_size;			// Size of the data of the block in bytes (GL_BUFFER_DATA_SIZE)
+		};
+
+		/// Expected size of a block, see SetExpectedBlockSize
+		struct ExpectedBlockSize
+		{
+			size_t size;				// Size of the data (before the array of unspecified size, if there is one)
+			size_t array_element_size;	// Size of one element of the array of unspecified size at the end, or zero
+		};
+
+		/// Locations of the active uniforms (arrays are also stored under their names without [0]),
+		/// and the active uniform and shader storage blocks. They are filled in Reflect when the program is linked.
+		/// The locations of other names (e.g. elements of arrays) are added by GetUniformLocation when they are queried.
+		mutable std::unordered_map<std::string, GLint> uniform_locations;
+		std::unordered_map<std::string, BlockInfo> uniform_blocks;
+		std::unordered_map<std::string, BlockInfo> storage_blocks;
+
+		/// Names of the uniforms with ids, the id is the index, see GetUniformId
+		static std::vector<std::string> uniform_id_names;
+		/// Locations of the uniforms with ids in this program, the id is the index. They are looked up when the ids are used.
+		mutable std::vector<GLint> uniform_id_locations;
+
+		/// Sizes of the C++ structures with the data of the blocks, see SetExpectedBlockSize
+		static std::map<std::string, ExpectedBlockSize> expected_block_sizes;
+
+		/// Queries all active uniforms and blocks of the linked program, and checks the sizes of the blocks
+		void Reflect();
+		/// Checks the size of one block against the expected size, prints a message if they do not match
+		void CheckBlockSize(const char *block_kind, const std::string &name, const BlockInfo &block) const;
+
 		/// OpenGL object of the shader program
 		GLuint program;
 
@@ -129,7 +324,14 @@ namespace PV227
 		/// Destroys all OpenGL objects and makes this program invalid.
 		void Destroy();
 
-		/// Loads, compiles, and adds given shader. When this fails, the program is destroyed,
+		/// Adds '#define name value' into all shaders that are added after this call. Call it after Init.
+		///
+		/// Example of use: my_program.AddDefine("TOON", 1);
+		void AddDefine(const char *name, int value = 1);
+		/// Returns the lines with #defines that are inserted into the shaders
+		const std::string &GetDefines() const;
+
+		/// Loads and adds given shader, the shader is compiled in Link. When this fails, the program is destroyed,
 		/// making all other AddShader/Bind*/Link/... not function.
 		///
 		/// Returns true if everything is OK, false if something failed.
@@ -152,12 +354,56 @@ namespace PV227
 		/// Similar to glBindFragDataLocation, uses this program as the first parameter.
 		void BindFragDataLocation(GLint idx, const char *name) const;
 
-		/// Links the program and checks for errors. When this fails, the errors are printed to
-		/// stdout and the program is destroyed.
+		/// Compiles the shaders and links the program (or loads it from the binary cache), and checks for errors.
+		/// When this fails, the errors are printed to stdout and the program is destroyed.
 		///
 		/// Returns true if everything is OK, false if something failed.
 		bool Link();
 
+		/// Returns true if the program was loaded from the binary cache instead of being compiled
+		bool WasLoadedFromCache() const;
+
+		/// Similar to Link, but it does not wait for the driver to compile the shaders and link the program.
+		/// The program becomes valid later, in PollPendingPrograms, when the build is complete. The driver is
+		/// asked to compile in parallel (GL_ARB/KHR_parallel_shader_compile), without the extension, the build
+		/// is finished (and waited for) in the next PollPendingPrograms.
+		bool LinkAsync();
+
+		/// Starts building a new version of this program while this version stays unchanged and usable.
+		/// Set up the returned program (AddShader, AddDefine, Bind*Location) and call LinkAsync on it.
+		/// When it is built successfully, it replaces this program (in PollPendingPrograms). When it fails,
+		/// the errors are printed and this program is kept.
+		///
+		/// Example of use:
+		///		ShaderProgram &new_program = my_program.BeginRebuild();
+		///		new_program.AddVertexShader("my_vertex_shader.glsl");
+		///		new_program.AddFragmentShader("my_fragment_shader.glsl");
+		///		new_program.LinkAsync();
+		ShaderProgram &BeginRebuild();
+
+		/// Returns true while the program, or its new version, is being built asynchronously
+		bool IsBuilding() const;
+
+		/// Starts an asynchronous rebuild (see BeginRebuild) of the program with the same shaders, defines and locations,
+		/// in which only the shaders from the given files are loaded and compiled again. The other shaders are reused.
+		/// Returns false (and does nothing) if the program does not use any of the files.
+		bool RebuildChangedShaders(const std::set<std::string> &changed_files);
+
+		/// Returns the files with the source code of the shaders of the program
+		std::vector<std::string> GetShaderFiles() const;
+
+		/// Checks the programs that are being built asynchronously, and finishes those whose build is complete.
+		/// Call it once per frame. Returns the number of programs that finished (successfully or not) in this call.
+		static int PollPendingPrograms();
+		/// Returns true if some programs are being built asynchronously
+		static bool HasPendingPrograms();
+
+		/// Sets the directory of the binary cache of all programs, and creates it if it does not exist.
+		/// Use an empty string (default) to disable the cache.
+		static void SetBinaryCacheDirectory(const char *directory);
+		/// Returns the directory of the binary cache, empty if the cache is disabled
+		static const std::string &GetBinaryCacheDirectory();
+
 		/// Returns true if the shader program is linked and ready to use, false if it is not.
 		bool IsValid() const;
 
@@ -171,9 +417,40 @@ namespace PV227
 		/// Similar to glGetAttribLocation, uses this program as the first parameter.
 		GLint GetAttribLocation(const char *name) const;
 		/// Similar to glGetUniformLocation, uses this program as the first parameter.
+		/// The location is taken from the data queried when the program was linked, OpenGL is called only for
+		/// the names that are not there (e.g. elements of arrays, such as 'lights[3]'), and their locations are remembered.
 		GLint GetUniformLocation(const char *name) const;
+		/// Returns the location of the uniform with the given id, see GetUniformId
+		GLint GetUniformLocation(UniformId id) const;
+		/// Returns the id of the name of a uniform, the id can be used instead of the name in GetUniformLocation and Uniform*.
+		/// The location of an id is looked up only when it is used with a program for the first time after the program
+		/// was linked, then it is taken from an array. Get the ids once, e.g. when the application starts.
+		///
+		/// Example: UniformId radius_id = ShaderProgram::GetUniformId("radius");	// Once
+		///			 my_program.Uniform1f(radius_id, 0.5f);							// Every frame
+		static UniformId GetUniformId(const char *name);
 		/// Similar to glGetUniformBlockIndex, uses this program as the first parameter.
+		/// The index is taken from the data queried when the program was linked, OpenGL is not called.
 		GLuint GetUniformBlockIndex(const char *name) const;
+		/// Similar to glGetProgramResourceIndex with GL_SHADER_STORAGE_BLOCK, uses this program as the first parameter.
+		/// The index is taken from the data queried when the program was linked, OpenGL is not called.
+		GLuint GetStorageBlockIndex(const char *name) const;
+		/// Returns the size in bytes of the data of the uniform block, or -1 if the program has no such active block
+		GLint GetUniformBlockSize(const char *name) const;
+		/// Returns the size in bytes of the data of the shader storage block, or -1 if the program has no such active block.
+		/// When the block ends with an array of unspecified size, the size contains one element of the array.
+		GLint GetStorageBlockSize(const char *name) const;
+
+		/// Sets the size of the C++ structure with the data of the uniform or shader storage block of the given name.
+		/// When a program is linked, the sizes of its active blocks are checked against these sizes, and the blocks
+		/// that do not match are reported (the program is still used). The sizes are compared rounded up to 16 bytes,
+		/// since the drivers differ in whether they report the padding at the end of std140 blocks.
+		///
+		/// For blocks that end with an array of unspecified size, 'size' is the size of the data before the array
+		/// and 'array_element_size' is the size of one element of the array.
+		///
+		/// Example: ShaderProgram::SetExpectedBlockSize("ModelData", sizeof(ModelData_UBO::SingleModelData));
+		static void SetExpectedBlockSize(const char *block_name, size_t size, size_t array_element_size = 0);
 
 		/// Calls glUniformBlockBinding and glGetUniformBlockIndex to set the index of an uniform block
 		///
@@ -189,8 +466,9 @@ namespace PV227
 		///
 		/// These functions are very easy to use. However, beware of several caveats:
 		///		- these functions do not call glUseProgram, make sure the program is active
-		///		- these functions look for the location of the uniform variable each time
-		///			they are called, which is not good, but sufficient for PV227 lectures
+		///		- these functions look for the location of the uniform variable in a hash table each time
+		///			they are called (no OpenGL query), use the versions with UniformId (see GetUniformId) in the code
+		///			that runs every frame
 		///
 		/// These functions are best for setting texture units to samplers, since they are
 		/// usually set only once.
@@ -212,6 +490,10 @@ namespace PV227
 		void Uniform4fv			(const char *name, GLsizei count, const GLfloat* value) const;
 		void Uniform4i			(const char *name, GLint v0, GLint v1, GLint v2, GLint v3) const;
 		void Uniform4iv			(const char *name, GLsizei count, const GLint* value) const;
+		void Uniform1ui			(const char *name, GLuint v0) const;
+		void Uniform2ui			(const char *name, GLuint v0, GLuint v1) const;
+		void Uniform3ui			(const char *name, GLuint v0, GLuint v1, GLuint v2) const;
+		void Uniform4ui			(const char *name, GLuint v0, GLuint v1, GLuint v2, GLuint v3) const;
 		void UniformMatrix2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
 		void UniformMatrix3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
 		void UniformMatrix4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
@@ -221,6 +503,36 @@ namespace PV227
 		void UniformMatrix3x4fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
 		void UniformMatrix4x2fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
 		void UniformMatrix4x3fv	(const char *name, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+
+		void Uniform1f			(UniformId id, GLfloat v0) const;
+		void Uniform1fv			(UniformId id, GLsizei count, const GLfloat* value) const;
+		void Uniform1i			(UniformId id, GLint v0) const;
+		void Uniform1iv			(UniformId id, GLsizei count, const GLint* value) const;
+		void Uniform2f			(UniformId id, GLfloat v0, GLfloat v1) const;
+		void Uniform2fv			(UniformId id, GLsizei count, const GLfloat* value) const;
+		void Uniform2i			(UniformId id, GLint v0, GLint v1) const;
+		void Uniform2iv			(UniformId id, GLsizei count, const GLint* value) const;
+		void Uniform3f			(UniformId id, GLfloat v0, GLfloat v1, GLfloat v2) const;
+		void Uniform3fv			(UniformId id, GLsizei count, const GLfloat* value) const;
+		void Uniform3i			(UniformId id, GLint v0, GLint v1, GLint v2) const;
+		void Uniform3iv			(UniformId id, GLsizei count, const GLint* value) const;
+		void Uniform4f			(UniformId id, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) const;
+		void Uniform4fv			(UniformId id, GLsizei count, const GLfloat* value) const;
+		void Uniform4i			(UniformId id, GLint v0, GLint v1, GLint v2, GLint v3) const;
+		void Uniform4iv			(UniformId id, GLsizei count, const GLint* value) const;
+		void Uniform1ui			(UniformId id, GLuint v0) const;
+		void Uniform2ui			(UniformId id, GLuint v0, GLuint v1) const;
+		void Uniform3ui			(UniformId id, GLuint v0, GLuint v1, GLuint v2) const;
+		void Uniform4ui			(UniformId id, GLuint v0, GLuint v1, GLuint v2, GLuint v3) const;
+		void UniformMatrix2fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix3fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix4fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix2x3fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix2x4fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix3x2fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix3x4fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix4x2fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
+		void UniformMatrix4x3fv	(UniformId id, GLsizei count, GLboolean transpose, const GLfloat* value) const;
 	};
 
 	/// ShaderProgramMap manages a group of shaders that are used to render the same objects in differennt
@@ -264,6 +576,252 @@ namespace PV227
 		bool UseProgram(int key);
 	};
 
+	/// ShaderProgramVariants compiles several variants of one shader program from the same source code.
+	/// The variants differ by #defines that are inserted after the #version line of each shader,
+	/// each define corresponds to one bit of a variant mask. All defines are always present, they are
+	/// 1 when their bit is set and 0 when it is not, so use them like this in GLSL:
+	///
+	///		#if TOON
+	///			...
+	///		#endif
+	///
+	/// The variants are compiled lazily and asynchronously (see ShaderProgram::LinkAsync), when they are used
+	/// for the first time. After Init, or after adding shaders or flags, the existing variants are rebuilt
+	/// in the same way when they are used next time, and their old versions are used until then. The usage is as follows:
+	///
+	///		ShaderProgramVariants variants;
+	///		variants.Init();
+	///		variants.AddVertexShader("my_vertex_shader.glsl");
+	///		variants.AddFragmentShader("my_fragment_shader.glsl");
+	///		variants.AddFlag(1, "TOON");
+	///		variants.AddFlag(2, "SHADOW");
+	///
+	///		// Use the variant with TOON=1 SHADOW=0
+	///		if (variants.UseVariant(1))
+	///		{
+	///			variants.GetVariant(1)->Uniform...
+	///			...		// Render the object
+	///		}
+	class ShaderProgramVariants
+	{
+	private:
+		struct Stage
+		{
+			GLenum type;				// Type of the shader, e.g. GL_VERTEX_SHADER
+			const char *file_name;		// Path to the source of the shader
+		};
+
+		/// Shaders of all variants
+		std::vector<Stage> stages;
+		/// Names of the defines, and the bits of the variant mask to which they correspond
+		std::vector<std::pair<unsigned int, std::string> > flags;
+		/// Variants that were already built (including those which failed to build), by their masks
+		std::map<unsigned int, ShaderProgram> variants;
+		/// Masks of the variants that must be rebuilt because the shaders or flags changed
+		std::set<unsigned int> outdated;
+
+		/// Marks all existing variants to be rebuilt when they are used next time
+		void MarkOutdated();
+		/// Adds the defines and shaders of the variant with given mask into the program
+		void SetUpVariant(ShaderProgram &program, unsigned int mask) const;
+
+	public:
+		/// Removes all shaders and flags, the existing variants are rebuilt with the new ones when they are used.
+		/// Call it when OpenGL context is created, and when the shaders are reloaded.
+		void Init();
+		/// Destroys all variants, they are built again when they are used next time (e.g. after the shaders were changed).
+		void Destroy();
+
+		/// Adds a shader to all variants. The shader is compiled only when a variant is built.
+		void AddShader(GLenum shader_type, const char *file_name);
+		void AddVertexShader(const char *file_name);
+		void AddTessControlShader(const char *file_name);
+		void AddTessEvaluationShader(const char *file_name);
+		void AddGeometryShader(const char *file_name);
+		void AddFragmentShader(const char *file_name);
+		void AddComputeShader(const char *file_name);
+
+		/// Adds a define that is 1 in the variants whose mask contains 'bit_mask', and 0 in the others
+		void AddFlag(unsigned int bit_mask, const char *define_name);
+
+		/// Returns the variant of the program with given mask, starts building it if it does not exist yet.
+		/// Check IsValid on the returned program, the build may be in progress or it may have failed.
+		ShaderProgram *GetVariant(unsigned int mask);
+
+		/// Tries to use the variant of the program. If it is valid, it is used and the function returns true.
+		/// If it is not valid, false is returned.
+		bool UseVariant(unsigned int mask);
+
+		/// Rebuilds all existing variants, recompiling only the shaders from given files (see ShaderProgram::RebuildChangedShaders).
+		/// Returns false (and does nothing) if the variants do not use any of the files.
+		bool RebuildChangedShaders(const std::set<std::string> &changed_files);
+
+		/// Returns the files with the source code of the shaders of the variants
+		std::vector<std::string> GetShaderFiles() const;
+	};
+
+	/// ShaderHotReloader watches the source files of shader programs, and rebuilds the programs when their
+	/// files change. Only the programs that use the changed files are rebuilt, and only the changed shaders
+	/// are compiled again, the other shaders are reused (see ShaderProgram::RebuildChangedShaders). The programs
+	/// are rebuilt asynchronously, their old versions are used until the new ones are ready.
+	///
+	/// On Linux, the directories with the files are watched with inotify. Elsewhere (or when inotify is not
+	/// available), the modification times of the files are checked twice a second.
+	///
+	/// Example of use:
+	///		ShaderHotReloader reloader;
+	///		reloader.Watch(&my_program);			// After the program is set up
+	///		...
+	///		reloader.Update();						// Once per frame, before ShaderProgram::PollPendingPrograms
+	class ShaderHotReloader
+	{
+	private:
+		/// Watched program, with the description of its shaders which is kept even when the program fails to build
+		struct WatchedProgram
+		{
+			ShaderProgram *program;
+			std::vector<std::pair<GLenum, const char *> > shaders;
+			std::string defines;
+		};
+		std::vector<WatchedProgram> programs;
+		std::vector<ShaderProgramVariants *> variants;
+
+		/// Modification times of the watched files, used when inotify is not available
+		std::map<std::string, long long> file_times;
+		/// Time of the last check of the modification times, in milliseconds
+		int last_check_time;
+
+		/// File descriptor of inotify (-1 if it is not used), and the watched directories by their watch descriptors
+		int inotify_fd;
+		std::map<int, std::string> watched_directories;
+
+		/// Updates the descriptions of the watched programs, and starts watching new files
+		void UpdateWatchedFiles();
+		/// Returns the files which changed since the last call
+		std::set<std::string> GetChangedFiles();
+
+	public:
+		ShaderHotReloader();
+
+		// No destructor, call Destroy to stop watching the files.
+
+		/// Stops watching all files and forgets all programs
+		void Destroy();
+
+		/// Starts watching the shaders of the program. The program must exist as long as it is watched.
+		void Watch(ShaderProgram *program);
+		/// Starts watching the shaders of the variants. They must exist as long as they are watched.
+		void Watch(ShaderProgramVariants *variants);
+
+		/// Checks whether some watched files changed, and starts rebuilding the programs that use them.
+		/// Returns the number of changed files.
+		int Update();
+	};
+
+	//----------------------------------------
+	//----    BUFFERS AND VERTEX ARRAYS    ----
+	//----------------------------------------
+
+	// These functions create and edit buffers and vertex arrays. When ARB_direct_state_access (or OpenGL 4.5)
+	// is available, they edit the objects directly, without binding them. Otherwise, they bind the objects,
+	// edit them, and unbind them. The framework uses them for its geometries and uniform buffers.
+
+	/// Returns true if the functions in this section use direct state access
+	bool IsDirectStateAccessUsed();
+	/// Allows or forbids the use of direct state access (it is allowed by default), e.g. to compare both paths
+	void AllowDirectStateAccess(bool allow);
+
+	/// Creates a buffer with immutable storage of the given size (glNamedBufferStorage). Use GL_DYNAMIC_STORAGE_BIT
+	/// in 'flags' if the content will be changed with UpdateBufferData. Without direct state access, glBufferData
+	/// is used, with GL_DYNAMIC_DRAW or GL_STATIC_DRAW usage according to 'flags'.
+	GLuint CreateImmutableBuffer(GLsizeiptr size, const void *data, GLbitfield flags = 0);
+	/// Creates a buffer whose storage may be reallocated with SetBufferData
+	GLuint CreateMutableBuffer(GLsizeiptr size, const void *data, GLenum usage = GL_DYNAMIC_DRAW);
+	/// Reallocates the storage of a buffer created by CreateMutableBuffer (glNamedBufferData)
+	void SetBufferData(GLuint buffer, GLsizeiptr size, const void *data, GLenum usage = GL_DYNAMIC_DRAW);
+	/// Changes a part of the content of a buffer (glNamedBufferSubData)
+	void UpdateBufferData(GLuint buffer, GLintptr offset, GLsizeiptr size, const void *data);
+	/// Returns the number of bytes copied by UpdateBufferData and allocated in FrameDataRing since the last ResetUploadedBytes
+	size_t GetUploadedBytes();
+	/// Resets the counter of GetUploadedBytes, e.g. at the beginning of each frame
+	void ResetUploadedBytes();
+
+	/// Creates a vertex array object
+	GLuint CreateVertexArray();
+	/// Sets a vertex attribute with 'components' floats to be read from 'buffer', 'stride' and 'offset' are in bytes.
+	/// Does nothing if 'location' is negative.
+	void SetVertexAttribute(GLuint vao, GLint location, GLuint buffer, GLint components, GLsizei stride, GLintptr offset);
+	/// Sets the buffer with indices of a vertex array object
+	void SetIndexBuffer(GLuint vao, GLuint buffer);
+
+	//-------------------------------
+	//----    FRAME DATA RING    ----
+	//-------------------------------
+
+	/// FrameDataRing is a buffer for the data that change every frame (cameras, lights, animated objects).
+	/// The buffer is split into several parts, one for each frame the GPU may still be working on. In each
+	/// frame, the data are allocated one after another from the part of the frame, and the part is reused
+	/// only after the GPU finished the frame that used it (this is ensured with fence sync objects).
+	///
+	/// With OpenGL 4.4 (or ARB_buffer_storage), the buffer is persistently mapped and the data are written
+	/// directly into it, so that the driver needs neither to copy the data nor to wait for the GPU. Otherwise,
+	/// the data are copied with glBufferSubData into the part of the frame, which the GPU does not use.
+	///
+	/// Example:
+	///		ring.Init(1024 * 1024);
+	///		...
+	///		// At the beginning of each frame
+	///		ring.BeginFrame();
+	///		GLintptr offset = ring.Upload(&data, sizeof(data));
+	///		GLStateCache::BindBufferRange(GL_UNIFORM_BUFFER, 0, ring.GetBuffer(), offset, sizeof(data));
+	class FrameDataRing
+	{
+	private:
+		GLuint buffer;
+		unsigned char *mapped;				// Persistently mapped buffer, or nullptr if the buffer is not mapped
+		GLsizeiptr frame_size;				// Size of the part of each frame, in bytes
+		GLintptr alignment;					// Alignment of the allocations (offset alignment of UBOs and SSBOs)
+		std::vector<GLsync> fences;			// Fences of the parts of the frames the GPU may still work on
+		int current;						// Part of the current frame
+		GLintptr used;						// Number of bytes allocated in the current frame
+		unsigned int frame_index;			// Incremented in each BeginFrame
+		int stalls;							// Number of times BeginFrame had to wait for the GPU
+
+	public:
+		FrameDataRing();
+
+		/// Creates the buffer with 'frame_size' bytes for each of 'frames_in_flight' frames
+		void Init(GLsizeiptr frame_size, int frames_in_flight = 3);
+		/// Destroys the buffer and the fences
+		void Destroy();
+
+		/// Finishes the current frame and starts a new one. Waits for the GPU if it still works with the data
+		/// of the frame that used the same part of the buffer. The data that were allocated in the previous
+		/// frames must not be used after this call (see GetFrameIndex).
+		void BeginFrame();
+
+		/// Allocates 'size' bytes in the current frame, returns their offset in the buffer, or -1 if the part
+		/// of the frame is full. The offset is aligned so that it can be used with glBindBufferRange.
+		GLintptr Allocate(GLsizeiptr size);
+		/// Writes the data into the allocated memory, 'offset' is the offset in the buffer
+		void Write(GLintptr offset, const void *data, GLsizeiptr size);
+		/// Allocates the memory and writes the data into it, returns the offset, or -1 if there is no space
+		GLintptr Upload(const void *data, GLsizeiptr size);
+		/// Returns the pointer to the allocated memory to write into, or nullptr if the buffer is not mapped
+		void *GetPointer(GLintptr offset) const;
+
+		/// Returns the ID of the buffer
+		GLuint GetBuffer() const;
+		/// Returns true if the buffer is persistently mapped
+		bool IsPersistentlyMapped() const;
+		/// Returns the number of the current frame, the data allocated in other frames are no longer valid
+		unsigned int GetFrameIndex() const;
+		/// Returns the number of bytes allocated in the current frame
+		GLsizeiptr GetUsedSize() const;
+		/// Returns the number of times BeginFrame had to wait for the GPU
+		int GetStallCount() const;
+	};
+
 	//------------------------------
 	//----    GEOMETRY CLASS    ----
 	//------------------------------
@@ -296,6 +854,14 @@ namespace PV227
 		/// Vertex Array Object with the geometry
 		GLuint VAO;
 
+		/// Buffer with tightly packed positions (three floats per vertex), used for depth-only rendering.
+		/// It is zero when the geometry has no such buffer, or when the positions are already tightly
+		/// packed in one of VertexBuffers.
+		GLuint PositionBuffer;
+		/// Vertex Array Object with positions only, for depth-only rendering (e.g. shadow maps). It uses
+		/// the same IndexBuffer as VAO. It is zero when the geometry has no position-only stream.
+		GLuint DepthOnlyVAO;
+
 		/// Type of the primitives to be drawn, e.g. GL_TRIANGLES
 		GLenum Mode;
 		/// Number of patch vertices, used when Mode is GL_PATCHES, ignored otherwise
@@ -305,6 +871,11 @@ namespace PV227
 		/// Number of vertices to be drawn using glDrawElements
 		GLsizei DrawElementsCount;
 
+		/// Axis-aligned bounding box of the vertices, in the space of the geometry (before the model matrix is applied).
+		/// The box is empty (BoundsMin is greater than BoundsMax) when the geometry has no positions.
+		glm::vec3 BoundsMin;
+		glm::vec3 BoundsMax;
+
 		//--  Methods  --
 
 		/// Initializes this object. It does not initialize OpenGL objects, because OpenGL may not be initialized here.
@@ -320,11 +891,22 @@ namespace PV227
 		// No Init(), objects are initialized by functions that creates the geometry, see for example CreateCube function.
 
 		/// Deletes all OpenGL objects of the geometry, i.e. deletes all buffers in VertexBuffers array,
-		/// IndexBuffer, VAO, and resets DrawArraysCount and DrawElementsCount to zero.
+		/// IndexBuffer, VAO, PositionBuffer, DepthOnlyVAO, and resets DrawArraysCount and DrawElementsCount to zero.
 		void Destroy();
 
+		/// Creates PositionBuffer and DepthOnlyVAO from interleaved vertex data. 'stride' is the number
+		/// of floats of one vertex, the position must be the first three floats of each vertex.
+		/// The IndexBuffer must already be created.
+		void CreateDepthOnlyVAO(const float *vertices, GLsizei vertices_count, GLsizei stride, GLint position_loc = DEFAULT_POSITION_LOC);
+		/// Computes BoundsMin and BoundsMax from interleaved vertex data, 'stride' is the number of floats of one vertex,
+		/// the position must be the first three floats of each vertex.
+		void ComputeBounds(const float *vertices, GLsizei vertices_count, GLsizei stride);
+
 		/// Binds this geometry's VAO
 		void BindVAO() const;
+		/// Binds this geometry's VAO with positions only, or the full VAO if the geometry has no position-only stream.
+		/// Use it in passes that need only the positions (shadow maps, depth pre-pass).
+		void BindDepthOnlyVAO() const;
 
 		/// Chooses glDrawArrays or glDrawElements to draw the geometry.
 		void Draw() const;
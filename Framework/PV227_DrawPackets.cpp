@@ -0,0 +1,119 @@
+#include "PV227_DrawPackets.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//----------------------------
+	//----    DRAW PACKETS    ----
+	//----------------------------
+
+	/// Orders the packets by their keys, the packets with the same key by their model data (to keep the order stable)
+	static bool ComparePackets(const DrawPacket &a, const DrawPacket &b)
+	{
+		if (a.sort_key != b.sort_key)
+			return a.sort_key < b.sort_key;
+		return a.transform_id < b.transform_id;
+	}
+
+	DrawPacketList::DrawPacketList(): culled_count(0)
+	{
+	}
+
+	uint64_t DrawPacketList::MakeSortKey(int program_id, GLuint texture, int geometry_id, int material_id)
+	{
+		// 8 bits of the program, 24 bits of the texture, 16 bits of the geometry, 16 bits of the material
+		return (uint64_t(program_id & 0xFF) << 56) |
+			(uint64_t(texture & 0xFFFFFF) << 32) |
+			(uint64_t(geometry_id & 0xFFFF) << 16) |
+			uint64_t(material_id & 0xFFFF);
+	}
+
+	void DrawPacketList::Build(const SceneStore &scene, unsigned int required_flags, const glm::mat4 &view_projection, int grain_size)
+	{
+		glm::vec4 planes[6];
+		ExtractFrustumPlanes(view_projection, planes);
+
+		const int thread_count = JobSystem::GetThreadCount();
+		thread_packets.resize(thread_count + 1);
+		for (size_t t = 0; t < thread_packets.size(); t++)
+			thread_packets[t].clear();
+
+		const int *geometry_ids = scene.GetGeometryIds();
+		const int *material_ids = scene.GetMaterialIds();
+		const int *program_ids = scene.GetProgramIds();
+		const int *transform_ids = scene.GetTransformIds();
+		const GLuint *textures = scene.GetTextures();
+		const glm::vec3 *bounds_min = scene.GetBoundsMin();
+		const glm::vec3 *bounds_max = scene.GetBoundsMax();
+		const unsigned int *flags = scene.GetFlags();
+
+		// Parallel phase: each thread culls its ranges of objects and writes the packets into its own array
+		std::atomic<int> flagged_count(0);
+		JobSystem::ParallelFor(0, int(scene.GetCount()), grain_size, [&](int begin, int end)
+		{
+			const int thread_index = JobSystem::GetThreadIndex();
+			std::vector<DrawPacket> &out = thread_packets[(thread_index >= 0) ? thread_index : thread_count];
+			int flagged = 0;
+			for (int i = begin; i < end; i++)
+			{
+				if ((flags[i] & required_flags) != required_flags)
+					continue;
+				flagged++;
+				if (!TestBoxFrustum(bounds_min[i], bounds_max[i], planes))
+					continue;
+
+				DrawPacket packet;
+				packet.sort_key = MakeSortKey(program_ids[i], textures[i], geometry_ids[i], material_ids[i]);
+				packet.geometry_id = geometry_ids[i];
+				packet.material_id = material_ids[i];
+				packet.program_id = program_ids[i];
+				packet.transform_id = transform_ids[i];
+				packet.texture = textures[i];
+				out.push_back(packet);
+			}
+			flagged_count += flagged;
+		});
+
+		// Sort the arrays of the threads in parallel, and merge them
+		JobSystem::ParallelFor(0, int(thread_packets.size()), 1, [&](int begin, int end)
+		{
+			for (int t = begin; t < end; t++)
+				std::sort(thread_packets[t].begin(), thread_packets[t].end(), ComparePackets);
+		});
+
+		packets.clear();
+		for (size_t t = 0; t < thread_packets.size(); t++)
+		{
+			const size_t middle = packets.size();
+			packets.insert(packets.end(), thread_packets[t].begin(), thread_packets[t].end());
+			std::inplace_merge(packets.begin(), packets.begin() + middle, packets.end(), ComparePackets);
+		}
+		culled_count = size_t(flagged_count) - packets.size();
+	}
+
+	void DrawPacketList::Clear()
+	{
+		packets.clear();
+		culled_count = 0;
+	}
+
+	size_t DrawPacketList::GetCount() const
+	{
+		return packets.size();
+	}
+
+	const DrawPacket *DrawPacketList::GetPackets() const
+	{
+		return packets.data();
+	}
+
+	size_t DrawPacketList::GetCulledCount() const
+	{
+		return culled_count;
+	}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+#ifndef INCLUDED_PV227_DRAW_PACKETS_H
+#define INCLUDED_PV227_DRAW_PACKETS_H
+
+#include "PV227_Jobs.h"
+#include "PV227_Scene.h"
+
+// This file contains lists of draw packets, i.e. of the objects a render pass draws, in the order it draws them.
+//
+// Building the list does not call OpenGL, so it is split between the threads of the job system: each thread
+// tests its part of the objects in a SceneStore against the flags and the frustum of the pass, and writes
+// the packets of the objects that passed into its own array (so the threads never write into the same memory).
+// The arrays are then sorted in parallel by the sort keys of the packets, and merged into one list.
+// The OpenGL thread only iterates over the merged list and issues the draw calls.
+//
+// The arrays are kept between the frames, so they are not reallocated once they are large enough.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable for each pass
+//		DrawPacketList ShadowPackets;
+//		// 2) Build the lists after the scene is updated
+//		ShadowPackets.Build(Scene, SceneStore::FLAG_VISIBLE | SceneStore::FLAG_CASTS_SHADOW, light_projection * light_view);
+//		// 3) In the pass, draw the packets
+//		const DrawPacket *packets = ShadowPackets.GetPackets();
+//		for (size_t i = 0; i < ShadowPackets.GetCount(); i++)
+//			...
+
+namespace PV227
+{
+
+	//----------------------------
+	//----    DRAW PACKETS    ----
+	//----------------------------
+
+	/// DrawPacket contains everything a pass needs to draw one object, copied from SceneStore.
+	struct DrawPacket
+	{
+		uint64_t sort_key;					// Key the packets are sorted by, see DrawPacketList::MakeSortKey
+		int geometry_id;
+		int material_id;
+		int program_id;
+		int transform_id;
+		GLuint texture;
+	};
+
+	/// DrawPacketList contains the draw packets of one render pass.
+	class DrawPacketList
+	{
+	private:
+		/// Packets written by each thread of the job system, the last array is for the threads outside the job system
+		std::vector<std::vector<DrawPacket> > thread_packets;
+		/// Merged and sorted packets
+		std::vector<DrawPacket> packets;
+		/// Number of the objects that had the required flags but were outside the frustum
+		size_t culled_count;
+
+	public:
+		DrawPacketList();
+
+		/// Returns the sort key of a packet. The packets are sorted by program first (the most expensive
+		/// change of state), then by texture, geometry, and material.
+		static uint64_t MakeSortKey(int program_id, GLuint texture, int geometry_id, int material_id);
+
+		/// Builds the list from the objects of the scene that have all 'required_flags' and whose bounds are (partially)
+		/// inside the frustum given by 'view_projection'. The objects are split among the threads in ranges of
+		/// 'grain_size' objects. Must not be called while the scene changes.
+		void Build(const SceneStore &scene, unsigned int required_flags, const glm::mat4 &view_projection, int grain_size = 1024);
+		/// Removes all packets
+		void Clear();
+
+		/// Returns the number of the packets
+		size_t GetCount() const;
+		/// Returns the sorted packets, valid until the next Build
+		const DrawPacket *GetPackets() const;
+		/// Returns the number of the objects that were culled by the frustum in the last Build
+		size_t GetCulledCount() const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_DRAW_PACKETS_H
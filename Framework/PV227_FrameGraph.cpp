@@ -0,0 +1,474 @@
+#include "PV227_FrameGraph.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//---------------------------
+	//----    FRAME GRAPH    ----
+	//---------------------------
+
+	/// Returns the attachment of a texture with the given format that is not a color texture, or GL_NONE if it is a color texture
+	static GLenum GetDepthAttachment(GLenum internal_format)
+	{
+		switch (internal_format)
+		{
+		case GL_DEPTH_COMPONENT:
+		case GL_DEPTH_COMPONENT16:
+		case GL_DEPTH_COMPONENT24:
+		case GL_DEPTH_COMPONENT32:
+		case GL_DEPTH_COMPONENT32F:
+			return GL_DEPTH_ATTACHMENT;
+		case GL_DEPTH_STENCIL:
+		case GL_DEPTH24_STENCIL8:
+		case GL_DEPTH32F_STENCIL8:
+			return GL_DEPTH_STENCIL_ATTACHMENT;
+		default:
+			return GL_NONE;
+		}
+	}
+
+	/// Returns the size of one texel of a texture with the given format, it is used only to report the memory
+	static size_t GetTexelSize(GLenum internal_format)
+	{
+		switch (internal_format)
+		{
+		case GL_R8:						return 1;
+		case GL_R16F:
+		case GL_RG8:
+		case GL_DEPTH_COMPONENT16:		return 2;
+		case GL_RGBA32F:				return 16;
+		case GL_RGB32F:					return 12;
+		case GL_RGBA16F:
+		case GL_RG32F:
+		case GL_DEPTH32F_STENCIL8:		return 8;
+		case GL_RGB16F:					return 6;
+		default:						return 4;		// GL_RGBA8, GL_R32F, GL_RG16F, GL_DEPTH24_STENCIL8, GL_DEPTH_COMPONENT24, ...
+		}
+	}
+
+	FrameGraph::FrameGraph()
+		: window_width(1), window_height(1), render_scale(1.0f), compiled(false), allocated_bytes(0), unaliased_bytes(0), culled_pass_count(0), skipped_pass_count(0)
+	{
+	}
+
+	void FrameGraph::Init(int window_width, int window_height)
+	{
+		Clear();
+		SetWindowSize(window_width, window_height);
+	}
+
+	void FrameGraph::Destroy()
+	{
+		Clear();
+	}
+
+	void FrameGraph::Clear()
+	{
+		DestroyObjects();
+		resources.clear();
+		passes.clear();
+	}
+
+	void FrameGraph::SetWindowSize(int window_width, int window_height)
+	{
+		this->window_width = std::max(window_width, 1);
+		this->window_height = std::max(window_height, 1);
+		compiled = false;
+	}
+
+	void FrameGraph::SetRenderScale(float render_scale)
+	{
+		render_scale = std::max(std::min(render_scale, 1.0f), 0.1f);
+		if (render_scale != this->render_scale)
+			compiled = false;
+		this->render_scale = render_scale;
+	}
+
+	float FrameGraph::GetRenderScale() const
+	{
+		return render_scale;
+	}
+
+	int FrameGraph::GetRenderWidth() const
+	{
+		return std::max(int(float(window_width) * render_scale + 0.5f), 1);
+	}
+
+	int FrameGraph::GetRenderHeight() const
+	{
+		return std::max(int(float(window_height) * render_scale + 0.5f), 1);
+	}
+
+	FrameGraph::Resource FrameGraph::AddResource(const char *name, ResourceKind kind, GLenum internal_format, int width, int height, bool persistent, GLuint texture)
+	{
+		ResourceData resource;
+		resource.name = name;
+		resource.kind = kind;
+		resource.internal_format = internal_format;
+		resource.width = width;
+		resource.height = height;
+		resource.persistent = persistent;
+		resource.is_output = false;
+		resource.texture = texture;
+		resource.first_use = -1;
+		resource.last_use = -1;
+		resources.push_back(resource);
+		compiled = false;
+		return Resource(resources.size() - 1);
+	}
+
+	FrameGraph::Resource FrameGraph::CreateTexture(const char *name, GLenum internal_format, bool persistent, int width, int height)
+	{
+		return AddResource(name, RESOURCE_TEXTURE, internal_format, width, height, persistent, 0);
+	}
+
+	FrameGraph::Resource FrameGraph::ImportTexture(const char *name, GLuint texture, GLenum internal_format, int width, int height)
+	{
+		return AddResource(name, RESOURCE_IMPORTED_TEXTURE, internal_format, width, height, true, texture);
+	}
+
+	FrameGraph::Resource FrameGraph::ImportExternal(const char *name)
+	{
+		return AddResource(name, RESOURCE_EXTERNAL, GL_NONE, 0, 0, true, 0);
+	}
+
+	FrameGraph::Resource FrameGraph::ImportBackbuffer()
+	{
+		return AddResource("Backbuffer", RESOURCE_BACKBUFFER, GL_NONE, 0, 0, true, 0);
+	}
+
+	void FrameGraph::SetOutput(Resource resource)
+	{
+		resources[resource].is_output = true;
+		compiled = false;
+	}
+
+	FrameGraph::Pass FrameGraph::AddPass(const char *name, const std::function<void()> &execute)
+	{
+		PassData pass;
+		pass.name = name;
+		pass.execute = execute;
+		pass.culled = false;
+		pass.runs = false;
+		pass.framebuffer = 0;
+		passes.push_back(pass);
+		compiled = false;
+		return Pass(passes.size() - 1);
+	}
+
+	void FrameGraph::Read(Pass pass, Resource resource)
+	{
+		passes[pass].reads.push_back(resource);
+		compiled = false;
+	}
+
+	void FrameGraph::Write(Pass pass, Resource resource)
+	{
+		passes[pass].writes.push_back(resource);
+		compiled = false;
+	}
+
+	void FrameGraph::SetCondition(Pass pass, const std::function<bool()> &condition)
+	{
+		passes[pass].condition = condition;
+	}
+
+	void FrameGraph::GetSize(const ResourceData &resource, int &width, int &height) const
+	{
+		width = (resource.width > 0) ? resource.width : GetRenderWidth();
+		height = (resource.height > 0) ? resource.height : GetRenderHeight();
+	}
+
+	void FrameGraph::DestroyObjects()
+	{
+		for (PassData &pass : passes)
+		{
+			if (pass.framebuffer != 0)
+				glDeleteFramebuffers(1, &pass.framebuffer);
+			pass.framebuffer = 0;
+		}
+		for (const AllocatedTexture &texture : textures)
+			glDeleteTextures(1, &texture.texture);
+		if (!textures.empty())
+			GLStateCache::Invalidate();		// The cache may remember the deleted textures as bound
+		textures.clear();
+		for (ResourceData &resource : resources)
+			if (resource.kind == RESOURCE_TEXTURE)
+				resource.texture = 0;
+		allocated_bytes = 0;
+		unaliased_bytes = 0;
+		compiled = false;
+	}
+
+	void FrameGraph::Compile()
+	{
+		DestroyObjects();
+
+		// Cull the passes, from the last one: a pass is needed when it writes a resource that is an output
+		// or that is read by a later pass that is needed
+		vector<bool> needed(resources.size(), false);
+		for (size_t r = 0; r < resources.size(); r++)
+			needed[r] = resources[r].is_output;
+		culled_pass_count = 0;
+		for (int p = int(passes.size()) - 1; p >= 0; p--)
+		{
+			PassData &pass = passes[p];
+			pass.culled = true;
+			for (Resource resource : pass.writes)
+				if (needed[resource])
+					pass.culled = false;
+			if (pass.culled)
+			{
+				culled_pass_count++;
+				continue;
+			}
+			for (Resource resource : pass.reads)
+				needed[resource] = true;
+		}
+
+		// Compute the lifetimes of the resources
+		for (ResourceData &resource : resources)
+		{
+			resource.first_use = -1;
+			resource.last_use = -1;
+		}
+		for (int p = 0; p < int(passes.size()); p++)
+		{
+			if (passes[p].culled)
+				continue;
+			for (int i = 0; i < 2; i++)
+			{
+				for (Resource r : (i == 0) ? passes[p].reads : passes[p].writes)
+				{
+					if (resources[r].first_use < 0)
+						resources[r].first_use = p;
+					resources[r].last_use = p;
+				}
+			}
+		}
+
+		// Create the textures in the order of their first use, a transient texture uses an existing texture
+		// with the same format and size if the lifetimes do not overlap
+		vector<Resource> order;
+		for (size_t r = 0; r < resources.size(); r++)
+			if ((resources[r].kind == RESOURCE_TEXTURE) && (resources[r].first_use >= 0))
+				order.push_back(Resource(r));
+		std::stable_sort(order.begin(), order.end(), [this](Resource a, Resource b) { return resources[a].first_use < resources[b].first_use; });
+		for (Resource r : order)
+		{
+			ResourceData &resource = resources[r];
+			int width, height;
+			GetSize(resource, width, height);
+			const size_t bytes = GetTexelSize(resource.internal_format) * size_t(width) * size_t(height);
+			unaliased_bytes += bytes;
+
+			if (!resource.persistent)
+			{
+				for (AllocatedTexture &texture : textures)
+				{
+					if ((texture.free_after < resource.first_use) && (texture.internal_format == resource.internal_format) &&
+						(texture.width == width) && (texture.height == height))
+					{
+						resource.texture = texture.texture;
+						texture.free_after = resource.last_use;
+						break;
+					}
+				}
+				if (resource.texture != 0)
+					continue;
+			}
+
+			AllocatedTexture texture;
+			glGenTextures(1, &texture.texture);
+			GLStateCache::BindTexture(GL_TEXTURE_2D, texture.texture);
+			glTexStorage2D(GL_TEXTURE_2D, 1, resource.internal_format, width, height);
+			SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+			GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
+			texture.internal_format = resource.internal_format;
+			texture.width = width;
+			texture.height = height;
+			texture.free_after = resource.persistent ? INT_MAX : resource.last_use;
+			textures.push_back(texture);
+			allocated_bytes += bytes;
+			resource.texture = texture.texture;
+		}
+
+		// Find the attachments of the passes, and the content that is not needed after them
+		for (int p = 0; p < int(passes.size()); p++)
+		{
+			PassData &pass = passes[p];
+			pass.attachments.clear();
+			pass.invalidated_attachments.clear();
+			pass.invalidated_textures.clear();
+			if (pass.culled)
+				continue;
+
+			int color_count = 0;
+			for (Resource r : pass.writes)
+			{
+				const ResourceData &resource = resources[r];
+				GLenum attachment = GL_NONE;
+				if ((resource.kind == RESOURCE_TEXTURE) || (resource.kind == RESOURCE_IMPORTED_TEXTURE))
+				{
+					attachment = GetDepthAttachment(resource.internal_format);
+					if (attachment == GL_NONE)
+						attachment = GL_COLOR_ATTACHMENT0 + color_count++;
+				}
+				pass.attachments.push_back(attachment);
+
+				if ((resource.kind == RESOURCE_TEXTURE) && !resource.persistent && (resource.last_use == p))
+					pass.invalidated_attachments.push_back(attachment);
+			}
+			for (Resource r : pass.reads)
+			{
+				const ResourceData &resource = resources[r];
+				if ((resource.kind == RESOURCE_TEXTURE) && !resource.persistent && (resource.last_use == p) &&
+					(std::find(pass.writes.begin(), pass.writes.end(), r) == pass.writes.end()))
+					pass.invalidated_textures.push_back(resource.texture);
+			}
+		}
+
+		compiled = true;
+	}
+
+	bool FrameGraph::IsCompiled() const
+	{
+		return compiled;
+	}
+
+	void FrameGraph::BindFramebuffer(PassData &pass)
+	{
+		// The passes that draw into the default framebuffer
+		for (Resource r : pass.writes)
+		{
+			if (resources[r].kind == RESOURCE_BACKBUFFER)
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				glViewport(0, 0, window_width, window_height);
+				return;
+			}
+		}
+
+		// The passes that do not draw into any texture (e.g. compute shaders) bind what they need themselves
+		int attachment_index = -1;
+		for (size_t i = 0; i < pass.attachments.size(); i++)
+		{
+			if (pass.attachments[i] != GL_NONE)
+			{
+				attachment_index = int(i);
+				break;
+			}
+		}
+		if (attachment_index < 0)
+			return;
+
+		if (pass.framebuffer == 0)
+		{
+			int color_count = 0;
+			glGenFramebuffers(1, &pass.framebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, pass.framebuffer);
+			for (size_t i = 0; i < pass.writes.size(); i++)
+			{
+				if (pass.attachments[i] == GL_NONE)
+					continue;
+				glFramebufferTexture2D(GL_FRAMEBUFFER, pass.attachments[i], GL_TEXTURE_2D, resources[pass.writes[i]].texture, 0);
+				if ((pass.attachments[i] != GL_DEPTH_ATTACHMENT) && (pass.attachments[i] != GL_DEPTH_STENCIL_ATTACHMENT))
+					color_count++;
+			}
+			if (color_count > 0)
+				glDrawBuffers(color_count, DrawBuffersConstants);
+			CheckFramebufferStatus(pass.name.c_str());
+		}
+		else
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, pass.framebuffer);
+		}
+
+		// All attachments have the same size
+		int width, height;
+		GetSize(resources[pass.writes[attachment_index]], width, height);
+		glViewport(0, 0, width, height);
+	}
+
+	void FrameGraph::Execute()
+	{
+		if (!compiled)
+			Compile();
+
+		// Evaluate the conditions, in the order of the passes (a condition may depend on the decision about an earlier pass)
+		for (PassData &pass : passes)
+			pass.runs = !pass.culled && (!pass.condition || pass.condition());
+
+		// A pass that writes a transient texture must run when a later pass that reads the texture runs
+		for (int p = int(passes.size()) - 1; p >= 0; p--)
+		{
+			if (!passes[p].runs)
+				continue;
+			for (Resource r : passes[p].reads)
+			{
+				if ((resources[r].kind != RESOURCE_TEXTURE) || resources[r].persistent)
+					continue;
+				for (int w = p - 1; w >= 0; w--)
+				{
+					if (!passes[w].culled && (std::find(passes[w].writes.begin(), passes[w].writes.end(), r) != passes[w].writes.end()))
+						passes[w].runs = true;
+				}
+			}
+		}
+
+		skipped_pass_count = 0;
+		for (PassData &pass : passes)
+		{
+			if (pass.culled)
+				continue;
+			if (!pass.runs)
+			{
+				skipped_pass_count++;
+				continue;
+			}
+
+			BindFramebuffer(pass);
+			pass.execute();
+
+			// Tell the driver the content that is not needed anymore (the pass may have bound another framebuffer)
+			if (!pass.invalidated_attachments.empty())
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, pass.framebuffer);
+				glInvalidateFramebuffer(GL_FRAMEBUFFER, GLsizei(pass.invalidated_attachments.size()), pass.invalidated_attachments.data());
+			}
+			for (GLuint texture : pass.invalidated_textures)
+				glInvalidateTexImage(texture, 0);
+		}
+	}
+
+	GLuint FrameGraph::GetTexture(Resource resource) const
+	{
+		return resources[resource].texture;
+	}
+
+	int FrameGraph::GetCulledPassCount() const
+	{
+		return culled_pass_count;
+	}
+
+	int FrameGraph::GetSkippedPassCount() const
+	{
+		return skipped_pass_count;
+	}
+
+	size_t FrameGraph::GetAllocatedBytes() const
+	{
+		return allocated_bytes;
+	}
+
+	size_t FrameGraph::GetUnaliasedBytes() const
+	{
+		return unaliased_bytes;
+	}
+
+}
@@ -0,0 +1,203 @@
+#pragma once
+#ifndef INCLUDED_PV227_FRAME_GRAPH_H
+#define INCLUDED_PV227_FRAME_GRAPH_H
+
+#include "PV227_Basics.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// This file contains the frame graph, i.e. the description of the render passes of a frame and of the textures
+// they read and write, from which the textures and the framebuffers are created automatically.
+//
+// The passes are added in the order they run, and each of them declares the resources it reads and writes.
+// When the graph is compiled:
+//	- The passes that do not contribute to the outputs of the graph (see SetOutput) are culled.
+//	- The lifetime of each texture is computed, i.e. the first and the last pass that uses it.
+//	- The transient textures (whose content is needed only within one frame) whose lifetimes do not overlap
+//	  share the same OpenGL texture, if they have the same format and size. OpenGL cannot place different
+//	  textures into the same memory, so this is the way their memory is aliased. The persistent textures
+//	  keep their content between the frames, so they are never shared.
+// When the graph is executed, the framebuffer of each pass (with the textures it writes as its attachments)
+// is created when it is used for the first time, it is bound before the pass runs, and the attachments
+// whose content is not needed anymore are invalidated after it (so that the driver does not have to keep them).
+//
+// A pass may have a condition, the pass is skipped when the condition returns false and the results of its
+// last run are used (see also PassCache). A pass that writes a transient texture runs whenever a pass that
+// reads it runs, regardless of its condition, as the transient textures do not keep their content.
+//
+// Besides the textures created by the graph, the resources may be existing textures, the default framebuffer,
+// and external resources (e.g. buffers) that are only used to express the dependencies between the passes.
+//
+// The textures whose size is not given follow the render size, i.e. the size of the window multiplied by the render
+// scale (see SetRenderScale), so that the scene may be rendered in a lower resolution and upscaled to the window.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		FrameGraph Frame_graph;
+//		// 2) After the OpenGL context is created, describe the passes
+//		Frame_graph.Init(win_width, win_height);
+//		FrameGraph::Resource albedo = Frame_graph.CreateTexture("Albedo", GL_RGBA8, true);
+//		FrameGraph::Resource depth = Frame_graph.CreateTexture("Depth", GL_DEPTH24_STENCIL8);
+//		FrameGraph::Resource backbuffer = Frame_graph.ImportBackbuffer();
+//		FrameGraph::Pass gbuffer = Frame_graph.AddPass("G-buffer", render_gbuffer);
+//		Frame_graph.Write(gbuffer, albedo);
+//		Frame_graph.Write(gbuffer, depth);
+//		FrameGraph::Pass lighting = Frame_graph.AddPass("Lighting", render_lighting);
+//		Frame_graph.Read(lighting, albedo);
+//		Frame_graph.Write(lighting, backbuffer);
+//		Frame_graph.SetOutput(backbuffer);
+//		// 3) When the window is resized, the textures are created again with the new size in the next Execute
+//		Frame_graph.SetWindowSize(win_width, win_height);
+//		// 4) Each frame, run the passes (the graph is compiled if needed)
+//		Frame_graph.Execute();
+//		// 5) In the passes, get the textures with GetTexture
+
+namespace PV227
+{
+
+	//---------------------------
+	//----    FRAME GRAPH    ----
+	//---------------------------
+
+	/// FrameGraph creates the textures and the framebuffers of the render passes, and runs the passes.
+	class FrameGraph
+	{
+	public:
+		/// Index of a resource in the graph
+		typedef int Resource;
+		/// Index of a pass in the graph
+		typedef int Pass;
+
+	private:
+		enum ResourceKind
+		{
+			RESOURCE_TEXTURE,			// Texture created by the graph
+			RESOURCE_IMPORTED_TEXTURE,	// Existing texture, it is persistent
+			RESOURCE_EXTERNAL,			// Resource that is not attached to the framebuffers (e.g. a buffer), it is persistent
+			RESOURCE_BACKBUFFER,		// The default framebuffer
+		};
+
+		struct ResourceData
+		{
+			std::string name;
+			ResourceKind kind;
+			GLenum internal_format;
+			int width;					// The size, 0 means the render size
+			int height;
+			bool persistent;			// True if the content is kept between the frames
+			bool is_output;
+			GLuint texture;				// OpenGL texture, shared by the transient textures with disjoint lifetimes
+			int first_use;				// Lifetime, i.e. the first and the last pass that is not culled and uses the resource, -1 if none
+			int last_use;
+		};
+
+		struct PassData
+		{
+			std::string name;
+			std::function<void()> execute;
+			std::function<bool()> condition;
+			std::vector<Resource> reads;
+			std::vector<Resource> writes;
+			bool culled;
+			bool runs;							// True if the pass runs in the current Execute
+			std::vector<GLenum> attachments;	// Attachment of each resource in 'writes', GL_NONE if it is not attached
+			GLuint framebuffer;					// Created when the pass runs for the first time after Compile
+			std::vector<GLenum> invalidated_attachments;	// Attachments whose content is not needed after the pass
+			std::vector<GLuint> invalidated_textures;		// Textures (read by the pass) whose content is not needed after the pass
+		};
+
+		/// Texture created by the graph, it is used by one or more resources
+		struct AllocatedTexture
+		{
+			GLuint texture;
+			GLenum internal_format;
+			int width;
+			int height;
+			int free_after;				// The last pass that uses the texture
+		};
+
+		std::vector<ResourceData> resources;
+		std::vector<PassData> passes;
+		std::vector<AllocatedTexture> textures;
+		int window_width;
+		int window_height;
+		float render_scale;
+		bool compiled;
+		size_t allocated_bytes;
+		size_t unaliased_bytes;
+		int culled_pass_count;
+		int skipped_pass_count;
+
+		Resource AddResource(const char *name, ResourceKind kind, GLenum internal_format, int width, int height, bool persistent, GLuint texture);
+		/// Returns the size of a resource, the render size for the textures that follow it
+		void GetSize(const ResourceData &resource, int &width, int &height) const;
+		/// Deletes the textures and the framebuffers created by the graph
+		void DestroyObjects();
+		/// Binds the framebuffer of a pass and sets the viewport, creates the framebuffer if needed
+		void BindFramebuffer(PassData &pass);
+
+	public:
+		FrameGraph();
+
+		/// Initializes the graph with the size of the window
+		void Init(int window_width, int window_height);
+		/// Deletes all OpenGL objects created by the graph, and removes all passes and resources
+		void Destroy();
+		/// Removes all passes and resources, so that the graph can be described again
+		void Clear();
+
+		/// Sets the size of the window, the textures that follow it are created again in the next Execute
+		void SetWindowSize(int window_width, int window_height);
+		/// Sets the render scale, i.e. the size of the textures that follow the window relative to the window (e.g. 0.5 for half
+		/// of the resolution in each direction). The textures are created again in the next Execute.
+		void SetRenderScale(float render_scale);
+		float GetRenderScale() const;
+		/// Returns the render size, i.e. the size of the window multiplied by the render scale
+		int GetRenderWidth() const;
+		int GetRenderHeight() const;
+
+		/// Adds a texture created by the graph, of the given size or (when 0) of the render size.
+		/// The persistent textures keep their content between the frames, the others may share the memory with other textures.
+		Resource CreateTexture(const char *name, GLenum internal_format, bool persistent = false, int width = 0, int height = 0);
+		/// Adds an existing texture, its size must not change (other than in SetWindowSize)
+		Resource ImportTexture(const char *name, GLuint texture, GLenum internal_format, int width, int height);
+		/// Adds a resource the graph does not manage (e.g. a buffer), it is used only to express the dependencies of the passes
+		Resource ImportExternal(const char *name);
+		/// Adds the default framebuffer
+		Resource ImportBackbuffer();
+		/// Marks a resource as an output of the graph, the passes that do not contribute to the outputs are culled
+		void SetOutput(Resource resource);
+
+		/// Adds a pass, the passes run in the order they were added
+		Pass AddPass(const char *name, const std::function<void()> &execute);
+		/// Declares that the pass reads the resource
+		void Read(Pass pass, Resource resource);
+		/// Declares that the pass writes the resource. The textures are attached to the framebuffer of the pass,
+		/// the color textures in the order of the calls, the depth (and stencil) texture to its attachment.
+		void Write(Pass pass, Resource resource);
+		/// Sets the condition of the pass, the pass is skipped when it returns false, see the description at the beginning of the file
+		void SetCondition(Pass pass, const std::function<bool()> &condition);
+
+		/// Culls the passes, and creates the textures. It is called by Execute when the graph changed.
+		void Compile();
+		/// Returns true if the graph is compiled and did not change since then
+		bool IsCompiled() const;
+		/// Runs the passes that are not culled and whose conditions are met
+		void Execute();
+
+		/// Returns the OpenGL texture of a resource (valid after Compile, 0 if the resource is not used by any pass that is not culled)
+		GLuint GetTexture(Resource resource) const;
+		/// Returns the number of the passes that were culled in Compile
+		int GetCulledPassCount() const;
+		/// Returns the number of the passes that were skipped in the last Execute because of their conditions
+		int GetSkippedPassCount() const;
+		/// Returns the memory of the textures created by the graph, and the memory they would need without the sharing
+		size_t GetAllocatedBytes() const;
+		size_t GetUnaliasedBytes() const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_FRAME_GRAPH_H
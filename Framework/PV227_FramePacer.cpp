@@ -0,0 +1,218 @@
+#include "PV227_FramePacer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// The default resolution of the sleep on Windows is about 15 ms, it is raised to 1 ms while the pacer is used
+#if defined(_WIN32)
+#define NOMINMAX				// Make Windows.h not define 'min' and 'max' macros
+#include <Windows.h>
+#pragma comment(lib, "winmm.lib")			// Link with timeBeginPeriod
+#endif
+
+using namespace std;
+
+namespace PV227
+{
+
+	//---------------------------
+	//----    FRAME PACER    ----
+	//---------------------------
+
+	const double FramePacer::SpinTime = 0.002;
+
+	/// Maximum divisor of the target rate in PACING_ADAPTIVE mode
+	static const int MaxRateDivisor = 4;
+
+	FramePacer::FramePacer()
+		: mode(PACING_UNCAPPED), target_rate(60.0f), rate_divisor(1), last_rate_change(0), next_frame_time(0.0), frame_begin_time(0.0),
+		last_frame_begin_time(0.0), cpu_frame_time(0.0), frame_interval(0.0), frame_count(0), on_demand(false), requested_frames(0)
+	{
+	}
+
+	void FramePacer::Init(PacingMode mode, float target_rate)
+	{
+#if defined(_WIN32)
+		timeBeginPeriod(1);
+#endif
+		this->target_rate = target_rate;
+		frame_count = 0;
+		SetMode(mode);
+	}
+
+	void FramePacer::Destroy()
+	{
+#if defined(_WIN32)
+		timeEndPeriod(1);
+#endif
+	}
+
+	void FramePacer::SetMode(PacingMode mode)
+	{
+		this->mode = mode;
+		SetVSync(mode == PACING_VSYNC);
+		rate_divisor = 1;
+		last_rate_change = frame_count;
+		next_frame_time = GetTime();
+	}
+
+	FramePacer::PacingMode FramePacer::GetMode() const
+	{
+		return mode;
+	}
+
+	void FramePacer::SetTargetRate(float target_rate)
+	{
+		this->target_rate = std::max(target_rate, 1.0f);
+		rate_divisor = 1;
+	}
+
+	float FramePacer::GetTargetRate() const
+	{
+		return target_rate;
+	}
+
+	float FramePacer::GetCurrentRate() const
+	{
+		const double period = GetFramePeriod();
+		return (period > 0.0) ? float(1.0 / period) : 0.0f;
+	}
+
+	void FramePacer::SetOnDemand(bool on_demand)
+	{
+		this->on_demand = on_demand;
+		RequestFrames(1);
+	}
+
+	bool FramePacer::IsOnDemand() const
+	{
+		return on_demand;
+	}
+
+	void FramePacer::RequestFrames(int count)
+	{
+		int requested = requested_frames;
+		while ((requested < count) && !requested_frames.compare_exchange_weak(requested, count))
+			;
+		// Not under the mutex, a missed signal only delays the frame by the maximum wait of WaitForFrame
+		request_signal.notify_one();
+	}
+
+	bool FramePacer::IsFrameRequested() const
+	{
+		return !on_demand || (requested_frames > 0);
+	}
+
+	double FramePacer::GetFramePeriod() const
+	{
+		switch (mode)
+		{
+		case PACING_FIXED_RATE:
+			return 1.0 / double(target_rate);
+		case PACING_ADAPTIVE:
+			return double(rate_divisor) / double(target_rate);
+		default:
+			return 0.0;		// The frames start immediately, or the swap of the buffers waits for V-Sync
+		}
+	}
+
+	bool FramePacer::WaitForFrame(double max_wait)
+	{
+		if (on_demand && (requested_frames <= 0))
+		{
+			// Nothing changed, sleep until a frame is requested
+			unique_lock<mutex> lock(request_mutex);
+			request_signal.wait_for(lock, chrono::duration<double>(max_wait), [this]() { return requested_frames > 0; });
+			if (requested_frames <= 0)
+				return false;
+		}
+
+		if (GetFramePeriod() <= 0.0)
+			return true;
+
+		// Sleep, but wake up SpinTime before the frame, as the sleep may take longer than requested
+		double remaining = next_frame_time - GetTime();
+		const double sleep_time = std::min(remaining - SpinTime, max_wait);
+		if (sleep_time > 0.0)
+		{
+			this_thread::sleep_for(chrono::duration<double>(sleep_time));
+			remaining = next_frame_time - GetTime();
+		}
+		if (remaining > SpinTime)
+			return false;		// Not yet, the caller may do something else in the meantime
+
+		// Spin for the rest of the time
+		while (GetTime() < next_frame_time)
+			this_thread::yield();
+		return true;
+	}
+
+	void FramePacer::BeginFrame()
+	{
+		int requested = requested_frames;
+		while ((requested > 0) && !requested_frames.compare_exchange_weak(requested, requested - 1))
+			;
+
+		last_frame_begin_time = frame_begin_time;
+		frame_begin_time = GetTime();
+		if (frame_count > 0)
+		{
+			const double interval = frame_begin_time - last_frame_begin_time;
+			frame_interval = (frame_count == 1) ? interval : frame_interval + (interval - frame_interval) / AveragedFrames;
+		}
+
+		// Keep the cadence when the frame started a bit late, start again from now when it missed a whole period
+		const double period = GetFramePeriod();
+		next_frame_time += period;
+		if (next_frame_time < frame_begin_time)
+			next_frame_time = frame_begin_time + period;
+	}
+
+	void FramePacer::EndFrame()
+	{
+		const double cpu_time = GetTime() - frame_begin_time;
+		cpu_frame_time = (frame_count == 0) ? cpu_time : cpu_frame_time + (cpu_time - cpu_frame_time) / AveragedFrames;
+		frame_count++;
+
+		if (mode == PACING_ADAPTIVE)
+			AdaptRate();
+	}
+
+	void FramePacer::AdaptRate()
+	{
+		// Change the rate at most once per AveragedFrames frames, so that the average reflects the new rate
+		if (frame_count - last_rate_change < unsigned(AveragedFrames))
+			return;
+
+		const double base_period = 1.0 / double(target_rate);
+		if ((cpu_frame_time > 0.95 * base_period * rate_divisor) && (rate_divisor < MaxRateDivisor))
+		{
+			// The frames do not fit into the period, present them less often
+			rate_divisor++;
+			last_rate_change = frame_count;
+		}
+		else if ((rate_divisor > 1) && (cpu_frame_time < 0.75 * base_period * (rate_divisor - 1)))
+		{
+			// The frames fit into a shorter period with a reserve
+			rate_divisor--;
+			last_rate_change = frame_count;
+		}
+	}
+
+	float FramePacer::GetCPUFrameTime() const
+	{
+		return float(cpu_frame_time * 1000.0);
+	}
+
+	float FramePacer::GetFrameInterval() const
+	{
+		return float(frame_interval * 1000.0);
+	}
+
+	float FramePacer::GetFPS() const
+	{
+		return (frame_interval > 0.0) ? float(1.0 / frame_interval) : 0.0f;
+	}
+
+}
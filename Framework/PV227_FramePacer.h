@@ -0,0 +1,136 @@
+#pragma once
+#ifndef INCLUDED_PV227_FRAME_PACER_H
+#define INCLUDED_PV227_FRAME_PACER_H
+
+#include "PV227_Basics.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// This file contains the frame pacing, i.e. the decision when the next frame starts, and the measurement of the frame times.
+//
+// The pacer has several modes:
+//	- PACING_UNCAPPED: the frames start immediately one after another, V-Sync is off. Use it to measure the throughput.
+//	- PACING_FIXED_RATE: the frames start at a fixed rate, V-Sync is off. The pacer sleeps until shortly before
+//	  the start of the next frame (the sleep is not precise), and spins for the rest of the time.
+//	- PACING_VSYNC: the frames are paced by V-Sync (the swap of the buffers waits for the display).
+//	- PACING_ADAPTIVE: like PACING_FIXED_RATE, but when the frames do not fit into the period of the target rate,
+//	  the rate is lowered to its half, third, ..., so that the frames are presented at regular intervals
+//	  (e.g. 30 FPS instead of an alternation of 60 and 30 FPS). The rate is raised again when the frames are fast enough.
+//
+// Independently of the mode, the frames may be rendered on demand: a frame starts only when it was requested
+// with RequestFrames (e.g. when the input or the scene changes), the pacer sleeps otherwise. The requested
+// frames are still paced by the mode.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		FramePacer Pacer;
+//		// 2) After the OpenGL context is created, initialize it
+//		Pacer.Init(FramePacer::PACING_FIXED_RATE, 60.0f);
+//		// 3) In GLUT idle function, start a new frame when it is time for it, the waiting is split into short
+//		//    parts so that GLUT can process the events in the meantime
+//		if (Pacer.WaitForFrame(0.002))
+//			glutPostRedisplay();
+//		// 4) In display function, mark the beginning and the end of the frame
+//		Pacer.BeginFrame();
+//		... update and render ...
+//		glutSwapBuffers();
+//		Pacer.EndFrame();
+
+namespace PV227
+{
+
+	//---------------------------
+	//----    FRAME PACER    ----
+	//---------------------------
+
+	/// FramePacer decides when the next frame starts, and measures how long the frames take.
+	class FramePacer
+	{
+	public:
+		/// Modes of the pacing, see the description at the beginning of the file
+		enum PacingMode
+		{
+			PACING_UNCAPPED,
+			PACING_FIXED_RATE,
+			PACING_VSYNC,
+			PACING_ADAPTIVE,
+		};
+
+	private:
+		/// Time before the start of the frame when the pacer stops sleeping and starts spinning
+		static const double SpinTime;
+		/// Number of the frames over which the frame times are averaged
+		static const int AveragedFrames = 30;
+
+		PacingMode mode;
+		float target_rate;				// Frames per second in PACING_FIXED_RATE and PACING_ADAPTIVE modes
+		int rate_divisor;				// PACING_ADAPTIVE mode presents the frames at target_rate / rate_divisor
+		unsigned int last_rate_change;	// Frame when rate_divisor changed
+
+		double next_frame_time;			// Time when the next frame should start
+		double frame_begin_time;		// Time of the last BeginFrame
+		double last_frame_begin_time;	// Time of the previous BeginFrame
+
+		// Averaged times of the frames, in seconds
+		double cpu_frame_time;			// From BeginFrame to EndFrame, i.e. the time the CPU works on the frame
+		double frame_interval;			// From BeginFrame to the next BeginFrame
+		unsigned int frame_count;
+
+		// The on-demand mode, the number of the frames that were requested and have not started yet,
+		// and the signal that wakes WaitForFrame when a frame is requested
+		bool on_demand;
+		std::atomic<int> requested_frames;
+		std::mutex request_mutex;
+		std::condition_variable request_signal;
+
+		/// Length of one frame in the current mode, 0 if the frames are not paced by the pacer
+		double GetFramePeriod() const;
+		/// Changes the rate in PACING_ADAPTIVE mode according to the CPU time of the frames
+		void AdaptRate();
+
+	public:
+		FramePacer();
+
+		/// Initializes the pacer, must be called with the OpenGL context current (it turns V-Sync on or off)
+		void Init(PacingMode mode, float target_rate = 60.0f);
+		/// Restores the system settings changed in Init
+		void Destroy();
+
+		/// Changes the mode, must be called with the OpenGL context current
+		void SetMode(PacingMode mode);
+		PacingMode GetMode() const;
+		/// Changes the target rate of PACING_FIXED_RATE and PACING_ADAPTIVE modes
+		void SetTargetRate(float target_rate);
+		float GetTargetRate() const;
+		/// Returns the rate the frames are presented at in PACING_ADAPTIVE mode, the target rate in PACING_FIXED_RATE mode, 0 otherwise
+		float GetCurrentRate() const;
+
+		/// Turns rendering on demand on or off, see the description at the beginning of the file
+		void SetOnDemand(bool on_demand);
+		bool IsOnDemand() const;
+		/// Requests at least 'count' frames to be rendered on demand (more than one e.g. for temporal effects that converge
+		/// over several frames). Can be called from any thread.
+		void RequestFrames(int count = 1);
+		/// Returns true if the next frame should be rendered, i.e. it was requested or the frames are not rendered on demand
+		bool IsFrameRequested() const;
+
+		/// Waits at most 'max_wait' seconds for the start of the next frame, returns true if the next frame should start now
+		bool WaitForFrame(double max_wait);
+		/// Marks the beginning of a frame
+		void BeginFrame();
+		/// Marks the end of a frame, i.e. after the buffers are swapped
+		void EndFrame();
+
+		/// Returns the average time in milliseconds the CPU works on a frame (from BeginFrame to EndFrame)
+		float GetCPUFrameTime() const;
+		/// Returns the average time in milliseconds between the beginnings of the frames
+		float GetFrameInterval() const;
+		/// Returns the average number of the frames per second
+		float GetFPS() const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_FRAME_PACER_H
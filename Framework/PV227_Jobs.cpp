@@ -0,0 +1,337 @@
+#include "PV227_Jobs.h"
+
+using namespace std;
+
+namespace PV227
+{
+
+	// Index of the current thread in JobSystem::deques, -1 for threads that are not in the job system
+	static thread_local int current_thread_index = -1;
+
+	//-----------------------------------
+	//----    WORK STEALING DEQUE    ----
+	//-----------------------------------
+
+	WorkStealingDeque::WorkStealingDeque(): top(0), bottom(0)
+	{
+		for (int64_t i = 0; i < Capacity; i++)
+			jobs[i].store(nullptr, memory_order_relaxed);
+	}
+
+	bool WorkStealingDeque::Push(Job *job)
+	{
+		const int64_t b = bottom.load(memory_order_relaxed);
+		const int64_t t = top.load(memory_order_acquire);
+		if (b - t >= Capacity)
+			return false;
+		jobs[b & (Capacity - 1)].store(job, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		bottom.store(b + 1, memory_order_relaxed);
+		return true;
+	}
+
+	Job *WorkStealingDeque::Pop()
+	{
+		const int64_t b = bottom.load(memory_order_relaxed) - 1;
+		bottom.store(b, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		int64_t t = top.load(memory_order_relaxed);
+		if (t > b)
+		{
+			// The deque is empty
+			bottom.store(b + 1, memory_order_relaxed);
+			return nullptr;
+		}
+
+		Job *job = jobs[b & (Capacity - 1)].load(memory_order_relaxed);
+		if (t == b)
+		{
+			// The last job, the thieves may take it at the same time
+			if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+				job = nullptr;
+			bottom.store(b + 1, memory_order_relaxed);
+		}
+		return job;
+	}
+
+	Job *WorkStealingDeque::Steal()
+	{
+		int64_t t = top.load(memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		const int64_t b = bottom.load(memory_order_acquire);
+		if (t >= b)
+			return nullptr;
+
+		Job *job = jobs[t & (Capacity - 1)].load(memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+			return nullptr;		// Another thread took the job
+		return job;
+	}
+
+	//--------------------------
+	//----    JOB SYSTEM    ----
+	//--------------------------
+
+	std::thread::id JobSystem::main_thread;
+	std::vector<std::thread> JobSystem::workers;
+	std::vector<WorkStealingDeque *> JobSystem::deques;
+	std::atomic<bool> JobSystem::running(false);
+	std::deque<Job *> JobSystem::overflow_jobs;
+	std::mutex JobSystem::overflow_mutex;
+	std::deque<Job *> JobSystem::main_thread_jobs;
+	std::mutex JobSystem::main_thread_mutex;
+	std::atomic<int> JobSystem::queued_jobs(0);
+	std::mutex JobSystem::wake_mutex;
+	std::condition_variable JobSystem::wake;
+
+	void JobSystem::Init(int worker_count)
+	{
+		if (running)
+			return;
+		if (worker_count < 0)
+			worker_count = max(int(thread::hardware_concurrency()) - 1, 0);
+
+		main_thread = this_thread::get_id();
+		current_thread_index = 0;
+		for (int i = 0; i <= worker_count; i++)
+			deques.push_back(new WorkStealingDeque());
+
+		running = true;
+		for (int i = 1; i <= worker_count; i++)
+			workers.push_back(thread(WorkerLoop, i));
+	}
+
+	void JobSystem::Destroy()
+	{
+		if (!running)
+			return;
+
+		// Finish the remaining jobs
+		Job *job;
+		while ((job = TakeJob()) != nullptr)
+			Execute(job);
+		ExecuteMainThreadJobs();
+
+		{
+			// Under the mutex, so that no worker misses the wake-up (see WorkerLoop)
+			lock_guard<mutex> lock(wake_mutex);
+			running = false;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+
+		for (size_t i = 0; i < deques.size(); i++)
+			delete deques[i];
+		deques.clear();
+		current_thread_index = -1;
+		main_thread = thread::id();
+		queued_jobs = 0;
+	}
+
+	int JobSystem::GetWorkerCount()
+	{
+		return int(workers.size());
+	}
+
+	bool JobSystem::IsMainThread()
+	{
+		return this_thread::get_id() == main_thread;
+	}
+
+	int JobSystem::GetThreadCount()
+	{
+		return max(int(deques.size()), 1);
+	}
+
+	int JobSystem::GetThreadIndex()
+	{
+		return current_thread_index;
+	}
+
+	void JobSystem::WorkerLoop(int thread_index)
+	{
+		current_thread_index = thread_index;
+		while (running)
+		{
+			Job *job = TakeJob();
+			if (job)
+			{
+				if (!Execute(job))
+					this_thread::yield();
+				continue;
+			}
+
+			// No work, sleep until a new job is added. The counter of the jobs is changed under the mutex,
+			// so the job added after the condition was checked always wakes the worker.
+			unique_lock<mutex> lock(wake_mutex);
+			wake.wait(lock, []() { return (queued_jobs > 0) || !running; });
+		}
+	}
+
+	void JobSystem::Submit(Job *job)
+	{
+		{
+			lock_guard<mutex> lock(wake_mutex);
+			queued_jobs++;
+		}
+		const int index = current_thread_index;
+		if ((index < 0) || !deques[index]->Push(job))
+		{
+			lock_guard<mutex> lock(overflow_mutex);
+			overflow_jobs.push_back(job);
+		}
+		wake.notify_one();
+	}
+
+	Job *JobSystem::TakeJob()
+	{
+		if (queued_jobs <= 0)
+			return nullptr;
+
+		// Own jobs first, then the jobs of other threads, and finally the overflow queue
+		const int index = current_thread_index;
+		const int count = int(deques.size());
+		Job *job = (index >= 0) ? deques[index]->Pop() : nullptr;
+		for (int i = 1; !job && (i <= count); i++)
+		{
+			const int victim = (max(index, 0) + i) % count;
+			if (victim != index)
+				job = deques[victim]->Steal();
+		}
+		if (!job)
+		{
+			lock_guard<mutex> lock(overflow_mutex);
+			if (!overflow_jobs.empty())
+			{
+				job = overflow_jobs.front();
+				overflow_jobs.pop_front();
+			}
+		}
+
+		if (job)
+			queued_jobs--;
+		return job;
+	}
+
+	bool JobSystem::Execute(Job *job)
+	{
+		if (job->dependency && !job->dependency->IsFinished())
+		{
+			// Put the job at the end of the overflow queue, so that the other jobs (including the dependency) go first
+			{
+				lock_guard<mutex> lock(wake_mutex);
+				queued_jobs++;
+			}
+			{
+				lock_guard<mutex> lock(overflow_mutex);
+				overflow_jobs.push_back(job);
+			}
+			return false;
+		}
+
+		job->function();
+		if (job->counter)
+			job->counter->count.fetch_sub(1, memory_order_release);
+		delete job;
+		return true;
+	}
+
+	void JobSystem::Run(const std::function<void()> &function, JobCounter *counter, const JobCounter *dependency)
+	{
+		if (!running)
+		{
+			// The job system is not initialized, execute the job immediately (its dependency must be finished too)
+			function();
+			return;
+		}
+
+		Job *job = new Job;
+		job->function = function;
+		job->counter = counter;
+		job->dependency = dependency;
+		if (counter)
+			counter->count.fetch_add(1, memory_order_relaxed);
+		Submit(job);
+	}
+
+	void JobSystem::RunOnMainThread(const std::function<void()> &function, JobCounter *counter)
+	{
+		if (!running)
+		{
+			function();
+			return;
+		}
+
+		Job *job = new Job;
+		job->function = function;
+		job->counter = counter;
+		job->dependency = nullptr;
+		if (counter)
+			counter->count.fetch_add(1, memory_order_relaxed);
+		lock_guard<mutex> lock(main_thread_mutex);
+		main_thread_jobs.push_back(job);
+	}
+
+	void JobSystem::Wait(const JobCounter *counter)
+	{
+		const bool is_main_thread = IsMainThread();
+		while (!counter->IsFinished())
+		{
+			// The jobs we wait for may need the main thread
+			if (is_main_thread)
+				ExecuteMainThreadJobs();
+
+			Job *job = TakeJob();
+			if (!job || !Execute(job))
+				this_thread::yield();
+		}
+	}
+
+	void JobSystem::SplitRange(int begin, int end, int grain_size, const std::shared_ptr<const std::function<void(int, int)> > &function, JobCounter *counter)
+	{
+		// The right halves are added as jobs, so that the idle threads steal large parts of the range
+		while (end - begin > grain_size)
+		{
+			const int middle = begin + (end - begin) / 2;
+			const int right_end = end;
+			Run([=]() { SplitRange(middle, right_end, grain_size, function, counter); }, counter);
+			end = middle;
+		}
+		(*function)(begin, end);
+	}
+
+	void JobSystem::ParallelFor(int begin, int end, int grain_size, const std::function<void(int, int)> &function)
+	{
+		if (begin >= end)
+			return;
+
+		JobCounter counter;
+		SplitRange(begin, end, max(grain_size, 1), make_shared<const std::function<void(int, int)> >(function), &counter);
+		Wait(&counter);
+	}
+
+	void JobSystem::ParallelForAsync(int begin, int end, int grain_size, const std::function<void(int, int)> &function, JobCounter *counter)
+	{
+		if (begin >= end)
+			return;
+
+		std::shared_ptr<const std::function<void(int, int)> > shared_function = make_shared<const std::function<void(int, int)> >(function);
+		grain_size = max(grain_size, 1);
+		Run([=]() { SplitRange(begin, end, grain_size, shared_function, counter); }, counter);
+	}
+
+	void JobSystem::ExecuteMainThreadJobs()
+	{
+		// The jobs may add new main thread jobs, these are executed next time
+		std::deque<Job *> jobs;
+		{
+			lock_guard<mutex> lock(main_thread_mutex);
+			jobs.swap(main_thread_jobs);
+		}
+		for (size_t i = 0; i < jobs.size(); i++)
+			Execute(jobs[i]);
+	}
+
+}
@@ -0,0 +1,183 @@
+#pragma once
+#ifndef INCLUDED_PV227_JOBS_H
+#define INCLUDED_PV227_JOBS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// This file contains a job system that distributes CPU work among several worker threads.
+//
+// Each thread of the job system (the main thread and the workers) has its own deque of jobs. A thread takes
+// the jobs from the bottom of its own deque, and when the deque is empty, it steals the jobs from the top of
+// the deques of the other threads. The deques are lock-free (Chase-Lev deques), only the overflow queue
+// (used when a deque is full, or when a job is added from a thread that is not in the job system) and the queue
+// of the main thread jobs use a mutex.
+//
+// The jobs are tracked by counters: the counter is incremented when a job is added, and decremented when the job
+// finishes, so that a thread can wait for a group of jobs, and a job can depend on the jobs of another counter.
+// A thread that waits for a counter executes other jobs in the meantime.
+//
+// OpenGL may be called only from the main thread, therefore the jobs that call OpenGL must be added with
+// RunOnMainThread, and they are executed in ExecuteMainThreadJobs (or when the main thread waits for a counter).
+//
+// Example of how to use this class:
+//		// 1) In init function, start the worker threads (one fewer than the number of cores by default)
+//		JobSystem::Init();
+//		// 2) Process an array in parallel, the function gets the ranges of at most 256 elements
+//		JobSystem::ParallelFor(0, count, 256, [&](int begin, int end) { for (int i = begin; i < end; i++) ... });
+//		// 3) Or run several jobs, and continue with a job that depends on them
+//		JobCounter loaded, finished;
+//		JobSystem::Run([]() { ... }, &loaded);
+//		JobSystem::Run([]() { ... }, &loaded);
+//		JobSystem::Run([]() { ... }, &finished, &loaded);
+//		JobSystem::Wait(&finished);
+//		// 4) In display function, execute the jobs that call OpenGL
+//		JobSystem::ExecuteMainThreadJobs();
+//		// 5) At the end, stop the worker threads
+//		JobSystem::Destroy();
+
+namespace PV227
+{
+
+	//------------------------
+	//----    JOB DATA    ----
+	//------------------------
+
+	/// JobCounter counts the jobs that were added with it and have not finished yet.
+	class JobCounter
+	{
+	private:
+		std::atomic<int> count;
+
+		friend class JobSystem;
+
+		JobCounter(const JobCounter &);
+		JobCounter &operator=(const JobCounter &);
+
+	public:
+		JobCounter(): count(0) {}
+
+		/// Returns true if all jobs of the counter have finished
+		bool IsFinished() const { return count.load(std::memory_order_acquire) == 0; }
+		/// Returns the number of the jobs that have not finished yet
+		int GetCount() const { return count.load(std::memory_order_acquire); }
+	};
+
+	/// Job is one piece of work for the job system.
+	struct Job
+	{
+		std::function<void()> function;		// Work to do
+		JobCounter *counter;				// Counter decremented when the job finishes, or nullptr
+		const JobCounter *dependency;		// Counter that must be finished before the job starts, or nullptr
+	};
+
+	/// WorkStealingDeque is a lock-free deque of jobs (D. Chase, Y. Lev, Dynamic Circular Work-Stealing Deque, 2005,
+	/// with the memory ordering of N. M. Le et al., Correct and Efficient Work-Stealing for Weak Memory Models, 2013).
+	///
+	/// Only the thread that owns the deque may call Push and Pop, any thread may call Steal.
+	class WorkStealingDeque
+	{
+	private:
+		/// Maximum number of the jobs in the deque, a power of two
+		static const int64_t Capacity = 4096;
+
+		std::atomic<int64_t> top;
+		std::atomic<int64_t> bottom;
+		std::atomic<Job *> jobs[Capacity];
+
+	public:
+		WorkStealingDeque();
+
+		/// Adds a job to the bottom of the deque, returns false if the deque is full
+		bool Push(Job *job);
+		/// Takes a job from the bottom of the deque, returns nullptr if the deque is empty
+		Job *Pop();
+		/// Takes a job from the top of the deque, returns nullptr if the deque is empty or another thread took the job
+		Job *Steal();
+	};
+
+	//--------------------------
+	//----    JOB SYSTEM    ----
+	//--------------------------
+
+	/// JobSystem executes the jobs on the worker threads and on the main thread.
+	///
+	/// Init must be called from the main thread (the thread with the OpenGL context). Until Init is called,
+	/// all jobs are executed immediately in the thread that adds them.
+	class JobSystem
+	{
+	private:
+		static std::thread::id main_thread;
+		static std::vector<std::thread> workers;
+		/// Deques of the threads, the first one is the deque of the main thread
+		static std::vector<WorkStealingDeque *> deques;
+		static std::atomic<bool> running;
+
+		/// Jobs that did not fit into the deques or were added from other threads
+		static std::deque<Job *> overflow_jobs;
+		static std::mutex overflow_mutex;
+
+		/// Jobs that must be executed on the main thread
+		static std::deque<Job *> main_thread_jobs;
+		static std::mutex main_thread_mutex;
+
+		/// The idle workers sleep on this condition variable until new jobs are added, the number of the jobs
+		/// is incremented (and 'running' cleared) under wake_mutex, so that no wake-up is missed
+		static std::atomic<int> queued_jobs;
+		static std::mutex wake_mutex;
+		static std::condition_variable wake;
+
+		/// Function of the worker threads
+		static void WorkerLoop(int thread_index);
+		/// Adds the job into the deque of the current thread (or into the overflow queue)
+		static void Submit(Job *job);
+		/// Takes a job from the deque of the current thread, or steals a job from another thread
+		static Job *TakeJob();
+		/// Executes the job, returns false if its dependency has not finished and the job was added again
+		static bool Execute(Job *job);
+		/// Splits the range in halves until it is not larger than 'grain_size', adds jobs for the right halves, and calls
+		/// the function with the remaining left part
+		static void SplitRange(int begin, int end, int grain_size, const std::shared_ptr<const std::function<void(int, int)> > &function, JobCounter *counter);
+
+	public:
+		/// Starts the worker threads, -1 uses one fewer worker than the number of hardware threads
+		static void Init(int worker_count = -1);
+		/// Executes the remaining jobs and stops the worker threads
+		static void Destroy();
+		/// Returns the number of the worker threads (without the main thread)
+		static int GetWorkerCount();
+		/// Returns true if the current thread is the main thread (the thread that called Init)
+		static bool IsMainThread();
+		/// Returns the number of the threads of the job system, i.e. the workers and the main thread (1 before Init)
+		static int GetThreadCount();
+		/// Returns the index of the current thread in [0, GetThreadCount()), 0 is the main thread, -1 for other threads (and before Init)
+		static int GetThreadIndex();
+
+		/// Adds a job. If 'counter' is not nullptr, it is incremented now and decremented when the job finishes.
+		/// If 'dependency' is not nullptr, the job does not start until all jobs of the dependency finish.
+		static void Run(const std::function<void()> &function, JobCounter *counter = nullptr, const JobCounter *dependency = nullptr);
+		/// Adds a job that is executed on the main thread, e.g. a job that calls OpenGL
+		static void RunOnMainThread(const std::function<void()> &function, JobCounter *counter = nullptr);
+		/// Executes the jobs of the current thread and of the other threads until all jobs of the counter finish
+		static void Wait(const JobCounter *counter);
+
+		/// Calls 'function' with consecutive subranges of [begin, end) in parallel, the subranges have at most 'grain_size'
+		/// elements (and more than a half of it, unless the whole range is smaller). Returns when the whole range is processed.
+		static void ParallelFor(int begin, int end, int grain_size, const std::function<void(int, int)> &function);
+		/// Same as ParallelFor, but returns immediately, wait for 'counter' to find out when the range is processed
+		static void ParallelForAsync(int begin, int end, int grain_size, const std::function<void(int, int)> &function, JobCounter *counter);
+
+		/// Executes all jobs added with RunOnMainThread, must be called from the main thread
+		static void ExecuteMainThreadJobs();
+	};
+
+}
+
+#endif	// INCLUDED_PV227_JOBS_H
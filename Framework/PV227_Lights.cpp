@@ -0,0 +1,338 @@
+#include "PV227_Lights.h"
+#include "PV227_Scene.h"
+
+#include <algorithm>
+#include <cfloat>
+
+// SSE is used to test four lights (i.e. one leaf of the hierarchy) at once, if it is available
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define PV227_LIGHTS_USE_SSE
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace PV227
+{
+
+	//----------------------------
+	//----    LIGHT SYSTEM    ----
+	//----------------------------
+
+	static_assert(LightSystem::LeafSize == 4, "The SIMD tests expect four lights in a leaf");
+
+	/// Tests four spheres against the planes of a frustum (the normals point inside), returns a bit mask of the spheres which are (partially) inside
+	static int TestSpheresFrustum(const float *x, const float *y, const float *z, const float *r, const glm::vec4 *planes)
+	{
+#ifdef PV227_LIGHTS_USE_SSE
+		__m128 px = _mm_loadu_ps(x);
+		__m128 py = _mm_loadu_ps(y);
+		__m128 pz = _mm_loadu_ps(z);
+		__m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(r));
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 dist = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p].x), px), _mm_mul_ps(_mm_set1_ps(planes[p].y), py)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p].z), pz), _mm_set1_ps(planes[p].w)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, neg_r));
+		}
+		return _mm_movemask_ps(inside);
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			bool inside = true;
+			for (int p = 0; (p < 6) && inside; p++)
+				inside = (planes[p].x * x[i] + planes[p].y * y[i] + planes[p].z * z[i] + planes[p].w >= -r[i]);
+			if (inside)
+				mask |= (1 << i);
+		}
+		return mask;
+#endif
+	}
+
+	/// Tests four spheres against an axis-aligned box, returns a bit mask of the spheres which intersect it
+	static int TestSpheresBox(const float *x, const float *y, const float *z, const float *r, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max)
+	{
+#ifdef PV227_LIGHTS_USE_SSE
+		__m128 px = _mm_loadu_ps(x);
+		__m128 py = _mm_loadu_ps(y);
+		__m128 pz = _mm_loadu_ps(z);
+		__m128 pr = _mm_loadu_ps(r);
+		__m128 dx = _mm_sub_ps(_mm_max_ps(_mm_min_ps(px, _mm_set1_ps(bounds_max.x)), _mm_set1_ps(bounds_min.x)), px);
+		__m128 dy = _mm_sub_ps(_mm_max_ps(_mm_min_ps(py, _mm_set1_ps(bounds_max.y)), _mm_set1_ps(bounds_min.y)), py);
+		__m128 dz = _mm_sub_ps(_mm_max_ps(_mm_min_ps(pz, _mm_set1_ps(bounds_max.z)), _mm_set1_ps(bounds_min.z)), pz);
+		__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		return _mm_movemask_ps(_mm_cmple_ps(dist2, _mm_mul_ps(pr, pr)));
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			float dx = std::max(std::min(x[i], bounds_max.x), bounds_min.x) - x[i];
+			float dy = std::max(std::min(y[i], bounds_max.y), bounds_min.y) - y[i];
+			float dz = std::max(std::min(z[i], bounds_max.z), bounds_min.z) - z[i];
+			if (dx * dx + dy * dy + dz * dz <= r[i] * r[i])
+				mask |= (1 << i);
+		}
+		return mask;
+#endif
+	}
+
+	LightSystem::LightSystem(): cutoff(1.0f / 256.0f)
+	{
+	}
+
+	void LightSystem::Clear()
+	{
+		lights.clear();
+		pos_x.clear();
+		pos_y.clear();
+		pos_z.clear();
+		radius.clear();
+		nodes.clear();
+		bvh_x.clear();
+		bvh_y.clear();
+		bvh_z.clear();
+		bvh_r.clear();
+		bvh_index.clear();
+		unbounded.clear();
+		visible.clear();
+		uploaded_index.clear();
+	}
+
+	size_t LightSystem::AddLight(const PhongLight &light)
+	{
+		lights.push_back(light);
+		pos_x.push_back(light.position.x);
+		pos_y.push_back(light.position.y);
+		pos_z.push_back(light.position.z);
+		radius.push_back(ComputeInfluenceRadius(light, cutoff));
+		return lights.size() - 1;
+	}
+
+	void LightSystem::SetLight(size_t index, const PhongLight &light)
+	{
+		lights[index] = light;
+		pos_x[index] = light.position.x;
+		pos_y[index] = light.position.y;
+		pos_z[index] = light.position.z;
+		radius[index] = ComputeInfluenceRadius(light, cutoff);
+	}
+
+	const PhongLight &LightSystem::GetLight(size_t index) const
+	{
+		return lights[index];
+	}
+
+	size_t LightSystem::GetLightCount() const
+	{
+		return lights.size();
+	}
+
+	void LightSystem::SetCutoff(float cutoff)
+	{
+		this->cutoff = cutoff;
+		for (size_t i = 0; i < lights.size(); i++)
+			radius[i] = ComputeInfluenceRadius(lights[i], cutoff);
+	}
+
+	float LightSystem::ComputeInfluenceRadius(const PhongLight &light, float cutoff)
+	{
+		// Spot lights use the radius of a point light, i.e. their cone is not taken into account
+		if (light.position.w == 0.0f)
+			return -1.0f;
+		float intensity = std::max(std::max(light.ambient.r, light.ambient.g), light.ambient.b);
+		intensity = std::max(intensity, std::max(std::max(light.diffuse.r, light.diffuse.g), light.diffuse.b));
+		intensity = std::max(intensity, std::max(std::max(light.specular.r, light.specular.g), light.specular.b));
+
+		// Solve atten_constant + atten_linear * d + atten_quadratic * d^2 = intensity / cutoff
+		float c = light.atten_constant - intensity / cutoff;
+		if (c >= 0.0f)
+			return 0.0f;
+		if (light.atten_quadratic > 0.0f)
+			return (-light.atten_linear + sqrtf(light.atten_linear * light.atten_linear - 4.0f * light.atten_quadratic * c)) / (2.0f * light.atten_quadratic);
+		if (light.atten_linear > 0.0f)
+			return -c / light.atten_linear;
+		return -1.0f;
+	}
+
+	void LightSystem::BuildBVH()
+	{
+		nodes.clear();
+		bvh_x.clear();
+		bvh_y.clear();
+		bvh_z.clear();
+		bvh_r.clear();
+		bvh_index.clear();
+		unbounded.clear();
+
+		std::vector<int> order;
+		order.reserve(lights.size());
+		for (int i = 0; i < int(lights.size()); i++)
+		{
+			if (radius[i] < 0.0f)
+				unbounded.push_back(i);
+			else
+				order.push_back(i);
+		}
+
+		if (!order.empty())
+		{
+			nodes.reserve(2 * (order.size() / LeafSize + 1));
+			BuildNode(order, 0, int(order.size()));
+		}
+	}
+
+	int LightSystem::BuildNode(std::vector<int> &order, int first, int count)
+	{
+		int node_idx = int(nodes.size());
+		nodes.push_back(BVHNode());
+
+		// Bounds of the spheres and of their centers
+		glm::vec3 bounds_min(FLT_MAX), bounds_max(-FLT_MAX);
+		glm::vec3 centers_min(FLT_MAX), centers_max(-FLT_MAX);
+		for (int i = first; i < first + count; i++)
+		{
+			int l = order[i];
+			glm::vec3 center(pos_x[l], pos_y[l], pos_z[l]);
+			bounds_min = glm::min(bounds_min, center - radius[l]);
+			bounds_max = glm::max(bounds_max, center + radius[l]);
+			centers_min = glm::min(centers_min, center);
+			centers_max = glm::max(centers_max, center);
+		}
+		nodes[node_idx].bounds_min = bounds_min;
+		nodes[node_idx].bounds_max = bounds_max;
+
+		if (count <= LeafSize)
+		{
+			// Create a leaf, fill the unused slots so that the SIMD tests can always process whole leaves
+			nodes[node_idx].first = int(bvh_index.size());
+			nodes[node_idx].count = count;
+			for (int i = 0; i < LeafSize; i++)
+			{
+				int l = (i < count) ? order[first + i] : -1;
+				bvh_x.push_back((l >= 0) ? pos_x[l] : 0.0f);
+				bvh_y.push_back((l >= 0) ? pos_y[l] : 0.0f);
+				bvh_z.push_back((l >= 0) ? pos_z[l] : 0.0f);
+				bvh_r.push_back((l >= 0) ? radius[l] : 0.0f);
+				bvh_index.push_back(l);
+			}
+			return node_idx;
+		}
+
+		// Split at the median of the longest axis of the centers
+		glm::vec3 extent = centers_max - centers_min;
+		int axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+		const std::vector<float> &coords = (axis == 0) ? pos_x : ((axis == 1) ? pos_y : pos_z);
+		int half = count / 2;
+		std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+			[&coords](int a, int b) { return coords[a] < coords[b]; });
+
+		BuildNode(order, first, half);
+		int right = BuildNode(order, first + half, count - half);
+		nodes[node_idx].first = right;
+		nodes[node_idx].count = 0;
+		return node_idx;
+	}
+
+	void LightSystem::CullFrustum(const glm::mat4 &view_projection)
+	{
+		glm::vec4 planes[6];
+		ExtractFrustumPlanes(view_projection, planes);
+
+		visible.assign(unbounded.begin(), unbounded.end());
+
+		if (!nodes.empty())
+		{
+			int stack[64];
+			int stack_size = 0;
+			stack[stack_size++] = 0;
+			while (stack_size > 0)
+			{
+				int node_idx = stack[--stack_size];
+				const BVHNode &node = nodes[node_idx];
+				if (!TestBoxFrustum(node.bounds_min, node.bounds_max, planes))
+					continue;
+				if (node.count > 0)
+				{
+					int mask = TestSpheresFrustum(&bvh_x[node.first], &bvh_y[node.first], &bvh_z[node.first], &bvh_r[node.first], planes);
+					mask &= (1 << node.count) - 1;
+					for (int i = 0; i < node.count; i++)
+						if (mask & (1 << i))
+							visible.push_back(bvh_index[node.first + i]);
+				}
+				else
+				{
+					stack[stack_size++] = node.first;
+					stack[stack_size++] = node_idx + 1;
+				}
+			}
+		}
+
+		// Keep the order in which the lights were added
+		std::sort(visible.begin(), visible.end());
+
+		uploaded_index.assign(lights.size(), -1);
+		for (size_t i = 0; i < visible.size(); i++)
+			uploaded_index[visible[i]] = int(i);
+	}
+
+	const std::vector<int> &LightSystem::GetVisibleLights() const
+	{
+		return visible;
+	}
+
+	void LightSystem::GetVisibleLightData(std::vector<PhongLight> &light_data) const
+	{
+		light_data.resize(visible.size());
+		for (size_t i = 0; i < visible.size(); i++)
+			light_data[i] = lights[visible[i]];
+	}
+
+	void LightSystem::UploadVisibleLights(PhongLightsData_UBO &lights_ubo) const
+	{
+		GetVisibleLightData(lights_ubo.PhongLights);
+		lights_ubo.UpdateOpenGLData();
+	}
+
+	void LightSystem::GetLightsForBounds(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, std::vector<int> &light_list) const
+	{
+		light_list.clear();
+		if (uploaded_index.size() != lights.size())		// CullFrustum was not called yet
+			return;
+		for (int l : unbounded)
+			if (uploaded_index[l] >= 0)
+				light_list.push_back(uploaded_index[l]);
+
+		if (!nodes.empty())
+		{
+			int stack[64];
+			int stack_size = 0;
+			stack[stack_size++] = 0;
+			while (stack_size > 0)
+			{
+				int node_idx = stack[--stack_size];
+				const BVHNode &node = nodes[node_idx];
+				if (glm::any(glm::lessThan(node.bounds_max, bounds_min)) || glm::any(glm::greaterThan(node.bounds_min, bounds_max)))
+					continue;
+				if (node.count > 0)
+				{
+					int mask = TestSpheresBox(&bvh_x[node.first], &bvh_y[node.first], &bvh_z[node.first], &bvh_r[node.first], bounds_min, bounds_max);
+					mask &= (1 << node.count) - 1;
+					for (int i = 0; i < node.count; i++)
+						if ((mask & (1 << i)) && (uploaded_index[bvh_index[node.first + i]] >= 0))
+							light_list.push_back(uploaded_index[bvh_index[node.first + i]]);
+				}
+				else
+				{
+					stack[stack_size++] = node.first;
+					stack[stack_size++] = node_idx + 1;
+				}
+			}
+		}
+
+		std::sort(light_list.begin(), light_list.end());
+	}
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+#ifndef INCLUDED_PV227_LIGHTS_H
+#define INCLUDED_PV227_LIGHTS_H
+
+#include "PV227_UBOs.h"
+
+// This file contains a CPU-side storage of lights that decides which lights affect the rendered frame.
+//
+// The lights are kept in a structure of arrays (positions and radii of their influence are in separate
+// arrays from the rest of the data), a bounding volume hierarchy is built over them, and the lights are
+// culled against the view frustum and against the bounds of objects. Only the lights that passed
+// the culling are copied into PhongLightsData_UBO.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		LightSystem Lights;
+//		// 2) In update function, fill the lights, build the hierarchy, cull, and upload the visible lights
+//		Lights.Clear();
+//		Lights.AddLight(PhongLight::CreatePointLight(...));
+//		Lights.BuildBVH();
+//		Lights.CullFrustum(projection_matrix * view_matrix);
+//		Lights.UploadVisibleLights(PhongLights_ubo);
+//		// 3) Optionally, get the lists of lights of objects that are rendered with forward shading
+//		Lights.GetLightsForBounds(bounds_min, bounds_max, light_list);
+
+namespace PV227
+{
+
+	//----------------------------
+	//----    LIGHT SYSTEM    ----
+	//----------------------------
+
+	/// LightSystem contains the lights of the scene and culls them.
+	///
+	/// Directional lights, and lights whose intensity never drops below the cutoff, are never culled.
+	/// The visible lights are uploaded in the same order in which they were added, so e.g. the light
+	/// that casts shadows may be added first and it stays the first one in the uploaded data.
+	class LightSystem
+	{
+	private:
+		// Lights in a structure of arrays, in the order in which they were added
+		std::vector<PhongLight> lights;			// All data of the lights, used only when uploading
+		std::vector<float> pos_x;				// Position of the light in world space
+		std::vector<float> pos_y;
+		std::vector<float> pos_z;
+		std::vector<float> radius;				// Radius of the light's influence, negative for lights that are never culled
+
+		/// Node of the bounding volume hierarchy
+		struct BVHNode
+		{
+			glm::vec3 bounds_min;				// Bounding box of all lights in the subtree
+			glm::vec3 bounds_max;
+			int first;							// Inner nodes: index of the right child (the left one follows the node), leaves: first slot in bvh_* arrays
+			int count;							// Zero for inner nodes, number of lights for leaves
+		};
+		std::vector<BVHNode> nodes;
+		// Lights in the order of the leaves of the hierarchy, each leaf has LeafSize slots (unused slots have bvh_index -1)
+		std::vector<float> bvh_x;
+		std::vector<float> bvh_y;
+		std::vector<float> bvh_z;
+		std::vector<float> bvh_r;
+		std::vector<int> bvh_index;
+		// Lights that are never culled
+		std::vector<int> unbounded;
+
+		// Result of the frustum culling - indices of visible lights (sorted), and the index of each light in the uploaded data (or -1)
+		std::vector<int> visible;
+		std::vector<int> uploaded_index;
+
+		/// Intensity below which the lights are ignored
+		float cutoff;
+
+		/// Builds the subtree over bvh_index[first, first + count), returns the index of its root node
+		int BuildNode(std::vector<int> &order, int first, int count);
+
+	public:
+		/// Maximum number of lights in one leaf of the hierarchy
+		static const int LeafSize = 4;
+
+		LightSystem();
+
+		/// Removes all lights
+		void Clear();
+		/// Adds a light, returns its index
+		size_t AddLight(const PhongLight &light);
+		/// Changes the data of an existing light (BuildBVH must be called afterwards)
+		void SetLight(size_t index, const PhongLight &light);
+		/// Returns the data of a light
+		const PhongLight &GetLight(size_t index) const;
+		/// Returns the number of all lights
+		size_t GetLightCount() const;
+
+		/// Sets the intensity below which the lights are ignored, it defines the radii of the lights
+		void SetCutoff(float cutoff);
+		/// Returns the distance in which the attenuated intensity of the light drops below the cutoff,
+		/// or a negative value if it never does (directional lights, no attenuation)
+		static float ComputeInfluenceRadius(const PhongLight &light, float cutoff);
+
+		/// Builds the bounding volume hierarchy over all lights. Call it after the lights changed.
+		void BuildBVH();
+
+		/// Finds the lights whose influence intersects the view frustum given by its view-projection matrix
+		void CullFrustum(const glm::mat4 &view_projection);
+		/// Returns the indices of the lights that passed the frustum culling, in the order in which they were added
+		const std::vector<int> &GetVisibleLights() const;
+		/// Copies the data of the visible lights into the list, in the same order as UploadVisibleLights (it does not call OpenGL)
+		void GetVisibleLightData(std::vector<PhongLight> &light_data) const;
+		/// Copies the visible lights into the buffer with the lights (and updates its OpenGL data)
+		void UploadVisibleLights(PhongLightsData_UBO &lights_ubo) const;
+
+		/// Fills the list with indices (into the uploaded data) of the visible lights which affect the given axis-aligned box
+		void GetLightsForBounds(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, std::vector<int> &light_list) const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_LIGHTS_H
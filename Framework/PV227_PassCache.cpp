@@ -0,0 +1,63 @@
+#include "PV227_PassCache.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//--------------------------
+	//----    PASS CACHE    ----
+	//--------------------------
+
+	PassCache::PassCache(): valid(false), remaining_frames(0), output_version(0), run_count(0), skip_count(0)
+	{
+	}
+
+	bool PassCache::NeedsToRun(std::initializer_list<uint64_t> versions, int settle_frames)
+	{
+		const bool changed = !valid || (input_versions.size() != versions.size()) ||
+			!std::equal(versions.begin(), versions.end(), input_versions.begin());
+		if (changed)
+		{
+			input_versions.assign(versions.begin(), versions.end());
+			valid = true;
+			remaining_frames = settle_frames;
+		}
+		else if (remaining_frames > 0)
+		{
+			remaining_frames--;
+		}
+		else
+		{
+			skip_count++;
+			return false;
+		}
+
+		output_version++;
+		run_count++;
+		return true;
+	}
+
+	void PassCache::Invalidate()
+	{
+		valid = false;
+	}
+
+	uint64_t PassCache::GetOutputVersion() const
+	{
+		return output_version;
+	}
+
+	unsigned int PassCache::GetRunCount() const
+	{
+		return run_count;
+	}
+
+	unsigned int PassCache::GetSkipCount() const
+	{
+		return skip_count;
+	}
+
+}
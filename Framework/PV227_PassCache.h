@@ -0,0 +1,67 @@
+#pragma once
+#ifndef INCLUDED_PV227_PASS_CACHE_H
+#define INCLUDED_PV227_PASS_CACHE_H
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// This file contains the caching of the results of the render passes.
+//
+// Each input of a pass (e.g. the camera, the light, the scene, the size of the window) has a version, i.e. a number
+// the application increments whenever the input changes. The pass runs only when the version of any of its inputs
+// differs from the versions it used the last time; otherwise it is skipped and its output textures from the last run
+// are used again. Each pass has also its own output version, which changes whenever the pass runs, so the passes
+// that read the outputs of another pass use its output version as their input.
+//
+// Example of how to use this class:
+//		// 1) Define the global variables
+//		PassCache ShadowPass, LightingPass;
+//		uint64_t LightVersion = 0, SceneVersion = 0;
+//		// 2) Increment the versions when the inputs change
+//		if (light_moved)
+//			LightVersion++;
+//		// 3) Run the passes only when needed
+//		if (ShadowPass.NeedsToRun({ LightVersion, SceneVersion }))
+//			render_shadows();
+//		if (LightingPass.NeedsToRun({ ShadowPass.GetOutputVersion(), ... }))
+//			render_lighting();
+
+namespace PV227
+{
+
+	//--------------------------
+	//----    PASS CACHE    ----
+	//--------------------------
+
+	/// PassCache decides whether a render pass must run, according to the versions of its inputs.
+	class PassCache
+	{
+	private:
+		std::vector<uint64_t> input_versions;		// Versions of the inputs used in the last run
+		bool valid;									// False if the pass must run regardless of the versions
+		int remaining_frames;						// Number of the frames the pass still runs after its inputs changed
+		uint64_t output_version;
+		unsigned int run_count;
+		unsigned int skip_count;
+
+	public:
+		PassCache();
+
+		/// Returns true if the pass must run with the given versions of its inputs (they are remembered for the next call).
+		/// After the inputs change, the pass runs 'settle_frames' more frames even when they do not change
+		/// (e.g. for temporal effects that converge over several frames).
+		bool NeedsToRun(std::initializer_list<uint64_t> versions, int settle_frames = 0);
+		/// Forces the pass to run the next time, e.g. when its output textures were recreated
+		void Invalidate();
+
+		/// Returns the version of the outputs of the pass, it changes whenever the pass runs
+		uint64_t GetOutputVersion() const;
+		/// Return the number of the frames the pass ran, and was skipped
+		unsigned int GetRunCount() const;
+		unsigned int GetSkipCount() const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_PASS_CACHE_H
@@ -0,0 +1,136 @@
+#include "PV227_QualityGovernor.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//--------------------------------
+	//----    QUALITY GOVERNOR    ----
+	//--------------------------------
+
+	// With the frames twice as long as the budget (the error is -1), the quality drops from 1 to 0 in about 15 frames
+	const float QualityGovernor::ProportionalGain = 0.1f;
+	const float QualityGovernor::IntegralGain = 0.06f;
+	const float QualityGovernor::DerivativeGain = 0.02f;
+	const float QualityGovernor::DeadBand = 0.05f;
+	const float QualityGovernor::LevelMargin = 0.2f;
+
+	QualityGovernor::QualityGovernor()
+		: budget_ms(16.6f), enabled(true), quality(1.0f), last_error(0.0f), previous_error(0.0f)
+	{
+	}
+
+	void QualityGovernor::Init(float budget_ms)
+	{
+		knobs.clear();
+		SetBudget(budget_ms);
+		quality = 1.0f;
+		last_error = 0.0f;
+		previous_error = 0.0f;
+	}
+
+	void QualityGovernor::SetBudget(float budget_ms)
+	{
+		this->budget_ms = std::max(budget_ms, 0.1f);
+	}
+
+	float QualityGovernor::GetBudget() const
+	{
+		return budget_ms;
+	}
+
+	void QualityGovernor::SetEnabled(bool enabled)
+	{
+		this->enabled = enabled;
+		if (!enabled)
+		{
+			quality = 1.0f;
+			last_error = 0.0f;
+			previous_error = 0.0f;
+			for (Knob &knob : knobs)
+				knob.level = knob.level_count - 1;
+		}
+	}
+
+	bool QualityGovernor::IsEnabled() const
+	{
+		return enabled;
+	}
+
+	int QualityGovernor::AddKnob(const char *name, int level_count, float quality_min, float quality_max)
+	{
+		Knob knob;
+		knob.name = name;
+		knob.level_count = std::max(level_count, 1);
+		knob.quality_min = quality_min;
+		knob.quality_max = std::max(quality_max, quality_min + 1e-3f);
+		knob.level = knob.level_count - 1;
+		knobs.push_back(knob);
+		return int(knobs.size()) - 1;
+	}
+
+	bool QualityGovernor::Update(float gpu_time_ms)
+	{
+		if (!enabled)
+			return false;
+
+		// Positive error means there is a reserve in the budget and the quality may be raised
+		float error = std::max(std::min((budget_ms - gpu_time_ms) / budget_ms, 1.0f), -1.0f);
+		if (fabsf(error) < DeadBand)
+			error = 0.0f;
+
+		const float change = ProportionalGain * (error - last_error) + IntegralGain * error +
+			DerivativeGain * (error - 2.0f * last_error + previous_error);
+		quality = std::max(std::min(quality + change, 1.0f), 0.0f);
+		previous_error = last_error;
+		last_error = error;
+
+		return UpdateLevels();
+	}
+
+	bool QualityGovernor::UpdateLevels()
+	{
+		bool changed = false;
+		for (Knob &knob : knobs)
+		{
+			// Position of the quality within the range of the knob, in levels
+			float t = (quality - knob.quality_min) / (knob.quality_max - knob.quality_min);
+			t = std::max(std::min(t, 1.0f), 0.0f) * float(knob.level_count - 1);
+
+			// The boundary between two levels is in the middle between them, it must be crossed by LevelMargin
+			int level = knob.level;
+			if (t >= float(level) + 0.5f + LevelMargin)
+				level = int(floorf(t - LevelMargin + 0.5f));
+			else if (t <= float(level) - 0.5f - LevelMargin)
+				level = int(ceilf(t + LevelMargin - 0.5f));
+			level = std::max(std::min(level, knob.level_count - 1), 0);
+
+			if (level != knob.level)
+			{
+				knob.level = level;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	float QualityGovernor::GetQuality() const
+	{
+		return quality;
+	}
+
+	int QualityGovernor::GetLevel(int knob) const
+	{
+		return knobs[knob].level;
+	}
+
+	int QualityGovernor::GetLevelCount(int knob) const
+	{
+		return knobs[knob].level_count;
+	}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+#ifndef INCLUDED_PV227_QUALITY_GOVERNOR_H
+#define INCLUDED_PV227_QUALITY_GOVERNOR_H
+
+#include <string>
+#include <vector>
+
+// This file contains the quality governor, which adapts the quality of the rendering so that the frames fit into a GPU time budget.
+//
+// The governor keeps a single quality value from 0 (the lowest) to 1 (the highest). It is controlled by a PID controller
+// (in its velocity form, i.e. the controller computes the change of the quality) from the difference between the GPU time
+// of the frames and the budget. The knobs (e.g. the resolution, the number of samples) have discrete levels, and each
+// of them covers a part of the range of the quality, so that the knobs are lowered one after another as the quality drops.
+//
+// To avoid oscillations between two levels, the changes are damped by hysteresis: the GPU times within a dead band around
+// the budget do not change the quality, and the level of a knob changes only when the quality moves a margin past
+// the boundary between the levels.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		QualityGovernor Governor;
+//		// 2) Initialize it and add the knobs, the samples are lowered first (when the quality drops below 1),
+//		//    the resolution when the quality drops below 0.5
+//		Governor.Init(16.6f);
+//		int resolution_knob = Governor.AddKnob("Resolution", 4, 0.0f, 0.5f);
+//		int samples_knob = Governor.AddKnob("Samples", 3, 0.5f, 1.0f);
+//		// 3) Each frame, update the governor with the GPU time of the frame, and apply the levels when they changed
+//		if (Governor.Update(gpu_time_ms))
+//			set_resolution(resolutions[Governor.GetLevel(resolution_knob)]);
+
+namespace PV227
+{
+
+	//--------------------------------
+	//----    QUALITY GOVERNOR    ----
+	//--------------------------------
+
+	/// QualityGovernor chooses the levels of the quality knobs so that the frames fit into a GPU time budget.
+	class QualityGovernor
+	{
+	private:
+		struct Knob
+		{
+			std::string name;
+			int level_count;
+			float quality_min;			// The range of the quality in which the knob changes its levels
+			float quality_max;
+			int level;					// The current level, from 0 (the lowest quality) to level_count - 1
+		};
+
+		/// Gains of the PID controller, the change of the quality in one frame is computed from the errors,
+		/// i.e. from the differences between the budget and the GPU times, relative to the budget
+		static const float ProportionalGain;
+		static const float IntegralGain;
+		static const float DerivativeGain;
+		/// Relative errors smaller than this do not change the quality
+		static const float DeadBand;
+		/// Distance (in levels) the quality must move past the boundary between two levels to change the level of a knob
+		static const float LevelMargin;
+
+		std::vector<Knob> knobs;
+		float budget_ms;
+		bool enabled;
+		float quality;
+		float last_error;				// The errors of the last two updates
+		float previous_error;
+
+		/// Updates the levels of the knobs from the quality, returns true if any of them changed
+		bool UpdateLevels();
+
+	public:
+		QualityGovernor();
+
+		/// Initializes the governor with the GPU time budget of one frame in milliseconds
+		void Init(float budget_ms);
+
+		/// Sets the GPU time budget of one frame in milliseconds
+		void SetBudget(float budget_ms);
+		float GetBudget() const;
+		/// Turns the governor on or off, when it is off, all knobs are at their highest levels
+		void SetEnabled(bool enabled);
+		bool IsEnabled() const;
+
+		/// Adds a knob with the given number of levels, which covers the given range of the quality. Returns the index of the knob.
+		/// The knob starts at its highest level.
+		int AddKnob(const char *name, int level_count, float quality_min, float quality_max);
+
+		/// Updates the quality from the GPU time of a frame, returns true if the level of any knob changed
+		bool Update(float gpu_time_ms);
+
+		/// Returns the quality, from 0 (the lowest) to 1 (the highest)
+		float GetQuality() const;
+		/// Returns the current level of a knob, from 0 (the lowest quality) to GetLevelCount(knob) - 1
+		int GetLevel(int knob) const;
+		int GetLevelCount(int knob) const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_QUALITY_GOVERNOR_H
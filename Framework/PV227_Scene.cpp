@@ -0,0 +1,255 @@
+#include "PV227_Scene.h"
+
+using namespace std;
+
+namespace PV227
+{
+
+	//-----------------------------
+	//----    SCENE STORAGE    ----
+	//-----------------------------
+
+	void SceneStore::Clear()
+	{
+		geometry_id.clear();
+		material_id.clear();
+		program_id.clear();
+		texture.clear();
+		transform_id.clear();
+		bounds_min.clear();
+		bounds_max.clear();
+		flags.clear();
+		object_slot.clear();
+
+		// Keep the generations, so that the old handles stay invalid
+		free_slots.clear();
+		for (int slot = int(slot_object.size()) - 1; slot >= 0; slot--)
+		{
+			if (slot_object[slot] >= 0)
+				slot_generation[slot]++;
+			slot_object[slot] = -1;
+			free_slots.push_back(slot);
+		}
+	}
+
+	SceneStore::Handle SceneStore::Add(int geometry_id, int material_id, int program_id, GLuint texture, int transform_id, unsigned int flags)
+	{
+		Handle handle;
+		if (free_slots.empty())
+		{
+			handle.slot = int(slot_object.size());
+			slot_object.push_back(-1);
+			slot_generation.push_back(1);
+		}
+		else
+		{
+			handle.slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		handle.generation = slot_generation[handle.slot];
+
+		slot_object[handle.slot] = int(this->geometry_id.size());
+		this->geometry_id.push_back(geometry_id);
+		this->material_id.push_back(material_id);
+		this->program_id.push_back(program_id);
+		this->texture.push_back(texture);
+		this->transform_id.push_back(transform_id);
+		bounds_min.push_back(glm::vec3(0.0f));
+		bounds_max.push_back(glm::vec3(0.0f));
+		this->flags.push_back(flags);
+		object_slot.push_back(handle.slot);
+		return handle;
+	}
+
+	bool SceneStore::Remove(Handle handle)
+	{
+		const int idx = GetIndex(handle);
+		if (idx < 0)
+			return false;
+
+		// Move the last object to the place of the removed one
+		const int last = int(geometry_id.size()) - 1;
+		if (idx != last)
+		{
+			geometry_id[idx] = geometry_id[last];
+			material_id[idx] = material_id[last];
+			program_id[idx] = program_id[last];
+			texture[idx] = texture[last];
+			transform_id[idx] = transform_id[last];
+			bounds_min[idx] = bounds_min[last];
+			bounds_max[idx] = bounds_max[last];
+			flags[idx] = flags[last];
+			object_slot[idx] = object_slot[last];
+			slot_object[object_slot[idx]] = idx;
+		}
+		geometry_id.pop_back();
+		material_id.pop_back();
+		program_id.pop_back();
+		texture.pop_back();
+		transform_id.pop_back();
+		bounds_min.pop_back();
+		bounds_max.pop_back();
+		flags.pop_back();
+		object_slot.pop_back();
+
+		// Free the slot, the new generation invalidates all existing handles of the slot
+		slot_object[handle.slot] = -1;
+		slot_generation[handle.slot]++;
+		free_slots.push_back(handle.slot);
+		return true;
+	}
+
+	bool SceneStore::IsValid(Handle handle) const
+	{
+		return GetIndex(handle) >= 0;
+	}
+
+	int SceneStore::GetIndex(Handle handle) const
+	{
+		if ((handle.slot < 0) || (handle.slot >= int(slot_object.size())) || (slot_generation[handle.slot] != handle.generation))
+			return -1;
+		return slot_object[handle.slot];
+	}
+
+	void SceneStore::SetGeometry(Handle handle, int geometry_id)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->geometry_id[idx] = geometry_id;
+	}
+
+	void SceneStore::SetMaterial(Handle handle, int material_id)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->material_id[idx] = material_id;
+	}
+
+	void SceneStore::SetProgram(Handle handle, int program_id)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->program_id[idx] = program_id;
+	}
+
+	void SceneStore::SetTexture(Handle handle, GLuint texture)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->texture[idx] = texture;
+	}
+
+	void SceneStore::SetTransform(Handle handle, int transform_id)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->transform_id[idx] = transform_id;
+	}
+
+	void SceneStore::SetFlags(Handle handle, unsigned int flags)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+			this->flags[idx] = flags;
+	}
+
+	void SceneStore::SetBounds(Handle handle, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max)
+	{
+		const int idx = GetIndex(handle);
+		if (idx >= 0)
+		{
+			this->bounds_min[idx] = bounds_min;
+			this->bounds_max[idx] = bounds_max;
+		}
+	}
+
+	size_t SceneStore::GetCount() const
+	{
+		return geometry_id.size();
+	}
+
+	const int *SceneStore::GetGeometryIds() const
+	{
+		return geometry_id.data();
+	}
+
+	const int *SceneStore::GetMaterialIds() const
+	{
+		return material_id.data();
+	}
+
+	const int *SceneStore::GetProgramIds() const
+	{
+		return program_id.data();
+	}
+
+	const GLuint *SceneStore::GetTextures() const
+	{
+		return texture.data();
+	}
+
+	const int *SceneStore::GetTransformIds() const
+	{
+		return transform_id.data();
+	}
+
+	const glm::vec3 *SceneStore::GetBoundsMin() const
+	{
+		return bounds_min.data();
+	}
+
+	const glm::vec3 *SceneStore::GetBoundsMax() const
+	{
+		return bounds_max.data();
+	}
+
+	const unsigned int *SceneStore::GetFlags() const
+	{
+		return flags.data();
+	}
+
+	void TransformBounds(const glm::mat4 &matrix, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, glm::vec3 &out_min, glm::vec3 &out_max)
+	{
+		// Each column of the matrix contributes with the smaller (to min) and the larger (to max) of its two products
+		// with the box (J. Arvo, Transforming Axis-Aligned Bounding Boxes, Graphics Gems, 1990)
+		out_min = out_max = glm::vec3(matrix[3]);
+		for (int col = 0; col < 3; col++)
+		{
+			const glm::vec3 a = glm::vec3(matrix[col]) * bounds_min[col];
+			const glm::vec3 b = glm::vec3(matrix[col]) * bounds_max[col];
+			out_min += glm::min(a, b);
+			out_max += glm::max(a, b);
+		}
+	}
+
+	void ExtractFrustumPlanes(const glm::mat4 &view_projection, glm::vec4 planes[6])
+	{
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++)
+			rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+		planes[0] = rows[3] + rows[0];
+		planes[1] = rows[3] - rows[0];
+		planes[2] = rows[3] + rows[1];
+		planes[3] = rows[3] - rows[1];
+		planes[4] = rows[3] + rows[2];
+		planes[5] = rows[3] - rows[2];
+		for (int p = 0; p < 6; p++)
+			planes[p] /= glm::length(glm::vec3(planes[p]));
+	}
+
+	bool TestBoxFrustum(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, const glm::vec4 *planes)
+	{
+		for (int p = 0; p < 6; p++)
+		{
+			// The corner of the box that is the farthest in the direction of the normal
+			glm::vec3 corner(
+				(planes[p].x >= 0.0f) ? bounds_max.x : bounds_min.x,
+				(planes[p].y >= 0.0f) ? bounds_max.y : bounds_min.y,
+				(planes[p].z >= 0.0f) ? bounds_max.z : bounds_min.z);
+			if (glm::dot(glm::vec3(planes[p]), corner) + planes[p].w < 0.0f)
+				return false;
+		}
+		return true;
+	}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef INCLUDED_PV227_SCENE_H
+#define INCLUDED_PV227_SCENE_H
+
+#include "PV227_Basics.h"
+
+#include <cstdint>
+
+// This file contains a storage of the objects in the scene.
+//
+// The data of the objects are kept in a structure of arrays: one array with the geometries of all objects, one
+// with their materials, etc. The objects do not point to the geometries, programs, and other data, they contain
+// only their indices (ids) into tables the application keeps, so the passes iterate over the arrays linearly
+// and look up the (few) shared objects by the indices.
+//
+// The arrays are always dense: when an object is removed, the last object is moved to its place. The objects
+// are therefore identified by handles, which stay valid until the object is removed. Each handle contains
+// a generation counter, so a handle of a removed object is never confused with a new object in the same slot.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		SceneStore Scene;
+//		// 2) In init function, add the objects
+//		SceneStore::Handle handle = Scene.Add(geometry_id, material_id, program_id, texture, model_index);
+//		Scene.SetBounds(handle, bounds_min, bounds_max);
+//		// 3) In draw function, iterate over the arrays
+//		const int *geometries = Scene.GetGeometryIds();
+//		for (size_t i = 0; i < Scene.GetCount(); i++)
+//			MyGeometries[geometries[i]]->Draw();
+
+namespace PV227
+{
+
+	//-----------------------------
+	//----    SCENE STORAGE    ----
+	//-----------------------------
+
+	/// SceneStore contains the objects of the scene in a structure of arrays.
+	class SceneStore
+	{
+	public:
+		/// Handle of an object, it stays valid until the object is removed
+		struct Handle
+		{
+			int slot;						// Slot of the object, -1 for an invalid handle
+			unsigned int generation;		// Generation of the slot when the object was added
+
+			Handle(): slot(-1), generation(0) {}
+		};
+
+		/// Flags of the objects
+		static const unsigned int FLAG_VISIBLE = 1;			///< The object is rendered
+		static const unsigned int FLAG_CASTS_SHADOW = 2;		///< The object is rendered into shadow maps
+		static const unsigned int FLAG_OUTLINE = 4;			///< The object has an outline (e.g. for cel shading)
+		static const unsigned int DEFAULT_FLAGS = FLAG_VISIBLE | FLAG_CASTS_SHADOW | FLAG_OUTLINE;
+
+	private:
+		// Data of the objects, all arrays have the same size
+		std::vector<int> geometry_id;
+		std::vector<int> material_id;
+		std::vector<int> program_id;
+		std::vector<GLuint> texture;
+		std::vector<int> transform_id;
+		std::vector<glm::vec3> bounds_min;			// Bounds of the object in world space
+		std::vector<glm::vec3> bounds_max;
+		std::vector<unsigned int> flags;
+		std::vector<int> object_slot;				// Slot of each object, to update the slot when the object is moved
+
+		// Slots of the handles
+		std::vector<int> slot_object;				// Index of the object in the arrays, -1 for free slots
+		std::vector<unsigned int> slot_generation;
+		std::vector<int> free_slots;
+
+	public:
+		/// Removes all objects, all handles become invalid
+		void Clear();
+
+		/// Adds an object. The ids are indices into tables of the application, 'transform_id' is typically
+		/// an index of the model data in a ModelData_UBO. Returns the handle of the object.
+		Handle Add(int geometry_id, int material_id, int program_id, GLuint texture, int transform_id, unsigned int flags = DEFAULT_FLAGS);
+		/// Removes the object, the last object is moved to its place. Returns false if the handle is not valid.
+		bool Remove(Handle handle);
+		/// Returns true if the handle refers to an existing object
+		bool IsValid(Handle handle) const;
+		/// Returns the index of the object in the arrays, or -1 if the handle is not valid. The index changes when other objects are removed.
+		int GetIndex(Handle handle) const;
+
+		/// Change the data of an object
+		void SetGeometry(Handle handle, int geometry_id);
+		void SetMaterial(Handle handle, int material_id);
+		void SetProgram(Handle handle, int program_id);
+		void SetTexture(Handle handle, GLuint texture);
+		void SetTransform(Handle handle, int transform_id);
+		void SetFlags(Handle handle, unsigned int flags);
+		void SetBounds(Handle handle, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max);
+
+		/// Returns the number of the objects, i.e. the size of all arrays
+		size_t GetCount() const;
+		/// Return the arrays with the data of the objects, for linear iteration. They are valid until objects are added or removed.
+		const int *GetGeometryIds() const;
+		const int *GetMaterialIds() const;
+		const int *GetProgramIds() const;
+		const GLuint *GetTextures() const;
+		const int *GetTransformIds() const;
+		const glm::vec3 *GetBoundsMin() const;
+		const glm::vec3 *GetBoundsMax() const;
+		const unsigned int *GetFlags() const;
+	};
+
+	/// Computes the axis-aligned bounding box of a transformed axis-aligned box
+	void TransformBounds(const glm::mat4 &matrix, const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, glm::vec3 &out_min, glm::vec3 &out_max);
+	/// Extracts the planes of the frustum from the view-projection matrix, the normals point inside and are normalized
+	void ExtractFrustumPlanes(const glm::mat4 &view_projection, glm::vec4 planes[6]);
+	/// Tests an axis-aligned box against the planes of a frustum, returns false if it is completely outside
+	bool TestBoxFrustum(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max, const glm::vec4 *planes);
+
+}
+
+#endif	// INCLUDED_PV227_SCENE_H
@@ -0,0 +1,79 @@
+#include "PV227_Simulation.h"
+
+#include <chrono>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//---------------------------------
+	//----    FIXED RATE THREAD    ----
+	//---------------------------------
+
+	/// Maximum number of the steps that are done immediately one after another to catch up, the older steps are skipped
+	static const int MaxCatchUpSteps = 5;
+
+	FixedRateThread::FixedRateThread(): running(false), step_count(0), skipped_steps(0)
+	{
+	}
+
+	void FixedRateThread::Start(float steps_per_second, const std::function<void(float)> &step)
+	{
+		if (running)
+			return;
+		running = true;
+		step_count = 0;
+		skipped_steps = 0;
+		thread = std::thread(&FixedRateThread::Loop, this, steps_per_second, step);
+	}
+
+	void FixedRateThread::Stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		thread.join();
+	}
+
+	bool FixedRateThread::IsRunning() const
+	{
+		return running;
+	}
+
+	unsigned int FixedRateThread::GetStepCount() const
+	{
+		return step_count;
+	}
+
+	unsigned int FixedRateThread::GetSkippedSteps() const
+	{
+		return skipped_steps;
+	}
+
+	void FixedRateThread::Loop(float steps_per_second, std::function<void(float)> step)
+	{
+		typedef chrono::steady_clock clock;
+		const float step_seconds = 1.0f / steps_per_second;
+		const clock::duration period = chrono::duration_cast<clock::duration>(chrono::duration<float>(step_seconds));
+
+		clock::time_point next_step = clock::now();
+		while (running)
+		{
+			step(step_seconds);
+			step_count++;
+			next_step += period;
+
+			// When the steps take longer than their period, do a few of them immediately, but do not try
+			// to catch up with a long pause (e.g. when the application was stopped in the debugger)
+			const clock::time_point now = clock::now();
+			if (now > next_step + period * MaxCatchUpSteps)
+			{
+				skipped_steps += static_cast<unsigned int>((now - next_step) / period);
+				next_step = now;
+			}
+			this_thread::sleep_until(next_step);
+		}
+	}
+
+}
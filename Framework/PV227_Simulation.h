@@ -0,0 +1,124 @@
+#pragma once
+#ifndef INCLUDED_PV227_SIMULATION_H
+#define INCLUDED_PV227_SIMULATION_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+// This file contains the classes that run the simulation (input, animation) of the scene on its own thread.
+//
+// FixedRateThread calls the update function a fixed number of times per second, independently of how long
+// the frames take to render. The update function writes the state of the scene the renderer needs into
+// a snapshot, and publishes it through SnapshotBuffer. The renderer (the thread with the OpenGL context)
+// takes the latest published snapshot at the beginning of each frame. Neither of the threads ever waits
+// for the other one: the buffer has three snapshots, one is written by the update thread, one is read by
+// the render thread, and the third one is the latest published snapshot, which is exchanged with one of
+// the others when a snapshot is published or acquired.
+//
+// Example of how to use these classes:
+//		// 1) Define the global variables
+//		SnapshotBuffer<MySnapshot> Snapshots;
+//		FixedRateThread UpdateThread;
+//		// 2) In init function, start the update thread
+//		UpdateThread.Start(100.0f, [](float step_seconds)
+//		{
+//			MySnapshot &snapshot = Snapshots.GetWriteSnapshot();
+//			... simulate, and fill the snapshot ...
+//			Snapshots.Publish();
+//		});
+//		// 3) In display function, use the latest snapshot
+//		if (Snapshots.Acquire())
+//			... apply Snapshots.GetReadSnapshot() ...
+//		// 4) At the end, stop the thread
+//		UpdateThread.Stop();
+
+namespace PV227
+{
+
+	//-------------------------------
+	//----    SNAPSHOT BUFFER    ----
+	//-------------------------------
+
+	/// SnapshotBuffer passes the snapshots of data from one producer thread to one consumer thread without locks.
+	template <class T>
+	class SnapshotBuffer
+	{
+	private:
+		/// Flag in 'latest' set when the latest snapshot was published and not acquired yet
+		static const int FreshFlag = 4;
+
+		T snapshots[3];
+		int write_index;				// Snapshot written by the producer
+		int read_index;					// Snapshot read by the consumer
+		std::atomic<int> latest;		// Index of the latest published snapshot, with FreshFlag
+
+	public:
+		SnapshotBuffer(): write_index(0), read_index(1), latest(2) {}
+
+		/// Returns the snapshot the producer writes into. It keeps the data of an older snapshot, not of the previous one.
+		T &GetWriteSnapshot() { return snapshots[write_index]; }
+		/// Publishes the written snapshot, the producer continues with another one. Returns true if the consumer took
+		/// the previously published snapshot, false if it was replaced without being taken (e.g. to send only the data
+		/// that changed since the last snapshot the consumer took, the producer keeps them until it returns true).
+		bool Publish()
+		{
+			const int previous = latest.exchange(write_index | FreshFlag);
+			write_index = previous & ~FreshFlag;
+			return !(previous & FreshFlag);
+		}
+
+		/// Takes the latest published snapshot, returns false if no snapshot was published since the last call
+		bool Acquire()
+		{
+			if (!(latest.load() & FreshFlag))
+				return false;
+			read_index = latest.exchange(read_index) & ~FreshFlag;
+			return true;
+		}
+		/// Returns the snapshot taken in the last Acquire
+		const T &GetReadSnapshot() const { return snapshots[read_index]; }
+		/// Returns the snapshot taken in the last Acquire, the consumer may move (swap) its data out, as the producer
+		/// gets the snapshot back only after the next Acquire, and it writes all its data again
+		T &GetReadSnapshot() { return snapshots[read_index]; }
+	};
+
+	//---------------------------------
+	//----    FIXED RATE THREAD    ----
+	//---------------------------------
+
+	/// FixedRateThread calls a function on its own thread at a fixed rate.
+	class FixedRateThread
+	{
+	private:
+		std::thread thread;
+		std::atomic<bool> running;
+		std::atomic<unsigned int> step_count;
+		std::atomic<unsigned int> skipped_steps;
+
+		/// Function of the thread
+		void Loop(float steps_per_second, std::function<void(float)> step);
+
+		FixedRateThread(const FixedRateThread &);
+		FixedRateThread &operator=(const FixedRateThread &);
+
+	public:
+		FixedRateThread();
+
+		/// Starts the thread, which calls 'step' 'steps_per_second' times per second, the parameter of 'step'
+		/// is the length of the step in seconds. Does nothing if the thread is already running.
+		void Start(float steps_per_second, const std::function<void(float)> &step);
+		/// Stops the thread, waits for the current step to finish
+		void Stop();
+		/// Returns true if the thread is running
+		bool IsRunning() const;
+
+		/// Returns the number of the steps done since Start
+		unsigned int GetStepCount() const;
+		/// Returns the number of the steps that were skipped because the steps took longer than their period
+		unsigned int GetSkippedSteps() const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_SIMULATION_H
@@ -0,0 +1,249 @@
+#include "PV227_Transforms.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace PV227
+{
+
+	//-----------------------------------
+	//----    TRANSFORM HIERARCHY    ----
+	//-----------------------------------
+
+	TransformHierarchy::TransformHierarchy(): order_valid(true)
+	{
+	}
+
+	void TransformHierarchy::Clear()
+	{
+		translation.clear();
+		rotation.clear();
+		scale.clear();
+		parent.clear();
+		world.clear();
+		model_index.clear();
+		model_offset.clear();
+		order.clear();
+		order_position.clear();
+		subtree_size.clear();
+		order_valid = true;
+		dirty_nodes.clear();
+		dirty.clear();
+		changed_nodes.clear();
+	}
+
+	int TransformHierarchy::AddNode(int parent, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale)
+	{
+		const int node = int(this->parent.size());
+		this->translation.push_back(translation);
+		this->rotation.push_back(rotation);
+		this->scale.push_back(scale);
+		this->parent.push_back(parent);
+		world.push_back(glm::mat4(1.0f));
+		model_index.push_back(-1);
+		model_offset.push_back(glm::mat4(1.0f));
+		dirty.push_back(0);
+		order_valid = false;
+		MarkDirty(node);
+		return node;
+	}
+
+	size_t TransformHierarchy::GetNodeCount() const
+	{
+		return parent.size();
+	}
+
+	void TransformHierarchy::BuildOrder()
+	{
+		const int count = int(parent.size());
+
+		// Children of all nodes in one array, first_child[n] is the beginning of the children of node n
+		std::vector<int> first_child(count + 1, 0);
+		for (int n = 0; n < count; n++)
+			if (parent[n] >= 0)
+				first_child[parent[n] + 1]++;
+		for (int n = 0; n < count; n++)
+			first_child[n + 1] += first_child[n];
+		std::vector<int> children(first_child[count]);
+		std::vector<int> filled(first_child.begin(), first_child.end() - 1);
+		for (int n = 0; n < count; n++)
+			if (parent[n] >= 0)
+				children[filled[parent[n]]++] = n;
+
+		// Depth-first traversal from all roots, the children are pushed in reverse to keep them in their order
+		order.clear();
+		order.reserve(count);
+		std::vector<int> stack;
+		for (int root = count - 1; root >= 0; root--)
+			if (parent[root] < 0)
+				stack.push_back(root);
+		while (!stack.empty())
+		{
+			const int n = stack.back();
+			stack.pop_back();
+			order.push_back(n);
+			for (int c = first_child[n + 1] - 1; c >= first_child[n]; c--)
+				stack.push_back(children[c]);
+		}
+
+		// The sizes of the subtrees are accumulated from the leaves, i.e. in the reverse order
+		order_position.resize(count);
+		subtree_size.assign(count, 1);
+		for (int p = int(order.size()) - 1; p >= 0; p--)
+		{
+			const int n = order[p];
+			order_position[n] = p;
+			if (parent[n] >= 0)
+				subtree_size[parent[n]] += subtree_size[n];
+		}
+		order_valid = true;
+	}
+
+	void TransformHierarchy::MarkDirty(int node)
+	{
+		if (!dirty[node])
+		{
+			dirty[node] = 1;
+			dirty_nodes.push_back(node);
+		}
+	}
+
+	bool TransformHierarchy::SetParent(int node, int parent)
+	{
+		if (parent >= 0)
+		{
+			// The new parent must not be in the subtree of the node
+			if (!order_valid)
+				BuildOrder();
+			const int p = order_position[parent];
+			if ((p >= order_position[node]) && (p < order_position[node] + subtree_size[node]))
+				return false;
+		}
+		if (this->parent[node] != parent)
+		{
+			this->parent[node] = parent;
+			order_valid = false;
+			MarkDirty(node);
+		}
+		return true;
+	}
+
+	int TransformHierarchy::GetParent(int node) const
+	{
+		return parent[node];
+	}
+
+	void TransformHierarchy::SetTranslation(int node, const glm::vec3 &translation)
+	{
+		this->translation[node] = translation;
+		MarkDirty(node);
+	}
+
+	void TransformHierarchy::SetRotation(int node, const glm::quat &rotation)
+	{
+		this->rotation[node] = rotation;
+		MarkDirty(node);
+	}
+
+	void TransformHierarchy::SetScale(int node, const glm::vec3 &scale)
+	{
+		this->scale[node] = scale;
+		MarkDirty(node);
+	}
+
+	void TransformHierarchy::SetTransform(int node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale)
+	{
+		this->translation[node] = translation;
+		this->rotation[node] = rotation;
+		this->scale[node] = scale;
+		MarkDirty(node);
+	}
+
+	const glm::vec3 &TransformHierarchy::GetTranslation(int node) const
+	{
+		return translation[node];
+	}
+
+	const glm::quat &TransformHierarchy::GetRotation(int node) const
+	{
+		return rotation[node];
+	}
+
+	const glm::vec3 &TransformHierarchy::GetScale(int node) const
+	{
+		return scale[node];
+	}
+
+	const glm::mat4 &TransformHierarchy::GetWorldMatrix(int node) const
+	{
+		return world[node];
+	}
+
+	void TransformHierarchy::BindModel(int node, int model_index, const glm::mat4 &offset)
+	{
+		this->model_index[node] = model_index;
+		model_offset[node] = offset;
+		MarkDirty(node);		// So that the model data are written in the next WriteModelData
+	}
+
+	int TransformHierarchy::GetModelIndex(int node) const
+	{
+		return model_index[node];
+	}
+
+	glm::mat4 TransformHierarchy::GetModelMatrix(int node) const
+	{
+		return world[node] * model_offset[node];
+	}
+
+	size_t TransformHierarchy::UpdateWorldMatrices()
+	{
+		changed_nodes.clear();
+		if (dirty_nodes.empty())
+			return 0;
+		if (!order_valid)
+			BuildOrder();
+
+		// In the depth-first order, a dirty node that lies in an already recomputed subtree is skipped
+		std::sort(dirty_nodes.begin(), dirty_nodes.end(),
+			[this](int a, int b) { return order_position[a] < order_position[b]; });
+		int recomputed_end = 0;
+		for (int node : dirty_nodes)
+		{
+			dirty[node] = 0;
+			const int begin = order_position[node];
+			if (begin < recomputed_end)
+				continue;
+			recomputed_end = begin + subtree_size[node];
+
+			// The parents precede their children, so their world matrices are always ready
+			for (int p = begin; p < recomputed_end; p++)
+			{
+				const int n = order[p];
+				glm::mat4 local = glm::mat4_cast(rotation[n]);
+				local[0] *= scale[n].x;
+				local[1] *= scale[n].y;
+				local[2] *= scale[n].z;
+				local[3] = glm::vec4(translation[n], 1.0f);
+				world[n] = (parent[n] >= 0) ? world[parent[n]] * local : local;
+				changed_nodes.push_back(n);
+			}
+		}
+		dirty_nodes.clear();
+		return changed_nodes.size();
+	}
+
+	const std::vector<int> &TransformHierarchy::GetChangedNodes() const
+	{
+		return changed_nodes;
+	}
+
+	void TransformHierarchy::WriteModelData(ModelData_UBO &models) const
+	{
+		for (int node : changed_nodes)
+			if (model_index[node] >= 0)
+				models.SetMatrix(model_index[node], GetModelMatrix(node));
+	}
+
+}
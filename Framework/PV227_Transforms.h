@@ -0,0 +1,123 @@
+#pragma once
+#ifndef INCLUDED_PV227_TRANSFORMS_H
+#define INCLUDED_PV227_TRANSFORMS_H
+
+#include "PV227_UBOs.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+// This file contains a hierarchy of transformations of the objects in the scene.
+//
+// Each node of the hierarchy has a local transformation (translation, rotation, and scale) relative to its
+// parent. The world matrices are recomputed only for the nodes whose local transformation changed, and for
+// their subtrees. The nodes are kept in a flattened array in depth-first order, where each subtree occupies
+// consecutive entries, so the world matrices of a changed subtree are recomputed in a single linear pass.
+//
+// Example of how to use this class:
+//		// 1) Define a global variable
+//		TransformHierarchy Transforms;
+//		// 2) In init function, create the nodes, and bind them to the model data of the objects
+//		int group = Transforms.AddNode();
+//		int node = Transforms.AddNode(group, glm::vec3(1.0f, 0.0f, 0.0f));
+//		Transforms.BindModel(node, object_index);
+//		// 3) In update function, change the nodes, recompute their world matrices, and copy them into model data
+//		Transforms.SetTranslation(group, ...);
+//		if (Transforms.UpdateWorldMatrices() > 0)
+//		{
+//			Transforms.WriteModelData(Models_ubo);
+//			Models_ubo.UpdateOpenGLData();
+//		}
+
+namespace PV227
+{
+
+	//-----------------------------------
+	//----    TRANSFORM HIERARCHY    ----
+	//-----------------------------------
+
+	/// TransformHierarchy contains the local transformations of the nodes of the scene, and computes their world matrices.
+	///
+	/// The nodes are identified by the indices returned from AddNode, these indices never change.
+	class TransformHierarchy
+	{
+	private:
+		// Local transformations of the nodes, and their parents (-1 for the roots)
+		std::vector<glm::vec3> translation;
+		std::vector<glm::quat> rotation;
+		std::vector<glm::vec3> scale;
+		std::vector<int> parent;
+		// World matrices of the nodes
+		std::vector<glm::mat4> world;
+
+		// Model data the world matrices are written into (the index is -1 if the node has no model data), and
+		// the matrix that is applied before the world matrix (e.g. to place the geometry on the ground)
+		std::vector<int> model_index;
+		std::vector<glm::mat4> model_offset;
+
+		// Nodes in depth-first order, the subtree of a node occupies 'subtree_size' entries beginning with the node
+		std::vector<int> order;
+		std::vector<int> order_position;		// Position of each node in 'order'
+		std::vector<int> subtree_size;
+		bool order_valid;						// False when the structure of the hierarchy changed and 'order' must be rebuilt
+
+		// Nodes whose local transformation (or parent) changed since the last UpdateWorldMatrices
+		std::vector<int> dirty_nodes;
+		std::vector<unsigned char> dirty;
+		// Nodes whose world matrix was recomputed in the last UpdateWorldMatrices
+		std::vector<int> changed_nodes;
+
+		/// Rebuilds the depth-first order of the nodes
+		void BuildOrder();
+		/// Marks the node so that the world matrices of its subtree are recomputed
+		void MarkDirty(int node);
+
+	public:
+		TransformHierarchy();
+
+		/// Removes all nodes
+		void Clear();
+		/// Adds a node with the given parent (-1 for a root) and local transformation, returns its index
+		int AddNode(int parent = -1, const glm::vec3 &translation = glm::vec3(0.0f),
+			const glm::quat &rotation = glm::quat(), const glm::vec3 &scale = glm::vec3(1.0f));
+		/// Returns the number of the nodes
+		size_t GetNodeCount() const;
+
+		/// Changes the parent of the node (-1 to make it a root). The node keeps its local transformation.
+		/// Returns false (and changes nothing) if the parent is in the subtree of the node.
+		bool SetParent(int node, int parent);
+		/// Returns the parent of the node, or -1 if it is a root
+		int GetParent(int node) const;
+
+		/// Sets the local transformation of the node
+		void SetTranslation(int node, const glm::vec3 &translation);
+		void SetRotation(int node, const glm::quat &rotation);
+		void SetScale(int node, const glm::vec3 &scale);
+		void SetTransform(int node, const glm::vec3 &translation, const glm::quat &rotation, const glm::vec3 &scale);
+		/// Returns the local transformation of the node
+		const glm::vec3 &GetTranslation(int node) const;
+		const glm::quat &GetRotation(int node) const;
+		const glm::vec3 &GetScale(int node) const;
+
+		/// Returns the world matrix of the node, valid after UpdateWorldMatrices
+		const glm::mat4 &GetWorldMatrix(int node) const;
+
+		/// Sets the index of the model data (in a ModelData_UBO) the world matrix of the node is written into,
+		/// -1 if the node has no model data. The model matrix is world matrix * 'offset'.
+		void BindModel(int node, int model_index, const glm::mat4 &offset = glm::mat4(1.0f));
+		/// Returns the index of the model data of the node, or -1 if the node has none
+		int GetModelIndex(int node) const;
+		/// Returns the model matrix of the node, i.e. its world matrix * offset, see BindModel
+		glm::mat4 GetModelMatrix(int node) const;
+
+		/// Recomputes the world matrices of the nodes that changed, and of their subtrees.
+		/// Returns the number of the recomputed nodes.
+		size_t UpdateWorldMatrices();
+		/// Returns the nodes whose world matrices were recomputed in the last UpdateWorldMatrices
+		const std::vector<int> &GetChangedNodes() const;
+		/// Sets the model matrices of the changed nodes in the model data (it does not call UpdateOpenGLData)
+		void WriteModelData(ModelData_UBO &models) const;
+	};
+
+}
+
+#endif	// INCLUDED_PV227_TRANSFORMS_H
@@ -1,17 +1,261 @@
 #include "PV227.h"
 
 #include <algorithm>
+#include <cstring>
+
+// SSE is used to invert four model matrices at once, if it is available
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define PV227_UBOS_USE_SSE
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 namespace PV227
 {
 
+	//------------------------------
+	//----    DIRTY ELEMENTS    ----
+	//------------------------------
+
+	DirtyElements::DirtyElements(): size(0), any(false)
+	{
+	}
+
+	void DirtyElements::Resize(size_t count)
+	{
+		size = count;
+		bits.assign((count + 63) / 64, 0);
+		MarkAll();
+	}
+
+	void DirtyElements::Mark(size_t idx)
+	{
+		bits[idx / 64] |= uint64_t(1) << (idx % 64);
+		any.store(true, std::memory_order_relaxed);		// The threads that mark the elements are joined before the flag is read
+	}
+
+	void DirtyElements::MarkAll()
+	{
+		if (bits.empty())
+			return;
+		std::fill(bits.begin(), bits.end(), ~uint64_t(0));
+		if (size % 64)		// Keep the bits after the last element clear
+			bits.back() = (uint64_t(1) << (size % 64)) - 1;
+		any = true;
+	}
+
+	void DirtyElements::Clear()
+	{
+		if (any)
+			std::fill(bits.begin(), bits.end(), uint64_t(0));
+		any = false;
+	}
+
+	bool DirtyElements::Any() const
+	{
+		return any;
+	}
+
+	const std::vector<DirtyElements::Range> &DirtyElements::CollectRanges(size_t max_gap)
+	{
+		ranges.clear();
+		if (!any)
+			return ranges;
+
+		for (size_t w = 0; w < bits.size(); w++)
+		{
+			uint64_t word = bits[w];
+			while (word)
+			{
+				// Find the run of set bits that starts at the lowest set bit
+				size_t bit = 0;
+				while (!((word >> bit) & 1))
+					bit++;
+				size_t run = 0;
+				while ((bit + run < 64) && ((word >> (bit + run)) & 1))
+					run++;
+				word = (run + bit < 64) ? (word & ~(((uint64_t(1) << run) - 1) << bit)) : 0;
+
+				const size_t first = w * 64 + bit;
+				if (!ranges.empty() && (first <= ranges.back().first + ranges.back().count + max_gap))
+					ranges.back().count = first + run - ranges.back().first;		// Merge with the previous run (also runs crossing words)
+				else
+				{
+					Range range = { first, run };
+					ranges.push_back(range);
+				}
+			}
+		}
+		return ranges;
+	}
+
+
+	/// Returns the distance in bytes between the records of individual objects in a buffer. When the records
+	/// are bound separately (glBindBufferRange), their offsets must be aligned to the alignment of the target.
+	static size_t GetRecordStride(GLenum target, size_t record_size, bool aligned_records)
+	{
+		if (!aligned_records)
+			return record_size;
+		GLint alignment = 1;
+		glGetIntegerv((target == GL_SHADER_STORAGE_BUFFER) ? GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT : GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		alignment = std::max(alignment, 1);
+		return (record_size + alignment - 1) / alignment * alignment;
+	}
+
+	/// Copies the records of the objects into 'dst', placing them 'stride' bytes apart
+	static void PackRecords(unsigned char *dst, const void *records, size_t count, size_t record_size, size_t stride)
+	{
+		for (size_t i = 0; i < count; i++)
+			memcpy(dst + i * stride, (const unsigned char *)records + i * record_size, record_size);
+	}
+
+	/// Two runs of changed records are copied with a single call if they are separated by fewer bytes than this,
+	/// copying a few unchanged bytes is cheaper than another call
+	static const size_t MergeGapBytes = 1024;
+
+	/// Copies the records of the objects that changed into the buffer, placing them 'stride' bytes apart
+	static void UploadRecords(GLuint buffer, const void *records, size_t record_size, size_t stride, std::vector<unsigned char> &staging, DirtyElements &dirty)
+	{
+		const std::vector<DirtyElements::Range> &ranges = dirty.CollectRanges(MergeGapBytes / stride);
+		for (const DirtyElements::Range &range : ranges)
+		{
+			const unsigned char *first_record = (const unsigned char *)records + range.first * record_size;
+			const size_t size = (range.count - 1) * stride + record_size;		// No padding after the last record
+			if (stride == record_size)
+			{
+				UpdateBufferData(buffer, range.first * stride, size, first_record);
+			}
+			else
+			{
+				staging.resize(stride * range.count);
+				PackRecords(staging.data(), first_record, range.count, record_size, stride);
+				UpdateBufferData(buffer, range.first * stride, size, staging.data());
+			}
+		}
+		dirty.Clear();
+	}
+
+	/// Copies the records of the objects into the current frame of the ring, returns their offset in the ring, or -1 if they do not fit
+	static GLintptr StreamRecords(FrameDataRing &ring, const void *records, size_t count, size_t record_size, size_t stride, std::vector<unsigned char> &staging)
+	{
+		const GLintptr offset = ring.Allocate(stride * count);
+		if (offset < 0)
+			return -1;
+		if (unsigned char *dst = (unsigned char *)ring.GetPointer(offset))
+		{
+			PackRecords(dst, records, count, record_size, stride);		// Directly into the mapped buffer
+		}
+		else
+		{
+			staging.resize(stride * count);
+			PackRecords(staging.data(), records, count, record_size, stride);
+			ring.Write(offset, staging.data(), staging.size());
+		}
+		return offset;
+	}
+
+	/// Computes the inverse of the matrix, and the inverse of the transpose of its top-left part 3x3. If the matrix
+	/// is affine (the last row is 0,0,0,1), the 3x3 inverse is computed only once and used for both results.
+	static void InvertMatrix(const glm::mat4 &m, glm::mat4 &inv, glm::mat3x4 &it)
+	{
+		if ((m[0][3] != 0.0f) || (m[1][3] != 0.0f) || (m[2][3] != 0.0f) || (m[3][3] != 1.0f))
+		{
+			inv = glm::inverse(m);
+			it = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(m))));
+			return;
+		}
+
+		// The rows of the inverse of A = [c0 c1 c2] are the cross products of its columns divided by the determinant
+		const glm::vec3 c0(m[0]), c1(m[1]), c2(m[2]), t(m[3]);
+		const glm::vec3 r0 = glm::cross(c1, c2);
+		const float inv_det = 1.0f / glm::dot(c0, r0);
+		const glm::vec3 rows[3] = { r0 * inv_det, glm::cross(c2, c0) * inv_det, glm::cross(c0, c1) * inv_det };
+
+		// The inverse of the transpose has the rows of the inverse in its columns
+		for (int i = 0; i < 3; i++)
+		{
+			inv[i] = glm::vec4(rows[0][i], rows[1][i], rows[2][i], 0.0f);
+			it[i] = glm::vec4(rows[i], 0.0f);
+		}
+		inv[3] = glm::vec4(-glm::dot(rows[0], t), -glm::dot(rows[1], t), -glm::dot(rows[2], t), 1.0f);
+	}
+
+#ifdef PV227_UBOS_USE_SSE
+	/// Inverts four affine matrices at once, each SSE register holds the same element of the four matrices.
+	/// Returns false (and writes nothing) if any of the matrices is not affine.
+	static bool InvertFourAffineMatrices(const glm::mat4 *m, glm::mat4 *inv[4], glm::mat3x4 *it[4])
+	{
+		// Transpose the columns of the matrices, so that e.g. c0[0] contains m[j][0][0] of the four matrices j
+		__m128 c[4][4];
+		for (int col = 0; col < 4; col++)
+		{
+			for (int j = 0; j < 4; j++)
+				c[col][j] = _mm_loadu_ps(&m[j][col][0]);
+			_MM_TRANSPOSE4_PS(c[col][0], c[col][1], c[col][2], c[col][3]);
+		}
+
+		// Check the last rows
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		__m128 affine = _mm_and_ps(_mm_cmpeq_ps(c[0][3], zero), _mm_cmpeq_ps(c[1][3], zero));
+		affine = _mm_and_ps(affine, _mm_and_ps(_mm_cmpeq_ps(c[2][3], zero), _mm_cmpeq_ps(c[3][3], one)));
+		if (_mm_movemask_ps(affine) != 0xF)
+			return false;
+
+		// Rows of the inverse of the top-left part 3x3, see InvertMatrix
+		__m128 r[3][4];
+		for (int i = 0; i < 3; i++)
+		{
+			const __m128 *a = c[(i + 1) % 3];
+			const __m128 *b = c[(i + 2) % 3];
+			r[i][0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+			r[i][1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+			r[i][2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+			r[i][3] = zero;
+		}
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0][0], r[0][0]), _mm_mul_ps(c[0][1], r[0][1])), _mm_mul_ps(c[0][2], r[0][2]));
+		const __m128 inv_det = _mm_div_ps(one, det);
+		for (int i = 0; i < 3; i++)
+			for (int k = 0; k < 3; k++)
+				r[i][k] = _mm_mul_ps(r[i][k], inv_det);
+
+		// Translation of the inverse
+		__m128 t[4];
+		for (int i = 0; i < 3; i++)
+			t[i] = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[i][0], c[3][0]), _mm_mul_ps(r[i][1], c[3][1])), _mm_mul_ps(r[i][2], c[3][2])));
+		t[3] = one;
+
+		// Columns of the inverse have the same element of the three rows, transpose them back to the matrices
+		for (int col = 0; col < 3; col++)
+		{
+			__m128 v0 = r[0][col], v1 = r[1][col], v2 = r[2][col], v3 = zero;
+			_MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+			_mm_storeu_ps(&(*inv[0])[col][0], v0);
+			_mm_storeu_ps(&(*inv[1])[col][0], v1);
+			_mm_storeu_ps(&(*inv[2])[col][0], v2);
+			_mm_storeu_ps(&(*inv[3])[col][0], v3);
+		}
+		_MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+		for (int j = 0; j < 4; j++)
+			_mm_storeu_ps(&(*inv[j])[3][0], t[j]);
+
+		// Columns of the inverse of the transpose are the rows of the inverse
+		for (int i = 0; i < 3; i++)
+		{
+			_MM_TRANSPOSE4_PS(r[i][0], r[i][1], r[i][2], r[i][3]);
+			for (int j = 0; j < 4; j++)
+				_mm_storeu_ps(&(*it[j])[i][0], r[i][j]);
+		}
+		return true;
+	}
+#endif
+
 	//---------------------------
 	//----    CAMERA DATA    ----
 	//---------------------------
 
-	CameraData_UBO::CameraData_UBO(): buffer(0), target(GL_UNIFORM_BUFFER)
+	CameraData_UBO::CameraData_UBO(): buffer(0), target(GL_UNIFORM_BUFFER), ring(nullptr), ring_offset(-1), ring_frame(0)
 	{
 		// Assert the layout
 		static_assert(offsetof(CameraData_UBO::SingleCameraData, projection) == 0,		"Incorrect CameraData layout");
@@ -25,6 +269,7 @@ namespace PV227
 
 	void CameraData_UBO::Destroy()
 	{
+		GLStateCache::ForgetBuffer(buffer);
 		glDeleteBuffers(1, &buffer);
 		buffer = 0;
 		data.clear();
@@ -37,15 +282,32 @@ namespace PV227
 
 	void CameraData_UBO::BindBuffer(GLuint index) const
 	{
-		glBindBufferBase(target, index, buffer);
+		if (ring)
+		{
+			// The data written in the previous frames may be already overwritten
+			if (ring_frame != ring->GetFrameIndex())
+				UpdateOpenGLData();
+			if (ring_offset >= 0)
+			{
+				GLStateCache::BindBufferRange(target, index, ring->GetBuffer(), ring_offset, sizeof(SingleCameraData) * data.size());
+				return;
+			}
+		}
+		GLStateCache::BindBufferBase(target, index, buffer);
 	}
 
 	void CameraData_UBO::UpdateOpenGLData() const
 	{
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferSubData(target, 0, sizeof(SingleCameraData) * data.size(), data.data());
-		glBindBuffer(target, 0);
+		if (ring)
+		{
+			// The part of the ring is new, all data must be written. The dirty elements are kept for 'buffer'.
+			ring_offset = ring->Upload(data.data(), sizeof(SingleCameraData) * data.size());
+			ring_frame = ring->GetFrameIndex();
+			if (ring_offset >= 0)
+				return;
+		}
+		std::vector<unsigned char> no_staging;		// Cameras are not aligned, no staging is needed
+		UploadRecords(buffer, data.data(), sizeof(SingleCameraData), sizeof(SingleCameraData), no_staging, dirty);
 	}
 
 	void CameraData_UBO::Init(size_t count, GLenum target)
@@ -64,11 +326,17 @@ namespace PV227
 			data[i].eye_position = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 		}
 
-		glGenBuffers(1, &buffer);
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferData(target, sizeof(SingleCameraData) * count, data.data(), GL_STATIC_DRAW);
-		glBindBuffer(target, 0);
+		// The size of the buffer never changes, only its content
+		buffer = CreateImmutableBuffer(sizeof(SingleCameraData) * count, data.data(), GL_DYNAMIC_STORAGE_BIT);
+		dirty.Resize(count);
+		dirty.Clear();		// The buffer was created with the data
+		ring_offset = -1;
+	}
+
+	void CameraData_UBO::StreamThrough(FrameDataRing *ring)
+	{
+		this->ring = ring;
+		ring_offset = -1;
 	}
 
 	void CameraData_UBO::SetProjection(const glm::mat4 &projection_matrix)
@@ -90,29 +358,32 @@ namespace PV227
 	{
 		data[idx].projection = projection_matrix;
 		data[idx].projection_inv = glm::inverse(projection_matrix);
+		dirty.Mark(idx);
 	}
 
 	void CameraData_UBO::SetCamera(int idx, const SimpleCamera &camera)
 	{
 		data[idx].view = camera.GetViewMatrix();
 		data[idx].view_inv = camera.GetViewInvMatrix();
-		data[idx].view_it = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(data[idx].view))));
+		data[idx].view_it = glm::mat3x4(glm::transpose(glm::mat3(data[idx].view_inv)));		// The inverse is already known
 		data[idx].eye_position = glm::vec4(camera.GetEyePosition(), 1.0f);
+		dirty.Mark(idx);
 	}
 
 	void CameraData_UBO::SetCamera(int idx, const glm::mat4 &view_matrix)
 	{
 		data[idx].view = view_matrix;
-		data[idx].view_inv = glm::inverse(view_matrix);
-		data[idx].view_it = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(data[idx].view))));
+		InvertMatrix(view_matrix, data[idx].view_inv, data[idx].view_it);
 		data[idx].eye_position = glm::vec4(glm::vec3(data[idx].view_inv[3]), 1.0f);
+		dirty.Mark(idx);
 	}
 
 	//--------------------------
 	//----    MODEL DATA    ----
 	//--------------------------
 
-	ModelData_UBO::ModelData_UBO(): buffer(0), target(GL_UNIFORM_BUFFER)
+	ModelData_UBO::ModelData_UBO()
+		: buffer(0), target(GL_UNIFORM_BUFFER), stride(sizeof(SingleModelData)), ring(nullptr), ring_offset(-1), ring_frame(0)
 	{
 		// Assert the layout
 		static_assert(offsetof(ModelData_UBO::SingleModelData, model) == 0,			"Incorrect ModelData layout");
@@ -123,6 +394,7 @@ namespace PV227
 
 	void ModelData_UBO::Destroy()
 	{
+		GLStateCache::ForgetBuffer(buffer);
 		glDeleteBuffers(1, &buffer);
 		buffer = 0;
 	}
@@ -134,21 +406,53 @@ namespace PV227
 
 	void ModelData_UBO::BindBuffer(GLuint index)
 	{
-		glBindBufferBase(target, index, buffer);
+		if (ring)
+		{
+			// The data written in the previous frames may be already overwritten
+			if (ring_frame != ring->GetFrameIndex())
+				UpdateOpenGLData();
+			if (ring_offset >= 0)
+			{
+				GLStateCache::BindBufferRange(target, index, ring->GetBuffer(), ring_offset, stride * data.size());
+				return;
+			}
+		}
+		GLStateCache::BindBufferBase(target, index, buffer);
+	}
+
+	void ModelData_UBO::BindBuffer(GLuint index, int idx)
+	{
+		if (ring)
+		{
+			if (ring_frame != ring->GetFrameIndex())
+				UpdateOpenGLData();
+			if (ring_offset >= 0)
+			{
+				GLStateCache::BindBufferRange(target, index, ring->GetBuffer(), ring_offset + stride * idx, sizeof(SingleModelData));
+				return;
+			}
+		}
+		GLStateCache::BindBufferRange(target, index, buffer, stride * idx, sizeof(SingleModelData));
 	}
 
 	void ModelData_UBO::UpdateOpenGLData()
 	{
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferSubData(target, 0, sizeof(SingleModelData) * data.size(), data.data());
-		glBindBuffer(target, 0);
+		if (ring)
+		{
+			// The part of the ring is new, all data must be written. The dirty elements are kept for 'buffer'.
+			ring_offset = StreamRecords(*ring, data.data(), data.size(), sizeof(SingleModelData), stride, staging);
+			ring_frame = ring->GetFrameIndex();
+			if (ring_offset >= 0)
+				return;
+		}
+		UploadRecords(buffer, data.data(), sizeof(SingleModelData), stride, staging, dirty);
 	}
 
-	void ModelData_UBO::Init(size_t count, GLenum target)
+	void ModelData_UBO::Init(size_t count, GLenum target, bool aligned_records)
 	{
 		Destroy();
 		this->target = target;
+		this->stride = GetRecordStride(target, sizeof(SingleModelData), aligned_records);
 
 		data.resize(count);
 		for (size_t i = 0; i < count; i++)
@@ -157,12 +461,17 @@ namespace PV227
 			data[i].model_inv = glm::mat4(1.0f);
 			data[i].model_it = glm::mat3x4(1.0f);
 		}
+		dirty.Resize(count);
 
-		glGenBuffers(1, &buffer);
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferData(target, sizeof(SingleModelData) * count, data.data(), GL_STATIC_DRAW);
-		glBindBuffer(target, 0);
+		// The size of the buffer never changes, only its content
+		buffer = CreateImmutableBuffer(stride * count, nullptr, GL_DYNAMIC_STORAGE_BIT);
+		UpdateOpenGLData();
+	}
+
+	void ModelData_UBO::StreamThrough(FrameDataRing *ring)
+	{
+		this->ring = ring;
+		ring_offset = -1;
 	}
 
 	void ModelData_UBO::SetMatrix(const glm::mat4 &model)
@@ -173,8 +482,51 @@ namespace PV227
 	void ModelData_UBO::SetMatrix(int idx, const glm::mat4 &model)
 	{
 		data[idx].model = model;
-		data[idx].model_inv = glm::inverse(model);
-		data[idx].model_it = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(data[idx].model))));
+		InvertMatrix(model, data[idx].model_inv, data[idx].model_it);
+		dirty.Mark(idx);
+	}
+
+	void ModelData_UBO::SetMatrices(int first, const glm::mat4 *models, size_t count)
+	{
+		ComputeData(models, count, &data[first]);
+		for (size_t i = 0; i < count; i++)
+			dirty.Mark(int(first + i));
+	}
+
+	void ModelData_UBO::SetData(int idx, const SingleModelData &model_data)
+	{
+		data[idx] = model_data;
+		dirty.Mark(idx);
+	}
+
+	void ModelData_UBO::ComputeData(const glm::mat4 *models, size_t count, SingleModelData *model_data)
+	{
+		size_t i = 0;
+#ifdef PV227_UBOS_USE_SSE
+		for (; i + 4 <= count; i += 4)
+		{
+			SingleModelData *d = model_data + i;
+			glm::mat4 *inv[4] = { &d[0].model_inv, &d[1].model_inv, &d[2].model_inv, &d[3].model_inv };
+			glm::mat3x4 *it[4] = { &d[0].model_it, &d[1].model_it, &d[2].model_it, &d[3].model_it };
+			if (!InvertFourAffineMatrices(models + i, inv, it))
+			{
+				for (int j = 0; j < 4; j++)
+					InvertMatrix(models[i + j], d[j].model_inv, d[j].model_it);
+			}
+			for (int j = 0; j < 4; j++)
+				d[j].model = models[i + j];
+		}
+#endif
+		for (; i < count; i++)
+		{
+			model_data[i].model = models[i];
+			InvertMatrix(models[i], model_data[i].model_inv, model_data[i].model_it);
+		}
+	}
+
+	const ModelData_UBO::SingleModelData &ModelData_UBO::GetData(int idx) const
+	{
+		return data[idx];
 	}
 
 	//---------------------------------
@@ -293,13 +645,15 @@ namespace PV227
 
 	//--  PhongLightsData_UBO
 
-	PhongLightsData_UBO::PhongLightsData_UBO(): buffer(0), max_lights(0), target(GL_UNIFORM_BUFFER)
+	PhongLightsData_UBO::PhongLightsData_UBO()
+		: buffer(0), max_lights(0), target(GL_UNIFORM_BUFFER), ring(nullptr), ring_offset(-1), ring_size(0), ring_frame(0)
 	{
 		header.global_ambient_color = glm::vec3(0.0f);
 	}
 
 	void PhongLightsData_UBO::Destroy()
 	{
+		GLStateCache::ForgetBuffer(buffer);
 		glDeleteBuffers(1, &buffer);
 		buffer = 0;
 	}
@@ -311,18 +665,48 @@ namespace PV227
 
 	void PhongLightsData_UBO::BindBuffer(GLuint index)
 	{
-		glBindBufferBase(target, index, buffer);
+		if (ring)
+		{
+			// The data written in the previous frames may be already overwritten
+			if (ring_frame != ring->GetFrameIndex())
+				UpdateOpenGLData();
+			if (ring_offset >= 0)
+			{
+				GLStateCache::BindBufferRange(target, index, ring->GetBuffer(), ring_offset, ring_size);
+				return;
+			}
+		}
+		GLStateCache::BindBufferBase(target, index, buffer);
 	}
 
 	void PhongLightsData_UBO::UpdateOpenGLData()
 	{
+		// Shader storage buffers have no limit, reallocate the buffer when the lights do not fit
+		if ((target == GL_SHADER_STORAGE_BUFFER) && (PhongLights.size() > max_lights))
+		{
+			max_lights = std::max(PhongLights.size(), max_lights * 2);
+			SetBufferData(buffer, sizeof(PhongLightsDataHeader) + sizeof(PhongLight) * max_lights, nullptr, GL_DYNAMIC_DRAW);
+		}
+
 		header.lights_count = std::min(int(max_lights), int(PhongLights.size()));
-		
-		glBindBuffer(target, buffer);
-		glBufferSubData(target, 0, sizeof(PhongLightsDataHeader), &header);
-		if (header.lights_count > 0)
-			glBufferSubData(target, sizeof(PhongLightsDataHeader), sizeof(PhongLight) * header.lights_count, PhongLights.data());
-		glBindBuffer(target, 0);
+
+		if (ring)
+		{
+			// The bound range must cover the whole uniform block, while the shader storage block may end with the last light
+			ring_size = sizeof(PhongLightsDataHeader) + sizeof(PhongLight) * ((target == GL_SHADER_STORAGE_BUFFER) ? header.lights_count : max_lights);
+			ring_offset = ring->Allocate(ring_size);
+			ring_frame = ring->GetFrameIndex();
+			if (ring_offset >= 0)
+			{
+				ring->Write(ring_offset, &header, sizeof(PhongLightsDataHeader));
+				if (header.lights_count > 0)
+					ring->Write(ring_offset + sizeof(PhongLightsDataHeader), PhongLights.data(), sizeof(PhongLight) * header.lights_count);
+				return;
+			}
+		}
+
+		UpdateBufferData(buffer, 0, sizeof(PhongLightsDataHeader), &header);
+		UpdateBufferData(buffer, sizeof(PhongLightsDataHeader), sizeof(PhongLight) * header.lights_count, PhongLights.data());
 	}
 
 	void PhongLightsData_UBO::Init(size_t max_lights, GLenum target)
@@ -331,10 +715,20 @@ namespace PV227
 		this->max_lights = max_lights;
 		this->target = target;
 
-		glGenBuffers(1, &buffer);
-		glBindBuffer(this->target, buffer);
-		glBufferData(this->target, sizeof(PhongLightsDataHeader) + sizeof(PhongLight) * this->max_lights, nullptr, GL_STATIC_DRAW);
-		glBindBuffer(this->target, 0);
+		// Shader storage buffers may be reallocated later, so the storage must be mutable
+		buffer = CreateMutableBuffer(sizeof(PhongLightsDataHeader) + sizeof(PhongLight) * this->max_lights, nullptr, GL_DYNAMIC_DRAW);
+		ring_offset = -1;
+	}
+
+	size_t PhongLightsData_UBO::GetCapacity() const
+	{
+		return max_lights;
+	}
+
+	void PhongLightsData_UBO::StreamThrough(FrameDataRing *ring)
+	{
+		this->ring = ring;
+		ring_offset = -1;
 	}
 
 	void PhongLightsData_UBO::SetGlobalAmbient(const glm::vec3 &global_ambient_color)
@@ -366,12 +760,13 @@ namespace PV227
 		return CreateMaterial(color, color, (shininess == 0.0f) ? glm::vec3(0.0f) : (white_specular ? glm::vec3(1.0f) : color), shininess, alpha);
 	}
 
-	MaterialData_UBO::MaterialData_UBO(): buffer(0), target(GL_UNIFORM_BUFFER)
+	MaterialData_UBO::MaterialData_UBO(): buffer(0), target(GL_UNIFORM_BUFFER), stride(sizeof(PhongMaterial))
 	{
 	}
 	
 	void MaterialData_UBO::Destroy()
 	{
+		GLStateCache::ForgetBuffer(buffer);
 		glDeleteBuffers(1, &buffer);
 		buffer = 0;
 	}
@@ -383,33 +778,35 @@ namespace PV227
 	
 	void MaterialData_UBO::BindBuffer(GLuint index)
 	{
-		glBindBufferBase(target, index, buffer);
+		GLStateCache::BindBufferBase(target, index, buffer);
+	}
+
+	void MaterialData_UBO::BindBuffer(GLuint index, int idx)
+	{
+		GLStateCache::BindBufferRange(target, index, buffer, stride * idx, sizeof(PhongMaterial));
 	}
 
 	void MaterialData_UBO::UpdateOpenGLData()
 	{
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferSubData(target, 0, sizeof(PhongMaterial) * data.size(), data.data());
-		glBindBuffer(target, 0);
+		UploadRecords(buffer, data.data(), sizeof(PhongMaterial), stride, staging, dirty);
 	}
 
-	void MaterialData_UBO::Init(size_t count, GLenum target)
+	void MaterialData_UBO::Init(size_t count, GLenum target, bool aligned_records)
 	{
 		Destroy();
 		this->target = target;
+		this->stride = GetRecordStride(target, sizeof(PhongMaterial), aligned_records);
 	
 		data.resize(count);
 		for (size_t i = 0; i < count; i++)
 		{
 			data[i] = PhongMaterial::CreateMaterial(glm::vec3(1.0f), glm::vec3(1.0f), glm::vec3(1.0f), 0.0f, 1.0f);
 		}
+		dirty.Resize(count);
 
-		glGenBuffers(1, &buffer);
-		glBindBuffer(target, buffer);
-		if (!data.empty())
-			glBufferData(target, sizeof(PhongMaterial) * count, data.data(), GL_STATIC_DRAW);
-		glBindBuffer(target, 0);
+		// The size of the buffer never changes, only its content
+		buffer = CreateImmutableBuffer(stride * count, nullptr, GL_DYNAMIC_STORAGE_BIT);
+		UpdateOpenGLData();
 	}
 
 	void MaterialData_UBO::SetMaterial(const PhongMaterial &material)
@@ -420,6 +817,7 @@ namespace PV227
 	void MaterialData_UBO::SetMaterial(int idx, const PhongMaterial &material)
 	{
 		data[idx] = material;
+		dirty.Mark(idx);
 	}
 
 }
\ No newline at end of file
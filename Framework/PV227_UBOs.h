@@ -4,6 +4,9 @@
 
 #include "PV227_Basics.h"
 
+#include <atomic>
+#include <cstdint>
+
 // This file contains classes which store data into OpenGL uniform buffer objects
 // which we use in our lessons.
 //
@@ -14,7 +17,12 @@
 //	- The classes have Destroy method which destroys all OpenGL objects. Call it before OpenGL context is unloaded, i.e. before deleting a window.
 //	- The classes have GetBuffer method which returns the ID of the UBO which is used.
 //	- The classes have BindBuffer method which binds the UBO to given binding point.
-//	- The classes have UpdateOpenGLData method which copies the data from CPU to OpenGL.
+//	- The classes have UpdateOpenGLData method which copies the data from CPU to OpenGL. The classes with arrays
+//		of objects (cameras, models, materials) copy only the objects that changed since the last call.
+//
+//	- The data that change every frame may be streamed through a FrameDataRing (see StreamThrough method of
+//		the classes). UpdateOpenGLData then writes the data into the ring, and BindBuffer binds the part of
+//		the ring with the data. The classes still have their own buffer, which is used when the ring is full.
 //
 //	- The classes can be initiated to contain the data on a single object, or for a set multiple objects (e.g. for instancing). Also,
 //		the data can be stored into a uniform buffer or shader storage buffer. This is all set up in Init method.
@@ -36,6 +44,50 @@
 namespace PV227
 {
 
+	//------------------------------
+	//----    DIRTY ELEMENTS    ----
+	//------------------------------
+
+	/// DirtyElements remembers which elements of an array changed since they were copied into OpenGL, one bit
+	/// per element. The classes below use it to copy only the changed elements in UpdateOpenGLData, with as few
+	/// calls as possible: the runs of changed elements that are close to each other are merged into one range.
+	///
+	/// Several threads may call Mark at the same time if they mark elements in different groups of 64 elements
+	/// (i.e. in different words of the bits), e.g. when each of them sets a range that starts at a multiple of 64.
+	class DirtyElements
+	{
+	public:
+		/// Run of consecutive elements, [first, first + count)
+		struct Range
+		{
+			size_t first;
+			size_t count;
+		};
+
+	private:
+		std::vector<uint64_t> bits;
+		size_t size;
+		std::atomic<bool> any;				// Atomic, since it is shared by all elements, see the description of the class
+		std::vector<Range> ranges;			// Result of CollectRanges, kept to avoid reallocations
+
+	public:
+		DirtyElements();
+
+		/// Sets the number of elements, all of them are marked as changed
+		void Resize(size_t count);
+		/// Marks the element as changed
+		void Mark(size_t idx);
+		/// Marks all elements as changed
+		void MarkAll();
+		/// Marks all elements as unchanged, call it when they are copied into OpenGL
+		void Clear();
+		/// Returns true if any element changed
+		bool Any() const;
+
+		/// Returns the runs of changed elements, the runs separated by at most 'max_gap' unchanged elements are merged
+		const std::vector<Range> &CollectRanges(size_t max_gap);
+	};
+
 	//---------------------------
 	//----    CAMERA DATA    ----
 	//---------------------------
@@ -59,6 +111,10 @@ namespace PV227
 		std::vector<SingleCameraData> data;
 		GLuint buffer;
 		GLenum target;
+		FrameDataRing *ring;					// Ring the data are streamed through, or nullptr
+		mutable GLintptr ring_offset;			// Offset of the data in the ring, or -1 if they are in 'buffer'
+		mutable unsigned int ring_frame;		// Frame of the ring in which the data were written
+		mutable DirtyElements dirty;			// Cameras that changed since they were copied into 'buffer'
 
 	public:
 		// Common methods, see the comment at the beginning of this file for more info.
@@ -70,6 +126,8 @@ namespace PV227
 
 		/// Creates all OpenGL objects, allocates the UBO to be able to contain given number of cameras.
 		void Init(size_t count = 1, GLenum target = GL_UNIFORM_BUFFER);
+		/// Streams the data through the given ring (nullptr to use only the own buffer), see the beginning of this file
+		void StreamThrough(FrameDataRing *ring);
 
 		/// Sets the data of the projection (projection matrix and its inverse)
 		void SetProjection(const glm::mat4 &projection_matrix);
@@ -135,6 +193,12 @@ layout (std140) uniform CameraData
 		std::vector<SingleModelData> data;
 		GLuint buffer;
 		GLenum target;
+		size_t stride;							// Distance between the objects in the buffer, in bytes
+		std::vector<unsigned char> staging;		// Data of the aligned objects before they are copied into the buffer
+		FrameDataRing *ring;					// Ring the data are streamed through, or nullptr
+		GLintptr ring_offset;					// Offset of the data in the ring, or -1 if they are in 'buffer'
+		unsigned int ring_frame;				// Frame of the ring in which the data were written
+		DirtyElements dirty;					// Objects that changed since they were copied into 'buffer'
 
 	public:
 		// Common methods, see the comment at the beginning of this file for more info.
@@ -145,12 +209,33 @@ layout (std140) uniform CameraData
 		void UpdateOpenGLData();
 
 		/// Creates all OpenGL objects, allocates the UBO to be able to contain given number of objects.
-		void Init(size_t count = 1, GLenum target = GL_UNIFORM_BUFFER);
+		///
+		/// When 'aligned_records' is true, the data of each object is aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+		/// (or GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT), and the objects are bound one at a time with
+		/// BindBuffer(index, idx), so that the shaders use the layout for a single object. This way,
+		/// the data of all objects in the scene may be stored in a single buffer.
+		void Init(size_t count = 1, GLenum target = GL_UNIFORM_BUFFER, bool aligned_records = false);
+		/// Binds the data of a single object to given binding point (glBindBufferRange), see Init
+		void BindBuffer(GLuint index, int idx);
+		/// Streams the data through the given ring (nullptr to use only the own buffer), use it for animated
+		/// objects whose data change every frame, see the beginning of this file
+		void StreamThrough(FrameDataRing *ring);
 
 		/// Sets the model matrix of the object and its derivations
 		void SetMatrix(const glm::mat4 &model);
 		/// Sets the model matrix of a given object and its derivations
 		void SetMatrix(int idx, const glm::mat4 &model);
+		/// Sets the model matrices of 'count' objects starting with the object 'first', and their derivations.
+		/// This is much faster than calling SetMatrix for each object, affine matrices are inverted four at a time.
+		void SetMatrices(int first, const glm::mat4 *models, size_t count);
+		/// Sets the model matrix of a given object and its derivations, computed by ComputeData
+		void SetData(int idx, const SingleModelData &model_data);
+		/// Returns the model matrix of a given object and its derivations
+		const SingleModelData &GetData(int idx) const;
+
+		/// Computes the derivations of 'count' model matrices the same way as SetMatrices, without any UBO.
+		/// It does not call OpenGL, so the data may be computed on another thread and set with SetData.
+		static void ComputeData(const glm::mat4 *models, size_t count, SingleModelData *model_data);
 	};
 
 	/* Use this code in shaders
@@ -277,6 +362,10 @@ layout (std140) uniform ModelData
 	/// To change the number of the lights, change the number of lights in GLSL, and call Init
 	/// with this number of the lights.
 	///
+	/// When the data are stored in a shader storage buffer (target is GL_SHADER_STORAGE_BUFFER),
+	/// the number of lights is not limited. The GLSL array has no size, and the buffer grows
+	/// in UpdateOpenGLData when there are more lights than it can contain.
+	///
 	/// The data of individual lights are public (to ease prototyping), in PhongLights array.
 	/// The size of this array needs not to be the same as the maximum number of supported lights
 	/// for which the UBO is prepared. Only the data of the lights that are used are copied into
@@ -295,6 +384,10 @@ layout (std140) uniform ModelData
 		GLuint buffer;
 		size_t max_lights;
 		GLenum target;
+		FrameDataRing *ring;					// Ring the data are streamed through, or nullptr
+		GLintptr ring_offset;					// Offset of the data in the ring, or -1 if they are in 'buffer'
+		GLsizeiptr ring_size;					// Size of the data in the ring
+		unsigned int ring_frame;				// Frame of the ring in which the data were written
 
 	public:
 		// Common methods, see the comment at the beginning of this file for more info.
@@ -308,8 +401,14 @@ layout (std140) uniform ModelData
 		std::vector<PhongLight> PhongLights;
 
 		/// Creates all OpenGL objects, allocates the UBO to be able to contain given number of lights.
+		/// For GL_SHADER_STORAGE_BUFFER, max_lights is only the initial capacity.
 		void Init(size_t max_lights = 8, GLenum target = GL_UNIFORM_BUFFER);
 
+		/// Returns the number of lights the buffer can currently contain
+		size_t GetCapacity() const;
+		/// Streams the data through the given ring (nullptr to use only the own buffer), see the beginning of this file
+		void StreamThrough(FrameDataRing *ring);
+
 		/// Set the intensity of the global ambient light
 		void SetGlobalAmbient(const glm::vec3 &global_ambient_color);
 	};
@@ -337,6 +436,15 @@ layout (std140) uniform PhongLightsData
 	PhongLight lights[#count];
 };
 
+	- or, when stored in a shader storage buffer (the layout of std430 is the same here)
+
+layout (std430) buffer PhongLightsData
+{
+	vec3 global_ambient_color;
+	int lights_count;
+	PhongLight lights[];
+};
+
 // Evaluates the lighting of one Phong light
 // light	.. [in] parameters of the light that is evaluated
 // amb		.. [out] result, ambient part
@@ -436,6 +544,9 @@ void EvaluatePhongLight(in PhongLight light, out vec3 amb, out vec3 dif, out vec
 		std::vector<PhongMaterial> data;
 		GLuint buffer;
 		GLenum target;
+		size_t stride;							// Distance between the materials in the buffer, in bytes
+		std::vector<unsigned char> staging;		// Data of the aligned materials before they are copied into the buffer
+		DirtyElements dirty;					// Materials that changed since they were copied into the buffer
 
 	public:
 		// Common methods, see the comment at the beginning of this file for more info.
@@ -446,7 +557,12 @@ void EvaluatePhongLight(in PhongLight light, out vec3 amb, out vec3 dif, out vec
 		void UpdateOpenGLData();
 
 		/// Creates all OpenGL objects, allocates the UBO to be able to contain given number of materials.
-		void Init(size_t count = 1, GLenum target = GL_UNIFORM_BUFFER);
+		///
+		/// When 'aligned_records' is true, each material is aligned to the offset alignment of the target, and
+		/// the materials are bound one at a time with BindBuffer(index, idx), see ModelData_UBO::Init.
+		void Init(size_t count = 1, GLenum target = GL_UNIFORM_BUFFER, bool aligned_records = false);
+		/// Binds the data of a single material to given binding point (glBindBufferRange), see Init
+		void BindBuffer(GLuint index, int idx);
 
 		/// Sets the data of the material
 		void SetMaterial(const PhongMaterial &material);
@@ -2,6 +2,9 @@
 
 #include "glm/gtx/color_space.hpp"
 
+#include <chrono>
+#include <random>
+
 //---------------------
 //----    SCENE    ----
 //---------------------
@@ -18,60 +21,46 @@ const float glass_quad_vertices[glass_quad_vertices_count * 8] =
 	 glass_size, 0.0f, glass_size,		 0.0f, 1.0f, 0.0f,		1.0f, 0.0f,
 };
 
-/// Reloads all shaders
-void reload_shaders()
+/// Starts an asynchronous rebuild of a program from a vertex shader and a fragment shader.
+/// The current version of the program is used until the new one is built.
+void rebuild_program(ShaderProgram &program, const char *vertex_shader, const char *fragment_shader)
 {
-	notexture_program.Init();
-	notexture_program.AddVertexShader("Shaders/notexture_vertex.glsl");
-	notexture_program.AddFragmentShader("Shaders/notexture_fragment.glsl");
-	notexture_program.Link();
-
-	texture_program.Init();
-	texture_program.AddVertexShader("Shaders/texture_vertex.glsl");
-	texture_program.AddFragmentShader("Shaders/texture_fragment.glsl");
-	texture_program.Link();
-
-	display_texture_program.Init();
-	display_texture_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	display_texture_program.AddFragmentShader("Shaders/display_texture_fragment.glsl");
-	display_texture_program.Link();
-
-	evaluate_lighting_program.Init();
-	evaluate_lighting_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	evaluate_lighting_program.AddFragmentShader("Shaders/evaluate_lighting_fragment.glsl");
-	evaluate_lighting_program.Link();
-
-	ignore_ssao_program.Init();
-	ignore_ssao_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	ignore_ssao_program.AddFragmentShader("Shaders/ignore_ssao_fragment.glsl");
-	ignore_ssao_program.Link();
-
-	evaluate_ssao_program.Init();
-	evaluate_ssao_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	evaluate_ssao_program.AddFragmentShader("Shaders/evaluate_ssao_fragment.glsl");
-	evaluate_ssao_program.Link();
-
-	display_shadow_texture_program.Init();
-	display_shadow_texture_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	display_shadow_texture_program.AddFragmentShader("Shaders/display_shadow_texture_fragment.glsl");
-	display_shadow_texture_program.Link();
-
-	gen_shadow_program.Init();
-	gen_shadow_program.AddVertexShader("Shaders/nolit_vertex.glsl");
-	gen_shadow_program.AddFragmentShader("Shaders/nothing_fragment.glsl");
-	gen_shadow_program.Link();
-
-	expand_program.Init();
-	expand_program.AddVertexShader("Shaders/expand_vertex.glsl");
-	expand_program.AddFragmentShader("Shaders/nolit_fragment.glsl");
-	expand_program.Link();
-
-	blur_ssao_program.Init();
-	blur_ssao_program.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
-	blur_ssao_program.AddFragmentShader("Shaders/blur_ssao_texture_fragment.glsl");
-	blur_ssao_program.Link();
+	ShaderProgram &new_program = program.BeginRebuild();
+	new_program.AddVertexShader(vertex_shader);
+	new_program.AddFragmentShader(fragment_shader);
+	new_program.LinkAsync();
+}
 
-	cout << "Shaders are reloaded" << endl;
+/// Reloads all shaders. The programs are compiled in the background, see ShaderProgram::PollPendingPrograms in on_display.
+void reload_shaders()
+{
+	shaders_reload_start_time = glutGet(GLUT_ELAPSED_TIME);
+
+	rebuild_program(notexture_program, "Shaders/notexture_vertex.glsl", "Shaders/notexture_fragment.glsl");
+	rebuild_program(texture_program, "Shaders/texture_vertex.glsl", "Shaders/texture_fragment.glsl");
+	rebuild_program(display_texture_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/display_texture_fragment.glsl");
+
+	// The variants are built when they are used for the first time
+	evaluate_lighting_variants.Init();
+	evaluate_lighting_variants.AddVertexShader("Shaders/fullscreen_quad_vertex.glsl");
+	evaluate_lighting_variants.AddFragmentShader("Shaders/evaluate_lighting_fragment.glsl");
+	evaluate_lighting_variants.AddFlag(LIGHTING_TOON, "TOON");
+	evaluate_lighting_variants.AddFlag(LIGHTING_SHADOW, "SHADOW");
+
+	rebuild_program(ignore_ssao_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/ignore_ssao_fragment.glsl");
+	rebuild_program(evaluate_ssao_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/evaluate_ssao_fragment.glsl");
+	rebuild_program(glass_program, "Shaders/notexture_vertex.glsl", "Shaders/glass_fragment.glsl");
+	rebuild_program(display_shadow_texture_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/display_shadow_texture_fragment.glsl");
+	rebuild_program(gen_shadow_program, "Shaders/nolit_vertex.glsl", "Shaders/nothing_fragment.glsl");
+	rebuild_program(expand_program, "Shaders/expand_vertex.glsl", "Shaders/nolit_fragment.glsl");
+	rebuild_program(blur_ssao_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/blur_ssao_texture_fragment.glsl");
+	rebuild_program(temporal_ssao_program, "Shaders/fullscreen_quad_vertex.glsl", "Shaders/temporal_ssao_fragment.glsl");
+
+	ShaderProgram &new_assign_lights_program = assign_lights_program.BeginRebuild();
+	new_assign_lights_program.AddComputeShader("Shaders/assign_lights_compute.glsl");
+	new_assign_lights_program.LinkAsync();
+
+	cout << "Shaders are being reloaded" << endl;
 }
 
 /// Initializes all objects of our scene
@@ -85,58 +74,104 @@ void init_scene()
 	//----------------------------------------------
 	//--  Load shaders
 
+	// Sizes of the blocks in the shaders are checked against the C++ structures when the programs are linked
+	ShaderProgram::SetExpectedBlockSize("CameraData", sizeof(CameraData_UBO::SingleCameraData));
+	ShaderProgram::SetExpectedBlockSize("ModelData", sizeof(ModelData_UBO::SingleModelData));
+	ShaderProgram::SetExpectedBlockSize("MaterialData", sizeof(PhongMaterial));
+	ShaderProgram::SetExpectedBlockSize("PhongLightsData", sizeof(PhongLightsData_UBO::PhongLightsDataHeader), sizeof(PhongLight));
+	ShaderProgram::SetExpectedBlockSize("KernelSamples", sizeof(glm::vec4) * SSAO_KernelSize);
+	ShaderProgram::SetExpectedBlockSize("ClusterLightGrid", 0, sizeof(glm::uvec2));
+	ShaderProgram::SetExpectedBlockSize("ClusterLightIndices", sizeof(GLuint), sizeof(GLuint));
+
 	reload_shaders();
+
+	// The uniforms that are set every frame are set by their ids
+	ShadowMatrix_uniform = ShaderProgram::GetUniformId("shadow_matrix");
+	ClusterGrid_uniform = ShaderProgram::GetUniformId("cluster_grid");
+	ClusterNear_uniform = ShaderProgram::GetUniformId("cluster_near");
+	ClusterFar_uniform = ShaderProgram::GetUniformId("cluster_far");
+	ClusterLightIndicesCapacity_uniform = ShaderProgram::GetUniformId("cluster_light_indices_capacity");
+	LightCutoff_uniform = ShaderProgram::GetUniformId("light_cutoff");
+	AssignPass_uniform = ShaderProgram::GetUniformId("assign_pass");
+	GlassLightsCount_uniform = ShaderProgram::GetUniformId("glass_lights_count");
+	SSAO_Radius_uniform = ShaderProgram::GetUniformId("SSAO_Radius");
+	SSAO_SampleCount_uniform = ShaderProgram::GetUniformId("SSAO_SampleCount");
+	SSAO_SampleOffset_uniform = ShaderProgram::GetUniformId("SSAO_SampleOffset");
+	SSAO_NoiseRotation_uniform = ShaderProgram::GetUniformId("SSAO_NoiseRotation");
+	PrevView_uniform = ShaderProgram::GetUniformId("prev_view");
+	PrevProjection_uniform = ShaderProgram::GetUniformId("prev_projection");
+	HistoryValid_uniform = ShaderProgram::GetUniformId("history_valid");
+	HistoryWeight_uniform = ShaderProgram::GetUniformId("history_weight");
+	DisocclusionThreshold_uniform = ShaderProgram::GetUniformId("disocclusion_threshold");
+	Transformation_uniform = ShaderProgram::GetUniformId("transformation");
+
+	// Watch the files of the shaders, the changed programs are rebuilt automatically
+	shader_reloader.Watch(&notexture_program);
+	shader_reloader.Watch(&texture_program);
+	shader_reloader.Watch(&display_texture_program);
+	shader_reloader.Watch(&evaluate_lighting_variants);
+	shader_reloader.Watch(&ignore_ssao_program);
+	shader_reloader.Watch(&evaluate_ssao_program);
+	shader_reloader.Watch(&display_shadow_texture_program);
+	shader_reloader.Watch(&glass_program);
+	shader_reloader.Watch(&gen_shadow_program);
+	shader_reloader.Watch(&expand_program);
+	shader_reloader.Watch(&blur_ssao_program);
+	shader_reloader.Watch(&temporal_ssao_program);
+	shader_reloader.Watch(&assign_lights_program);
 	
+	//----------------------------------------------
+	//--  Prepare the ring for the data that change every frame
+
+	// Cameras and lights are written into the ring, so that updating them never waits for the GPU
+	FrameData_ring.Init(1024 * 1024);
+	CameraData_ubo.StreamThrough(&FrameData_ring);
+	LightCameraData_ubo.StreamThrough(&FrameData_ring);
+	PhongLights_ubo.StreamThrough(&FrameData_ring);
+
 	//----------------------------------------------
 	//--  Prepare the lights
 	
-	PhongLights_ubo.Init();
+	PhongLights_ubo.Init(1024, GL_SHADER_STORAGE_BUFFER);
 	PhongLights_ubo.SetGlobalAmbient(glm::vec3(0.0f));
 	PhongLights_ubo.PhongLights.push_back(PhongLight::CreateDirectionalLight(glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(0.7f), glm::vec3(0.3f), glm::vec3(0.0f)));
 	PhongLights_ubo.UpdateOpenGLData();
 
+	// Buffers for the lists of lights of the clusters
+	Cluster_LightGrid_SSBO = CreateImmutableBuffer(sizeof(GLuint) * 2 * ClusterGrid.x * ClusterGrid.y * ClusterGrid.z, nullptr);
+	ClusterLightIndicesCapacity = ClusterInitialLightIndices;
+	Cluster_LightIndices_SSBO = CreateMutableBuffer(sizeof(GLuint) * (1 + ClusterLightIndicesCapacity), nullptr);
+	for (int i = 0; i < ClusterReadbackCount; i++)
+		Cluster_Readback_Buffers[i] = CreateMutableBuffer(sizeof(GLuint), nullptr, GL_STREAM_READ);
+
+	// Buffer for the list of the lights of the glass, it grows when the list does not fit
+	GlassLightsCapacity = 256;
+	GlassLights_SSBO = CreateMutableBuffer(sizeof(GLint) * GlassLightsCapacity, nullptr);
+
 	//----------------------------------------------
 	//--  Prepare materials
 
-	RedMaterial_ubo.Init();
-	GreenMaterial_ubo.Init();
-	BlueMaterial_ubo.Init();
-	CyanMaterial_ubo.Init();
-	MagentaMaterial_ubo.Init();
-	YellowMaterial_ubo.Init();
-	WhiteMaterial_ubo.Init();
-	FloorMaterial_ubo.Init();
-	GlassMaterial_ubo.Init();
-	BlackMaterial_ubo.Init();
-	RedMaterial_ubo.SetMaterial		(PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 0.0f, 0.0f), true, 200.0f, 1.0f));
-	GreenMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 1.0f, 0.0f), true, 200.0f, 1.0f));
-	BlueMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 0.0f, 1.0f), true, 200.0f, 1.0f));
-	CyanMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 1.0f, 1.0f), true, 200.0f, 1.0f));
-	MagentaMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 0.0f, 1.0f), true, 200.0f, 1.0f));
-	YellowMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 0.0f), true, 200.0f, 1.0f));
-	WhiteMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 1.0f), true, 200.0f, 1.0f));
-	FloorMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(0.7f, 0.7f, 0.7f), true, 200.0f, 1.0f));
-	GlassMaterial_ubo.SetMaterial	(PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 1.0f), false, 0.0f, 0.5f));
-	BlackMaterial_ubo.SetMaterial(PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f), false, 0.0f, 1.0f));
-	RedMaterial_ubo.UpdateOpenGLData();
-	GreenMaterial_ubo.UpdateOpenGLData();
-	BlueMaterial_ubo.UpdateOpenGLData();
-	CyanMaterial_ubo.UpdateOpenGLData();
-	MagentaMaterial_ubo.UpdateOpenGLData();
-	YellowMaterial_ubo.UpdateOpenGLData();
-	WhiteMaterial_ubo.UpdateOpenGLData();
-	FloorMaterial_ubo.UpdateOpenGLData();
-	GlassMaterial_ubo.UpdateOpenGLData();
-	BlackMaterial_ubo.UpdateOpenGLData();
+	Materials_ubo.Init(MaterialCount, GL_UNIFORM_BUFFER, true);
+	Materials_ubo.SetMaterial(RedMaterial,		PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 0.0f, 0.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(GreenMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 1.0f, 0.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(BlueMaterial,		PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 0.0f, 1.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(CyanMaterial,		PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f, 1.0f, 1.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(MagentaMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 0.0f, 1.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(YellowMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 0.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(WhiteMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 1.0f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(FloorMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(0.7f, 0.7f, 0.7f), true, 200.0f, 1.0f));
+	Materials_ubo.SetMaterial(GlassMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(1.0f, 1.0f, 1.0f), false, 0.0f, 0.5f));
+	Materials_ubo.SetMaterial(BlackMaterial,	PhongMaterial::CreateBasicMaterial(glm::vec3(0.0f), false, 0.0f, 1.0f));
+	Materials_ubo.UpdateOpenGLData();
 
 	// Add the materials into our list of materials (we do not add the material for the floor, only the basic colors)
-	Colors_ubo.push_back(&RedMaterial_ubo);
-	Colors_ubo.push_back(&GreenMaterial_ubo);
-	Colors_ubo.push_back(&BlueMaterial_ubo);
-	Colors_ubo.push_back(&CyanMaterial_ubo);
-	Colors_ubo.push_back(&MagentaMaterial_ubo);
-	Colors_ubo.push_back(&YellowMaterial_ubo);
-	Colors_ubo.push_back(&WhiteMaterial_ubo);
+	Colors.push_back(RedMaterial);
+	Colors.push_back(GreenMaterial);
+	Colors.push_back(BlueMaterial);
+	Colors.push_back(CyanMaterial);
+	Colors.push_back(MagentaMaterial);
+	Colors.push_back(YellowMaterial);
+	Colors.push_back(WhiteMaterial);
 
 	//----------------------------------------------
 	//--  Prepare all cameras
@@ -184,14 +219,14 @@ void init_scene()
 	//--  Prepare textures
 
 	wood_tex = CreateAndLoadTexture2D(L"../../textures/wood.jpg");
-	glBindTexture(GL_TEXTURE_2D, wood_tex);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, wood_tex);
 	SetTexture2DParameters(GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 
 	lenna_tex = CreateAndLoadTexture2D(L"../../textures/Lenna.jpg");
-	glBindTexture(GL_TEXTURE_2D, lenna_tex);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, lenna_tex);
 	SetTexture2DParameters(GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 	
 	// Add the textures into our list of textures
 	Textures.push_back(wood_tex);
@@ -199,10 +234,10 @@ void init_scene()
 
 	// Create the shadow texture, allocate its memory, and set its basic parameters
 	glGenTextures(1, &ShadowTexture);
-	glBindTexture(GL_TEXTURE_2D, ShadowTexture);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, ShadowTexture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, ShadowTexSize, ShadowTexSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
 	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 
 	//----------------------------------------------
 	//--  Prepare objects in the scene
@@ -215,7 +250,18 @@ void init_scene()
 	int x_grid_size = 11;
 	int z_grid_size = 11;
 
-	Models_ubo.resize(x_grid_size * z_grid_size);
+	// The objects in the grid are followed by the floor and the glass
+	FloorModel = x_grid_size * z_grid_size;
+	GlassModel = FloorModel + 1;
+	Models_ubo.Init(GlassModel + 1, GL_UNIFORM_BUFFER, true);
+
+	// All objects in the grid are children of a single node, so that the whole grid can be moved at once
+	GridNode = SceneTransforms.AddNode();
+	ObjectNodes.resize(FloorModel);
+	ObjectHandles.resize(FloorModel);
+
+	ScenePrograms.push_back(&notexture_program);		// NoTextureProgram
+	ScenePrograms.push_back(&texture_program);			// TextureProgram
 
 	for (int x = 0; x < x_grid_size; x++)
 	for (int z = 0; z < z_grid_size; z++)
@@ -224,60 +270,52 @@ void init_scene()
 		int geometry = rand() % int(Geometries.size());
 
 		// Rotate the object randomly around the y axis
-		glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), float(rand()) / float(RAND_MAX) * float(M_PI) * 2.0f, glm::vec3(0.0f, 1.0f, 0.0f));
+		glm::quat rotation = glm::angleAxis(float(rand()) / float(RAND_MAX) * float(M_PI) * 2.0f, glm::vec3(0.0f, 1.0f, 0.0f));
 
 		// Place the object at the proper place in the grid
-		glm::mat4 translation = glm::translate(glm::mat4(1.0f), glm::vec3(x_start + float(x) * x_spacing, 0.0f, z_start + float(z) * z_spacing));
+		glm::vec3 translation = glm::vec3(x_start + float(x) * x_spacing, 0.0f, z_start + float(z) * z_spacing);
 
 		// Choose the material randomly, choose randomly between the colors and the textures
-		int material = rand() % int(Colors_ubo.size() + Textures.size());
-
-		// Compute the model matrix
-		Models_ubo[z*x_grid_size + x].Init();
-		Models_ubo[z*x_grid_size + x].SetMatrix(translation * rotation * Geometries[geometry].second);
-		Models_ubo[z*x_grid_size + x].UpdateOpenGLData();
-
-		// Create the scene object and add it into the list
-		SceneObject scene_object;
-		scene_object.geometry = Geometries[geometry].first;
-		scene_object.model_ubo = &Models_ubo[z*x_grid_size + x];
-		if (material < int(Colors_ubo.size()))
+		int material = rand() % int(Colors.size() + Textures.size());
+
+		// Create the node of the object, its model matrix is computed below, with the model matrices of all objects
+		ObjectNodes[z*x_grid_size + x] = SceneTransforms.AddNode(GridNode, translation, rotation);
+		SceneTransforms.BindModel(ObjectNodes[z*x_grid_size + x], z*x_grid_size + x, Geometries[geometry].second);
+
+		// Add the object into the scene
+		if (material < int(Colors.size()))
 		{
 			// Object with a color without textures
-			scene_object.shading_program = &notexture_program;
-			scene_object.material_ubo = Colors_ubo[material];
-			scene_object.texture = 0;
+			ObjectHandles[z*x_grid_size + x] = Scene.Add(geometry, Colors[material], NoTextureProgram, 0, z*x_grid_size + x);
 		}
 		else
 		{
 			// Object with a texture
-			scene_object.shading_program = &texture_program;
-			scene_object.material_ubo = &WhiteMaterial_ubo;
-			scene_object.texture = Textures[material - int(Colors_ubo.size())];
+			ObjectHandles[z*x_grid_size + x] = Scene.Add(geometry, WhiteMaterial, TextureProgram, Textures[material - int(Colors.size())], z*x_grid_size + x);
 		}
-		ObjectsInScene.push_back(scene_object);
 	}
 
+	// Compute the model matrices and the bounds of the objects in the grid
+	SceneTransforms.UpdateWorldMatrices();
+	SceneTransforms.WriteModelData(Models_ubo);
+	update_object_bounds();
+
 	// Prepare the floor model matrix. Its size corresponds to the size of the scene
-	FloorModel_ubo.Init();
-	FloorModel_ubo.SetMatrix(
+	glm::mat4 floor_model_matrix =
 		glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.1f, 0.0f)) *
-		glm::scale(glm::mat4(1.0f), glm::vec3(x_spacing * float(x_grid_size) / 2.0f + 5.0f, 0.1f, z_spacing * float(z_grid_size) / 2.0f + 5.0f)));
-	FloorModel_ubo.UpdateOpenGLData();
-
-	// Add the floor into the list of scene objects
-	SceneObject floor_scene_object;
-	floor_scene_object.geometry = &geom_cube;
-	floor_scene_object.model_ubo = &FloorModel_ubo;
-	floor_scene_object.shading_program = &notexture_program;
-	floor_scene_object.material_ubo = &FloorMaterial_ubo;
-	floor_scene_object.texture = 0;
-	ObjectsInScene.push_back(floor_scene_object);
+		glm::scale(glm::mat4(1.0f), glm::vec3(x_spacing * float(x_grid_size) / 2.0f + 5.0f, 0.1f, z_spacing * float(z_grid_size) / 2.0f + 5.0f));
+	Models_ubo.SetMatrix(FloorModel, floor_model_matrix);
+
+	// Add the floor into the scene, it is a cube (the first geometry in Geometries)
+	SceneStore::Handle floor_handle = Scene.Add(0, FloorMaterial, NoTextureProgram, 0, FloorModel);
+	glm::vec3 floor_min, floor_max;
+	TransformBounds(floor_model_matrix, geom_cube.BoundsMin, geom_cube.BoundsMax, floor_min, floor_max);
+	Scene.SetBounds(floor_handle, floor_min, floor_max);
 
 	//----------------------------------------------
 	//--  Compute the random positions of samples for SSAO
 
-	std::vector<glm::vec4> SSAOSamples(64);
+	std::vector<glm::vec4> SSAOSamples(SSAO_KernelSize);
 	for (size_t i = 0; i < SSAOSamples.size(); i++)
 	{
 		// Create a uniform point on a hemisphere (unit sphere, cut by xy plane, hemisphere in +z direction)
@@ -294,10 +332,7 @@ void init_scene()
 		SSAOSamples[i] = glm::vec4(point_in_hemisphere, 0.0f);
 	}
 	// Create a UBO for these random positions
-	glGenBuffers(1, &SSAO_Samples_UBO);
-	glBindBuffer(GL_UNIFORM_BUFFER, SSAO_Samples_UBO);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(float) * 4 * SSAOSamples.size(), SSAOSamples.data(), GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	SSAO_Samples_UBO = CreateImmutableBuffer(sizeof(float) * 4 * SSAOSamples.size(), SSAOSamples.data());
 
 	//----------------------------------------------
 	//--  Compute random tangent directions for SSAO
@@ -311,81 +346,45 @@ void init_scene()
 	}
 	// Create a 4x4 texture for these random directions
 	glGenTextures(1, &SSAO_RandomTangentVS_Texture);
-	glBindTexture(GL_TEXTURE_2D, SSAO_RandomTangentVS_Texture);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, SSAO_RandomTangentVS_Texture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 4, 4, 0, GL_RGB, GL_FLOAT, SSAORandomTangent.data());
 	SetTexture2DParameters(GL_REPEAT, GL_REPEAT, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 
 	//----------------------------------------------
 	//--  Prepare framebuffers
 
-	glGenTextures(1, &Gbuffer_PositionWS_Texture);
-	glGenTextures(1, &Gbuffer_PositionVS_Texture);
-	glGenTextures(1, &Gbuffer_NormalWS_Texture);
-	glGenTextures(1, &Gbuffer_NormalVS_Texture);
-	glGenTextures(1, &Gbuffer_Albedo_Texture);
-	glGenTextures(1, &Gbuffer_Depth_Texture);
-	glGenTextures(1, &SSAO_Occlusion_Texture);
-	glGenTextures(1, &SSAO_Blurred_Occlusion_Texture);
-	glGenTextures(1, &SSAO_Depth_Texture);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionWS_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionVS_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalWS_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalVS_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_Albedo_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_Depth_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Occlusion_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Blurred_Occlusion_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Depth_Texture);
-	SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	// Allocate the memory of the textures
-	resize_fullscreen_textures();
+	glGenTextures(2, SSAO_History_Texture);
+	for (int i = 0; i < 2; i++)
+	{
+		GLStateCache::BindTexture(GL_TEXTURE_2D, SSAO_History_Texture[i]);
+		SetTexture2DParameters(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
+	}
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
 
-	// Create the G-buffer framebuffer
-	glGenFramebuffers(1, &Gbuffer_FBO);
-	glBindFramebuffer(GL_FRAMEBUFFER, Gbuffer_FBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, Gbuffer_PositionWS_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, Gbuffer_PositionVS_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, Gbuffer_NormalWS_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, Gbuffer_NormalVS_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, Gbuffer_Albedo_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, Gbuffer_Depth_Texture, 0);
-	glDrawBuffers(5, DrawBuffersConstants);
-	CheckFramebufferStatus("Gbuffer");
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// Sampler that filters the rendered image when it is upscaled to the window
+	glGenSamplers(1, &LinearSampler);
+	glSamplerParameteri(LinearSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(LinearSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(LinearSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(LinearSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	// Create the SSAO_Evaluation_FBO framebuffer
-	glGenFramebuffers(1, &SSAO_Evaluation_FBO);
-	glBindFramebuffer(GL_FRAMEBUFFER, SSAO_Evaluation_FBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, SSAO_Occlusion_Texture, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, SSAO_Depth_Texture, 0);
-	glDrawBuffers(1, DrawBuffersConstants);
-	CheckFramebufferStatus("SSAO_Evaluation");
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// The other fullscreen textures and their framebuffers are created by the frame graph
+	Frame_graph.Init(win_width, win_height);
+	build_frame_graph();
 
-	// Create the SSAO_Evaluation_FBO framebuffer
-	glGenFramebuffers(1, &SSAO_Bluring_FBO);
-	glBindFramebuffer(GL_FRAMEBUFFER, SSAO_Bluring_FBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, SSAO_Blurred_Occlusion_Texture, 0);
-	glDrawBuffers(1, DrawBuffersConstants);
-	CheckFramebufferStatus("SSAO_Bluring");
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// Allocate the memory of the textures
+	resize_fullscreen_textures();
 
-	// Create the framebuffer for rendering into the shadow texture, and set the shadow texture to it
-	glGenFramebuffers(1, &ShadowFBO);
-	glBindFramebuffer(GL_FRAMEBUFFER, ShadowFBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, ShadowTexture, 0);
-	CheckFramebufferStatus("ShadowFBO");
+	// Create the framebuffers for the accumulation of the temporal SSAO, one for each history texture
+	glGenFramebuffers(2, SSAO_History_FBO);
+	for (int i = 0; i < 2; i++)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, SSAO_History_FBO[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, SSAO_History_Texture[i], 0);
+		glDrawBuffers(1, DrawBuffersConstants);
+		CheckFramebufferStatus("SSAO_History");
+	}
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	//------------------------
@@ -395,31 +394,34 @@ void init_scene()
 	glm::mat4 glass_model_matrix =
 		glm::translate(glm::mat4(1.0f), glm::vec3(-5.0f, 10.0f, 0.0f)) *
 		glm::rotate(glm::mat4(1.0f), 0.5f, glm::vec3(0.0f, 0.0f, 1.0f));
-	GlassModel_ubo.Init();
-	GlassModel_ubo.SetMatrix(glass_model_matrix);
-	GlassModel_ubo.UpdateOpenGLData();
+	Models_ubo.SetMatrix(GlassModel, glass_model_matrix);
+	Models_ubo.UpdateOpenGLData();		// All model matrices are set now
+
+	// The update thread starts with the same data of the objects, and only the objects that change later are sent to the render thread
+	SimulatedModels.resize(GlassModel + 1);
+	for (int i = 0; i <= GlassModel; i++)
+		SimulatedModels[i] = Models_ubo.GetData(i);
+	IsModelPending.assign(SimulatedModels.size(), false);
+
+	// Bounds of the glass for culling of the lights
+	GlassBoundsMin = glm::vec3(FLT_MAX);
+	GlassBoundsMax = glm::vec3(-FLT_MAX);
+	for (int i = 0; i < glass_quad_vertices_count; i++)
+	{
+		glm::vec3 corner = glm::vec3(glass_model_matrix * glm::vec4(glass_quad_vertices[i * 8], glass_quad_vertices[i * 8 + 1], glass_quad_vertices[i * 8 + 2], 1.0f));
+		GlassBoundsMin = glm::min(GlassBoundsMin, corner);
+		GlassBoundsMax = glm::max(GlassBoundsMax, corner);
+	}
 
 	// Create glass geometry
 	geom_glass.VertexBuffers.resize(1, 0);
-	glGenBuffers(1, &geom_glass.VertexBuffers[0]);
-	glBindBuffer(GL_ARRAY_BUFFER, geom_glass.VertexBuffers[0]);
-	glBufferData(GL_ARRAY_BUFFER, glass_quad_vertices_count * sizeof(float) * 8, glass_quad_vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object for glass geometry
-	glGenVertexArrays(1, &geom_glass.VAO);
-
-	// Set the parameters of the geometry
-	glBindVertexArray(geom_glass.VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, geom_glass.VertexBuffers[0]);
-	glEnableVertexAttribArray(DEFAULT_POSITION_LOC);
-	glVertexAttribPointer(DEFAULT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, 0);
-	glEnableVertexAttribArray(DEFAULT_NORMAL_LOC);
-	glVertexAttribPointer(DEFAULT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 3));
-	glEnableVertexAttribArray(DEFAULT_TEX_COORD_LOC);
-	glVertexAttribPointer(DEFAULT_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 8, (const void *)(sizeof(float) * 6));
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	geom_glass.VertexBuffers[0] = CreateImmutableBuffer(glass_quad_vertices_count * sizeof(float) * 8, glass_quad_vertices);
+
+	// Create a vertex array object for glass geometry and set its parameters
+	geom_glass.VAO = CreateVertexArray();
+	SetVertexAttribute(geom_glass.VAO, DEFAULT_POSITION_LOC, geom_glass.VertexBuffers[0], 3, sizeof(float) * 8, 0);
+	SetVertexAttribute(geom_glass.VAO, DEFAULT_NORMAL_LOC, geom_glass.VertexBuffers[0], 3, sizeof(float) * 8, sizeof(float) * 3);
+	SetVertexAttribute(geom_glass.VAO, DEFAULT_TEX_COORD_LOC, geom_glass.VertexBuffers[0], 2, sizeof(float) * 8, sizeof(float) * 6);
 
 	// Set the Mode and the number of vertices to draw
 	geom_glass.Mode = GL_TRIANGLE_STRIP;
@@ -439,64 +441,405 @@ void init_scene()
 
 	ShadowMatrix = shadow_matrix_translation * LightCameraProjection * LightCameraView;
 
-	// Create the query object
-	glGenQueries(1, &RenderTimeQuery);
+	// Create the query objects
+	glGenQueries(RenderTimeQueryCount, RenderTimeQueries);
 }
 
-/// Updates the scene: performs animations, updates the data of the buffers, etc.
+/// Updates the scene: applies the latest snapshot from the update thread, and updates the data of the buffers
 void update_scene(int app_time_diff_ms)
 {
+	// Remember the data of the main camera from the previous frame for the temporal SSAO
+	PrevCameraProjection = CameraProjection;
+	PrevCameraView = CameraView;
+
+	// Apply the latest state simulated on the update thread (if a new one is ready, otherwise the scene stays the same)
+	if (SceneSnapshots.Acquire())
+	{
+		SceneSnapshot &snapshot = SceneSnapshots.GetReadSnapshot();
+		app_time_ms = snapshot.app_time_ms;
+		CameraView = snapshot.camera_view;
+		CameraProjection = snapshot.camera_projection;
+
+		// The snapshot contains only the objects that changed since the last applied snapshot, UpdateOpenGLData copies only them
+		for (size_t i = 0; i < snapshot.changed_models.size(); i++)
+			Models_ubo.SetData(snapshot.changed_models[i], snapshot.changed_model_data[i]);
+		if (!snapshot.changed_models.empty())
+		{
+			Models_ubo.UpdateOpenGLData();
+			SceneVersion++;
+		}
+
+		// The light is directional, it is in all clusters regardless of its direction, so only the shadows and the lighting change
+		if (snapshot.light_camera_view != LightCameraView)
+		{
+			LightCameraView = snapshot.light_camera_view;
+			LightVersion++;
+		}
+		if (snapshot.point_lights_version != AppliedPointLightsVersion)
+		{
+			AppliedPointLightsVersion = snapshot.point_lights_version;
+			LightsVersion++;
+		}
+
+		// The lists are swapped, the update thread writes them again when it gets the snapshot back
+		PhongLights_ubo.PhongLights.swap(snapshot.visible_lights);
+		GlassLights.swap(snapshot.glass_lights);
+		std::swap(ShadowPackets, snapshot.shadow_packets);
+		std::swap(CelPackets, snapshot.cel_packets);
+		std::swap(ScenePackets, snapshot.scene_packets);
+
+		// Upload the list of the lights of the glass, the indices are into the visible lights of the same snapshot
+		if (GlassLights.size() > GlassLightsCapacity)
+		{
+			GlassLightsCapacity = GlassLights.size() * 2;
+			SetBufferData(GlassLights_SSBO, sizeof(GLint) * GlassLightsCapacity, nullptr);
+		}
+		UpdateBufferData(GlassLights_SSBO, 0, sizeof(GLint) * GlassLights.size(), GlassLights.data());
+
+		visible_lights_count = int(PhongLights_ubo.PhongLights.size());
+		glass_lights_count = int(GlassLights.size());
+		packets_build_ms = snapshot.packets_build_ms;
+		drawn_objects_count = int(ScenePackets.GetCount());
+	}
+
 	// Data of the main camera
-	CameraData_ubo.SetProjection(glm::perspective(glm::radians(45.0f), float(win_width) / float(win_height), 0.5f, 1000.0f));
-	CameraData_ubo.SetCamera(the_camera);
+	CameraData_ubo.SetProjection(CameraProjection);
+	CameraData_ubo.SetCamera(CameraView);
 	CameraData_ubo.UpdateOpenGLData();
+	if ((CameraView != PrevCameraView) || (CameraProjection != PrevCameraProjection))
+		CameraVersion++;
 
-	glm::vec3 light_position = 15.0f * glm::vec3(
-		cosf(light_pos / 6.0f) * sinf(light_pos),
-		sinf(light_pos / 6.0f),
-		cosf(light_pos / 6.0f) * cosf(light_pos));
+	// Data of the camera that is used when rendering from the light
+	LightCameraData_ubo.SetCamera(LightCameraView);
+	LightCameraData_ubo.UpdateOpenGLData();
 
-	// Data of the lights
-	PhongLights_ubo.PhongLights.clear();
-	PhongLights_ubo.PhongLights.push_back(PhongLight::CreateDirectionalLight(light_position, glm::vec3(0.7f), glm::vec3(0.3f), glm::vec3(0.0f)));
+	ShadowMatrix = shadow_matrix_translation * LightCameraProjection * LightCameraView;
+
+	// The lights are streamed through FrameData_ring, so they are written in every frame
 	PhongLights_ubo.UpdateOpenGLData();
+}
 
-	LightCameraView = glm::lookAt(
+/// Simulates one step of the scene on the update thread, and publishes its snapshot for the render thread. It must not call OpenGL.
+void simulate_scene(float step_seconds)
+{
+	SimulationTimeMs += step_seconds * 1000.0f;
+
+	// Take the input from the GLUT thread
+	std::vector<InputEvent> input_events;
+	float light_direction;
+	int animated_count;
+	int lights_count;
+	float aspect;
+	bool temporal;
+	{
+		std::lock_guard<std::mutex> lock(GuiMutex);
+		input_events.swap(InputEvents);
+		light_direction = light_pos;
+		animated_count = std::min(animated_objects_count, int(ObjectNodes.size()));
+		lights_count = extra_lights_count;
+		aspect = float(win_width) / float(win_height);
+		temporal = temporal_ssao;
+	}
+
+	// Nothing can change in a static view, the render thread keeps the last published snapshot (which contains
+	// all the pending objects), so that neither the lights, nor the draw packets, nor the snapshot are built again
+	if (input_events.empty() && (animated_count == 0) && (light_direction == SimulatedLightDirection) &&
+		(lights_count == int(ExtraLights.size())) && (aspect == SimulatedAspect))
+		return;
+	SimulatedLightDirection = light_direction;
+	SimulatedAspect = aspect;
+
+	SceneSnapshot &snapshot = SceneSnapshots.GetWriteSnapshot();
+	snapshot.app_time_ms = int(SimulationTimeMs);
+
+	// Move the camera
+	for (const InputEvent &event : input_events)
+	{
+		if (event.type == InputEvent::MOUSE_BUTTON)
+			the_camera.OnMouseFunc(event.button, event.state, event.x, event.y);
+		else
+			the_camera.OnMotionFunc(event.x, event.y);
+	}
+	snapshot.camera_view = the_camera.GetViewMatrix();
+	snapshot.camera_projection = glm::perspective(glm::radians(45.0f), aspect, CameraNear, CameraFar);
+
+	// Data of the camera that is used when rendering from the light
+	glm::vec3 light_position = 15.0f * glm::vec3(
+		cosf(light_direction / 6.0f) * sinf(light_direction),
+		sinf(light_direction / 6.0f),
+		cosf(light_direction / 6.0f) * cosf(light_direction));
+	snapshot.light_camera_view = glm::lookAt(
 		light_position,
 		glm::vec3(0.0f, 1.0f, 0.0f),
 		glm::vec3(0.0f, 1.0f, 0.0f));
-	LightCameraData_ubo.SetCamera(LightCameraView);
-	LightCameraData_ubo.UpdateOpenGLData();
 
-	ShadowMatrix = shadow_matrix_translation * LightCameraProjection * LightCameraView;
+	// Lift some of the objects up and down, they are spread over the grid
+	for (int i = 0; i < animated_count; i++)
+	{
+		int idx = int(ObjectNodes.size()) * i / animated_count;
+		glm::vec3 translation = SceneTransforms.GetTranslation(ObjectNodes[idx]);
+		translation.y = 0.25f * (1.0f + sinf(float(snapshot.app_time_ms) * 0.003f + float(idx)));
+		SceneTransforms.SetTranslation(ObjectNodes[idx], translation);
+	}
+	// Only the nodes that changed (and their subtrees) are recomputed
+	StepModels.clear();
+	if (SceneTransforms.UpdateWorldMatrices() > 0)
+	{
+		simulate_model_data();
+		update_object_bounds();
+	}
+	// Send the objects that changed since the last snapshot the render thread took, it may skip some snapshots
+	snapshot.changed_models.clear();
+	snapshot.changed_model_data.clear();
+	for (int model : PendingModels)
+	{
+		snapshot.changed_models.push_back(model);
+		snapshot.changed_model_data.push_back(SimulatedModels[model]);
+	}
+
+	// Lights, the first one is the light which casts shadows
+	if (int(ExtraLights.size()) != lights_count)
+	{
+		generate_extra_lights(lights_count);
+		PointLightsVersion++;
+	}
+	snapshot.point_lights_version = PointLightsVersion;
+	Lights.Clear();
+	Lights.AddLight(PhongLight::CreateDirectionalLight(light_position, glm::vec3(0.7f), glm::vec3(0.3f), glm::vec3(0.0f)));
+	for (const PhongLight &light : ExtraLights)
+		Lights.AddLight(light);
+	simulate_lights(snapshot);
+
+	build_draw_packets(snapshot);
+
+	// In the on-demand mode, request a frame only when the snapshot differs from the previous one
+	if ((animated_count > 0) || (snapshot.camera_view != PublishedCameraView) || (snapshot.camera_projection != PublishedCameraProjection) ||
+		(light_position != PublishedLightPosition) || (snapshot.point_lights_version != PublishedPointLightsVersion))
+		Pacer.RequestFrames(temporal ? SSAO_SettleFrames : 1);
+	PublishedCameraView = snapshot.camera_view;
+	PublishedCameraProjection = snapshot.camera_projection;
+	PublishedLightPosition = light_position;
+	PublishedPointLightsVersion = snapshot.point_lights_version;
+
+	// When the render thread took the previous snapshot, the next one needs only the objects that changed since it,
+	// i.e. in this step (this snapshot may be skipped). Otherwise the previous snapshot was dropped, and the objects are kept.
+	if (SceneSnapshots.Publish())
+	{
+		for (int model : PendingModels)
+			IsModelPending[model] = false;
+		PendingModels.clear();
+		for (int model : StepModels)
+		{
+			IsModelPending[model] = true;
+			PendingModels.push_back(model);
+		}
+	}
+}
+
+/// Computes the data of the objects whose nodes changed in the last SceneTransforms.UpdateWorldMatrices into SimulatedModels,
+/// and adds the objects into StepModels and PendingModels
+void simulate_model_data()
+{
+	std::vector<int> models;
+	std::vector<glm::mat4> matrices;
+	for (int node : SceneTransforms.GetChangedNodes())
+	{
+		int model = SceneTransforms.GetModelIndex(node);
+		if (model < 0)
+			continue;
+		models.push_back(model);
+		matrices.push_back(SceneTransforms.GetModelMatrix(node));
+	}
+
+	// The matrices are inverted together (four at a time), and the data are scattered to the objects
+	std::vector<ModelData_UBO::SingleModelData> model_data(matrices.size());
+	ModelData_UBO::ComputeData(matrices.data(), matrices.size(), model_data.data());
+	for (size_t i = 0; i < models.size(); i++)
+	{
+		SimulatedModels[models[i]] = model_data[i];
+		StepModels.push_back(models[i]);
+		if (!IsModelPending[models[i]])
+		{
+			IsModelPending[models[i]] = true;
+			PendingModels.push_back(models[i]);
+		}
+	}
+}
+
+/// Culls the lights in Lights against the view frustum of the main camera in the snapshot, and writes the visible lights
+/// and the lights of the objects rendered with forward shading into the snapshot
+void simulate_lights(SceneSnapshot &snapshot)
+{
+	Lights.BuildBVH();
+	Lights.CullFrustum(snapshot.camera_projection * snapshot.camera_view);
+	Lights.GetVisibleLightData(snapshot.visible_lights);
+	Lights.GetLightsForBounds(GlassBoundsMin, GlassBoundsMax, snapshot.glass_lights);
+}
+
+/// Updates the bounds of the objects in the grid whose nodes changed in the last SceneTransforms.UpdateWorldMatrices
+void update_object_bounds()
+{
+	const int *geometry_ids = Scene.GetGeometryIds();
+	for (int node : SceneTransforms.GetChangedNodes())
+	{
+		int model = SceneTransforms.GetModelIndex(node);
+		if ((model < 0) || (model >= int(ObjectHandles.size())))
+			continue;
+		const Geometry *geometry = Geometries[geometry_ids[Scene.GetIndex(ObjectHandles[model])]].first;
+		glm::vec3 bounds_min, bounds_max;
+		TransformBounds(SceneTransforms.GetModelMatrix(node), geometry->BoundsMin, geometry->BoundsMax, bounds_min, bounds_max);
+		Scene.SetBounds(ObjectHandles[model], bounds_min, bounds_max);
+	}
+}
+
+/// Builds the lists of the objects drawn in the passes into the snapshot. This does not call OpenGL, the work is split among
+/// the threads of the job system (the update thread is not one of them, it fills the list DrawPacketList keeps for other threads).
+void build_draw_packets(SceneSnapshot &snapshot)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	snapshot.shadow_packets.Build(Scene, SceneStore::FLAG_VISIBLE | SceneStore::FLAG_CASTS_SHADOW, LightCameraProjection * snapshot.light_camera_view);
+	snapshot.cel_packets.Build(Scene, SceneStore::FLAG_VISIBLE | SceneStore::FLAG_OUTLINE, snapshot.camera_projection * snapshot.camera_view);
+	snapshot.scene_packets.Build(Scene, SceneStore::FLAG_VISIBLE, snapshot.camera_projection * snapshot.camera_view);
+
+	auto end = std::chrono::high_resolution_clock::now();
+	snapshot.packets_build_ms = std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+void generate_extra_lights(int count)
+{
+	// Point lights with random colors, placed randomly above the floor. Always use the same seed,
+	// so that the lights stay at their places when their number changes. The generator is local,
+	// this runs on the update thread and must not change the sequence of rand() of the GLUT thread.
+	std::mt19937 generator(54321);
+	std::uniform_real_distribution<float> random(0.0f, 1.0f);
+	ExtraLights.clear();
+	for (int i = 0; i < count; i++)
+	{
+		glm::vec3 position(
+			random(generator) * 40.0f - 20.0f,
+			random(generator) * 2.5f + 0.5f,
+			random(generator) * 40.0f - 20.0f);
+		glm::vec3 color = glm::rgbColor(glm::vec3(random(generator) * 360.0f, 1.0f, 1.0f)) * 2.0f;
+		ExtraLights.push_back(PhongLight::CreatePointLight(position, glm::vec3(0.0f), color, color, 1.0f, 0.0f, 20.0f));
+	}
+}
+
+void assign_lights_to_clusters()
+{
+	if (!assign_lights_program.IsValid())
+		return;
+
+	// Reset the counter of the indices
+	GLuint zero = 0;
+	UpdateBufferData(Cluster_LightIndices_SSBO, 0, sizeof(GLuint), &zero);
+
+	// Bind all buffers that we need
+	CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
+	PhongLights_ubo.BindBuffer(DEFAULT_LIGHTS_BINDING);
+	GLStateCache::BindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_BINDING, Cluster_LightGrid_SSBO);
+	GLStateCache::BindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_BINDING, Cluster_LightIndices_SSBO);
+
+	assign_lights_program.Use();
+	assign_lights_program.Uniform3ui(ClusterGrid_uniform, ClusterGrid.x, ClusterGrid.y, ClusterGrid.z);
+	assign_lights_program.Uniform1f(ClusterNear_uniform, CameraNear);
+	assign_lights_program.Uniform1f(ClusterFar_uniform, CameraFar);
+	assign_lights_program.Uniform1ui(ClusterLightIndicesCapacity_uniform, ClusterLightIndicesCapacity);
+	assign_lights_program.Uniform1f(LightCutoff_uniform, LightCutoff);
+
+	// One invocation for each cluster, 128 invocations in a work group. The first pass counts the lights
+	// of the clusters and reserves their space, the second pass writes them.
+	GLuint cluster_count = ClusterGrid.x * ClusterGrid.y * ClusterGrid.z;
+	assign_lights_program.Uniform1ui(AssignPass_uniform, 0);
+	glDispatchCompute((cluster_count + 127) / 128, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	assign_lights_program.Uniform1ui(AssignPass_uniform, 1);
+	glDispatchCompute((cluster_count + 127) / 128, 1, 1);
+
+	// Make the results visible to the lighting pass, and the counter to the copy below
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	// Copy the number of the indices the clusters needed, it is read in poll_cluster_readback when the copy is finished.
+	// When all buffers are still in use, this frame is not read back, the CPU never waits.
+	if (!Cluster_Readback_Fences[Cluster_Readback_Next])
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, Cluster_LightIndices_SSBO);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, Cluster_Readback_Buffers[Cluster_Readback_Next]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint));
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		Cluster_Readback_Fences[Cluster_Readback_Next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		Cluster_Readback_Next = (Cluster_Readback_Next + 1) % ClusterReadbackCount;
+	}
+}
+
+/// Reads the numbers of the light indices the clusters needed in the previous frames (only those the GPU already finished),
+/// and grows Cluster_LightIndices_SSBO when they did not fit, so that the clusters get all their lights in the next frame
+void poll_cluster_readback()
+{
+	for (int i = 0; i < ClusterReadbackCount; i++)
+	{
+		if (!Cluster_Readback_Fences[i])
+			continue;
+		GLenum result = glClientWaitSync(Cluster_Readback_Fences[i], 0, 0);
+		if ((result != GL_ALREADY_SIGNALED) && (result != GL_CONDITION_SATISFIED))
+			continue;
+		glDeleteSync(Cluster_Readback_Fences[i]);
+		Cluster_Readback_Fences[i] = 0;
+
+		GLuint needed = 0;
+		glBindBuffer(GL_COPY_READ_BUFFER, Cluster_Readback_Buffers[i]);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLuint), &needed);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		cluster_light_indices = int(needed);
+
+		if (needed > ClusterLightIndicesCapacity)
+		{
+			// Some clusters lost their lights, grow the buffer with a reserve and assign the lights again
+			cluster_overflows++;
+			cout << "Clusters need " << needed << " light indices, the capacity " << ClusterLightIndicesCapacity << " is increased" << endl;
+			ClusterLightIndicesCapacity = needed + needed / 2;
+			SetBufferData(Cluster_LightIndices_SSBO, sizeof(GLuint) * (1 + GLsizeiptr(ClusterLightIndicesCapacity)), nullptr);
+			ClustersPass.Invalidate();
+		}
+	}
 }
 
-void render_glass(bool blended)
+/// Renders the glass, either only into the stencil, or lit with forward shading (by the lights in GlassLights) and blended over the image
+void render_glass(bool lit)
 {
-	if (notexture_program.IsValid())
+	ShaderProgram &program = lit ? glass_program : notexture_program;
+	if (program.IsValid())
 	{
 		// Set up depth test and blending
 		glDepthMask(GL_FALSE);
 
-		if (blended)
+		if (lit)
 		{
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+			// Bind the lights and the list of the lights of the glass
+			CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
+			PhongLights_ubo.BindBuffer(DEFAULT_LIGHTS_BINDING);
+			GLStateCache::BindBufferBase(GL_SHADER_STORAGE_BUFFER, GLASS_LIGHTS_BINDING, GlassLights_SSBO);
 		}
 
 		// Set the data of the material
-		GlassMaterial_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING);
+		Materials_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING, GlassMaterial);
 		// Set the data of the object
-		GlassModel_ubo.BindBuffer(DEFAULT_OBJECT_BINDING);
+		Models_ubo.BindBuffer(DEFAULT_OBJECT_BINDING, GlassModel);
 
 		// Use the proper program and set its uniform variables
-		notexture_program.Use();
+		program.Use();
+		if (lit)
+			program.Uniform1i(GlassLightsCount_uniform, int(GlassLights.size()));
 
 		// Render the glass quad
 		geom_glass.BindVAO();
 		geom_glass.Draw();
 
-		if (blended)
+		if (lit)
 		{
 			glDisable(GL_BLEND);
 		}
@@ -527,25 +870,26 @@ void render_cel_stuff()
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_FRONT);
 
-	// Render all objects in the scene
-	for (auto iter = ObjectsInScene.begin(); iter != ObjectsInScene.end(); ++iter)
-	{
-		expand_program.Use();
-		BlackMaterial_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING);
+	// All objects use the same program and material
+	expand_program.Use();
+	Materials_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING, BlackMaterial);
 
+	// Render all objects in the scene that have an outline and are visible
+	const size_t count = CelPackets.GetCount();
+	const DrawPacket *packets = CelPackets.GetPackets();
+	for (size_t i = 0; i < count; i++)
+	{
 		// Set the data of the object
-		if (iter->model_ubo)
-			iter->model_ubo->BindBuffer(DEFAULT_OBJECT_BINDING);
+		if (packets[i].transform_id >= 0)
+			Models_ubo.BindBuffer(DEFAULT_OBJECT_BINDING, packets[i].transform_id);
 
 		// Set the texture
-		glActiveTexture(GL_TEXTURE1);	glBindTexture(GL_TEXTURE_2D, iter->texture);
+		GLStateCache::BindTexture(1, GL_TEXTURE_2D, packets[i].texture);
 
 		// Render the object
-		if (iter->geometry)
-		{
-			iter->geometry->BindVAO();
-			iter->geometry->Draw();
-		}
+		const Geometry *geometry = Geometries[packets[i].geometry_id].first;
+		geometry->BindVAO();
+		geometry->Draw();
 	}
 
 	glCullFace(GL_BACK);
@@ -560,8 +904,11 @@ void render_stuff_once(bool gen_shadows)
 		glCullFace(GL_FRONT);
 	}
 
-	// Render all objects in the scene
-	for (auto iter = ObjectsInScene.begin(); iter != ObjectsInScene.end(); ++iter)
+	// Render all visible objects in the scene, the shadow pass renders only the objects that cast shadows
+	const DrawPacketList &packet_list = gen_shadows ? ShadowPackets : ScenePackets;
+	const size_t count = packet_list.GetCount();
+	const DrawPacket *packets = packet_list.GetPackets();
+	for (size_t i = 0; i < count; i++)
 	{
 		if (gen_shadows)
 		{
@@ -569,30 +916,32 @@ void render_stuff_once(bool gen_shadows)
 		}
 		else
 		{
-			if (iter->shading_program && iter->shading_program->IsValid())
+			ShaderProgram *program = ScenePrograms[packets[i].program_id];
+			if (program->IsValid())
 			{
-				iter->shading_program->Use();
-				//iter->shading_program->UniformMatrix4fv("shadow_matrix", 1, GL_FALSE, glm::value_ptr(ShadowMatrix));
+				program->Use();
+				//program->UniformMatrix4fv(ShadowMatrix_uniform, 1, GL_FALSE, glm::value_ptr(ShadowMatrix));
 			}
 			else continue;
 		}
 
 		// Set the data of the material
-		if (iter->material_ubo)
-			iter->material_ubo->BindBuffer(DEFAULT_MATERIAL_BINDING);
+		if (packets[i].material_id >= 0)
+			Materials_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING, packets[i].material_id);
 		// Set the data of the object
-		if (iter->model_ubo)
-			iter->model_ubo->BindBuffer(DEFAULT_OBJECT_BINDING);
+		if (packets[i].transform_id >= 0)
+			Models_ubo.BindBuffer(DEFAULT_OBJECT_BINDING, packets[i].transform_id);
 
 		// Set the texture
-		glActiveTexture(GL_TEXTURE0);	glBindTexture(GL_TEXTURE_2D, iter->texture);
+		GLStateCache::BindTexture(0, GL_TEXTURE_2D, packets[i].texture);
 
-		// Render the object
-		if (iter->geometry)
-		{
-			iter->geometry->BindVAO();
-			iter->geometry->Draw();
-		}
+		// Render the object, the shadow pass needs only the positions
+		const Geometry *geometry = Geometries[packets[i].geometry_id].first;
+		if (gen_shadows)
+			geometry->BindDepthOnlyVAO();
+		else
+			geometry->BindVAO();
+		geometry->Draw();
 	}
 
 	if (gen_shadows)
@@ -603,19 +952,15 @@ void render_stuff_once(bool gen_shadows)
 
 void evaluate_ssao()
 {
-	// Bind the proper framebuffer
-	glBindFramebuffer(GL_FRAMEBUFFER, SSAO_Evaluation_FBO);
-	glViewport(0, 0, win_width, win_height);
-
-	// Bind all textures that we need
-	glActiveTexture(GL_TEXTURE0);	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionVS_Texture);
-	glActiveTexture(GL_TEXTURE1);	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalVS_Texture);
-	glActiveTexture(GL_TEXTURE2);	glBindTexture(GL_TEXTURE_2D, SSAO_RandomTangentVS_Texture);
+	// Bind all textures that we need (the framebuffer is bound by Frame_graph)
+	GLStateCache::BindTexture(0, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_PositionVS));
+	GLStateCache::BindTexture(1, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_NormalVS));
+	GLStateCache::BindTexture(2, GL_TEXTURE_2D, SSAO_RandomTangentVS_Texture);
 
 	// Bind all UBOs that we need
 	CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
 	// Although the binding point 1 is usually used by the data of the lights, we do not need the lights here, so we may use this binding point
-	glBindBufferBase(GL_UNIFORM_BUFFER, 1, SSAO_Samples_UBO);
+	GLStateCache::BindBufferBase(GL_UNIFORM_BUFFER, 1, SSAO_Samples_UBO);
 
 	// sklo do stencil bufferu
 	glEnable(GL_STENCIL_TEST);
@@ -627,8 +972,24 @@ void evaluate_ssao()
 	glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
 
 	// Use the proper program and set its uniform variables
+	// The number of the samples and the radius are lowered by Governor when the frames are over the budget
+	ssao_samples_count = std::max(int(float(temporal_ssao ? SSAO_TemporalSamples : SSAO_KernelSize) * SSAO_SampleFractions[SSAO_QualityLevel]), 1);
 	evaluate_ssao_program.Use();
-	evaluate_ssao_program.Uniform1f("SSAO_Radius", SSAO_Radius);
+	evaluate_ssao_program.Uniform1f(SSAO_Radius_uniform, SSAO_Radius * SSAO_RadiusScales[SSAO_QualityLevel]);
+	evaluate_ssao_program.Uniform1i(SSAO_SampleCount_uniform, ssao_samples_count);
+	if (temporal_ssao)
+	{
+		// Use only a part of the kernel in each frame, and rotate it, the rest is done by the accumulation
+		const float golden_angle = 2.39996323f;
+		evaluate_ssao_program.Uniform1i(SSAO_SampleOffset_uniform, int((SSAO_FrameIndex * ssao_samples_count) % SSAO_KernelSize));
+		evaluate_ssao_program.Uniform1f(SSAO_NoiseRotation_uniform, fmodf(float(SSAO_FrameIndex) * golden_angle, 2.0f * float(M_PI)));
+		SSAO_FrameIndex++;
+	}
+	else
+	{
+		evaluate_ssao_program.Uniform1i(SSAO_SampleOffset_uniform, 0);
+		evaluate_ssao_program.Uniform1f(SSAO_NoiseRotation_uniform, 0.0f);
+	}
 
 	// Render the fullscreen quad to evaluate every pixel
 	geom_fullscreen_quad.BindVAO();
@@ -647,12 +1008,46 @@ void evaluate_ssao()
 	glDisable(GL_STENCIL_TEST);
 }
 
-void blur_ssao()
+void accumulate_ssao()
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, SSAO_Bluring_FBO);
-	glViewport(0, 0, win_width, win_height);
+	// Swap the history textures, the one from the previous frame is read, the other one is written
+	int previous = SSAO_History_Current;
+	SSAO_History_Current = 1 - SSAO_History_Current;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, SSAO_History_FBO[SSAO_History_Current]);
+	glViewport(0, 0, Frame_graph.GetRenderWidth(), Frame_graph.GetRenderHeight());
 
-	glActiveTexture(GL_TEXTURE0);	glBindTexture(GL_TEXTURE_2D, SSAO_Occlusion_Texture);
+	GLStateCache::BindTexture(0, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_PositionWS));
+	GLStateCache::BindTexture(1, GL_TEXTURE_2D, Frame_graph.GetTexture(SSAO_Occlusion));
+	GLStateCache::BindTexture(2, GL_TEXTURE_2D, SSAO_History_Texture[previous]);
+
+	CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
+
+	temporal_ssao_program.Use();
+	temporal_ssao_program.UniformMatrix4fv(PrevView_uniform, 1, GL_FALSE, glm::value_ptr(PrevCameraView));
+	temporal_ssao_program.UniformMatrix4fv(PrevProjection_uniform, 1, GL_FALSE, glm::value_ptr(PrevCameraProjection));
+	temporal_ssao_program.Uniform1i(HistoryValid_uniform, SSAO_History_Valid ? 1 : 0);
+	temporal_ssao_program.Uniform1f(HistoryWeight_uniform, SSAO_HistoryWeight);
+	temporal_ssao_program.Uniform1f(DisocclusionThreshold_uniform, SSAO_DisocclusionThreshold);
+
+	geom_fullscreen_quad.BindVAO();
+	geom_fullscreen_quad.Draw();
+
+	SSAO_History_Valid = true;
+}
+
+void blur_ssao()
+{
+	// Blur the accumulated occlusion when the temporal SSAO is used, or the occlusion from this frame otherwise
+	if (temporal_ssao)
+	{
+		GLStateCache::BindTexture(0, GL_TEXTURE_2D, SSAO_History_Texture[SSAO_History_Current]);
+	}
+	else
+	{
+		GLStateCache::BindTexture(0, GL_TEXTURE_2D, Frame_graph.GetTexture(SSAO_Occlusion));
+		SSAO_History_Valid = false;		// The history is not updated, it must not be used later
+	}
 
 	blur_ssao_program.Use();
 
@@ -666,8 +1061,8 @@ void display_shadow_tex()
 	display_shadow_texture_program.Use();
 	glDisable(GL_DEPTH_TEST);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ShadowTexture);
+	GLStateCache::ActiveTexture(0);
+	GLStateCache::BindTexture(GL_TEXTURE_2D, ShadowTexture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
 
 	geom_fullscreen_quad.BindVAO();
@@ -677,39 +1072,40 @@ void display_shadow_tex()
 void render_ssao_final(bool shadow_toon_rendering)
 {
 	// Bind all textures that we need
-	glActiveTexture(GL_TEXTURE0);	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionWS_Texture);
-	glActiveTexture(GL_TEXTURE1);	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalWS_Texture);
-	glActiveTexture(GL_TEXTURE2);	glBindTexture(GL_TEXTURE_2D, Gbuffer_Albedo_Texture);
-	glActiveTexture(GL_TEXTURE3);	glBindTexture(GL_TEXTURE_2D, SSAO_Blurred_Occlusion_Texture);
-	glActiveTexture(GL_TEXTURE4);	glBindTexture(GL_TEXTURE_2D, ShadowTexture);
+	GLStateCache::BindTexture(0, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_PositionWS));
+	GLStateCache::BindTexture(1, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_NormalWS));
+	GLStateCache::BindTexture(2, GL_TEXTURE_2D, Frame_graph.GetTexture(Gbuffer_Albedo));
+	GLStateCache::BindTexture(3, GL_TEXTURE_2D, Frame_graph.GetTexture(SSAO_Blurred_Occlusion));
+	GLStateCache::ActiveTexture(4);		// The parameters below are set to the texture in the active unit
+	GLStateCache::BindTexture(GL_TEXTURE_2D, ShadowTexture);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
 
-	// Bind all UBOs that we need
+	// Bind all UBOs and SSBOs that we need
 	CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
 	PhongLights_ubo.BindBuffer(DEFAULT_LIGHTS_BINDING);
-	WhiteMaterial_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING);		// Bind the data with the specular color and shininess (all materials have the same)
+	Materials_ubo.BindBuffer(DEFAULT_MATERIAL_BINDING, WhiteMaterial);		// Bind the data with the specular color and shininess (all materials have the same)
+	GLStateCache::BindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_BINDING, Cluster_LightGrid_SSBO);
+	GLStateCache::BindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_BINDING, Cluster_LightIndices_SSBO);
 
-	evaluate_lighting_program.Use();
-	evaluate_lighting_program.Uniform1i("compute_toon_and_shadow", shadow_toon_rendering ? 1 : 0);
-	evaluate_lighting_program.UniformMatrix4fv("shadow_matrix", 1, GL_FALSE, glm::value_ptr(ShadowMatrix));
+	// Toon shading and shadows are compiled into a separate variant of the program
+	unsigned int variant = shadow_toon_rendering ? (LIGHTING_TOON | LIGHTING_SHADOW) : 0;
+	if (!evaluate_lighting_variants.UseVariant(variant))
+		return;
+	ShaderProgram *evaluate_lighting_program = evaluate_lighting_variants.GetVariant(variant);
+	evaluate_lighting_program->UniformMatrix4fv(ShadowMatrix_uniform, 1, GL_FALSE, glm::value_ptr(ShadowMatrix));
+	evaluate_lighting_program->Uniform3ui(ClusterGrid_uniform, ClusterGrid.x, ClusterGrid.y, ClusterGrid.z);
+	evaluate_lighting_program->Uniform1f(ClusterNear_uniform, CameraNear);
+	evaluate_lighting_program->Uniform1f(ClusterFar_uniform, CameraFar);
 
 	// Render the fullscreen quad to evaluate every pixel
 	geom_fullscreen_quad.BindVAO();
 	geom_fullscreen_quad.Draw();
 }
 
-/// Renders the whole frame
-void render_scene()
+/// Renders the scene from the light into the shadow texture
+void render_shadow_map()
 {
-	// Start measuring the elapsed time
-	glBeginQuery(GL_TIME_ELAPSED, RenderTimeQuery);
-
-	// Render into shadow texture
-
-	glBindFramebuffer(GL_FRAMEBUFFER, ShadowFBO);
-	glViewport(0, 0, ShadowTexSize, ShadowTexSize);
-
 	// Clear the framebuffer, clear only the depth (there is no color)
 	glClearDepth(1.0);
 	glClear(GL_DEPTH_BUFFER_BIT);
@@ -719,15 +1115,17 @@ void render_scene()
 
 	render_stuff_once(true);
 
-	// Render into the G-buffer
-
-	glBindFramebuffer(GL_FRAMEBUFFER, Gbuffer_FBO);
-	glViewport(0, 0, win_width, win_height);
+	glDisable(GL_DEPTH_TEST);
+}
 
+/// Renders the scene into the G-buffer
+void render_gbuffer()
+{
 	// Clear the G-buffer, i.e., clear all textures to (0,0,0,0) and depth to 1.0
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClearDepth(1.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
 
 	CameraData_ubo.BindBuffer(DEFAULT_CAMERA_BINDING);
 	PhongLights_ubo.BindBuffer(DEFAULT_LIGHTS_BINDING);
@@ -744,19 +1142,15 @@ void render_scene()
 	glDisable(GL_STENCIL_TEST);
 
 	render_stuff_once(false);
-	
-	glDisable(GL_DEPTH_TEST);
 
-	// niekde ma byt glass
-	render_glass(true);
-
-	evaluate_ssao();
-
-	blur_ssao();
+	glDisable(GL_DEPTH_TEST);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, win_width, win_height);
+	// The glass is not in the G-buffer, it is rendered with forward shading in render_lighting
+}
 
+/// Evaluates the lighting from the G-buffer into the final image
+void render_lighting()
+{
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClearDepth(1.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -775,49 +1169,280 @@ void render_scene()
 	glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
 	render_ssao_final(false);
 
+	// The glass itself, over the image behind it
+	render_glass(true);
+
 	glDisable(GL_STENCIL_TEST);
+}
+
+/// Displays a texture on the whole screen, its colors are transformed by a matrix
+void display_texture(GLuint texture, const glm::mat4 &transformation)
+{
+	display_texture_program.Use();
+	display_texture_program.UniformMatrix4fv(Transformation_uniform, 1, GL_FALSE, glm::value_ptr(transformation));
+
+	GLStateCache::BindTexture(0, GL_TEXTURE_2D, texture);
+	glBindSampler(0, LinearSampler);		// The texture may be smaller than the window when the render scale is below 1
+
+	geom_fullscreen_quad.BindVAO();
+	geom_fullscreen_quad.Draw();
+
+	glBindSampler(0, 0);
+}
+
+/// Describes the passes of the frame and the textures they read and write. The passes that do not contribute
+/// to what is displayed are culled, so the graph is built again when display_mode or temporal_ssao changes.
+void build_frame_graph()
+{
+	Frame_graph.Clear();
+	FrameGraphDisplayMode = display_mode;
+	FrameGraphTemporalSSAO = temporal_ssao;
+
+	// The textures that are used again in the next frames are persistent, as the passes that write them may be skipped
+	// (see PassCache). The others are transient, the depth of the G-buffer and of the SSAO share the same memory.
+	FrameGraph::Resource shadow_map = Frame_graph.ImportTexture("Shadow map", ShadowTexture, GL_DEPTH_COMPONENT, ShadowTexSize, ShadowTexSize);
+	Gbuffer_PositionWS = Frame_graph.CreateTexture("G-buffer position WS", GL_RGBA32F, true);
+	Gbuffer_PositionVS = Frame_graph.CreateTexture("G-buffer position VS", GL_RGBA32F, true);
+	Gbuffer_NormalWS = Frame_graph.CreateTexture("G-buffer normal WS", GL_RGBA16F, true);
+	Gbuffer_NormalVS = Frame_graph.CreateTexture("G-buffer normal VS", GL_RGBA16F, true);
+	Gbuffer_Albedo = Frame_graph.CreateTexture("G-buffer albedo", GL_RGBA8, true);
+	FrameGraph::Resource gbuffer_depth = Frame_graph.CreateTexture("G-buffer depth", GL_DEPTH24_STENCIL8);
+	SSAO_Occlusion = Frame_graph.CreateTexture("SSAO occlusion", GL_R8);
+	FrameGraph::Resource ssao_depth = Frame_graph.CreateTexture("SSAO depth", GL_DEPTH24_STENCIL8);
+	SSAO_Blurred_Occlusion = Frame_graph.CreateTexture("SSAO blurred occlusion", GL_R8, true);
+	FrameGraph::Resource ssao_history = Frame_graph.ImportExternal("SSAO history");		// SSAO_History_Texture, with their own framebuffers
+	FrameGraph::Resource light_clusters = Frame_graph.ImportExternal("Light clusters");	// Cluster_LightGrid_SSBO and Cluster_LightIndices_SSBO
+	FrameGraph::Resource backbuffer = Frame_graph.ImportBackbuffer();
+	Frame_graph.SetOutput(backbuffer);
+
+	FrameGraph::Pass pass = Frame_graph.AddPass("Shadow map", render_shadow_map);
+	Frame_graph.Write(pass, shadow_map);
+	Frame_graph.SetCondition(pass, []() { return RunShadowPass; });
+
+	pass = Frame_graph.AddPass("G-buffer", render_gbuffer);
+	Frame_graph.Write(pass, Gbuffer_PositionWS);
+	Frame_graph.Write(pass, Gbuffer_PositionVS);
+	Frame_graph.Write(pass, Gbuffer_NormalWS);
+	Frame_graph.Write(pass, Gbuffer_NormalVS);
+	Frame_graph.Write(pass, Gbuffer_Albedo);
+	Frame_graph.Write(pass, gbuffer_depth);
+	Frame_graph.SetCondition(pass, []() { return RunGbufferPass; });
+
+	pass = Frame_graph.AddPass("SSAO evaluation", evaluate_ssao);
+	Frame_graph.Read(pass, Gbuffer_PositionVS);
+	Frame_graph.Read(pass, Gbuffer_NormalVS);
+	Frame_graph.Write(pass, SSAO_Occlusion);
+	Frame_graph.Write(pass, ssao_depth);
+	Frame_graph.SetCondition(pass, []() { return RunSSAOPasses; });
+
+	if (temporal_ssao)
+	{
+		pass = Frame_graph.AddPass("SSAO accumulation", accumulate_ssao);
+		Frame_graph.Read(pass, Gbuffer_PositionWS);
+		Frame_graph.Read(pass, SSAO_Occlusion);
+		Frame_graph.Read(pass, ssao_history);
+		Frame_graph.Write(pass, ssao_history);
+		Frame_graph.SetCondition(pass, []() { return RunSSAOPasses; });
+	}
+
+	pass = Frame_graph.AddPass("SSAO blur", blur_ssao);
+	Frame_graph.Read(pass, temporal_ssao ? ssao_history : SSAO_Occlusion);
+	Frame_graph.Write(pass, SSAO_Blurred_Occlusion);
+	Frame_graph.SetCondition(pass, []() { return RunSSAOPasses; });
+
+	pass = Frame_graph.AddPass("Light clusters", assign_lights_to_clusters);
+	Frame_graph.Write(pass, light_clusters);
+	Frame_graph.SetCondition(pass, []() { return RunClustersPass; });
+
+	// The pass that renders into the screen is always run, the content of the back buffer is undefined after the buffers are swapped
+	switch (display_mode)
+	{
+	case DISPLAY_FINAL:
+		pass = Frame_graph.AddPass("Lighting", render_lighting);
+		Frame_graph.Read(pass, Gbuffer_PositionWS);
+		Frame_graph.Read(pass, Gbuffer_NormalWS);
+		Frame_graph.Read(pass, Gbuffer_Albedo);
+		Frame_graph.Read(pass, SSAO_Blurred_Occlusion);
+		Frame_graph.Read(pass, shadow_map);
+		Frame_graph.Read(pass, light_clusters);
+		if (RenderScale < 1.0f)
+		{
+			// The image is rendered in the render size and upscaled to the window
+			FrameGraph::Resource lighting = Frame_graph.CreateTexture("Lighting", GL_RGBA8);
+			Frame_graph.Write(pass, lighting);
+			Frame_graph.Write(pass, Frame_graph.CreateTexture("Lighting depth", GL_DEPTH24_STENCIL8));
+			pass = Frame_graph.AddPass("Upscale", [lighting]() { display_texture(Frame_graph.GetTexture(lighting), glm::mat4(1.0f)); });
+			Frame_graph.Read(pass, lighting);
+		}
+		break;
+	case DISPLAY_SHADOW_MAP:
+		pass = Frame_graph.AddPass("Display shadow map", display_shadow_tex);
+		Frame_graph.Read(pass, shadow_map);
+		break;
+	case DISPLAY_SSAO:
+		pass = Frame_graph.AddPass("Display SSAO", []() {
+			// Display the occlusion in grayscale
+			glm::mat4 red_to_gray(0.0f);
+			red_to_gray[0] = glm::vec4(1.0f, 1.0f, 1.0f, 0.0f);
+			red_to_gray[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+			display_texture(Frame_graph.GetTexture(SSAO_Blurred_Occlusion), red_to_gray);
+		});
+		Frame_graph.Read(pass, SSAO_Blurred_Occlusion);
+		break;
+	case DISPLAY_ALBEDO:
+		pass = Frame_graph.AddPass("Display albedo", []() { display_texture(Frame_graph.GetTexture(Gbuffer_Albedo), glm::mat4(1.0f)); });
+		Frame_graph.Read(pass, Gbuffer_Albedo);
+		break;
+	}
+	Frame_graph.Write(pass, backbuffer);
+}
+
+/// Compiles the frame graph, i.e. creates its textures
+void compile_frame_graph()
+{
+	Frame_graph.Compile();
+
+	// The textures are new (and the culled passes did not run), so the results of all passes must be computed again
+	ShadowPass.Invalidate();
+	GbufferPass.Invalidate();
+	SSAOPass.Invalidate();
+	ClustersPass.Invalidate();
+
+	culled_passes_count = Frame_graph.GetCulledPassCount();
+	frame_graph_memory_mb = float(Frame_graph.GetAllocatedBytes()) / (1024.0f * 1024.0f);
+	aliasing_saved_mb = float(Frame_graph.GetUnaliasedBytes() - Frame_graph.GetAllocatedBytes()) / (1024.0f * 1024.0f);
+	cout << "Frame graph: " << culled_passes_count << " passes culled, textures use " << frame_graph_memory_mb << " MB, "
+		<< aliasing_saved_mb << " MB saved by aliasing" << endl;
+}
+
+/// Renders the whole frame
+void render_scene()
+{
+	// Start measuring the elapsed time, unless all queries still wait for the results of the previous frames
+	const int query = RenderTimeQueryNext;
+	const bool measured = !RenderTimeQueryPending[query];
+	if (measured)
+		glBeginQuery(GL_TIME_ELAPSED, RenderTimeQueries[query]);
+	GLStateCache::ResetCounters();
+
+	// Build the frame graph again when its passes changed, its textures are created again also when the window was resized
+	if ((display_mode != FrameGraphDisplayMode) || (temporal_ssao != FrameGraphTemporalSSAO))
+		build_frame_graph();
+	if (!Frame_graph.IsCompiled())
+		compile_frame_graph();
+
+	// Grow the lists of the lights of the clusters if they did not fit in the previous frames
+	poll_cluster_readback();
+
+	// The passes run only when their inputs changed, otherwise their results from the last run are used.
+	// The temporal SSAO runs for several more frames after the G-buffer changed, so that it converges.
+	RunShadowPass = ShadowPass.NeedsToRun({ LightVersion, SceneVersion, ProgramsVersion });
+	RunGbufferPass = GbufferPass.NeedsToRun({ CameraVersion, SceneVersion, ProgramsVersion, ViewportVersion });
+	RunSSAOPasses = SSAOPass.NeedsToRun({ GbufferPass.GetOutputVersion(), ProgramsVersion, uint64_t(temporal_ssao), uint64_t(SSAO_QualityLevel) },
+		temporal_ssao ? SSAO_SettleFrames : 0);
+	RunClustersPass = ClustersPass.NeedsToRun({ CameraVersion, LightsVersion, ProgramsVersion });
+
+	// Run the passes, see build_frame_graph
+	Frame_graph.Execute();
+	skipped_passes_count = Frame_graph.GetSkippedPassCount();
 
 	//----------------------------------------------
 
 	// Reset the VAO and the program
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	GLStateCache::BindVertexArray(0);
+	GLStateCache::UseProgram(0);
 
 	// Stop measuring the elapsed time
-	glEndQuery(GL_TIME_ELAPSED);
+	if (measured)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		RenderTimeQueryPending[query] = true;
+		RenderTimeQueryGbuffer[query] = RunGbufferPass;
+		RenderTimeQuerySettings[query] = QualitySettingsVersion;
+		RenderTimeQueryNext = (query + 1) % RenderTimeQueryCount;
+	}
 
-	// Evaluate the query
-	glFinish();					// Wait for OpenGL, don't forget OpenGL is asynchronous
-	GLuint64 render_time;
-	glGetQueryObjectui64v(RenderTimeQuery, GL_QUERY_RESULT, &render_time);
-	render_time_ms = float(render_time) * 1e-6f;
+	// Evaluate the queries of the previous frames the GPU already finished
+	read_render_time_queries();
+	filtered_gl_calls = int(GLStateCache::GetFilteredCalls());
+	frame_ring_stalls = FrameData_ring.GetStallCount();
+	uploaded_bytes_per_frame = int(GetUploadedBytes());
 
 	// :)
 }
 
 void resize_fullscreen_textures()
 {
-	// Resize G-buffer textures to match the window
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionWS_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, win_width, win_height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_PositionVS_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, win_width, win_height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalWS_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, win_width, win_height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_NormalVS_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, win_width, win_height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_Albedo_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, win_width, win_height, 0, GL_RGBA, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, Gbuffer_Depth_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, win_width, win_height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, nullptr);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Occlusion_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, win_width, win_height, 0, GL_RED, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Blurred_Occlusion_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, win_width, win_height, 0, GL_RED, GL_FLOAT, nullptr);
-	glBindTexture(GL_TEXTURE_2D, SSAO_Depth_Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, win_width, win_height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, nullptr);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// The textures of the frame graph are created again with the new size when it is executed
+	Frame_graph.SetWindowSize(win_width, win_height);
+	Frame_graph.SetRenderScale(RenderScale);
+
+	// Resize the history textures of the temporal SSAO to match the other textures of the SSAO
+	for (int i = 0; i < 2; i++)
+	{
+		GLStateCache::BindTexture(GL_TEXTURE_2D, SSAO_History_Texture[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, Frame_graph.GetRenderWidth(), Frame_graph.GetRenderHeight(), 0, GL_RG, GL_FLOAT, nullptr);
+	}
+	GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
+
+	// The content of the history textures is lost
+	SSAO_History_Valid = false;
+}
+
+/// Reads the render times of the previous frames whose queries have their results, from the oldest one. The governor
+/// gets the delayed times, only of the frames rendered with the current settings.
+void read_render_time_queries()
+{
+	for (int i = 0; i < RenderTimeQueryCount; i++)
+	{
+		const int query = (RenderTimeQueryNext + i) % RenderTimeQueryCount;
+		if (!RenderTimeQueryPending[query])
+			continue;
+		GLint available = 0;
+		glGetQueryObjectiv(RenderTimeQueries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;		// The queries of the later frames are not available either
+		RenderTimeQueryPending[query] = false;
+
+		GLuint64 render_time;
+		glGetQueryObjectui64v(RenderTimeQueries[query], GL_QUERY_RESULT, &render_time);
+		render_time_ms = float(render_time) * 1e-6f;
+		// Only the frames that rendered the G-buffer again show the full cost of the settings, the others reuse most of the passes
+		if (RenderTimeQueryGbuffer[query] && (RenderTimeQuerySettings[query] == QualitySettingsVersion) && Governor.Update(render_time_ms))
+			apply_quality_levels();
+	}
+}
+
+/// Sets the quality settings from the levels of the knobs of Governor
+void apply_quality_levels()
+{
+	// The render times of the frames in flight were measured with the old settings
+	QualitySettingsVersion++;
+
+	const float render_scale = RenderScales[Governor.GetLevel(RenderScaleKnob)];
+	const int shadow_tex_size = ShadowTexSizes[Governor.GetLevel(ShadowSizeKnob)];
+	SSAO_QualityLevel = Governor.GetLevel(SSAOQualityKnob);
+
+	if ((shadow_tex_size == ShadowTexSize) && (render_scale == RenderScale))
+		return;		// Only the SSAO changed, it is an input of SSAOPass
+
+	if (shadow_tex_size != ShadowTexSize)
+	{
+		ShadowTexSize = shadow_tex_size;
+		GLStateCache::BindTexture(GL_TEXTURE_2D, ShadowTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, ShadowTexSize, ShadowTexSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+		GLStateCache::BindTexture(GL_TEXTURE_2D, 0);
+	}
+	if (render_scale != RenderScale)
+	{
+		RenderScale = render_scale;
+		resize_fullscreen_textures();
+	}
+
+	// The graph imports the shadow texture with its size, and upscales the image only when the render scale is below 1.
+	// It is compiled again in the next frame, which also invalidates the pass caches, so that all passes run.
+	build_frame_graph();
 }
 
 //-------------------
@@ -830,10 +1455,144 @@ void TW_CALL reload(void *)
 	reload_shaders();
 }
 
+void TW_CALL benchmark_transforms(void *)
+{
+	// Random affine model matrices of many objects
+	const int count = 100000;
+	const int repeats = 10;
+	std::vector<glm::mat4> matrices(count);
+	for (int i = 0; i < count; i++)
+	{
+		glm::vec3 axis = glm::normalize(glm::vec3(float(rand()) / float(RAND_MAX), 1.0f, float(rand()) / float(RAND_MAX)));
+		matrices[i] = glm::translate(glm::mat4(1.0f), glm::vec3(float(rand() % 100), 0.0f, float(rand() % 100))) *
+			glm::rotate(glm::mat4(1.0f), float(rand()) / float(RAND_MAX) * 6.0f, axis) *
+			glm::scale(glm::mat4(1.0f), glm::vec3(1.0f + float(rand() % 4)));
+	}
+
+	ModelData_UBO benchmark_ubo;
+	benchmark_ubo.Init(count, GL_SHADER_STORAGE_BUFFER);
+	std::vector<ModelData_UBO::SingleModelData> baseline(count);
+
+	// Compare the general inversion with glm (the baseline) with setting the matrices one by one, with setting them
+	// all at once, and with setting them in parallel in chunks (the chunks are multiples of 64 objects, so that
+	// no two threads mark the same word of dirty bits). The results of each way are checked against the baseline.
+	const int chunk_size = 4096;
+	const int chunk_count = (count + chunk_size - 1) / chunk_size;
+	int mismatches[3];
+	float max_errors[3];
+	auto baseline_start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; r++)
+		for (int i = 0; i < count; i++)
+			set_model_data_glm(baseline[i], matrices[i]);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; r++)
+		for (int i = 0; i < count; i++)
+			benchmark_ubo.SetMatrix(i, matrices[i]);
+	auto middle = std::chrono::high_resolution_clock::now();
+	mismatches[0] = count_model_data_mismatches(benchmark_ubo, baseline, max_errors[0]);
+	auto batch_start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; r++)
+		benchmark_ubo.SetMatrices(0, matrices.data(), count);
+	auto batch_end = std::chrono::high_resolution_clock::now();
+	mismatches[1] = count_model_data_mismatches(benchmark_ubo, baseline, max_errors[1]);
+	auto parallel_start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; r++)
+	{
+		JobSystem::ParallelFor(0, chunk_count, 1, [&](int begin, int end)
+		{
+			for (int c = begin; c < end; c++)
+			{
+				const int first = c * chunk_size;
+				benchmark_ubo.SetMatrices(first, matrices.data() + first, std::min(chunk_size, count - first));
+			}
+		});
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	mismatches[2] = count_model_data_mismatches(benchmark_ubo, baseline, max_errors[2]);
+
+	benchmark_ubo.Destroy();
+
+	double baseline_ms = std::chrono::duration<double, std::milli>(start - baseline_start).count() / repeats;
+	double single_ms = std::chrono::duration<double, std::milli>(middle - start).count() / repeats;
+	double batch_ms = std::chrono::duration<double, std::milli>(batch_end - batch_start).count() / repeats;
+	double parallel_ms = std::chrono::duration<double, std::milli>(end - parallel_start).count() / repeats;
+	cout << "Transforms of " << count << " objects: glm::inverse " << baseline_ms << " ms, SetMatrix " << single_ms
+		<< " ms (" << baseline_ms / single_ms << "x faster), SetMatrices " << batch_ms << " ms (" << baseline_ms / batch_ms
+		<< "x faster), parallel SetMatrices on " << (JobSystem::GetWorkerCount() + 1) << " threads " << parallel_ms
+		<< " ms (" << baseline_ms / parallel_ms << "x faster)" << endl;
+	const char *names[3] = { "SetMatrix", "SetMatrices", "parallel SetMatrices" };
+	for (int i = 0; i < 3; i++)
+		cout << "  " << names[i] << ": " << (mismatches[i] ? "MISMATCH" : "OK") << ", " << mismatches[i]
+			<< " objects differ from glm::inverse, max. relative error " << max_errors[i] << endl;
+}
+
+/// Sets the model matrix and its derivations with the general inversion of glm, the way ModelData_UBO::SetMatrix
+/// did it before it used the inversion of affine matrices. It is the baseline of benchmark_transforms.
+void set_model_data_glm(ModelData_UBO::SingleModelData &data, const glm::mat4 &model)
+{
+	data.model = model;
+	data.model_inv = glm::inverse(model);
+	data.model_it = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(model))));
+}
+
+/// Returns the number of the objects in the UBO whose data differ from the expected ones by more than
+/// the tolerance (relative to the magnitude of the values), and the maximum relative error
+int count_model_data_mismatches(const ModelData_UBO &ubo, const std::vector<ModelData_UBO::SingleModelData> &expected, float &max_error)
+{
+	const float tolerance = 1e-4f;
+	int mismatches = 0;
+	max_error = 0.0f;
+	for (int i = 0; i < int(expected.size()); i++)
+	{
+		const ModelData_UBO::SingleModelData &data = ubo.GetData(i);
+		float error = 0.0f;
+		for (int c = 0; c < 4; c++)
+			for (int r = 0; r < 4; r++)
+			{
+				error = std::max(error, fabsf(data.model[c][r] - expected[i].model[c][r]) / std::max(1.0f, fabsf(expected[i].model[c][r])));
+				error = std::max(error, fabsf(data.model_inv[c][r] - expected[i].model_inv[c][r]) / std::max(1.0f, fabsf(expected[i].model_inv[c][r])));
+			}
+		for (int c = 0; c < 3; c++)
+			for (int r = 0; r < 3; r++)		// The fourth row is only the padding of std140
+				error = std::max(error, fabsf(data.model_it[c][r] - expected[i].model_it[c][r]) / std::max(1.0f, fabsf(expected[i].model_it[c][r])));
+		max_error = std::max(max_error, error);
+		if (error > tolerance)
+			mismatches++;
+	}
+	return mismatches;
+}
+
 void init_gui()
 {
 	// Initial values
 	light_pos = 4.0f;
+	temporal_ssao = true;
+	extra_lights_count = 0;
+	hot_reload_shaders = true;
+	visible_lights_count = 0;
+	glass_lights_count = 0;
+	cluster_light_indices = 0;
+	cluster_overflows = 0;
+	filtered_gl_calls = 0;
+	frame_ring_stalls = 0;
+	animated_objects_count = 0;
+	uploaded_bytes_per_frame = 0;
+	packets_build_ms = 0.0f;
+	drawn_objects_count = 0;
+	skipped_passes_count = 0;
+	culled_passes_count = 0;
+	frame_graph_memory_mb = 0.0f;
+	aliasing_saved_mb = 0.0f;
+	display_mode = DISPLAY_FINAL;
+	pacing_mode = FramePacer::PACING_FIXED_RATE;
+	target_fps = 60.0f;
+	frames_per_second = 0.0f;
+	frame_cpu_time_ms = 0.0f;
+	redraw_on_demand = false;
+	quality_governor = true;
+	gpu_budget_ms = 16.6f;
+	governor_quality = 1.0f;
+	ssao_samples_count = 0;
 
 	// Initialize AntTweakBar
 	TwInit(TW_OPENGL_CORE, nullptr);
@@ -843,9 +1602,49 @@ void init_gui()
 	// Initialize GUI
 	the_gui = TwNewBar("Parameters");
 	TwAddButton(the_gui, "Reload", reload, nullptr, nullptr);
+	TwEnumVal pacing_modes[] = {
+		{ FramePacer::PACING_UNCAPPED, "Uncapped" },
+		{ FramePacer::PACING_FIXED_RATE, "Fixed rate" },
+		{ FramePacer::PACING_VSYNC, "V-Sync" },
+		{ FramePacer::PACING_ADAPTIVE, "Adaptive" } };
+	TwAddVarRW(the_gui, "Frame pacing", TwDefineEnum("PacingMode", pacing_modes, 4), &pacing_mode, nullptr);
+	TwEnumVal display_modes[] = {
+		{ DISPLAY_FINAL, "Final image" },
+		{ DISPLAY_SHADOW_MAP, "Shadow map" },
+		{ DISPLAY_SSAO, "SSAO" },
+		{ DISPLAY_ALBEDO, "Albedo" } };
+	TwAddVarRW(the_gui, "Display", TwDefineEnum("DisplayMode", display_modes, 4), &display_mode, nullptr);
+	TwAddVarRW(the_gui, "Target FPS", TW_TYPE_FLOAT, &target_fps, "min=10 max=240 step=5");
+	TwAddVarRW(the_gui, "Redraw on demand", TW_TYPE_BOOLCPP, &redraw_on_demand, nullptr);
+	TwAddVarRO(the_gui, "FPS", TW_TYPE_FLOAT, &frames_per_second, nullptr);
+	TwAddVarRO(the_gui, "Frame CPU time (ms)", TW_TYPE_FLOAT, &frame_cpu_time_ms, nullptr);
+	TwAddVarRW(the_gui, "Quality governor", TW_TYPE_BOOLCPP, &quality_governor, nullptr);
+	TwAddVarRW(the_gui, "GPU budget (ms)", TW_TYPE_FLOAT, &gpu_budget_ms, "min=1 max=100 step=0.1");
+	TwAddVarRO(the_gui, "Quality", TW_TYPE_FLOAT, &governor_quality, nullptr);
+	TwAddVarRO(the_gui, "Render scale", TW_TYPE_FLOAT, &RenderScale, nullptr);
+	TwAddVarRO(the_gui, "Shadow map size", TW_TYPE_INT32, &ShadowTexSize, nullptr);
+	TwAddVarRO(the_gui, "SSAO samples", TW_TYPE_INT32, &ssao_samples_count, nullptr);
+	TwAddButton(the_gui, "Benchmark transforms", benchmark_transforms, nullptr, nullptr);
 	TwAddVarRW(the_gui, "Light direction", TW_TYPE_FLOAT, &light_pos, "min=1 max=8 step=0.03");
+	TwAddVarRW(the_gui, "Temporal SSAO", TW_TYPE_BOOLCPP, &temporal_ssao, nullptr);
+	TwAddVarRW(the_gui, "Hot reload shaders", TW_TYPE_BOOLCPP, &hot_reload_shaders, nullptr);
+	TwAddVarRW(the_gui, "Point lights", TW_TYPE_INT32, &extra_lights_count, "min=0 max=10000 step=100");
+	TwAddVarRO(the_gui, "Visible lights", TW_TYPE_INT32, &visible_lights_count, nullptr);
+	TwAddVarRO(the_gui, "Lights on glass", TW_TYPE_INT32, &glass_lights_count, nullptr);
+	TwAddVarRO(the_gui, "Cluster light indices", TW_TYPE_INT32, &cluster_light_indices, nullptr);
+	TwAddVarRO(the_gui, "Cluster overflows", TW_TYPE_INT32, &cluster_overflows, nullptr);
+	TwAddVarRW(the_gui, "Animated objects", TW_TYPE_INT32, &animated_objects_count, "min=0 max=121 step=1");
 
 	TwAddVarRO(the_gui, "Render time (ms)", TW_TYPE_FLOAT, &render_time_ms, nullptr);
+	TwAddVarRO(the_gui, "Skipped GL calls", TW_TYPE_INT32, &filtered_gl_calls, nullptr);
+	TwAddVarRO(the_gui, "Frame data stalls", TW_TYPE_INT32, &frame_ring_stalls, nullptr);
+	TwAddVarRO(the_gui, "Uploaded bytes", TW_TYPE_INT32, &uploaded_bytes_per_frame, nullptr);
+	TwAddVarRO(the_gui, "Draw packets (ms)", TW_TYPE_FLOAT, &packets_build_ms, nullptr);
+	TwAddVarRO(the_gui, "Drawn objects", TW_TYPE_INT32, &drawn_objects_count, nullptr);
+	TwAddVarRO(the_gui, "Skipped passes", TW_TYPE_INT32, &skipped_passes_count, nullptr);
+	TwAddVarRO(the_gui, "Culled passes", TW_TYPE_INT32, &culled_passes_count, nullptr);
+	TwAddVarRO(the_gui, "Frame graph memory (MB)", TW_TYPE_FLOAT, &frame_graph_memory_mb, nullptr);
+	TwAddVarRO(the_gui, "Saved by aliasing (MB)", TW_TYPE_FLOAT, &aliasing_saved_mb, nullptr);
 }
 
 //---------------------------
@@ -855,13 +1654,23 @@ void init_gui()
 /// GLUT callback - when the user presses a key. See glutKeyboardFunc for more info
 void on_keyboard_func(unsigned char key, int x, int y)
 {
-	// Inform AntTweakBar
-	if (TwEventKeyboardGLUT(key, x, y))
-		return;		// Already handled by AntTweakBar
+	// The input may change the GUI or the camera
+	request_redraw();
+
+	// Inform AntTweakBar, it changes the variables read on the update thread
+	{
+		std::lock_guard<std::mutex> lock(GuiMutex);
+		if (TwEventKeyboardGLUT(key, x, y))
+			return;		// Already handled by AntTweakBar
+	}
 
 	switch (key)
 	{
 		case 27:		// Escape key
+			// The threads must be stopped before exit destroys their objects, and the timer resolution restored
+			UpdateThread.Stop();
+			JobSystem::Destroy();
+			Pacer.Destroy();
 			exit(0);
 		default: ;
 	}
@@ -870,7 +1679,11 @@ void on_keyboard_func(unsigned char key, int x, int y)
 /// GLUT callback - when the user presses a special key (like F1 key). See glutSpecialFunc for more info
 void on_special_func(int key, int x, int y)
 {
-	// Inform AntTweakBar
+	// The input may change the GUI or the camera
+	request_redraw();
+
+	// Inform AntTweakBar, it changes the variables read on the update thread
+	std::lock_guard<std::mutex> lock(GuiMutex);
 	if (TwEventSpecialGLUT(key, x, y))
 		return;		// Already handled by AntTweakBar
 }
@@ -878,27 +1691,43 @@ void on_special_func(int key, int x, int y)
 /// GLUT callback - when the user presses or releases a mouse button. See glutMouseFunc for more info
 void on_mouse_func(int button, int state, int x, int y)
 {
-	// Inform AntTweakBar
+	// The input may change the GUI or the camera
+	request_redraw();
+
+	// Inform AntTweakBar, it changes the variables read on the update thread
+	std::lock_guard<std::mutex> lock(GuiMutex);
 	if (TwEventMouseButtonGLUT(button, state, x, y))
 		return;		// Already handled by AntTweakBar
 
-	the_camera.OnMouseFunc(button, state, x, y);
+	// The camera is moved on the update thread
+	InputEvent event = { InputEvent::MOUSE_BUTTON, button, state, x, y };
+	InputEvents.push_back(event);
 }
 
 /// GLUT callback - when the user moves the mouse when holding a botton. See glutMotionFunc for more info
 void on_motion_func(int x, int y)
 {
-	// Inform AntTweakBar
+	// The input may change the GUI or the camera
+	request_redraw();
+
+	// Inform AntTweakBar, it changes the variables read on the update thread
+	std::lock_guard<std::mutex> lock(GuiMutex);
 	if (TwEventMouseMotionGLUT(x, y))
 		return;		// Already handled by AntTweakBar
 
-	the_camera.OnMotionFunc(x, y);
+	// The camera is moved on the update thread
+	InputEvent event = { InputEvent::MOUSE_MOTION, 0, 0, x, y };
+	InputEvents.push_back(event);
 }
 
 /// GLUT callback - when the user moves the mouse when not holding a botton. See glutPassiveMotionFunc for more info
 void on_passive_motion_func(int x, int y)
 {
-	// Inform AntTweakBar
+	// The input may change the GUI or the camera
+	request_redraw();
+
+	// Inform AntTweakBar, it changes the variables read on the update thread
+	std::lock_guard<std::mutex> lock(GuiMutex);
 	if (TwEventMouseMotionGLUT(x, y))
 		return;		// Already handled by AntTweakBar
 }
@@ -906,22 +1735,93 @@ void on_passive_motion_func(int x, int y)
 /// GLUT callback - when the window is resized. See glutReshapeFunc for more info
 void on_reshape(int width, int height)
 {
-	win_width = width;
-	win_height = height;
+	{
+		// The size of the window is read on the update thread, for the projection matrix of the camera
+		std::lock_guard<std::mutex> lock(GuiMutex);
+		win_width = width;
+		win_height = height;
+	}
+	request_redraw();
 	
 	glViewport(0, 0, win_width, win_height);
 	resize_fullscreen_textures();
+	ViewportVersion++;
 	
 	// Inform AntTweakBar
 	TwWindowSize(win_width, win_height);
 }
 
-/// GLUT callback - when our animation timer requests a new frame. See glutTimerFunc for more info
-void on_timer(int)
+/// GLUT callback - when there are no events to process. See glutIdleFunc for more info
+void on_idle()
+{
+	// Rerender the scene when it is time for a new frame, wait only shortly, so that GLUT processes the events in the meantime
+	if (Pacer.WaitForFrame(0.002))
+	{
+		glutPostRedisplay();
+		LastActivityTime = GetTime();
+	}
+	else if (poll_background_work())
+		request_redraw();		// The frames are rendered on demand, and the shaders changed
+	else if (Pacer.IsOnDemand() && (GetTime() - LastActivityTime > IdleTimeout))
+	{
+		// Nothing is rendered, let GLUT sleep until an event comes instead of calling this function all the time
+		IdleSleeping = true;
+		IdleSleeps++;
+		glutIdleFunc(nullptr);
+		glutTimerFunc(IdlePollInterval, on_idle_timer, IdleSleeps);
+	}
+}
+
+/// GLUT callback - while the idle function is off, polls the frames requested by the update thread and the background work.
+/// See glutTimerFunc for more info
+void on_idle_timer(int value)
+{
+	if (!IdleSleeping || (value != IdleSleeps))
+		return;		// The idle function was turned on in the meantime
+	if (poll_background_work())
+		request_redraw();
+	else if (Pacer.IsFrameRequested())
+		wake_idle();
+	else
+		glutTimerFunc(IdlePollInterval, on_idle_timer, value);
+}
+
+/// Requests new frames when something changed in the on-demand mode (see FramePacer), more frames with the temporal SSAO, so that it converges.
+/// Must be called on the GLUT thread.
+void request_redraw()
 {
-	// Register the timer to be called again in 20 ms, and rerender the scene
-	glutTimerFunc(20, on_timer, 0);
-	glutPostRedisplay();
+	Pacer.RequestFrames(temporal_ssao ? SSAO_SettleFrames : 1);
+	wake_idle();
+}
+
+/// Turns the idle function on again when it was turned off in on_idle, must be called on the GLUT thread
+void wake_idle()
+{
+	LastActivityTime = GetTime();
+	if (IdleSleeping)
+	{
+		IdleSleeping = false;
+		glutIdleFunc(on_idle);
+	}
+}
+
+/// Does the work that may be finished in the background, returns true if it changed the programs
+bool poll_background_work()
+{
+	// Execute the jobs of the worker threads that need OpenGL
+	JobSystem::ExecuteMainThreadJobs();
+
+	// Rebuild the programs whose shaders changed, and finish the programs whose asynchronous build is complete
+	if (hot_reload_shaders)
+		shader_reloader.Update();
+	if (ShaderProgram::PollPendingPrograms() > 0)
+	{
+		if (!ShaderProgram::HasPendingPrograms())
+			cout << "Shaders are reloaded in " << (glutGet(GLUT_ELAPSED_TIME) - shaders_reload_start_time) << " ms" << endl;
+		ProgramsVersion++;
+		return true;
+	}
+	return false;
 }
 
 /// GLUT callback - when the window needs to be redrawn. See glutDisplayFunc for more info
@@ -929,13 +1829,36 @@ void on_display()
 {
 	//--  Update all the data
 
+	// Apply the pacing settings changed in the GUI, and start measuring the frame
+	if (Pacer.GetMode() != pacing_mode)
+		Pacer.SetMode(pacing_mode);
+	if (Pacer.GetTargetRate() != target_fps)
+		Pacer.SetTargetRate(target_fps);
+	if (Pacer.IsOnDemand() != redraw_on_demand)
+		Pacer.SetOnDemand(redraw_on_demand);
+	Pacer.BeginFrame();
+
+	// The governor restores the highest quality when it is turned off
+	Governor.SetBudget(gpu_budget_ms);
+	if (Governor.IsEnabled() != quality_governor)
+	{
+		Governor.SetEnabled(quality_governor);
+		apply_quality_levels();
+	}
+
+	// Finish the work done in the background
+	poll_background_work();
+
 	// Update the application time
 	int current_glut_time = glutGet(GLUT_ELAPSED_TIME);
 	int app_time_diff_ms = current_glut_time - last_glut_time;
-	app_time_ms += app_time_diff_ms;
 	last_glut_time = current_glut_time;
 
-	// Update the scene
+	// Start a new frame of the per-frame data, this waits only if the GPU is several frames behind
+	FrameData_ring.BeginFrame();
+	ResetUploadedBytes();
+
+	// Update the scene, it only applies the state simulated on the update thread
 	update_scene(app_time_diff_ms);
 
 	//--  Render the scene
@@ -943,11 +1866,17 @@ void on_display()
 	// Render the scene
 	render_scene();
 	
-	// Render the GUI
+	// Render the GUI, it changes the OpenGL state without the knowledge of the state cache
 	TwDraw();
+	GLStateCache::Invalidate();
 
 	// Swaps the front and back buffer (double-buffering)
 	glutSwapBuffers();
+
+	Pacer.EndFrame();
+	frames_per_second = Pacer.GetFPS();
+	frame_cpu_time_ms = Pacer.GetCPUFrameTime();
+	governor_quality = Governor.GetQuality();
 }
 
 /// Callback function to be called when we make an error in OpenGL
@@ -992,10 +1921,19 @@ int main(int argc, char ** argv)
 	// Set the OpenGL debug callback
 	SetDebugCallback(simple_debug_callback);
 
+	// Start the frames at 60 FPS, the mode can be changed in the GUI
+	Pacer.Init(FramePacer::PACING_FIXED_RATE, 60.0f);
+
+	// Adapt the quality to the GPU time budget, the SSAO is lowered first, then the shadows, and the resolution last
+	Governor.Init(16.6f);
+	RenderScaleKnob = Governor.AddKnob("Render scale", int(sizeof(RenderScales) / sizeof(RenderScales[0])), 0.0f, 0.35f);
+	ShadowSizeKnob = Governor.AddKnob("Shadow map size", int(sizeof(ShadowTexSizes) / sizeof(ShadowTexSizes[0])), 0.35f, 0.65f);
+	SSAOQualityKnob = Governor.AddKnob("SSAO", int(sizeof(SSAO_SampleFractions) / sizeof(SSAO_SampleFractions[0])), 0.65f, 1.0f);
+
 	// Register GLUT callbacks
 	glutDisplayFunc(on_display);
 	glutReshapeFunc(on_reshape);
-	glutTimerFunc(20, on_timer, 0);
+	glutIdleFunc(on_idle);
 
 	glutKeyboardFunc(on_keyboard_func);
 	glutSpecialFunc(on_special_func);
@@ -1003,6 +1941,12 @@ int main(int argc, char ** argv)
 	glutMotionFunc(on_motion_func);
 	glutPassiveMotionFunc(on_passive_motion_func);
 
+	// Store the binaries of the shader programs, so that next time they need not be compiled
+	ShaderProgram::SetBinaryCacheDirectory("ShaderCache");
+
+	// Start the worker threads of the job system
+	JobSystem::Init();
+
 	// Initialize OpenGL stuff
 	init_gui();
 	init_scene();
@@ -1011,11 +1955,20 @@ int main(int argc, char ** argv)
 	last_glut_time = glutGet(GLUT_ELAPSED_TIME);
 	app_time_ms = 0;
 
+	// Simulate the first step, so that the first frame has a snapshot, and start the update thread
+	simulate_scene(0.0f);
+	UpdateThread.Start(UpdateStepsPerSecond, simulate_scene);
+
 	// Run the main loop
 	glutMainLoop();
 
 	// Unload AntTweakBar
 	TwTerminate();
 
+	// Stop the update thread and the worker threads
+	UpdateThread.Stop();
+	JobSystem::Destroy();
+	Pacer.Destroy();
+
 	return 0;
 }
\ No newline at end of file
@@ -14,13 +14,35 @@ using namespace PV227;
 ShaderProgram notexture_program;
 ShaderProgram texture_program;
 ShaderProgram display_texture_program;
-ShaderProgram evaluate_lighting_program;
+ShaderProgramVariants evaluate_lighting_variants;		// Variants are given by LIGHTING_* flags
 ShaderProgram evaluate_ssao_program;
 ShaderProgram ignore_ssao_program;
 ShaderProgram gen_shadow_program;
 ShaderProgram display_shadow_texture_program;
+ShaderProgram glass_program;
 ShaderProgram expand_program;
 ShaderProgram blur_ssao_program;
+ShaderProgram temporal_ssao_program;
+ShaderProgram assign_lights_program;
+// Ids of the uniforms that are set every frame, so that their locations are not searched by name, see ShaderProgram::GetUniformId
+UniformId ShadowMatrix_uniform;
+UniformId ClusterGrid_uniform;
+UniformId ClusterNear_uniform;
+UniformId ClusterFar_uniform;
+UniformId ClusterLightIndicesCapacity_uniform;
+UniformId LightCutoff_uniform;
+UniformId AssignPass_uniform;
+UniformId GlassLightsCount_uniform;
+UniformId SSAO_Radius_uniform;
+UniformId SSAO_SampleCount_uniform;
+UniformId SSAO_SampleOffset_uniform;
+UniformId SSAO_NoiseRotation_uniform;
+UniformId PrevView_uniform;
+UniformId PrevProjection_uniform;
+UniformId HistoryValid_uniform;
+UniformId HistoryWeight_uniform;
+UniformId DisocclusionThreshold_uniform;
+UniformId Transformation_uniform;
 
 // Geometries we use in this lecture
 Geometry geom_cube;
@@ -34,7 +56,7 @@ Geometry geom_fullscreen_quad;
 // List of geometries which we choose for our scene
 std::vector<std::pair<Geometry *, glm::mat4> > Geometries;
 
-// A camera that allows us to look at the object from different views
+// A camera that allows us to look at the object from different views, it is moved on the update thread
 SimpleCamera the_camera;
 
 // Textures
@@ -44,83 +66,174 @@ GLuint lenna_tex;
 std::vector<GLuint> Textures;
 
 // Shadow texture
-GLuint ShadowFBO;			// Framebuffer object that is used when rendering into the shadow texture
 GLuint ShadowTexture;		// Shadow texture
+int ShadowTexSize = 1024;	// Size of the shadow texture, one of ShadowTexSizes chosen by Governor
 glm::mat4 ShadowMatrix;
 
-// Data of our materials
-MaterialData_UBO RedMaterial_ubo;
-MaterialData_UBO GreenMaterial_ubo;
-MaterialData_UBO BlueMaterial_ubo;
-MaterialData_UBO CyanMaterial_ubo;
-MaterialData_UBO MagentaMaterial_ubo;
-MaterialData_UBO YellowMaterial_ubo;
-MaterialData_UBO WhiteMaterial_ubo;
-MaterialData_UBO FloorMaterial_ubo;
-MaterialData_UBO GlassMaterial_ubo;
-MaterialData_UBO BlackMaterial_ubo;
+// Data of our materials, all materials are in a single buffer and each of them is bound by glBindBufferRange
+MaterialData_UBO Materials_ubo;
+// Indices of our materials in Materials_ubo
+enum MaterialIndex
+{
+	RedMaterial,
+	GreenMaterial,
+	BlueMaterial,
+	CyanMaterial,
+	MagentaMaterial,
+	YellowMaterial,
+	WhiteMaterial,
+	FloorMaterial,
+	GlassMaterial,
+	BlackMaterial,
+	MaterialCount
+};
 // List of materials which we choose for our scene
-std::vector<MaterialData_UBO *> Colors_ubo;
+std::vector<int> Colors;
 
-// Data of our objects (their position)
-std::vector<ModelData_UBO> Models_ubo;
-ModelData_UBO FloorModel_ubo;
-ModelData_UBO GlassModel_ubo;
+// Data of our objects (their position), all objects are in a single buffer, the same way as the materials
+ModelData_UBO Models_ubo;
+int FloorModel;			// Index of the floor in Models_ubo
+int GlassModel;			// Index of the glass in Models_ubo
+// Transformations of the objects in the grid, their world matrices are written into Models_ubo
+TransformHierarchy SceneTransforms;
+int GridNode;							// Parent of all objects in the grid
+std::vector<int> ObjectNodes;			// Node of each object in the grid, the index is the same as in Models_ubo
 
 // UBO with random samples in the unit hemisphere for SSAO
 GLuint SSAO_Samples_UBO;
 // Texture with random tangents directions (in view space) for SSAO
 GLuint SSAO_RandomTangentVS_Texture;
 
-// List of objects in the scene. Each object is defined by shaders it uses, its material,
-// model matrix, texture (if used), and geometry.
-struct SceneObject
+// Temporal SSAO - two history textures (ping-pong) with the accumulated occlusion (r) and the distance
+// from the eye at the time it was accumulated (g), and framebuffers to render into them
+GLuint SSAO_History_Texture[2];
+GLuint SSAO_History_FBO[2];
+int SSAO_History_Current = 0;		// Index of the history texture that is written in this frame
+bool SSAO_History_Valid = false;	// False when the history contains no usable data (first frame, resize)
+unsigned int SSAO_FrameIndex = 0;	// Counter used to rotate the kernel from frame to frame
+
+// Objects in the scene. Each object is defined by the index of its geometry in Geometries, the index of its
+// material in Materials_ubo, the index of its program in ScenePrograms, its texture (or 0 if no texture is used),
+// and the index of its model matrix in Models_ubo.
+SceneStore Scene;
+// Handles of the objects in the grid, the index is the same as in Models_ubo
+std::vector<SceneStore::Handle> ObjectHandles;
+// Shader programs of the objects in the scene
+std::vector<ShaderProgram *> ScenePrograms;
+enum ProgramIndex
 {
-	ShaderProgram *shading_program;		// Shader program
-	MaterialData_UBO *material_ubo;		// Material of the object
-	ModelData_UBO *model_ubo;			// Model matrix with the position of the object
-	GLuint texture;						// Texture of the object (or 0 if no texture is used)
-	Geometry *geometry;					// Geomety of the object
+	NoTextureProgram,
+	TextureProgram,
 };
-std::vector<SceneObject> ObjectsInScene;
+// Objects drawn in the shadow pass, in the outline (cel) pass, and in the G-buffer pass, built in parallel
+// on the update thread in each step, and taken from the latest snapshot
+DrawPacketList ShadowPackets;
+DrawPacketList CelPackets;
+DrawPacketList ScenePackets;
 
-// UBO with lights in the scene
+// SSBO with lights in the scene
 PhongLightsData_UBO PhongLights_ubo;
+// Additional point lights that are placed randomly in the scene (their number is set in the GUI)
+std::vector<PhongLight> ExtraLights;
+// CPU-side storage of all lights, only the lights that affect the frame are copied into PhongLights_ubo (on the update thread)
+LightSystem Lights;
+// Bounds of the glass in world space, and the lights that affect it (the glass is rendered with forward shading)
+glm::vec3 GlassBoundsMin;
+glm::vec3 GlassBoundsMax;
+std::vector<int> GlassLights;
+GLuint GlassLights_SSBO;					// GlassLights for the shader of the glass
+size_t GlassLightsCapacity;					// Number of the indices in GlassLights_SSBO
+
+// Clustered shading - lists of lights for each cluster (froxel) of a grid over the view frustum of the main camera
+GLuint Cluster_LightGrid_SSBO;				// Offset and count of the lights of each cluster in Cluster_LightIndices_SSBO
+GLuint Cluster_LightIndices_SSBO;			// Counter and compact lists of the indices of the lights of all clusters
+GLuint ClusterLightIndicesCapacity;			// Number of the indices in Cluster_LightIndices_SSBO, it grows when the clusters need more
+// The counter of Cluster_LightIndices_SSBO is copied into one of these buffers after the lights are assigned, and it is read
+// a few frames later when its fence is signaled, so that the buffer grows without waiting for the GPU
+const int ClusterReadbackCount = 3;
+GLuint Cluster_Readback_Buffers[ClusterReadbackCount];
+GLsync Cluster_Readback_Fences[ClusterReadbackCount] = {};
+int Cluster_Readback_Next = 0;
+
+// Ring buffer for the data that change every frame (cameras and lights), see FrameDataRing
+FrameDataRing FrameData_ring;
 
 // Data of our camera - view matrix, projection matrix, etc.
 CameraData_UBO CameraData_ubo;
+glm::mat4 CameraProjection;					// Projection matrix of the camera in this frame
+glm::mat4 CameraView;						// View matrix of the camera in this frame
+glm::mat4 PrevCameraProjection;				// Projection matrix of the camera in the previous frame
+glm::mat4 PrevCameraView;					// View matrix of the camera in the previous frame
 
 // Data of the camera that is used when rendering from the position of the light
 glm::mat4 LightCameraProjection;			// Projection matrix of the camera
 glm::mat4 LightCameraView;					// View matrix of the camera
 CameraData_UBO LightCameraData_ubo;			// UBO with the data
 
-// FBO for G-buffer for deferred shading
-GLuint Gbuffer_FBO;					// Framebuffer object that is used when rendering into the G-buffer
-GLuint Gbuffer_PositionWS_Texture;	// Texture with positions in world space
-GLuint Gbuffer_PositionVS_Texture;	// Texture with positions in view space
-GLuint Gbuffer_NormalWS_Texture;	// Texture with normals in world space
-GLuint Gbuffer_NormalVS_Texture;	// Texture with normals in view space
-GLuint Gbuffer_Albedo_Texture;		// Texture with albedo (i.e. diffuse color)
-GLuint Gbuffer_Depth_Texture;		// Texture with depths for depth test
-
-									// FBO for evaluation of the SSAO
-GLuint SSAO_Evaluation_FBO;					// Framebuffer object that is used to evaluate SSAO
-GLuint SSAO_Bluring_FBO;					
-GLuint SSAO_Occlusion_Texture;				// Texture with ambient occlusion
-GLuint SSAO_Blurred_Occlusion_Texture;				// Texture with ambient occlusion
-GLuint SSAO_Depth_Texture;
-
-// OpenGL query object to get render time of one frame
-GLuint RenderTimeQuery;
+// The passes of the frame, and the fullscreen textures and the framebuffers they use, see build_frame_graph
+FrameGraph Frame_graph;
+// Textures of the G-buffer for deferred shading, in Frame_graph
+FrameGraph::Resource Gbuffer_PositionWS;	// Texture with positions in world space
+FrameGraph::Resource Gbuffer_PositionVS;	// Texture with positions in view space
+FrameGraph::Resource Gbuffer_NormalWS;		// Texture with normals in world space
+FrameGraph::Resource Gbuffer_NormalVS;		// Texture with normals in view space
+FrameGraph::Resource Gbuffer_Albedo;		// Texture with albedo (i.e. diffuse color)
+// Textures for the evaluation of the SSAO, in Frame_graph
+FrameGraph::Resource SSAO_Occlusion;			// Texture with ambient occlusion
+FrameGraph::Resource SSAO_Blurred_Occlusion;	// Texture with blurred ambient occlusion
+
+// Versions of the inputs of the passes, they are incremented when the inputs change, see PassCache
+uint64_t CameraVersion = 0;					// View or projection matrix of the main camera
+uint64_t LightVersion = 0;					// Camera of the light that casts shadows
+uint64_t LightsVersion = 0;					// Point lights in the scene, i.e. the lights that are assigned to the clusters
+uint64_t SceneVersion = 0;					// Transformations of the objects
+uint64_t ProgramsVersion = 0;				// Shader programs, when they are rebuilt
+uint64_t ViewportVersion = 0;				// Size of the window, i.e. of the fullscreen textures
+// The passes that run only when their inputs change, otherwise the results from their last run are used
+PassCache ShadowPass;
+PassCache GbufferPass;
+PassCache SSAOPass;
+PassCache ClustersPass;
+// Decisions of the pass caches in this frame, Frame_graph skips the passes that do not need to run
+bool RunShadowPass = true;
+bool RunGbufferPass = true;
+bool RunSSAOPasses = true;
+bool RunClustersPass = true;
+
+// Adapts the quality of the rendering to the GPU time budget, each knob chooses a level of one of the settings below
+QualityGovernor Governor;
+int RenderScaleKnob;						// Level in RenderScales
+int ShadowSizeKnob;							// Level in ShadowTexSizes
+int SSAOQualityKnob;						// Level in SSAO_SampleFractions and SSAO_RadiusScales
+float RenderScale = 1.0f;					// Size of the rendered image relative to the window, it is upscaled to the window
+int SSAO_QualityLevel = 3;					// Index into SSAO_SampleFractions and SSAO_RadiusScales
+// Sampler with linear filtering, used when the rendered image is upscaled to the window
+GLuint LinearSampler;
+
+// OpenGL query objects to get render time of the frames. Each frame uses the next one, and the results are read
+// a few frames later when they are available, so that the CPU never waits for the GPU to finish the frame.
+const int RenderTimeQueryCount = 4;
+GLuint RenderTimeQueries[RenderTimeQueryCount];
+bool RenderTimeQueryPending[RenderTimeQueryCount] = {};		// The query waits for its result
+bool RenderTimeQueryGbuffer[RenderTimeQueryCount];			// The frame of the query rendered the G-buffer
+unsigned int RenderTimeQuerySettings[RenderTimeQueryCount];	// QualitySettingsVersion of the frame of the query
+int RenderTimeQueryNext = 0;				// Query of the next frame, the oldest pending query
+unsigned int QualitySettingsVersion = 0;	// Incremented when apply_quality_levels changes the settings
+
+// Time when the shaders started to reload, to report how long it took
+int shaders_reload_start_time = 0;
+// Rebuilds the programs when their shaders are changed on the disk
+ShaderHotReloader shader_reloader;
 
 // Functions that works with scene objects
+struct SceneSnapshot;
 void reload_shaders();
+void rebuild_program(ShaderProgram &program, const char *vertex_shader, const char *fragment_shader);
 void init_scene();
 void update_scene(int app_time_diff_ms);
 void render_scene();
 void resize_fullscreen_textures();
-void render_glass(bool blended);
+void render_glass(bool lit);
 void render_stuff_once(bool gen_shadows);
 void enable_draw_to_stencil();
 void disable_draw_to_stencil();
@@ -129,6 +242,27 @@ void evaluate_ssao();
 void render_ssao_final(bool shadow_toon_rendering);
 void display_shadow_tex();
 void blur_ssao();
+void accumulate_ssao();
+void assign_lights_to_clusters();
+void poll_cluster_readback();
+void generate_extra_lights(int count);
+void update_object_bounds();
+void simulate_scene(float step_seconds);
+void simulate_model_data();
+void simulate_lights(SceneSnapshot &snapshot);
+void request_redraw();
+void wake_idle();
+void on_idle_timer(int value);
+bool poll_background_work();
+void build_draw_packets(SceneSnapshot &snapshot);
+void build_frame_graph();
+void compile_frame_graph();
+void render_shadow_map();
+void render_gbuffer();
+void render_lighting();
+void display_texture(GLuint texture, const glm::mat4 &transformation);
+void apply_quality_levels();
+void read_render_time_queries();
 
 // cache
 glm::mat4 shadow_matrix_translation = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -0.0015f)) * glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * 
@@ -141,15 +275,54 @@ glm::mat4 shadow_matrix_translation = glm::translate(glm::mat4(1.0f), glm::vec3(
 // Main AntTweakBar object
 TwBar *the_gui;
 
+// What is displayed on the screen, the passes that do not contribute to it are culled from Frame_graph
+enum DisplayMode
+{
+	DISPLAY_FINAL,
+	DISPLAY_SHADOW_MAP,
+	DISPLAY_SSAO,
+	DISPLAY_ALBEDO,
+};
+
 // Variables that are changed with GUI
 float light_pos;
 float render_time_ms;
+bool temporal_ssao;
+int extra_lights_count;
+bool hot_reload_shaders;
+int visible_lights_count;
+int filtered_gl_calls;
+int frame_ring_stalls;
+int animated_objects_count;
+int uploaded_bytes_per_frame;
+float packets_build_ms;
+int drawn_objects_count;
+int skipped_passes_count;
+int culled_passes_count;
+float frame_graph_memory_mb;
+float aliasing_saved_mb;
+DisplayMode display_mode;
+int glass_lights_count;
+int cluster_light_indices;
+int cluster_overflows;
+FramePacer::PacingMode pacing_mode;
+float target_fps;
+float frames_per_second;
+float frame_cpu_time_ms;
+bool redraw_on_demand;
+bool quality_governor;
+float gpu_budget_ms;
+float governor_quality;
+int ssao_samples_count;
 
 // Callbacks from the GUI
 void TW_CALL reload(void *);
+void TW_CALL benchmark_transforms(void *);
 
 // Functions that works with GUI
 void init_gui();
+void set_model_data_glm(ModelData_UBO::SingleModelData &data, const glm::mat4 &model);
+int count_model_data_mismatches(const ModelData_UBO &ubo, const std::vector<ModelData_UBO::SingleModelData> &expected, float &max_error);
 
 //---------------------------
 //----    APPLICATION    ----
@@ -158,11 +331,92 @@ void init_gui();
 int win_width = 640*2;
 int win_height = 480*2;
 
-// Current time of the application in milliseconds, for animations
+// Decides when the frames start, and measures their times
+FramePacer Pacer;
+
+// Current time of the application in milliseconds, for animations (it is the time of the latest snapshot)
 int app_time_ms = 0;
 int last_glut_time = 0;
-int what_to_display = 0;
+
+// The input, the animations, the transformations, the bounds, the culling of the lights, and the draw packets are
+// simulated on the update thread at a fixed rate, independently of the rendering. Each step produces a snapshot
+// of the scene, the render thread (the GLUT thread, which owns the OpenGL context) only applies the latest one
+// in update_scene. The render thread may skip some snapshots, so each of them contains the whole state.
+struct SceneSnapshot
+{
+	int app_time_ms;						// Time of the application of the snapshot
+	glm::mat4 camera_view;					// View matrix of the main camera
+	glm::mat4 camera_projection;			// Projection matrix of the main camera
+	glm::mat4 light_camera_view;			// View matrix of the camera of the light
+	std::vector<int> changed_models;		// Objects that changed since the last snapshot the render thread took, and their data
+	std::vector<ModelData_UBO::SingleModelData> changed_model_data;
+	std::vector<PhongLight> visible_lights;	// Lights that affect the view frustum, the first one casts shadows
+	std::vector<int> glass_lights;			// Lights that affect the glass, indices into visible_lights
+	unsigned int point_lights_version;		// Incremented when the point lights change
+	DrawPacketList shadow_packets;			// Objects drawn in the passes, see ShadowPackets
+	DrawPacketList cel_packets;
+	DrawPacketList scene_packets;
+	float packets_build_ms;					// Time it took to build the draw packets
+};
+SnapshotBuffer<SceneSnapshot> SceneSnapshots;
+FixedRateThread UpdateThread;
+const float UpdateStepsPerSecond = 100.0f;
+float SimulationTimeMs = 0.0f;				// Time of the application on the update thread
+// Guards the variables changed with GUI, the window size, and InputEvents, they are changed on the GLUT thread and read on the update thread
+std::mutex GuiMutex;
+// Input of the camera from the GLUT callbacks, it is queued and applied to the_camera in the next step of the update thread
+struct InputEvent
+{
+	enum Type { MOUSE_BUTTON, MOUSE_MOTION } type;
+	int button, state;						// Only MOUSE_BUTTON, see glutMouseFunc
+	int x, y;
+};
+std::vector<InputEvent> InputEvents;
+// State of the scene owned by the update thread, besides the_camera, SceneTransforms, Scene, ExtraLights, and Lights
+std::vector<ModelData_UBO::SingleModelData> SimulatedModels;	// Data of all objects in Models_ubo
+std::vector<int> StepModels;				// Objects that changed in this step
+std::vector<int> PendingModels;				// Objects that changed since the last snapshot the render thread took
+std::vector<bool> IsModelPending;			// Whether the object is in PendingModels
+unsigned int PointLightsVersion = 0;		// Incremented when ExtraLights change
+// Inputs of the last simulated step, a step without input events, animation, and changes of these is skipped
+float SimulatedLightDirection = 0.0f;
+float SimulatedAspect = 0.0f;				// Zero so that the first step is simulated
+// Data of the last published snapshot, to find out whether the scene changed (and must be rendered in the on-demand mode)
+glm::mat4 PublishedCameraView;
+glm::mat4 PublishedCameraProjection;
+glm::vec3 PublishedLightPosition;
+unsigned int PublishedPointLightsVersion = 0;
+// State of the latest snapshot applied on the render thread, to find out what changed
+unsigned int AppliedPointLightsVersion = 0;
+// In the on-demand mode, the idle function is turned off when no frame was requested for IdleTimeout seconds, GLUT then sleeps
+// until an event comes, and a timer polls the frames requested by the update thread and the background work
+bool IdleSleeping = false;
+int IdleSleeps = 0;							// Number of the times the idle function was turned off, to ignore the timers of the earlier ones
+double LastActivityTime = 0.0;				// Time of the last frame or request on the GLUT thread
+// Settings the frame graph was built with, it is built again when they change
+DisplayMode FrameGraphDisplayMode;
+bool FrameGraphTemporalSSAO;
 
 // config
+const unsigned int LIGHTING_TOON = 1;		// Variant of evaluate_lighting_variants with toon shading
+const unsigned int LIGHTING_SHADOW = 2;		// Variant of evaluate_lighting_variants with shadows
+const float CameraNear = 0.5f;				// Near plane of the main camera
+const float CameraFar = 1000.0f;			// Far plane of the main camera
+const glm::uvec3 ClusterGrid(16, 9, 24);	// Number of clusters in x, y, and z (depth slices) directions
+const int ClusterInitialLightIndices = 16 * 9 * 24 * 64;	// Initial capacity of Cluster_LightIndices_SSBO (on average 64 lights per cluster)
+const float LightCutoff = 1.0f / 256.0f;	// Lights are ignored where their attenuated intensity drops below this value
+const int CLUSTER_GRID_BINDING = 2;			// Binding point (of shader storage buffers) of Cluster_LightGrid_SSBO
+const int CLUSTER_INDICES_BINDING = 3;		// Binding point (of shader storage buffers) of Cluster_LightIndices_SSBO
+const int GLASS_LIGHTS_BINDING = 4;			// Binding point (of shader storage buffers) of GlassLights_SSBO
 const float SSAO_Radius = 0.5f;
-const int ShadowTexSize = 1024;
\ No newline at end of file
+const int SSAO_KernelSize = 64;				// Number of samples in SSAO_Samples_UBO
+const int SSAO_TemporalSamples = 16;		// Number of samples per frame when the temporal SSAO is used
+const float SSAO_HistoryWeight = 0.85f;		// Weight of the reprojected history when the temporal SSAO is used
+const double IdleTimeout = 0.25;			// Seconds without frames after which the idle function is turned off in the on-demand mode
+const int IdlePollInterval = 50;			// Milliseconds between the polls while the idle function is off
+const int SSAO_SettleFrames = 30;			// Frames after which the old history contributes less than 1% (0.85^30 < 0.01)
+const float SSAO_DisocclusionThreshold = 0.05f;	// Relative difference of the distances when the history is rejected
+const float RenderScales[] = { 0.5f, 0.625f, 0.75f, 0.875f, 1.0f };	// Levels of RenderScale
+const int ShadowTexSizes[] = { 256, 512, 1024 };						// Levels of ShadowTexSize
+const float SSAO_SampleFractions[] = { 0.25f, 0.5f, 0.75f, 1.0f };		// Levels of the SSAO, the fraction of the samples that are used
+const float SSAO_RadiusScales[] = { 0.6f, 0.75f, 0.9f, 1.0f };			// and the scale of SSAO_Radius
\ No newline at end of file
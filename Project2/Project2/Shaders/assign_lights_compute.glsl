@@ -0,0 +1,171 @@
+#version 430 core
+
+// Each invocation processes one cluster (froxel) of the grid. The lights are tested in batches,
+// each batch is first loaded into the shared memory by the whole work group.
+//
+// The shader is dispatched twice. The first pass counts the lights of each cluster and reserves the space
+// for them in cluster_light_indices, the second pass tests the lights again and writes their indices.
+// This way, the number of the lights in a cluster is not limited, and cluster_light_indices_count contains
+// the number of the indices all clusters needed, even if it is above the capacity of the buffer.
+layout (local_size_x = 128) in;
+
+// Data of the camera
+layout (std140, binding = 0) uniform CameraData
+{
+	mat4 projection;		// Projection matrix
+	mat4 projection_inv;	// Inverse of the projection matrix
+	mat4 view;				// View matrix
+	mat4 view_inv;			// Inverse of the view matrix
+	mat3 view_it;			// Inverse of the transpose of the top-left part 3x3 of the view matrix
+	vec3 eye_position;		// Position of the eye in world space
+};
+
+// Data of the lights
+struct PhongLight
+{
+	// See the C++ code for the documentation to individual attributes
+	vec4 position;
+	vec3 ambient;
+	vec3 diffuse;
+	vec3 specular;
+	vec3 spot_direction;
+	float spot_exponent;
+	float spot_cos_cutoff;
+	float atten_constant;
+	float atten_linear;
+	float atten_quadratic;
+};
+layout (std430, binding = 1) readonly buffer PhongLightsData
+{
+	vec3 global_ambient_color;
+	int lights_count;
+	PhongLight lights[];
+};
+
+// Output - offset and count of the lights of each cluster in cluster_light_indices
+layout (std430, binding = 2) buffer ClusterLightGrid
+{
+	uvec2 cluster_lights[];
+};
+// Output - compact lists of light indices of all clusters
+layout (std430, binding = 3) buffer ClusterLightIndices
+{
+	uint cluster_light_indices_count;		// Must be set to zero before the dispatch
+	uint cluster_light_indices[];
+};
+
+// Size of the grid, near and far planes between which the depth slices are distributed (exponentially)
+uniform uvec3 cluster_grid;
+uniform float cluster_near;
+uniform float cluster_far;
+// Capacity of cluster_light_indices
+uniform uint cluster_light_indices_capacity;
+// Lights whose contribution is below this value are ignored
+uniform float light_cutoff;
+// 0 - count the lights of the clusters and reserve their space, 1 - write the indices of the lights
+uniform uint assign_pass;
+
+shared vec4 batch_spheres[gl_WorkGroupSize.x];		// Position in view space (xyz) and radius (w) of the lights in the current batch
+
+// Returns the radius of the light's influence, i.e., the distance in which its attenuated intensity drops below light_cutoff.
+// Directional lights and lights without attenuation have an infinite radius.
+float light_radius(in PhongLight light)
+{
+	if (light.position.w == 0.0)
+		return 1.0e30;
+	float intensity = max(max(max(light.diffuse.r, light.diffuse.g), light.diffuse.b), max(max(light.specular.r, light.specular.g), light.specular.b));
+	intensity = max(intensity, max(max(light.ambient.r, light.ambient.g), light.ambient.b));
+	// Solve atten_constant + atten_linear * d + atten_quadratic * d^2 = intensity / light_cutoff
+	float c = light.atten_constant - intensity / light_cutoff;
+	if (c >= 0.0)
+		return 0.0;
+	if (light.atten_quadratic > 0.0)
+		return (-light.atten_linear + sqrt(light.atten_linear * light.atten_linear - 4.0 * light.atten_quadratic * c)) / (2.0 * light.atten_quadratic);
+	if (light.atten_linear > 0.0)
+		return -c / light.atten_linear;
+	return 1.0e30;
+}
+
+// Returns the point in view space on the ray from the eye through the given point in normalized device coordinates, at the given depth
+vec3 ndc_to_view_at_depth(vec2 ndc, float depth)
+{
+	vec4 point_vs = projection_inv * vec4(ndc, -1.0, 1.0);
+	vec3 dir = point_vs.xyz / point_vs.w;
+	return dir * (depth / -dir.z);
+}
+
+//-----------------------------------------------------------------------
+
+void main()
+{
+	uint cluster_count = cluster_grid.x * cluster_grid.y * cluster_grid.z;
+	uint cluster = gl_GlobalInvocationID.x;
+	bool active = cluster < cluster_count;
+
+	// Compute the bounding box of the cluster in view space
+	uvec3 cell = uvec3(cluster % cluster_grid.x, (cluster / cluster_grid.x) % cluster_grid.y, cluster / (cluster_grid.x * cluster_grid.y));
+	vec2 ndc_min = vec2(cell.xy) / vec2(cluster_grid.xy) * 2.0 - 1.0;
+	vec2 ndc_max = vec2(cell.xy + 1) / vec2(cluster_grid.xy) * 2.0 - 1.0;
+	float depth_near = cluster_near * pow(cluster_far / cluster_near, float(cell.z) / float(cluster_grid.z));
+	float depth_far = cluster_near * pow(cluster_far / cluster_near, float(cell.z + 1) / float(cluster_grid.z));
+	vec3 p0 = ndc_to_view_at_depth(ndc_min, depth_near);
+	vec3 p1 = ndc_to_view_at_depth(ndc_max, depth_near);
+	vec3 p2 = ndc_to_view_at_depth(ndc_min, depth_far);
+	vec3 p3 = ndc_to_view_at_depth(ndc_max, depth_far);
+	vec3 aabb_min = min(min(p0, p1), min(p2, p3));
+	vec3 aabb_max = max(max(p0, p1), max(p2, p3));
+
+	// In the second pass, the lights are written into the space reserved in the first pass, the clusters whose
+	// space is not in the buffer (it is too small) keep only the lights that fit, see cluster_light_indices_count
+	uint offset = 0;
+	uint capacity = 0;
+	if ((assign_pass == 1) && active)
+	{
+		uvec2 reserved = cluster_lights[cluster];
+		offset = reserved.x;
+		capacity = (offset >= cluster_light_indices_capacity) ? 0 : min(reserved.y, cluster_light_indices_capacity - offset);
+	}
+	uint visible_count = 0;
+
+	for (int batch_start = 0; batch_start < lights_count; batch_start += int(gl_WorkGroupSize.x))
+	{
+		// Load the batch of the lights into the shared memory
+		int light_idx = batch_start + int(gl_LocalInvocationIndex);
+		if (light_idx < lights_count)
+		{
+			PhongLight light = lights[light_idx];
+			vec3 position_vs = (light.position.w == 0.0) ? vec3(0.0) : (view * vec4(light.position.xyz, 1.0)).xyz;
+			batch_spheres[gl_LocalInvocationIndex] = vec4(position_vs, light_radius(light));
+		}
+		barrier();
+
+		// Test the lights of the batch against the cluster
+		int batch_size = min(int(gl_WorkGroupSize.x), lights_count - batch_start);
+		for (int i = 0; (i < batch_size) && active; i++)
+		{
+			vec4 sphere = batch_spheres[i];
+			vec3 closest = clamp(sphere.xyz, aabb_min, aabb_max);
+			vec3 diff = closest - sphere.xyz;
+			if ((sphere.w >= 1.0e30) || (dot(diff, diff) <= sphere.w * sphere.w))
+			{
+				if ((assign_pass == 1) && (visible_count < capacity))
+					cluster_light_indices[offset + visible_count] = uint(batch_start + i);
+				visible_count++;
+			}
+		}
+		barrier();
+	}
+
+	if (!active)
+		return;
+
+	if (assign_pass == 0)
+	{
+		// Reserve the space in the global list of indices, the counter counts all lights, even those that do not fit
+		cluster_lights[cluster] = uvec2(atomicAdd(cluster_light_indices_count, visible_count), visible_count);
+	}
+	else
+	{
+		cluster_lights[cluster] = uvec2(offset, min(visible_count, capacity));
+	}
+}
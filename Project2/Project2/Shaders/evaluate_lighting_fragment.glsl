@@ -1,5 +1,13 @@
 #version 430 core
 
+// Variants of the program, the C++ code defines them after the #version line (see ShaderProgramVariants)
+#ifndef TOON
+#define TOON 0			// The first light is evaluated with toon shading
+#endif
+#ifndef SHADOW
+#define SHADOW 0		// The first light is evaluated with shadows
+#endif
+
 // Input variables
 in VertexData
 {
@@ -46,13 +54,29 @@ struct PhongLight
 	float atten_linear;
 	float atten_quadratic;
 };
-layout (std140, binding = 1) uniform PhongLightsData
+layout (std430, binding = 1) readonly buffer PhongLightsData
 {
 	vec3 global_ambient_color;
 	int lights_count;
-	PhongLight lights[8];
+	PhongLight lights[];
 };
 
+// Lights of individual clusters, see assign_lights_compute.glsl
+layout (std430, binding = 2) readonly buffer ClusterLightGrid
+{
+	uvec2 cluster_lights[];		// Offset and count of the lights of each cluster in cluster_light_indices
+};
+layout (std430, binding = 3) readonly buffer ClusterLightIndices
+{
+	uint cluster_light_indices_count;
+	uint cluster_light_indices[];
+};
+
+// Size of the grid of the clusters, and near and far planes between which the depth slices are distributed
+uniform uvec3 cluster_grid;
+uniform float cluster_near;
+uniform float cluster_far;
+
 // Evaluates the lighting of one Phong light. The implementation is at the end of the file
 void EvaluatePhongLight(in PhongLight light, out vec3 amb, out vec3 dif, out vec3 spe, in vec3 normal, in vec3 position, in vec3 eye, in float shininess);
 
@@ -66,7 +90,6 @@ layout (binding = 3) uniform sampler2D ssao_tex;
 layout (binding = 4) uniform sampler2DShadow shadow_tex;
 
 uniform mat4 shadow_matrix;
-uniform bool compute_toon_and_shadow;
 
 //-----------------------------------------------------------------------
 
@@ -78,9 +101,11 @@ void main()
 	vec3 albedo = texture(albedo_tex, inData.tex_coord).xyz;
     float ssao = texture(ssao_tex, inData.tex_coord).r;
 
+#if SHADOW
 	// Coordinate for the shadow
 	vec4 shadow_tex_coord = shadow_matrix * vec4(position_ws, 1.0);
 	float shadow_factor = textureProj(shadow_tex, shadow_tex_coord);
+#endif
     
     //final_color = shadow_tex_coord;
 	//return;
@@ -93,13 +118,25 @@ void main()
 	vec3 dif = vec3(0.0);
 	vec3 spe = vec3(0.0);
 
-	//for (int i = 0; i < lights_count; i++)
+	// Find the cluster of the pixel
+	float depth_vs = -(view * vec4(position_ws, 1.0)).z;
+	uvec2 cell_xy = min(uvec2(inData.tex_coord * vec2(cluster_grid.xy)), cluster_grid.xy - 1);
+	uint cell_z = uint(clamp(log(depth_vs / cluster_near) / log(cluster_far / cluster_near) * float(cluster_grid.z), 0.0, float(cluster_grid.z - 1)));
+	uvec2 cluster = cluster_lights[cell_xy.x + cluster_grid.x * (cell_xy.y + cluster_grid.y * cell_z)];
+
+	// Evaluate only the lights of the cluster
+	for (uint c = 0; c < cluster.y; c++)
 	{
+		uint i = cluster_light_indices[cluster.x + c];
+
 		vec3 a, d, s;
-		EvaluatePhongLight(lights[0], a, d, s, N, position_ws, Eye, material.shininess);
+		EvaluatePhongLight(lights[i], a, d, s, N, position_ws, Eye, material.shininess);
 
-		if (compute_toon_and_shadow)
+#if TOON || SHADOW
+		// Only the first light (the one of the shadow texture) is rendered with toon shading and shadows
+		if (i == 0)
 		{
+#if TOON
 			// toon shading dif
 			if (d.x < 0.4)				d = vec3(0.2);
 			else if (d.x < 0.6)			d = vec3(0.5);
@@ -109,11 +146,15 @@ void main()
 			// toon shading spe
 			if (s.x < 0.6)				s = vec3(0.0);
 			else						s = vec3(1.0);
+#endif
 
+#if SHADOW
 			// shadow
 			d *= shadow_factor;
 			s *= shadow_factor;
+#endif
 		}
+#endif
 
 		amb += a;	dif += d;	spe += s;
 	}
@@ -34,6 +34,12 @@ layout (binding = 2) uniform sampler2D random_tangent_vs_tex;
 // Radius of the SSAO hemisphere which is sampled
 uniform float SSAO_Radius;
 
+// Which samples of the kernel are used in this frame (kernel_samples[(SSAO_SampleOffset + i) % 64], i < SSAO_SampleCount),
+// and the angle by which the random tangents are rotated. The temporal SSAO changes them every frame.
+uniform int SSAO_SampleCount = 64;
+uniform int SSAO_SampleOffset = 0;
+uniform float SSAO_NoiseRotation = 0.0;
+
 float compute_ssao();
 
 //-----------------------------------------------------------------------
@@ -62,6 +68,10 @@ float compute_ssao()
 	//
 	// We get a tangent that is not necessarly perpendicular to the normal (not yet)
 	vec3 tangent_vs = texture(random_tangent_vs_tex, gl_FragCoord.xy / vec2(textureSize(random_tangent_vs_tex, 0))).xyz;
+	// Rotate the tangent around z-axis, so that each frame uses different directions
+	float rot_cos = cos(SSAO_NoiseRotation);
+	float rot_sin = sin(SSAO_NoiseRotation);
+	tangent_vs.xy = mat2(rot_cos, rot_sin, -rot_sin, rot_cos) * tangent_vs.xy;
 	// Compute the bitangent so that it is perpendicular to both the tangent and the normal
 	vec3 bitangent_vs = normalize(cross(normal_vs, tangent_vs));
 	// Recompute the tangent so that it is perpendicular to both the normal and the bitangent
@@ -74,10 +84,10 @@ float compute_ssao()
 	float occluded_samples = 0.0f;
 	// Number of samples that we tested for occlusion
 	float occluded_test_count = 0.0f;
-	for (int i = 0; i < 64; i++)
+	for (int i = 0; i < SSAO_SampleCount; i++)
 	{
 		// Compute the position of the sample in view space
-		vec3 sample_offset_vs = TBN * kernel_samples[i].xyz * SSAO_Radius;
+		vec3 sample_offset_vs = TBN * kernel_samples[(SSAO_SampleOffset + i) % 64].xyz * SSAO_Radius;
 		vec3 sample_position_vs = position_vs.xyz + sample_offset_vs;
 		// Transform the position into the clip space ...
 		vec4 sample_position_cs = projection * vec4(sample_position_vs, 1.0);
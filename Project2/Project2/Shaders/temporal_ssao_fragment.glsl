@@ -0,0 +1,77 @@
+#version 430 core
+
+// Input variables
+in VertexData
+{
+	vec2 tex_coord;
+} inData;
+
+// Output variables - accumulated occlusion (r) and the distance of the pixel from the eye (g)
+layout (location = 0) out vec2 final_history;
+
+// Data of the camera
+layout (std140, binding = 0) uniform CameraData
+{
+	mat4 projection;		// Projection matrix
+	mat4 projection_inv;	// Inverse of the projection matrix
+	mat4 view;				// View matrix
+	mat4 view_inv;			// Inverse of the view matrix
+	mat3 view_it;			// Inverse of the transpose of the top-left part 3x3 of the view matrix
+	vec3 eye_position;		// Position of the eye in world space
+};
+
+// Positions in world space, occlusion computed in this frame, and the history from the previous frame
+layout (binding = 0) uniform sampler2D position_ws_tex;
+layout (binding = 1) uniform sampler2D occlusion_tex;
+layout (binding = 2) uniform sampler2D history_tex;
+
+// View and projection matrices of the camera in the previous frame
+uniform mat4 prev_view;
+uniform mat4 prev_projection;
+
+// False when the history contains no usable data
+uniform bool history_valid;
+// Weight of the history when blending it with the occlusion of this frame
+uniform float history_weight;
+// Relative difference between the expected and the stored distance when we reject the history
+uniform float disocclusion_threshold;
+
+//-----------------------------------------------------------------------
+
+void main()
+{
+	float occlusion = textureLod(occlusion_tex, inData.tex_coord, 0).r;
+	vec4 position_ws = textureLod(position_ws_tex, inData.tex_coord, 0);
+
+	if (position_ws.w == 0.0)
+	{
+		// Background, there is nothing to accumulate
+		final_history = vec2(occlusion, 0.0);
+		return;
+	}
+
+	float distance = length((view * vec4(position_ws.xyz, 1.0)).xyz);
+	final_history = vec2(occlusion, distance);
+
+	if (!history_valid)
+		return;
+
+	// Reproject the position into the previous frame
+	vec4 prev_position_vs = prev_view * vec4(position_ws.xyz, 1.0);
+	vec4 prev_position_cs = prev_projection * prev_position_vs;
+	if (prev_position_cs.w <= 0.0)
+		return;		// The point was behind the camera
+	vec2 prev_tex_coord = prev_position_cs.xy / prev_position_cs.w * 0.5 + 0.5;
+	if (any(lessThan(prev_tex_coord, vec2(0.0))) || any(greaterThan(prev_tex_coord, vec2(1.0))))
+		return;		// The point was outside the screen
+
+	// Reject the history when a different surface was visible at that place (disocclusion)
+	vec2 history = textureLod(history_tex, prev_tex_coord, 0).rg;
+	float expected_distance = length(prev_position_vs.xyz);
+	if (abs(history.g - expected_distance) > disocclusion_threshold * expected_distance)
+		return;
+
+	final_history = vec2(mix(occlusion, history.r, history_weight), distance);
+}
+
+//-----------------------------------------------------------------------
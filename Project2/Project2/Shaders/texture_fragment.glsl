@@ -54,11 +54,11 @@ struct PhongLight
 	float atten_linear;
 	float atten_quadratic;
 };
-layout (std140, binding = 1) uniform PhongLightsData
+layout (std430, binding = 1) readonly buffer PhongLightsData
 {
 	vec3 global_ambient_color;
 	int lights_count;
-	PhongLight lights[8];
+	PhongLight lights[];
 };
 
 // Data of the object